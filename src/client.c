@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "ssfs_client.h"
+#include "error.h"
+
+// The requests of a run are sent while the responses are received, so that neither
+// side blocks on a full socket: the server stops reading from a client whose responses
+// pile up.
+
+#define CLIENT_IOV_MAX 256 // Requests handed to one sendmsg()
+
+struct SsfsClient {
+    int fd;
+    uint8_t *shm;        // Shared buffer, NULL until ssfs_client_map()
+    size_t shm_size;
+};
+
+/// @brief State of the responses of a run being received.
+typedef struct {
+    int index;             // Operation whose response comes next
+    SsfsdResponse header;
+    size_t header_got;
+    size_t data_got;
+} Receiver;
+
+/// @brief Connects to the ssfsd listening on socket_path.
+/// @param socket_path
+/// @return NULL on error
+SsfsClient *ssfs_client_connect(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) return NULL;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    SsfsClient *client = calloc(1, sizeof(SsfsClient));
+    if (!client) return NULL;
+    client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->fd < 0 || connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        fcntl(client->fd, F_SETFL, O_NONBLOCK) != 0) {
+        if (client->fd >= 0) close(client->fd);
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+void ssfs_client_close(SsfsClient *client)
+{
+    if (!client) return;
+    close(client->fd);
+    if (client->shm) munmap(client->shm, client->shm_size);
+    free(client);
+}
+
+/// @brief Waits until the socket can be written (if want_out) or read.
+/// @param client
+/// @param want_out
+/// @return the revents of the socket, 0 on error
+static short wait_socket(SsfsClient *client, int want_out)
+{
+    struct pollfd pfd = { client->fd, POLLIN | (want_out ? POLLOUT : 0), 0 };
+    while (poll(&pfd, 1, -1) < 0)
+        if (errno != EINTR) return 0;
+    return pfd.revents;
+}
+
+/// @brief Sets up a buffer shared with the server: the reads of SSFS_CLIENT_SHM_MIN bytes
+/// or more are then written there by the server rather than sent over the socket.
+/// @param client
+/// @param size bytes of the buffer, at most SSFSD_MAX_DATA reads in flight per run
+/// @return 0 on success, a negative error code otherwise
+int ssfs_client_map(SsfsClient *client, size_t size)
+{
+    if (client->shm || size == 0 || size > INT32_MAX) return fs_ENOTSUP;
+    // The server only maps a buffer that cannot shrink under it
+    int memfd = memfd_create("ssfs_client", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) return fs_ENOTSUP;
+    uint8_t *shm = ftruncate(memfd, size) == 0 && fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) == 0
+        ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0) : MAP_FAILED;
+    if (shm == MAP_FAILED) {
+        close(memfd);
+        return fs_ENOTSUP;
+    }
+
+    // The descriptor travels with the request, the server maps the same pages
+    SsfsdRequest request = { 0, SSFSD_OP_MAP, 0, (int32_t)size, 0, 0 };
+    struct iovec iov = { &request, sizeof(request) };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    ssize_t sent;
+    while ((sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL)) < 0 && (errno == EINTR || errno == EAGAIN))
+        wait_socket(client, 1);
+    close(memfd);
+    if (sent != (ssize_t)sizeof(request)) {
+        munmap(shm, size);
+        return fs_EON;
+    }
+
+    SsfsdResponse response;
+    size_t got = 0;
+    while (got < sizeof(response)) {
+        ssize_t r = recv(client->fd, (uint8_t *)&response + got, sizeof(response) - got, 0);
+        if (r > 0) got += r;
+        else if (r < 0 && (errno == EINTR || errno == EAGAIN)) wait_socket(client, 0);
+        else break;
+    }
+    if (got < sizeof(response) || response.result != 0) {
+        munmap(shm, size);
+        return got < sizeof(response) ? fs_EON : response.result;
+    }
+    client->shm = shm;
+    client->shm_size = size;
+    return 0;
+}
+
+/// @brief Receives what the socket holds of the responses of a run.
+/// @param client
+/// @param ops
+/// @param requests
+/// @param op_index operation of each request
+/// @param count requests sent
+/// @param rx
+/// @return 0 while the connection is fine, fs_EON once it failed
+static int receive_responses(SsfsClient *client, SsfsClientOp *ops, const SsfsdRequest *requests,
+                             const int *op_index, int count, Receiver *rx)
+{
+    while (rx->index < count) {
+        SsfsClientOp *op = &ops[op_index[rx->index]];
+        ssize_t r;
+        if (rx->header_got < sizeof(SsfsdResponse)) {
+            r = recv(client->fd, (uint8_t *)&rx->header + rx->header_got, sizeof(SsfsdResponse) - rx->header_got, 0);
+            if (r > 0) rx->header_got += r;
+        } else {
+            // The data of a read over the socket goes straight to its buffer
+            r = recv(client->fd, op->data + rx->data_got, rx->header.result - rx->data_got, 0);
+            if (r > 0) rx->data_got += r;
+        }
+        if (r == 0) return fs_EON;
+        if (r < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : fs_EON;
+
+        if (rx->header_got < sizeof(SsfsdResponse)) continue;
+        if (rx->header.id != (uint32_t)rx->index) return fs_EON;
+        const SsfsdRequest *request = &requests[rx->index];
+        int via_socket = request->op == SSFS_CLIENT_READ && rx->header.result > 0;
+        if (via_socket && rx->header.result > op->len) return fs_EON;
+        if (via_socket && rx->data_got < (size_t)rx->header.result) continue;
+
+        op->result = rx->header.result;
+        if ((request->op & SSFSD_FLAG_SHM) && op->result > 0)
+            memcpy(op->data, client->shm + request->shm_offset, op->result);
+        rx->index++;
+        rx->header_got = 0;
+        rx->data_got = 0;
+    }
+    return 0;
+}
+
+/// @brief Runs count operations on the server, each as the fs.h call of the same name,
+/// and stores what that call returned in its result. Every request is sent without
+/// waiting for the responses; the server may merge them with those of other clients
+/// into ssfs_batch() calls, so that, as in a batch, the creates run after the others.
+/// A write of a negative length or of more than SSFSD_MAX_DATA bytes is not sent, and
+/// has the result fs_ENOTSUP.
+/// @param client
+/// @param ops
+/// @param count
+/// @return 0 on success, a negative error code if the server could not be reached (the
+/// operations not run then have that result)
+int ssfs_client_run(SsfsClient *client, SsfsClientOp *ops, int count)
+{
+    if (count <= 0) return 0;
+    SsfsdRequest *requests = malloc(count * sizeof(SsfsdRequest));
+    int *op_index = malloc(count * sizeof(int));
+    if (!requests || !op_index) {
+        free(requests);
+        free(op_index);
+        return fs_EON;
+    }
+
+    size_t shm_used = 0;
+    int nb_requests = 0;
+    for (int i = 0; i < count; ++i) {
+        SsfsClientOp *op = &ops[i];
+        if (op->op == SSFS_CLIENT_WRITE && (op->len < 0 || op->len > SSFSD_MAX_DATA)) {
+            op->result = fs_ENOTSUP;
+            continue;
+        }
+        SsfsdRequest *request = &requests[nb_requests];
+        op_index[nb_requests] = i;
+        request->id = (uint32_t)nb_requests++;
+        request->op = (uint32_t)op->op;
+        request->inode_num = op->inode_num;
+        request->len = op->len;
+        request->offset = op->offset;
+        request->shm_offset = 0;
+        if (op->op == SSFS_CLIENT_READ && client->shm && op->len >= SSFS_CLIENT_SHM_MIN &&
+            (size_t)op->len <= client->shm_size - shm_used) {
+            request->op |= SSFSD_FLAG_SHM;
+            request->shm_offset = (uint32_t)shm_used;
+            shm_used += op->len;
+        }
+        op->result = fs_EON;
+    }
+
+    // Sending position: request i, byte sent of its header and payload
+    int next = 0;
+    size_t sent = 0;
+    Receiver rx = { 0, { 0, 0 }, 0, 0 };
+    int ret = 0;
+    while (rx.index < nb_requests && ret == 0) {
+        if (next < nb_requests) {
+            struct iovec iov[2 * CLIENT_IOV_MAX];
+            int nb_iov = 0;
+            size_t skip = sent;
+            for (int i = next; i < nb_requests && i < next + CLIENT_IOV_MAX; ++i) {
+                SsfsClientOp *op = &ops[op_index[i]];
+                size_t header_len = sizeof(SsfsdRequest);
+                size_t data_len = requests[i].op == SSFS_CLIENT_WRITE && op->len > 0 ? (size_t)op->len : 0;
+                if (skip < header_len) {
+                    iov[nb_iov].iov_base = (uint8_t *)&requests[i] + skip;
+                    iov[nb_iov++].iov_len = header_len - skip;
+                    skip = 0;
+                } else {
+                    skip -= header_len;
+                }
+                if (data_len > 0) {
+                    iov[nb_iov].iov_base = op->data + skip;
+                    iov[nb_iov++].iov_len = data_len - skip;
+                }
+                skip = 0;
+            }
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = nb_iov;
+            ssize_t w = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+            if (w < 0 && errno != EAGAIN && errno != EINTR) {
+                ret = fs_EON;
+                break;
+            }
+            // Moves the sending position past the bytes just sent
+            size_t left = w > 0 ? (size_t)w : 0;
+            while (left > 0) {
+                SsfsClientOp *op = &ops[op_index[next]];
+                size_t size = sizeof(SsfsdRequest) +
+                    (requests[next].op == SSFS_CLIENT_WRITE && op->len > 0 ? (size_t)op->len : 0);
+                size_t step = size - sent < left ? size - sent : left;
+                sent += step;
+                left -= step;
+                if (sent == size) {
+                    next++;
+                    sent = 0;
+                }
+            }
+        }
+
+        ret = receive_responses(client, ops, requests, op_index, nb_requests, &rx);
+        if (ret == 0 && rx.index < nb_requests) {
+            short revents = wait_socket(client, next < nb_requests);
+            if (revents == 0 || (revents & (POLLERR | POLLNVAL))) ret = fs_EON;
+        }
+    }
+    free(requests);
+    free(op_index);
+    return ret;
+}
+
+/// @brief Runs a single operation.
+/// @return its result
+static int run_one(SsfsClient *client, int op, int inode_num, uint8_t *data, int len, int offset)
+{
+    SsfsClientOp one = { op, inode_num, data, len, offset, 0 };
+    int ret = ssfs_client_run(client, &one, 1);
+    return ret < 0 ? ret : one.result;
+}
+
+int ssfs_client_stat(SsfsClient *client, int inode_num)
+{
+    return run_one(client, SSFS_CLIENT_STAT, inode_num, NULL, 0, 0);
+}
+
+int ssfs_client_create(SsfsClient *client)
+{
+    return run_one(client, SSFS_CLIENT_CREATE, 0, NULL, 0, 0);
+}
+
+int ssfs_client_delete(SsfsClient *client, int inode_num)
+{
+    return run_one(client, SSFS_CLIENT_DELETE, inode_num, NULL, 0, 0);
+}
+
+int ssfs_client_read(SsfsClient *client, int inode_num, uint8_t *data, int len, int offset)
+{
+    return run_one(client, SSFS_CLIENT_READ, inode_num, data, len, offset);
+}
+
+int ssfs_client_write(SsfsClient *client, int inode_num, uint8_t *data, int len, int offset)
+{
+    return run_one(client, SSFS_CLIENT_WRITE, inode_num, data, len, offset);
+}
@@ -0,0 +1,360 @@
+// client_test: runs ssfsd on a disk image and checks what its clients get back.
+//
+// Usage: client_test ssfsd disk_image
+//
+// The image must be a mountable volume with free inodes; the test files are deleted
+// at the end. Like fs_test, it stops at the first failing test.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "ssfs_client.h"
+#include "error.h"
+
+#define NB_CLIENTS   4
+#define CLIENT_RUNS  50
+#define FILE_SIZE    (20 * 1024)
+
+static char socket_path[64];
+
+/// @brief Connects to the server, retrying while it starts.
+static SsfsClient *connect_server(void) {
+    for (int i = 0; i < 500; i++) {
+        SsfsClient *client = ssfs_client_connect(socket_path);
+        if (client) return client;
+        struct timespec pause = { 0, 10 * 1000 * 1000 };
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+static void fill_pattern(uint8_t *data, int len, int seed) {
+    for (int i = 0; i < len; i++) data[i] = (uint8_t)(i * 7 + seed * 13 + i / 1024);
+}
+
+static int test_round_trip(void) {
+    SsfsClient *client = connect_server();
+    if (!client) {
+        printf("Cannot connect to %s\n", socket_path);
+        return 1;
+    }
+
+    static uint8_t data[FILE_SIZE], check[FILE_SIZE];
+    fill_pattern(data, FILE_SIZE, 1);
+    int inode = ssfs_client_create(client);
+    if (inode < 0) {
+        printf("ssfs_client_create() returned %d\n", inode);
+        ssfs_client_close(client);
+        return 1;
+    }
+
+    // The write, the stat and the read of one run are pipelined
+    SsfsClientOp ops[] = {
+        { SSFS_CLIENT_WRITE, inode, data, FILE_SIZE, 0, 0 },
+        { SSFS_CLIENT_STAT, inode, NULL, 0, 0, 0 },
+        { SSFS_CLIENT_READ, inode, check, FILE_SIZE, 0, 0 },
+    };
+    int ret = ssfs_client_run(client, ops, 3);
+    if (ret != 0 || ops[0].result != FILE_SIZE || ops[1].result != FILE_SIZE || ops[2].result != FILE_SIZE ||
+        memcmp(check, data, FILE_SIZE) != 0) {
+        printf("Run returned %d: write %d, stat %d, read %d\n", ret, ops[0].result, ops[1].result, ops[2].result);
+        ssfs_client_close(client);
+        return 1;
+    }
+    if (ssfs_client_delete(client, inode) != 0 || ssfs_client_stat(client, inode) >= 0) {
+        printf("Inode %d still there after ssfs_client_delete()\n", inode);
+        ssfs_client_close(client);
+        return 1;
+    }
+    printf("Inode %d written, read back and deleted\n", inode);
+
+    ssfs_client_close(client);
+    return 0;
+}
+
+/// @brief Sends a raw request header and, if len > 0, len bytes of payload.
+static int send_raw(int fd, const SsfsdRequest *request, size_t len) {
+    static uint8_t zeros[64 * 1024];
+    if (send(fd, request, sizeof(*request), MSG_NOSIGNAL) != (ssize_t)sizeof(*request)) return -1;
+    while (len > 0) {
+        size_t chunk = len < sizeof(zeros) ? len : sizeof(zeros);
+        ssize_t w = send(fd, zeros, chunk, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        len -= w;
+    }
+    return 0;
+}
+
+static int receive_raw(int fd, SsfsdResponse *response) {
+    size_t got = 0;
+    while (got < sizeof(*response)) {
+        ssize_t r = recv(fd, (uint8_t *)response + got, sizeof(*response) - got, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        got += r;
+    }
+    return 0;
+}
+
+/// @brief Connects without the client library, for requests it would not send.
+static int connect_raw(void) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) printf("Cannot connect to %s\n", socket_path);
+    return fd;
+}
+
+/// @brief Sends a SSFSD_OP_MAP request declaring declared bytes, along with a memfd of
+/// size bytes, sealed against shrinking if seal is set.
+static int send_map(int fd, uint32_t id, int32_t declared, size_t size, int seal) {
+    int memfd = memfd_create("client_test", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) return -1;
+    if (ftruncate(memfd, size) != 0 || (seal && fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) != 0)) {
+        close(memfd);
+        return -1;
+    }
+    SsfsdRequest request = { id, SSFSD_OP_MAP, 0, declared, 0, 0 };
+    struct iovec iov = { &request, sizeof(request) };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    close(memfd);
+    return sent == (ssize_t)sizeof(request) ? 0 : -1;
+}
+
+static int test_shared_buffer(void) {
+    // Large reads go through the buffer mapped by the client library
+    SsfsClient *client = connect_server();
+    if (!client || ssfs_client_map(client, 1024 * 1024) != 0) {
+        printf("Cannot map a shared buffer on %s\n", socket_path);
+        ssfs_client_close(client);
+        return 1;
+    }
+    int len = 2 * SSFS_CLIENT_SHM_MIN;
+    uint8_t *data = malloc(2 * len);
+    uint8_t *check = data + len;
+    int inode = data ? ssfs_client_create(client) : -1;
+    if (inode < 0) {
+        printf("ssfs_client_create() returned %d\n", inode);
+        free(data);
+        ssfs_client_close(client);
+        return 1;
+    }
+    fill_pattern(data, len, 2);
+    int written = ssfs_client_write(client, inode, data, len, 0);
+    int got = ssfs_client_read(client, inode, check, len, 0);
+    int same = got == len && memcmp(check, data, len) == 0;
+    ssfs_client_delete(client, inode);
+    free(data);
+    ssfs_client_close(client);
+    if (written != len || !same) {
+        printf("Wrote %d bytes, read %d back through the shared buffer\n", written, got);
+        return 1;
+    }
+
+    // A memfd smaller than declared, or that could shrink, is refused; the read that
+    // would have gone past its end is refused too, and the server goes on
+    int fd = connect_raw();
+    if (fd < 0) return 1;
+    SsfsdRequest shm_read = { 2, SSFS_CLIENT_READ | SSFSD_FLAG_SHM, 0, 200000, 0, 0 };
+    SsfsdRequest stat_request = { 3, SSFS_CLIENT_STAT, 0, 0, 0, 0 };
+    SsfsdResponse responses[4];
+    int failed = send_map(fd, 0, 1024 * 1024, 4096, 1) != 0 || send_map(fd, 1, 4096, 4096, 0) != 0 ||
+                 send_raw(fd, &shm_read, 0) != 0 || send_raw(fd, &stat_request, 0) != 0;
+    for (int i = 0; i < 4 && !failed; i++)
+        failed = receive_raw(fd, &responses[i]) != 0 || responses[i].id != (uint32_t)i;
+    close(fd);
+    if (failed || responses[0].result != fs_ENOTSUP || responses[1].result != fs_ENOTSUP ||
+        responses[2].result != fs_ENOTSUP) {
+        printf("Server did not refuse the bad mappings and go on\n");
+        return 1;
+    }
+    printf("%d bytes read through the shared buffer, bad mappings refused\n", len);
+    return 0;
+}
+
+static int test_bad_lengths(void) {
+    // Rejected by the client library, without reaching the server
+    SsfsClient *client = connect_server();
+    if (!client) {
+        printf("Cannot connect to %s\n", socket_path);
+        return 1;
+    }
+    uint8_t byte = 0;
+    SsfsClientOp ops[] = {
+        { SSFS_CLIENT_WRITE, 0, &byte, -1, 0, 0 },
+        { SSFS_CLIENT_CREATE, 0, NULL, 0, 0, 0 },
+        { SSFS_CLIENT_WRITE, 0, &byte, SSFSD_MAX_DATA + 1, 0, 0 },
+    };
+    int ret = ssfs_client_run(client, ops, 3);
+    if (ret != 0 || ops[0].result != fs_ENOTSUP || ops[1].result < 0 || ops[2].result != fs_ENOTSUP) {
+        printf("Run returned %d: writes %d and %d, create %d\n", ret, ops[0].result, ops[2].result, ops[1].result);
+        ssfs_client_close(client);
+        return 1;
+    }
+    int inode = ops[1].result;
+    ssfs_client_delete(client, inode);
+    ssfs_client_close(client);
+
+    // Sent as is: the server answers and drops the payload of the write, then serves
+    // the requests that follow
+    int fd = connect_raw();
+    if (fd < 0) return 1;
+    SsfsdRequest negative = { 0, SSFS_CLIENT_WRITE, inode, -5, 0, 0 };
+    SsfsdRequest large = { 1, SSFS_CLIENT_WRITE, inode, SSFSD_MAX_DATA + 4096, 0, 0 };
+    SsfsdRequest create = { 2, SSFS_CLIENT_CREATE, 0, 0, 0, 0 };
+    SsfsdResponse responses[3];
+    int failed = send_raw(fd, &negative, 0) != 0 || send_raw(fd, &large, (size_t)large.len) != 0 ||
+                 send_raw(fd, &create, 0) != 0;
+    for (int i = 0; i < 3 && !failed; i++) failed = receive_raw(fd, &responses[i]) != 0;
+    close(fd);
+    if (failed || responses[0].id != 0 || responses[0].result != fs_ENOTSUP || responses[1].id != 1 ||
+        responses[1].result != fs_ENOTSUP || responses[2].id != 2 || responses[2].result < 0) {
+        printf("Server did not reject the bad writes and go on\n");
+        return 1;
+    }
+
+    client = connect_server();
+    if (client) {
+        ssfs_client_delete(client, responses[2].result);
+        ssfs_client_close(client);
+    }
+    printf("Writes of bad lengths rejected by the client and by the server\n");
+    return 0;
+}
+
+typedef struct {
+    int seed;
+    int failures;
+} Worker;
+
+/// @brief Writes and reads back its own file, one pipelined run after another.
+static void *client_loop(void *arg) {
+    Worker *worker = arg;
+    SsfsClient *client = connect_server();
+    int inode = client ? ssfs_client_create(client) : -1;
+    uint8_t *data = malloc(2 * FILE_SIZE);
+    uint8_t *check = data + FILE_SIZE;
+    if (inode < 0 || !data) {
+        worker->failures++;
+        free(data);
+        ssfs_client_close(client);
+        return NULL;
+    }
+    for (int run = 0; run < CLIENT_RUNS; run++) {
+        fill_pattern(data, FILE_SIZE, worker->seed * CLIENT_RUNS + run);
+        memset(check, 0, FILE_SIZE);
+        SsfsClientOp ops[] = {
+            { SSFS_CLIENT_WRITE, inode, data, FILE_SIZE, 0, 0 },
+            { SSFS_CLIENT_READ, inode, check, FILE_SIZE, 0, 0 },
+        };
+        if (ssfs_client_run(client, ops, 2) != 0 || ops[0].result != FILE_SIZE || ops[1].result != FILE_SIZE ||
+            memcmp(check, data, FILE_SIZE) != 0)
+            worker->failures++;
+    }
+    if (ssfs_client_delete(client, inode) != 0) worker->failures++;
+    free(data);
+    ssfs_client_close(client);
+    return NULL;
+}
+
+static int test_clients(void) {
+    pthread_t threads[NB_CLIENTS];
+    Worker workers[NB_CLIENTS];
+    for (int i = 0; i < NB_CLIENTS; i++) {
+        workers[i].seed = i;
+        workers[i].failures = 0;
+        if (pthread_create(&threads[i], NULL, client_loop, &workers[i]) != 0) {
+            printf("Cannot start client %d\n", i);
+            for (int j = 0; j < i; j++) pthread_join(threads[j], NULL);
+            return 1;
+        }
+    }
+    int failures = 0;
+    for (int i = 0; i < NB_CLIENTS; i++) {
+        pthread_join(threads[i], NULL);
+        failures += workers[i].failures;
+    }
+    if (failures > 0) {
+        printf("%d failed runs over %d clients\n", failures, NB_CLIENTS);
+        return 1;
+    }
+    printf("%d clients ran %d runs each\n", NB_CLIENTS, CLIENT_RUNS);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("Usage: %s ssfsd disk_image\n", argv[0]);
+        return 1;
+    }
+    snprintf(socket_path, sizeof(socket_path), "client_test.%d.sock", (int)getpid());
+
+    pid_t server = fork();
+    if (server < 0) return 1;
+    if (server == 0) {
+        execl(argv[1], argv[1], "-s", socket_path, argv[2], (char *)NULL);
+        _exit(127);
+    }
+
+    int failed = 0;
+    printf("\n-------------- Test 1: Round trip --------------\n");
+    failed = test_round_trip();
+    if (!failed) {
+        printf("\n-------------- Test 2: Bad lengths --------------\n");
+        failed = test_bad_lengths();
+    }
+    if (!failed) {
+        printf("\n-------------- Test 3: Shared buffer --------------\n");
+        failed = test_shared_buffer();
+    }
+    if (!failed) {
+        printf("\n-------------- Test 4: Concurrent clients --------------\n");
+        failed = test_clients();
+    }
+
+    kill(server, SIGTERM);
+    int status;
+    waitpid(server, &status, 0);
+    if (!failed && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+        printf("ssfsd did not exit cleanly\n");
+        failed = 1;
+    }
+    if (!failed) printf("\nAll tests passed.\n");
+    return failed;
+}
@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <string.h>
+#include "compress.h"
+
+#define LZ4_MIN_MATCH    4     // Shortest match that can be encoded
+#define LZ4_MFLIMIT      12    // The last match starts at least this far from the end
+#define LZ4_LAST_LITERALS 5    // The block always ends with this many literals
+#define LZ4_MAX_OFFSET   65535 // Farthest match
+#define LZ4_HASH_BITS    12    // Entries of the match finder table (2^12)
+
+/// @brief Reads 4 bytes in host order.
+/// @param p
+/// @return
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/// @brief Hash of the 4 bytes at p, indexing the match finder table.
+/// @param p
+/// @return
+static uint32_t hash4(const uint8_t *p)
+{
+    return (read32(p) * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/// @brief Writes the continuation bytes of a length that does not fit in its token nibble.
+/// @param dst
+/// @param op
+/// @param n length minus 15
+/// @return the new output position
+static int write_length(uint8_t *dst, int op, int n)
+{
+    while (n >= 255) {
+        dst[op++] = 255;
+        n -= 255;
+    }
+    dst[op++] = (uint8_t)n;
+    return op;
+}
+
+/// @brief Compresses len bytes of src into dst with a greedy single-probe match finder.
+/// @param src
+/// @param len
+/// @param dst
+/// @param capacity size of dst
+/// @return the compressed size, or 0 if it does not fit in capacity
+int lz4_compress_block(const uint8_t *src, int len, uint8_t *dst, int capacity)
+{
+    uint32_t table[1 << LZ4_HASH_BITS]; // Position + 1 of the last occurrence, 0 if none
+    memset(table, 0, sizeof(table));
+
+    int ip = 0, anchor = 0, op = 0;
+    int match_limit = len - LZ4_LAST_LITERALS;
+
+    while (ip < len - LZ4_MFLIMIT) {
+        uint32_t h = hash4(src + ip);
+        int ref = (int)table[h] - 1;
+        table[h] = ip + 1;
+        if (ref < 0 || ip - ref > LZ4_MAX_OFFSET || read32(src + ref) != read32(src + ip)) {
+            ip++;
+            continue;
+        }
+
+        int match_len = LZ4_MIN_MATCH;
+        while (ip + match_len < match_limit && src[ref + match_len] == src[ip + match_len])
+            match_len++;
+
+        // Token, literals, offset and match length, checked against the worst case
+        int literals = ip - anchor;
+        int extra = match_len - LZ4_MIN_MATCH;
+        if (op + 1 + literals / 255 + 1 + literals + 2 + extra / 255 + 1 > capacity)
+            return 0;
+
+        uint8_t *token = &dst[op++];
+        *token = (uint8_t)(((literals < 15 ? literals : 15) << 4) | (extra < 15 ? extra : 15));
+        if (literals >= 15) op = write_length(dst, op, literals - 15);
+        memcpy(dst + op, src + anchor, literals);
+        op += literals;
+        dst[op++] = (uint8_t)(ip - ref);
+        dst[op++] = (uint8_t)((ip - ref) >> 8);
+        if (extra >= 15) op = write_length(dst, op, extra - 15);
+
+        ip += match_len;
+        anchor = ip;
+    }
+
+    // Last literals
+    int literals = len - anchor;
+    if (op + 1 + literals / 255 + 1 + literals > capacity)
+        return 0;
+    dst[op++] = (uint8_t)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) op = write_length(dst, op, literals - 15);
+    memcpy(dst + op, src + anchor, literals);
+    return op + literals;
+}
+
+/// @brief Decompresses a block produced by lz4_compress_block() (or any LZ4 block).
+/// Malformed input is rejected, never read or written out of bounds.
+/// @param src
+/// @param len compressed size
+/// @param dst
+/// @param capacity size of dst
+/// @return the decompressed size, or -1 if the block is malformed or does not fit
+int lz4_decompress_block(const uint8_t *src, int len, uint8_t *dst, int capacity)
+{
+    int ip = 0, op = 0;
+
+    while (ip < len) {
+        int token = src[ip++];
+
+        int literals = token >> 4;
+        if (literals == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) return -1;
+                b = src[ip++];
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > len - ip || literals > capacity - op) return -1;
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == len) break; // The last sequence has no match
+
+        if (len - ip < 2) return -1;
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+
+        int match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) return -1;
+                b = src[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > capacity - op) return -1;
+
+        // Overlapping matches repeat the last offset bytes, they are copied byte by byte
+        if (offset >= match_len) {
+            memcpy(dst + op, dst + op - offset, match_len);
+        } else {
+            for (int i = 0; i < match_len; ++i)
+                dst[op + i] = dst[op - offset + i];
+        }
+        op += match_len;
+    }
+
+    return op;
+}
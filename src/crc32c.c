@@ -0,0 +1,155 @@
+#include <stdint.h>
+#include <string.h>
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82F63B78u // Reversed Castagnoli polynomial
+
+#define CRC32C_STRIDE 336      // Bytes per stream when three are interleaved (3 x 336 = 1008)
+
+static uint32_t crc_table[8][256];
+static uint32_t shift_table[4][256]; // Appends CRC32C_STRIDE zero bytes to a CRC register
+
+/// @brief Product of two polynomials modulo the CRC polynomial, bit-reflected.
+/// @param a
+/// @param b
+/// @return
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+/// @brief Register after CRC32C_STRIDE zero bytes were fed to a register holding crc.
+/// @param crc
+/// @return
+static inline uint32_t shift_stride(uint32_t crc)
+{
+    return shift_table[0][crc & 0xff] ^ shift_table[1][(crc >> 8) & 0xff] ^
+           shift_table[2][(crc >> 16) & 0xff] ^ shift_table[3][crc >> 24];
+}
+
+/// @brief Slicing-by-8 implementation, 8 bytes per step.
+/// @param crc running CRC, already inverted
+/// @param p
+/// @param len
+/// @return
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + 4, sizeof(hi));
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_HW 1
+
+/// @brief SSE4.2 implementation. The crc32 instruction has a latency of three cycles
+/// but a throughput of one, so three independent streams are run side by side and
+/// merged by shifting the first ones over the bytes of the next.
+/// @param crc running CRC, already inverted
+/// @param p
+/// @param len
+/// @return
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c = crc;
+    while (len >= 3 * CRC32C_STRIDE) {
+        uint64_t c1 = 0, c2 = 0;
+        for (size_t i = 0; i < CRC32C_STRIDE; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, sizeof(v0));
+            memcpy(&v1, p + CRC32C_STRIDE + i, sizeof(v1));
+            memcpy(&v2, p + 2 * CRC32C_STRIDE + i, sizeof(v2));
+            c = __builtin_ia32_crc32di(c, v0);
+            c1 = __builtin_ia32_crc32di(c1, v1);
+            c2 = __builtin_ia32_crc32di(c2, v2);
+        }
+        c = shift_stride((uint32_t)c) ^ (uint32_t)c1;
+        c = shift_stride((uint32_t)c) ^ (uint32_t)c2;
+        p += 3 * CRC32C_STRIDE;
+        len -= 3 * CRC32C_STRIDE;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t *, size_t) = crc32c_sw;
+
+/// @brief Builds the tables and picks the implementation, before main().
+__attribute__((constructor))
+static void crc32c_init()
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; ++k)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; ++i)
+        for (int k = 1; k < 8; ++k)
+            crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^ crc_table[0][crc_table[k - 1][i] & 0xff];
+
+    // x^(8 * CRC32C_STRIDE) mod P, by repeated multiplication of x^8 (0x00800000 reflected)
+    uint32_t op = (uint32_t)1 << 31;
+    for (int i = 0; i < CRC32C_STRIDE; ++i)
+        op = multmodp(op, 0x00800000u);
+    for (int k = 0; k < 4; ++k)
+        for (uint32_t i = 0; i < 256; ++i)
+            shift_table[k][i] = multmodp(op, i << (8 * k));
+
+#ifdef CRC32C_HW
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl = crc32c_hw;
+#endif
+}
+
+/// @brief Extends crc (0 for a new checksum) with len bytes of data.
+/// @param crc
+/// @param data
+/// @param len
+/// @return
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    return ~crc32c_impl(~crc, data, len);
+}
+
+/// @brief Name of the implementation in use, for reports.
+/// @return
+const char *crc32c_impl_name()
+{
+#ifdef CRC32C_HW
+    if (crc32c_impl == crc32c_hw) return "sse4.2";
+#endif
+    return "software";
+}
@@ -7,4 +7,8 @@ const int fs_EWRITE      = -6;
 const int fs_ESYNC       = -7;
 const int fs_EREAD       = -8;
 const int fs_EON         = -9;
-const int fs_EMOUNT      = -10;
\ No newline at end of file
+const int fs_EMOUNT      = -10;
+const int fs_ENOTSUP     = -11;
+const int fs_ECORRUPT    = -12;
+const int fs_EBADF       = -13;
+const int fs_ENFILE      = -14;
\ No newline at end of file
@@ -1,37 +1,636 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "include/vdisk.h"
 #include "fs.h"
 #include "ssfs.h"
 #include "include/error.h"
-
-#define INODE_VALID             1 // Valid inode status
-#define INODE_STATUT            0 // Offset for inode status in the inode structure
-#define INODE_SIZE_OFFSET       4 // Offset for file size in the inode structure
-#define INODE_DIRECT_OFFSET     8 // Offset for direct pointers in the inode structure
-#define INODE_INDIRECT1_OFFSET  24 // Offset for indirect1 pointer in the inode structure
-#define INODE_INDIRECT2_OFFSET  28 // Offset for indirect2 pointer in the inode structure
-#define BLOCK_POINTERS_SIZE     256 // Number of pointers in a block
-#define NB_DIRECT_BLOCKS        4 // Number of direct blocks in an inode
-#define BLOCK_PTR_SIZE          4 // Size of a block pointer
-
-#define MAX_BLOCKS 10000
-char block_used[MAX_BLOCKS] = {0}; // Array to track used blocks
+#include "stats.h"
+#include "trace.h"
+#include "compress.h"
+#include "crc32c.h"
+#include "xxhash.h"
+#include "hostio.h"
+
+// References to each block of the mounted volume, 0 if the block is free. A block is
+// referenced by the inodes, pointer blocks and snapshots pointing to it: clones and
+// snapshots share blocks, which are copied on write (see load_private_data_block()).
+static uint32_t *block_refs = NULL;
+
+/// @brief Checksums of a volume with SSFS_FEATURE_CHECKSUMS, loaded from its checksum
+/// region at mount. A block is verified on its first read only: the verified bitmap
+/// remembers the blocks read or written since. Changed checksums are written back at
+/// the end of the call that changed them (see flush_checksums()).
+typedef struct {
+    uint32_t *sums;          // Checksum of each block, 0 if unknown. NULL without the feature
+    uint64_t *verified;      // Blocks whose contents are known to match their checksum
+    uint32_t *dirty;         // Blocks of the checksum region to write back
+    uint8_t *is_dirty;       // Whether each block of the checksum region is in dirty
+    uint32_t nb_dirty;
+    uint32_t nb_sum_blocks;  // Blocks of the checksum region
+} Checksums;
+
+static Checksums checksums;
+
+/// @brief Entry of the dedup index: the last block written with contents of this hash
+typedef struct {
+    uint64_t hash;   // 0 for an empty entry
+    uint32_t block;
+} DedupEntry;
+
+#define DEDUP_PROBES 16 // Entries probed per lookup; a full neighbourhood evicts its first entry
+
+/// @brief Index of the data blocks of a volume in dedup mode (SSFS_FEATURE_DEDUP) by
+/// contents, kept in memory only: it is built on the first write after mount, from the
+/// data blocks of the files. Entries are not removed when a block changes or is freed,
+/// the indexed bitmap and the comparison of the contents on a hit catch stale ones.
+typedef struct {
+    DedupEntry *entries;  // Open addressing table, NULL until built
+    uint32_t mask;        // Number of entries - 1
+    uint64_t *indexed;    // Data blocks the entries may point to
+} DedupIndex;
+
+static DedupIndex dedup_index;
+
+#define ALLOC_GROUP_BLOCKS  1024 // Data blocks per allocation group
+#define PREALLOC_WINDOWS    32   // Files holding a preallocation window at a time
+#define PREALLOC_MIN_BLOCKS 8    // First window of a growing file
+#define PREALLOC_MAX_BLOCKS 512  // Windows double up to this size
+
+/// @brief Free blocks reserved, in memory only, for the next blocks of a growing file:
+/// the other files allocate around them, so that files written side by side are not
+/// interleaved block by block.
+typedef struct {
+    int inode_num;      // -1 for an unused window
+    uint32_t next;      // Next block of the window to hand out
+    uint32_t end;       // End of the window (excluded)
+    uint32_t size;      // Blocks reserved by the last window, the next one is twice as large
+    uint32_t last_use;  // Allocator clock at the last use, the least recently used window is recycled
+} PreallocWindow;
+
+/// @brief Allocation state of the mounted volume. The data area is split in allocation
+/// groups: each file starts in the group of its inode, its blocks then follow the last one
+/// allocated (the goal), and groups without a free block are skipped without a scan.
+/// Inside a group, the free map is scanned 64 blocks at a time, and a block is taken by
+/// clearing its bit with a compare-and-swap (see claim_block()). Only that claim is
+/// atomic: the windows, the goals and the reference counts are not locked, and the fs.h
+/// calls must not run concurrently.
+typedef struct {
+    uint32_t *group_free;   // Free blocks of each group, NULL when not mounted
+    uint32_t nb_groups;
+    uint64_t *free_map;     // Bit set for each free block of the data area
+    PreallocWindow windows[PREALLOC_WINDOWS];
+    uint32_t clock;
+} Allocator;
+
+static Allocator allocator;
+
+/// @brief What the blocks allocated by the call in progress are for (see set_alloc_cursor())
+typedef struct {
+    int inode_num;   // File being written, -1 for other blocks
+    int grow;        // 1 if the file grows: its preallocation window is used and extended
+    uint32_t goal;   // Block to allocate next if free, 0 for none
+} AllocCursor;
+
+static AllocCursor alloc_cursor = { -1, 0, 0 };
+
+/// @brief State of a walk over the blocks of a file in file order (see walk_layout())
+typedef struct {
+    int compressed;          // The file is stored in compressed clusters
+    uint32_t expected;       // Block right after the last data or pointer block walked
+    uint32_t data_blocks;
+    uint32_t pointer_blocks;
+    uint32_t shared_blocks;  // Blocks shared, or below a shared pointer block
+    uint32_t private_blocks; // Blocks defrag_file() can move
+    uint32_t extents;
+} LayoutWalk;
+
+/// @brief A file being moved by defrag_file(): the blocks copied so far and their copies
+typedef struct {
+    LayoutWalk walk;
+    uint32_t *old_blocks;
+    uint32_t *new_blocks;
+    uint32_t nb_moved;
+    uint32_t capacity;
+    int rate_kib;             // KiB copied per second at most, 0 for no limit
+    struct timespec start;
+} Relocation;
+
+#define MAX_OPEN_FILES   64         // Handles open at a time, see ssfs_open()
+#define HANDLE_SLOT_BITS 6          // Low bits of a handle: its slot in open_files
+#define MAP_HOLE         UINT32_MAX // Block map entry of a hole of the file
+
+/// @brief A file opened with ssfs_open(). Its inode is kept, and the data blocks of the
+/// file are looked up once, one pointer block at a time, into the block map: reading
+/// through the handle then costs the data blocks only. The calls that change the file
+/// by inode number mark its handles stale (see invalidate_handles()), the inode is read
+/// again and the map dropped on their next use.
+typedef struct {
+    int in_use;
+    uint32_t generation;        // Bumped when the handle is closed, stale handles do not match
+    int volume;                 // mount_depth of the volume of the file
+    int inode_num;
+    int stale;                  // The inode and map must be loaded again
+    int deleted;                // The file was deleted, every call fails
+    uint8_t inode[INODE_SIZE];
+    uint32_t *map;              // File block -> data block, 0 until looked up
+    uint32_t map_size;
+    uint32_t position;          // Offset of the next ssfs_read() or ssfs_write()
+} OpenFile;
+
+static OpenFile open_files[MAX_OPEN_FILES];
+
+#define TRANSFER_BLOCKS 256 // Blocks moved per step by ssfs_export() and ssfs_import()
+
+/// @brief An operation of ssfs_batch() on an inode, sorted by inode then by position
+typedef struct {
+    uint32_t inode_num;
+    int index;          // Position of the operation in the batch
+} BatchEntry;
+
+// Set when a metadata block could not be read while rebuilding the reference counts:
+// the blocks below it would look free, so the volume is not mounted.
+static int refs_incomplete = 0;
+
+#define MAX_NESTED_MOUNTS 8 // Volumes that can be stacked with mount_nested()
+
+/// @brief A volume suspended by mount_nested(), restored by unmount()
+typedef struct {
+    SSFS ssfs;
+    uint32_t *block_refs;
+    Checksums checksums;
+    DedupIndex dedup_index;
+    Allocator allocator;
+} SuspendedVolume;
+
+static SuspendedVolume mount_stack[MAX_NESTED_MOUNTS];
+static int mount_depth = 0;
+
+/// @brief The pointer blocks between an inode and one of its block pointers, loaded
+/// to modify that pointer (see open_block_path())
+typedef struct {
+    uint8_t indirect[BLOCK_SIZE];       // Indirect1 block
+    uint8_t dbl_indirect[BLOCK_SIZE];   // Indirect2 block
+    uint8_t inner_indirect[BLOCK_SIZE]; // Pointer block below the indirect2 block
+    uint32_t *intermediate_ptr;         // Pointer to inner_indirect inside dbl_indirect
+    int indirect_dirty;
+    int dbl_indirect_dirty;
+    int inner_indirect_dirty;
+} BlockPath;
 
 static uint8_t* get_inode(uint32_t inode_num, uint8_t *block_out);
 static int free_block(uint32_t block_num);
 static uint32_t allocate_block();
-static void clear_indirect_block(uint32_t block_num);
-static void clear_double_indirect_block(uint32_t block_num);
+static int claim_block(uint32_t block_num);
+static void unclaim_block(uint32_t block_num);
 static uint32_t get_vdisk_size(DISK *disk);
-static void rebuild_block_usage_from_inodes();
+static int mount_disk();
+static int write_superblock();
+static int enable_reflink();
+static void take_ref(uint32_t block_num, int depth);
+static void release_block(uint32_t block_num, int depth);
+static void count_block_refs(uint32_t block_num, int depth);
+static void count_table_refs(uint32_t block_num);
+static void for_each_inode_root(const uint8_t *inode, void (*fn)(uint32_t block_num, int depth));
+static void rebuild_block_refs();
+static int load_private_pointer_block(uint32_t *slot, uint8_t *buffer);
+static int load_private_data_block(uint32_t *slot, uint8_t *buffer, int overwrite);
+static void drop_private_data_block(uint32_t *slot, uint32_t old);
+static int unshare_block(uint32_t *slot, int depth);
+static int unshare_file(uint32_t inode_num);
+static void release_snapshot(uint32_t root_num, const uint8_t *root);
+static uint8_t *get_snapshot_inode(int snapshot, uint32_t inode_num, uint8_t *block_out);
+static int read_from_inode(const uint8_t *inode, uint8_t *data, int len, int offset);
+static int open_block_path(uint8_t *inode, int file_block_index, BlockPath *path, uint32_t **slot);
+static int close_block_path(uint8_t *inode, int file_block_index, BlockPath *path, int slot_changed);
+static int write_blocks(uint8_t *inode, const uint8_t *data, int len, int offset);
+static int get_cluster_slots(const uint8_t *inode, int cluster, uint32_t *slots);
+static int read_cluster(const uint32_t *slots, uint8_t *plain, int from, int to);
+static int store_cluster(uint32_t *slots, uint8_t *plain, int used);
+static int read_clusters(const uint8_t *inode, uint8_t *data, int len, int offset);
+static int write_clusters(uint8_t *inode, const uint8_t *data, int len, int offset);
+static int read_meta_block(uint32_t block_num, uint8_t *buffer);
+static int write_meta_block(uint32_t block_num, uint8_t *buffer);
+static int read_data_block(uint32_t block_num, uint8_t *buffer);
+static int write_data_block(uint32_t block_num, uint8_t *buffer);
+static int alloc_checksums(uint32_t nb_sum_blocks);
+static void free_checksums();
+static int load_checksums();
+static int flush_checksums(int ret);
+static int verify_checksum(uint32_t block_num, const uint8_t *buffer);
+static inline int read_error(int ret);
+static void record_checksum(uint32_t block_num, const uint8_t *buffer);
+static void set_checksum(uint32_t block_num, uint32_t sum);
+static void forget_checksums(uint32_t block_num, int depth);
+static uint64_t block_hash(const uint8_t *buffer);
+static int build_dedup_index();
+static void free_dedup_index();
+static void index_blocks(uint32_t block_num, int depth);
+static void dedup_insert(uint32_t block_num, uint64_t hash);
+static uint32_t find_duplicate(const uint8_t *buffer, uint64_t hash);
+static int get_file_block(const uint8_t *inode, int file_block_index, uint32_t *block_num);
+static int alloc_allocator();
+static void free_allocator();
+static void count_free_blocks();
+static void set_alloc_cursor(int inode_num, int grow);
+static void clear_alloc_cursor();
+static uint32_t home_block(int inode_num);
+static uint32_t previous_block(int file_block_index, const uint32_t *slot);
+static PreallocWindow *get_window(int inode_num);
+static void reserve_window(int inode_num, uint32_t start, uint32_t size);
+static void drop_window(int inode_num);
+static inline int is_free(uint32_t block_num);
+static uint32_t reserved_until(uint32_t block_num, int inode_num);
+static uint32_t find_free_block(uint32_t goal, int inode_num, int steal);
+static uint32_t find_free_run(uint32_t goal, uint32_t count, int inode_num);
+static int walk_layout(const uint8_t *inode, LayoutWalk *walk);
+static int walk_block(uint32_t block_num, int depth, int shared, LayoutWalk *walk);
+static int relocate_block(uint32_t *slot, int depth, Relocation *reloc);
+static void throttle(const Relocation *reloc);
+static OpenFile *get_open_file(int handle);
+static void close_open_file(OpenFile *file);
+static void invalidate_handles(int inode_num, const OpenFile *except, int deleted);
+static int refresh_open_file(OpenFile *file);
+static int lookup_block(OpenFile *file, uint32_t index, uint32_t *block_num);
+static uint32_t pointer_group_end(uint32_t index);
+static int load_pointer_group(const uint8_t *inode, uint32_t index, uint32_t *pointers);
+static int map_blocks(uint8_t *inode, uint32_t first, uint32_t count, uint32_t *blocks);
+static int unmap_blocks(uint8_t *inode, uint32_t first, uint32_t count);
+static int export_blocks(const uint8_t *inode, uint32_t size, int image_fd, int fd);
+static int export_buffered(const uint8_t *inode, uint32_t size, int fd);
+static int import_blocks(int inode_num, uint8_t *inode, int64_t known_size, int fd);
+static int import_buffered(int inode_num, uint8_t *inode, int fd);
+static int compare_batch_entries(const void *a, const void *b);
+static int run_batch_op(BatchOp *op, uint8_t *inode, int *dirty);
+static inline int batch_trace_op(int op);
+
+static int do_format(char *disk_name, int inodes);
+static int do_stat(int inode_num);
+static int do_mount(char *disk_name);
+static int do_mount_nested(int inode_num);
+static int do_unmount();
+static int do_delete(int inode_num);
+static int do_read(int inode_num, uint8_t *data, int len, int offset);
+static int do_write(int inode_num, uint8_t *data, int len, int offset);
+static int do_create();
+static int do_clone_file(int inode_num);
+static int do_snapshot_create();
+static int do_snapshot_delete(int snapshot);
+static int do_snapshot_stat(int snapshot, int inode_num);
+static int do_snapshot_read(int snapshot, int inode_num, uint8_t *data, int len, int offset);
+static int do_set_compression(int inode_num, int mode);
+static int do_enable_checksums();
+static int do_set_dedup(int enabled);
+static int do_dedup_file(int inode_num);
+static int do_preallocate(int inode_num, int len, int offset);
+static int do_file_layout(int inode_num, FileLayout *layout);
+static int do_defrag_file(int inode_num, int rate_kib);
+static int do_open(int inode_num);
+static int do_close(int handle);
+static int do_pread(OpenFile *file, uint8_t *data, int len, int offset);
+static int do_pwrite(OpenFile *file, uint8_t *data, int len, int offset);
+static int do_batch(BatchOp *ops, int count);
+static int do_export(int inode_num, int fd);
+static int do_import(int fd, int *bytes);
 
 //=============================================================================
 //========================== SSFS API FUNCTIONS ===============================
 //=============================================================================
 
+// The API functions only account for and trace the call (see stats.h and trace.h),
+// forward to the do_* implementations below and, for the calls that write blocks,
+// write back the checksums they changed.
+
+int format(char *disk_name, int inodes)
+{
+    STATS_BEGIN(STATS_OP_FORMAT);
+    TRACE_BEGIN();
+    int ret = do_format(disk_name, inodes);
+    TRACE_END(TRACE_OP_FORMAT, -1, inodes, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int stat(int inode_num)
+{
+    STATS_BEGIN(STATS_OP_STAT);
+    TRACE_BEGIN();
+    int ret = do_stat(inode_num);
+    TRACE_END(TRACE_OP_STAT, inode_num, 0, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int mount(char *disk_name)
+{
+    STATS_BEGIN(STATS_OP_MOUNT);
+    TRACE_BEGIN();
+    int ret = do_mount(disk_name);
+    TRACE_END(TRACE_OP_MOUNT, -1, 0, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int mount_nested(int inode_num)
+{
+    STATS_BEGIN(STATS_OP_MOUNT_NESTED);
+    TRACE_BEGIN();
+    int ret = do_mount_nested(inode_num);
+    TRACE_END(TRACE_OP_MOUNT_NESTED, inode_num, 0, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int unmount()
+{
+    STATS_BEGIN(STATS_OP_UNMOUNT);
+    TRACE_BEGIN();
+    int ret = do_unmount();
+    TRACE_END(TRACE_OP_UNMOUNT, -1, 0, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int delete(int inode_num)
+{
+    STATS_BEGIN(STATS_OP_DELETE);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_delete(inode_num));
+    TRACE_END(TRACE_OP_DELETE, inode_num, 0, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int read(int inode_num, uint8_t *data, int len, int offset)
+{
+    STATS_BEGIN(STATS_OP_READ);
+    TRACE_BEGIN();
+    int ret = do_read(inode_num, data, len, offset);
+    TRACE_END(TRACE_OP_READ, inode_num, len, offset, ret);
+    STATS_END(ret, ret);
+    return ret;
+}
+
+int write(int inode_num, uint8_t *data, int len, int offset)
+{
+    STATS_BEGIN(STATS_OP_WRITE);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_write(inode_num, data, len, offset));
+    TRACE_END(TRACE_OP_WRITE, inode_num, len, offset, ret);
+    STATS_END(ret, ret);
+    return ret;
+}
+
+int create()
+{
+    STATS_BEGIN(STATS_OP_CREATE);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_create());
+    TRACE_END(TRACE_OP_CREATE, -1, 0, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int clone_file(int inode_num)
+{
+    STATS_BEGIN(STATS_OP_CLONE);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_clone_file(inode_num));
+    TRACE_END(TRACE_OP_CLONE, inode_num, 0, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int snapshot_create()
+{
+    STATS_BEGIN(STATS_OP_SNAPSHOT_CREATE);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_snapshot_create());
+    TRACE_END(TRACE_OP_SNAPSHOT_CREATE, -1, 0, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int snapshot_delete(int snapshot)
+{
+    STATS_BEGIN(STATS_OP_SNAPSHOT_DELETE);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_snapshot_delete(snapshot));
+    TRACE_END(TRACE_OP_SNAPSHOT_DELETE, -1, snapshot, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int set_compression(int inode_num, int mode)
+{
+    STATS_BEGIN(STATS_OP_SET_COMPRESSION);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_set_compression(inode_num, mode));
+    TRACE_END(TRACE_OP_SET_COMPRESSION, inode_num, mode, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int enable_checksums()
+{
+    STATS_BEGIN(STATS_OP_ENABLE_CHECKSUMS);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_enable_checksums());
+    TRACE_END(TRACE_OP_ENABLE_CHECKSUMS, -1, 0, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int set_dedup(int enabled)
+{
+    STATS_BEGIN(STATS_OP_SET_DEDUP);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_set_dedup(enabled));
+    TRACE_END(TRACE_OP_SET_DEDUP, -1, enabled, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int dedup_file(int inode_num)
+{
+    STATS_BEGIN(STATS_OP_DEDUP_FILE);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_dedup_file(inode_num));
+    TRACE_END(TRACE_OP_DEDUP_FILE, inode_num, 0, 0, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int preallocate(int inode_num, int len, int offset)
+{
+    STATS_BEGIN(STATS_OP_PREALLOCATE);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_preallocate(inode_num, len, offset));
+    TRACE_END(TRACE_OP_PREALLOCATE, inode_num, len, offset, ret);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int defrag_file(int inode_num, int rate_kib)
+{
+    STATS_BEGIN(STATS_OP_DEFRAG_FILE);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_defrag_file(inode_num, rate_kib));
+    TRACE_END(TRACE_OP_DEFRAG_FILE, inode_num, rate_kib, 0, ret);
+    STATS_END(ret, ret > 0 ? ret * BLOCK_SIZE : 0);
+    return ret;
+}
+
+// Calls through a handle are accounted and traced as the read() and write() of its file.
+
+int ssfs_open(int inode_num)
+{
+    STATS_BEGIN(STATS_OP_OPEN);
+    int ret = do_open(inode_num);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int ssfs_close(int handle)
+{
+    STATS_BEGIN(STATS_OP_CLOSE);
+    int ret = do_close(handle);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int ssfs_pread(int handle, uint8_t *data, int len, int offset)
+{
+    STATS_BEGIN(STATS_OP_READ);
+    TRACE_BEGIN();
+    OpenFile *file = get_open_file(handle);
+    int ret = do_pread(file, data, len, offset);
+    TRACE_END(TRACE_OP_READ, file ? file->inode_num : -1, len, offset, ret);
+    STATS_END(ret, ret);
+    return ret;
+}
+
+int ssfs_pwrite(int handle, uint8_t *data, int len, int offset)
+{
+    STATS_BEGIN(STATS_OP_WRITE);
+    TRACE_BEGIN();
+    OpenFile *file = get_open_file(handle);
+    int ret = flush_checksums(do_pwrite(file, data, len, offset));
+    TRACE_END(TRACE_OP_WRITE, file ? file->inode_num : -1, len, offset, ret);
+    STATS_END(ret, ret);
+    return ret;
+}
+
+int ssfs_read(int handle, uint8_t *data, int len)
+{
+    STATS_BEGIN(STATS_OP_READ);
+    TRACE_BEGIN();
+    OpenFile *file = get_open_file(handle);
+    int offset = file ? (int)file->position : 0;
+    int ret = do_pread(file, data, len, offset);
+    if (ret > 0) file->position += (uint32_t)ret;
+    TRACE_END(TRACE_OP_READ, file ? file->inode_num : -1, len, offset, ret);
+    STATS_END(ret, ret);
+    return ret;
+}
+
+int ssfs_write(int handle, uint8_t *data, int len)
+{
+    STATS_BEGIN(STATS_OP_WRITE);
+    TRACE_BEGIN();
+    OpenFile *file = get_open_file(handle);
+    int offset = file ? (int)file->position : 0;
+    int ret = flush_checksums(do_pwrite(file, data, len, offset));
+    if (ret > 0) file->position += (uint32_t)ret;
+    TRACE_END(TRACE_OP_WRITE, file ? file->inode_num : -1, len, offset, ret);
+    STATS_END(ret, ret);
+    return ret;
+}
+
+// The operations of a batch are traced one by one, in the order they are run (see
+// do_batch()), so that a replay calling them one at a time gets the same results.
+
+int ssfs_batch(BatchOp *ops, int count)
+{
+    STATS_BEGIN(STATS_OP_BATCH);
+    TRACE_BEGIN();
+    int ret = flush_checksums(do_batch(ops, count));
+    int bytes = 0;
+    for (int creates = 0; creates < 2 && ret == 0; ++creates) {
+        for (int i = 0; i < count; ++i) {
+            BatchOp *op = &ops[i];
+            if ((op->op == BATCH_CREATE) != creates || op->result == fs_ENOTSUP) continue;
+            if ((op->op == BATCH_READ || op->op == BATCH_WRITE) && op->result > 0) bytes += op->result;
+            TRACE_END(batch_trace_op(op->op), creates ? -1 : op->inode_num,
+                      op->op == BATCH_READ || op->op == BATCH_WRITE ? op->len : 0,
+                      op->op == BATCH_READ || op->op == BATCH_WRITE ? op->offset : 0, op->result);
+        }
+    }
+    STATS_END(ret, bytes);
+    return ret;
+}
+
+// Transfers with the host are traced as the read(), or the create() and write(), they
+// amount to; a replay reads or writes the same number of bytes.
+
+int ssfs_export(int inode_num, int fd)
+{
+    STATS_BEGIN(STATS_OP_EXPORT);
+    TRACE_BEGIN();
+    int ret = do_export(inode_num, fd);
+    TRACE_END(TRACE_OP_READ, inode_num, ret > 0 ? ret : 0, 0, ret);
+    STATS_END(ret, ret);
+    return ret;
+}
+
+int ssfs_import(int fd)
+{
+    STATS_BEGIN(STATS_OP_IMPORT);
+    TRACE_BEGIN();
+    int bytes = 0;
+    int ret = flush_checksums(do_import(fd, &bytes));
+    TRACE_END(TRACE_OP_CREATE, -1, 0, 0, ret);
+    if (ret >= 0) TRACE_END(TRACE_OP_WRITE, ret, bytes, 0, bytes);
+    STATS_END(ret, bytes);
+    return ret;
+}
+
+// Reads of a snapshot and of the layout of a file are accounted with stat() and read()
+// but not traced: a replay has no way to recreate the contents of the snapshot, and
+// the layout depends on the volume replayed to.
+
+int file_layout(int inode_num, FileLayout *layout)
+{
+    STATS_BEGIN(STATS_OP_STAT);
+    int ret = do_file_layout(inode_num, layout);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int snapshot_stat(int snapshot, int inode_num)
+{
+    STATS_BEGIN(STATS_OP_STAT);
+    int ret = do_snapshot_stat(snapshot, inode_num);
+    STATS_END(ret, 0);
+    return ret;
+}
+
+int snapshot_read(int snapshot, int inode_num, uint8_t *data, int len, int offset)
+{
+    STATS_BEGIN(STATS_OP_READ);
+    int ret = do_snapshot_read(snapshot, inode_num, data, len, offset);
+    STATS_END(ret, ret);
+    return ret;
+}
+
+//=============================================================================
+//====================== SSFS OPERATION IMPLEMENTATIONS =======================
+//=============================================================================
+
 /// @brief formats, 
 /// that is, installs SSFS on, the virtual disk whose disk image is contained in file disk_name (as a c-style string). 
 /// It will attempt to construct an SSFS instance with at least inodes i-nodes and a minimum of a single data block. 
@@ -39,7 +638,7 @@ static void rebuild_block_usage_from_inodes();
 /// @param disk_name 
 /// @param inodes 
 /// @return 
-int format(char *disk_name, int inodes)
+static int do_format(char *disk_name, int inodes)
 {
     if (ssfs.is_mounted) return fs_EMOUNT;
     if (vdisk_on(disk_name, &ssfs.disk) != 0) return fs_EON;
@@ -52,6 +651,7 @@ int format(char *disk_name, int inodes)
         return fs_EWRITE;
     
     SuperBlock *sb = &ssfs.superblock;
+    memset(sb, 0, sizeof(SuperBlock));
     memcpy(sb->magic, MAGIC_NUMBER, MAGIC_NUMBER_SIZE);
     sb->nb_blocks = total_blocks;
     sb->nb_inode_blocks = inode_blocks;
@@ -60,14 +660,14 @@ int format(char *disk_name, int inodes)
     // Write the superblock to the first block
     uint8_t block[BLOCK_SIZE] = {0};
     memcpy(block, sb, sizeof(SuperBlock));
-    if (vdisk_write(&ssfs.disk, SUPERBLOCK_SECTOR, block) != 0)
+    if (write_meta_block(SUPERBLOCK_SECTOR, block) != 0)
         return fs_EWRITE;
     
     printf("format(): total_blocks = %u\n", total_blocks);
 
     for (uint32_t i = 1; i < total_blocks; ++i) {
         uint8_t check[BLOCK_SIZE];
-        if (vdisk_read(&ssfs.disk, i, check) != 0) return fs_EREAD;
+        if (read_data_block(i, check) != 0) return fs_EREAD;
     
         for (int j = 0; j < BLOCK_SIZE; ++j) {
             if (check[j] != 0) {
@@ -80,15 +680,13 @@ int format(char *disk_name, int inodes)
     // Erase the rest of the disk to 0
     memset(block, 0, BLOCK_SIZE);
     for (uint32_t i = 1; i < total_blocks; ++i) {
-        if (vdisk_write(&ssfs.disk, i, block) != 0)
+        if (write_data_block(i, block) != 0)
         {
             printf("Failed to write block %u\n", i);
             return fs_EWRITE;
         }
     }
 
-    memset(block_used, 0, sizeof(block_used));
-
     if(vdisk_sync(&ssfs.disk) != 0) return fs_ESYNC;
     vdisk_off(&ssfs.disk);
     return 0;
@@ -98,7 +696,7 @@ int format(char *disk_name, int inodes)
 /// @brief returns the file size on success.
 /// @param inode_num 
 /// @return 
-int stat(int inode_num)
+static int do_stat(int inode_num)
 {
     if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
         return fs_EMOUNT;
@@ -119,13 +717,81 @@ int stat(int inode_num)
 /// should fail if it is called while another volume is already mounted.
 /// @param disk_name 
 /// @return 
-int mount(char *disk_name)
+static int do_mount(char *disk_name)
 {
     if (ssfs.is_mounted) return fs_EMOUNT;
     if (vdisk_on(disk_name, &ssfs.disk) != 0) return fs_EON;
 
+    return mount_disk();
+}
+
+
+/// @brief mounts the SSFS image stored in file inode_num of the mounted volume, in
+/// place: its blocks are read from and written to the blocks of the file, nothing is
+/// copied. The current volume is suspended until the nested one is unmounted, so
+/// nested volumes can be stacked (up to MAX_NESTED_MOUNTS).
+/// @param inode_num 
+/// @return 
+static int do_mount_nested(int inode_num)
+{
+    if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
+        return fs_EMOUNT;
+    if (mount_depth == MAX_NESTED_MOUNTS) return fs_EMOUNT;
+
+    // The nested disk writes the blocks of the file in place, they must not be shared
+    set_alloc_cursor(inode_num, 0);
+    int ret = unshare_file(inode_num);
+    clear_alloc_cursor();
+    invalidate_handles(inode_num, NULL, 0);
+    if (ret < 0) return ret;
+
+    // Nor checksummed: the outer volume does not see these writes
+    if (checksums.sums) {
+        uint8_t block[BLOCK_SIZE];
+        uint8_t *inode = get_inode(inode_num, block);
+        if (!inode) return fs_EREAD;
+        if (inode[INODE_STATUT] == INODE_VALID)
+            for_each_inode_root(inode, forget_checksums);
+    }
+    ret = flush_checksums(0);
+    if (ret < 0) return ret;
+
+    // The suspended copy of the outer volume keeps a stable address for the nested disk
+    SuspendedVolume *outer = &mount_stack[mount_depth];
+    outer->ssfs = ssfs;
+    outer->block_refs = block_refs;
+    outer->checksums = checksums;
+    outer->dedup_index = dedup_index;
+    outer->allocator = allocator;
+    if (vdisk_on_nested(&outer->ssfs.disk, ssfs.inode_start_block, inode_num, &ssfs.disk) != 0)
+        return fs_EON;
+
+    mount_depth++;
+    ssfs.is_mounted = 0;
+    block_refs = NULL;
+    memset(&checksums, 0, sizeof(Checksums));
+    memset(&dedup_index, 0, sizeof(DedupIndex));
+    memset(&allocator, 0, sizeof(Allocator));
+
+    ret = mount_disk();
+    if (ret != 0) {
+        mount_depth--;
+        ssfs = outer->ssfs;
+        block_refs = outer->block_refs;
+        checksums = outer->checksums;
+        dedup_index = outer->dedup_index;
+        allocator = outer->allocator;
+    }
+    return ret;
+}
+
+/// @brief Reads the superblock of ssfs.disk and sets up the mounted volume.
+/// Turns the disk off on failure.
+/// @return 0 on success
+static int mount_disk()
+{
     uint8_t block[BLOCK_SIZE];
-    if (vdisk_read(&ssfs.disk, SUPERBLOCK_SECTOR, block) != 0) {
+    if (read_meta_block(SUPERBLOCK_SECTOR, block) != 0) {
         vdisk_off(&ssfs.disk);
         return fs_EREAD;
     }
@@ -139,29 +805,96 @@ int mount(char *disk_name)
         return -1;
     }
 
+    // And that its geometry fits the disk
+    if (sb->block_size != BLOCK_SIZE || sb->nb_blocks > get_vdisk_size(&ssfs.disk) ||
+        sb->nb_inode_blocks == 0 || sb->nb_inode_blocks >= sb->nb_blocks - 1) {
+        vdisk_off(&ssfs.disk);
+        return fs_EMOUNT;
+    }
+
     // Set all the parameters
     ssfs.nb_inodes = sb->nb_inode_blocks * INODES_PER_BLOCK;
     ssfs.inode_start_block = 1;
     ssfs.data_start_block  = ssfs.inode_start_block + sb->nb_inode_blocks;
+    ssfs.data_end_block    = sb->nb_blocks;
 
-    ssfs.is_mounted = 1;
-    rebuild_block_usage_from_inodes();
+    if (sb->features & SSFS_FEATURE_CHECKSUMS) {
+        uint32_t nb_sum_blocks = (sb->nb_blocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+        if (sb->checksum_start != sb->nb_blocks - nb_sum_blocks || sb->checksum_start <= ssfs.data_start_block) {
+            vdisk_off(&ssfs.disk);
+            return fs_EMOUNT;
+        }
+        ssfs.data_end_block = sb->checksum_start;
+    }
 
-    return 0;
+    block_refs = calloc(sb->nb_blocks, sizeof(uint32_t));
+    if (!block_refs) {
+        vdisk_off(&ssfs.disk);
+        return fs_EMOUNT;
+    }
+
+    // Loaded first, so that the metadata read below is verified
+    if (sb->features & SSFS_FEATURE_CHECKSUMS) {
+        int ret = load_checksums();
+        if (ret != 0) {
+            free(block_refs);
+            block_refs = NULL;
+            vdisk_off(&ssfs.disk);
+            return ret;
+        }
+    }
+
+    ssfs.is_mounted = 1;
+    refs_incomplete = 0;
+    rebuild_block_refs();
+
+    int ret = 0;
+    if (refs_incomplete) {
+        fprintf(stderr, "mount(): unreadable metadata, run ssfs_fsck\n");
+        ret = fs_EREAD;
+    } else if (alloc_allocator() != 0) {
+        ret = fs_EMOUNT;
+    }
+    if (ret != 0) {
+        ssfs.is_mounted = 0;
+        free(block_refs);
+        block_refs = NULL;
+        free_checksums();
+        vdisk_off(&ssfs.disk);
+    }
+    return ret;
 }
 
 
 /// @brief unmounts the mounted volume. This can only fail if it is called when no
 /// volume has been mounted.
 /// @return 
-int unmount()
+static int do_unmount()
 {
     if (!ssfs.is_mounted) return fs_EMOUNT;
+    if (flush_checksums(0) != 0) return fs_EWRITE;
     if(vdisk_sync(&ssfs.disk) != 0) return fs_ESYNC;
 
     vdisk_off(&ssfs.disk);
     ssfs.is_mounted = 0;
-    memset(block_used, 0, sizeof(block_used)); // Reset block usage information
+    free(block_refs); // Reset block usage information
+    block_refs = NULL;
+    free_checksums();
+    free_dedup_index();
+    free_allocator();
+    for (int i = 0; i < MAX_OPEN_FILES; ++i)
+        if (open_files[i].in_use && open_files[i].volume == mount_depth)
+            close_open_file(&open_files[i]);
+
+    // Back to the volume suspended by mount_nested()
+    if (mount_depth > 0) {
+        mount_depth--;
+        ssfs = mount_stack[mount_depth].ssfs;
+        block_refs = mount_stack[mount_depth].block_refs;
+        checksums = mount_stack[mount_depth].checksums;
+        dedup_index = mount_stack[mount_depth].dedup_index;
+        allocator = mount_stack[mount_depth].allocator;
+    }
 
     return 0;
 }
@@ -169,7 +902,7 @@ int unmount()
 /// @brief deletes the file identified by inode_num.
 /// @param inode_num
 /// @return
-int delete(int inode_num) 
+static int do_delete(int inode_num) 
 {
     if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
         return fs_EMOUNT;
@@ -178,22 +911,10 @@ int delete(int inode_num)
     uint8_t *inode = get_inode(inode_num, inode_block);
     if (!inode || inode[0] == 0) return fs_EREAD;
 
-    // Direct pointers
-    for (int i = 0; i < NB_DIRECT_BLOCKS; i++) {
-        uint32_t ptr;
-        memcpy(&ptr, inode + INODE_DIRECT_OFFSET + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
-        if (ptr) free_block(ptr);
-    }
-
-    // Indirect 1
-    uint32_t indirect1;
-    memcpy(&indirect1, inode + INODE_INDIRECT1_OFFSET, sizeof(uint32_t));
-    if (indirect1) clear_indirect_block(indirect1);
-
-    // Indirect 2
-    uint32_t indirect2;
-    memcpy(&indirect2, inode + INODE_INDIRECT2_OFFSET, sizeof(uint32_t));
-    if (indirect2) clear_double_indirect_block(indirect2);
+    // Blocks shared with clones or snapshots are only freed with their last reference
+    for_each_inode_root(inode, release_block);
+    drop_window(inode_num);
+    invalidate_handles(inode_num, NULL, 1);
 
     // Clear inode
     memset(inode, 0, INODE_SIZE);
@@ -201,7 +922,7 @@ int delete(int inode_num)
     // Save inode block
     int inode_block_index = inode_num / INODES_PER_BLOCK;
     int block_num = ssfs.inode_start_block + inode_block_index;
-    return vdisk_write(&ssfs.disk, block_num, inode_block);
+    return write_meta_block(block_num, inode_block);
 }
 
 /// @brief reads len bytes, from
@@ -211,7 +932,7 @@ int delete(int inode_num)
 /// @param len 
 /// @param offset 
 /// @return 
-int read(int inode_num, uint8_t *data, int len, int offset)
+static int do_read(int inode_num, uint8_t *data, int len, int offset)
 {
     if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
         return fs_EMOUNT;
@@ -219,90 +940,9 @@ int read(int inode_num, uint8_t *data, int len, int offset)
     // Read the inode block
     uint8_t block[BLOCK_SIZE];
     uint8_t *inode = get_inode(inode_num, block);
+    if (!inode) return fs_EREAD;
 
-    uint32_t size;
-    memcpy(&size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
-    if (offset >= (int)size) return 0;
-
-    int bytes_to_read = (len < (int)(size - offset)) ? len : (int)(size - offset);
-    int bytes_read = 0;
-    int current_offset = offset;
-
-    while (bytes_read < bytes_to_read) {
-        int file_block_index = current_offset / BLOCK_SIZE;
-        int inner_offset = current_offset % BLOCK_SIZE;
-
-        uint32_t data_block_num = 0;
-
-        // Direct blocks
-        if (file_block_index < NB_DIRECT_BLOCKS) {
-            memcpy(&data_block_num, inode + INODE_DIRECT_OFFSET + BLOCK_PTR_SIZE * file_block_index, sizeof(uint32_t));
-        } 
-
-        // Indirect 1 blocks
-        else if (file_block_index < BLOCK_POINTERS_SIZE + NB_DIRECT_BLOCKS) {
-            uint32_t indirect1;
-            memcpy(&indirect1, inode + INODE_INDIRECT1_OFFSET, sizeof(uint32_t));
-            if (indirect1 == 0) break;
-
-            uint8_t indirect_block[BLOCK_SIZE];
-            if (vdisk_read(&ssfs.disk, indirect1, indirect_block) != 0)
-                return fs_EREAD;
-
-            memcpy(&data_block_num, indirect_block + BLOCK_PTR_SIZE * (file_block_index - NB_DIRECT_BLOCKS), BLOCK_PTR_SIZE);
-        
-        } 
-        
-        // Indirect 2 blocks
-        else {
-            uint32_t indirect2;
-            memcpy(&indirect2, inode + INODE_INDIRECT2_OFFSET, sizeof(uint32_t));
-            if (indirect2 == 0) break;
-
-            uint8_t indirect2_block[BLOCK_SIZE];
-            if (vdisk_read(&ssfs.disk, indirect2, indirect2_block) != 0)
-                return fs_EREAD;
-
-            int idx = file_block_index - (BLOCK_POINTERS_SIZE + NB_DIRECT_BLOCKS);
-            int first_level = idx / BLOCK_POINTERS_SIZE;
-            int second_level = idx % BLOCK_POINTERS_SIZE;
-
-            uint32_t intermediate_block_num;
-            memcpy(&intermediate_block_num, indirect2_block + BLOCK_PTR_SIZE * first_level, sizeof(uint32_t));
-            if (intermediate_block_num == 0) break;
-
-            uint8_t intermediate_block[BLOCK_SIZE];
-            if (vdisk_read(&ssfs.disk, intermediate_block_num, intermediate_block) != 0)
-                return fs_EREAD;
-
-            memcpy(&data_block_num, intermediate_block + BLOCK_PTR_SIZE * second_level, sizeof(uint32_t));
-        }
-
-        if (data_block_num == 0) {
-            int chunk = (BLOCK_SIZE - inner_offset < bytes_to_read - bytes_read)
-                      ? BLOCK_SIZE - inner_offset
-                      : bytes_to_read - bytes_read;
-            memset(data + bytes_read, 0, chunk); // simulate sparse
-            bytes_read += chunk;
-            current_offset += chunk;
-            continue;
-        }
-        
-        uint8_t data_block[BLOCK_SIZE];
-        if (vdisk_read(&ssfs.disk, data_block_num, data_block) != 0)
-            break;
-
-        int bytes_available = BLOCK_SIZE - inner_offset;
-        int bytes_remaining = bytes_to_read - bytes_read;
-        int chunk = (bytes_available < bytes_remaining) ? bytes_available : bytes_remaining;
-
-        memcpy(data + bytes_read, data_block + inner_offset, chunk);
-
-        bytes_read += chunk;
-        current_offset += chunk;
-    }
-
-    return bytes_read;
+    return read_from_inode(inode, data, len, offset);
 }
 
 /// @brief writes len bytes from
@@ -314,10 +954,11 @@ int read(int inode_num, uint8_t *data, int len, int offset)
 /// @param len 
 /// @param offset 
 /// @return 
-int write(int inode_num, uint8_t *data, int len, int offset)
+static int do_write(int inode_num, uint8_t *data, int len, int offset)
 {
     if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
         return fs_EMOUNT;
+    invalidate_handles(inode_num, NULL, 0);
 
     // Get inode and containing block
     uint8_t inode_block[BLOCK_SIZE];
@@ -328,341 +969,2968 @@ int write(int inode_num, uint8_t *data, int len, int offset)
     uint32_t file_size;
     memcpy(&file_size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
 
-    int bytes_written = 0;
-    int current_offset = offset;
-
-    while (bytes_written < len) {
-        int file_block_index = current_offset / BLOCK_SIZE;
-        int inner_offset = current_offset % BLOCK_SIZE;
+    // A write past the end grows the file into its preallocation window
+    set_alloc_cursor(inode_num, (int64_t)offset + len > (int64_t)file_size);
+    int bytes_written = (inode[INODE_FLAGS] & INODE_FLAG_COMPRESSED)
+                      ? write_clusters(inode, data, len, offset)
+                      : write_blocks(inode, data, len, offset);
+    clear_alloc_cursor();
 
-        uint32_t *data_block_ptr = NULL;
-        uint8_t indirect_block[BLOCK_SIZE];
-        uint8_t dbl_indirect_block[BLOCK_SIZE];
-        uint8_t inner_indirect_block[BLOCK_SIZE];
+    // Update file size if needed
+    uint32_t new_size = offset + bytes_written;
+    if (bytes_written > 0 && new_size > file_size) {
+        memcpy(inode + INODE_SIZE_OFFSET, &new_size, sizeof(uint32_t));
+    }
 
-        // Case 1: Direct blocks
-        if (file_block_index < NB_DIRECT_BLOCKS) {
-            data_block_ptr = (uint32_t *)(inode + INODE_DIRECT_OFFSET + BLOCK_PTR_SIZE * file_block_index);
-        }
+    // Save updated inode block, even after an error: the blocks copied on write until
+    // then are the ones referenced
+    int block_num = ssfs.inode_start_block + (inode_num / INODES_PER_BLOCK);
+    if (write_meta_block(block_num, inode_block) != 0 && bytes_written >= 0) return -1;
+    return bytes_written;
+}
 
-        // Case 2: Indirect 1
-        else if (file_block_index < BLOCK_POINTERS_SIZE + NB_DIRECT_BLOCKS) {
-            uint32_t *indirect_ptr = (uint32_t *)(inode + INODE_INDIRECT1_OFFSET);
-            if (*indirect_ptr == 0) {
-                *indirect_ptr = allocate_block();
-                if (*indirect_ptr == 0) return fs_EWRITE;
-            }
+static int do_create()
+{
+    if (!ssfs.is_mounted) return fs_EMOUNT;
 
-            if (vdisk_read(&ssfs.disk, *indirect_ptr, indirect_block) != 0)
-                return fs_EREAD;
+    for (uint32_t inode_num = 0; inode_num < ssfs.nb_inodes; ++inode_num) {
+        uint8_t block[BLOCK_SIZE];
+        uint8_t *inode = get_inode(inode_num, block);
+        if (!inode)
+            return fs_EREAD;
+
+        if (inode[INODE_STATUT] != INODE_VALID) {
+            inode[INODE_STATUT] = (uint8_t)INODE_VALID;
+            memset(inode + 1, 0, INODE_SIZE - 1);
+
+            int block_index = inode_num / INODES_PER_BLOCK;
+            int block_num = ssfs.inode_start_block + block_index;
+            if (write_meta_block(block_num, block) != 0)
+                return fs_EWRITE;
+
+            return inode_num;
+        }
+    }
+
+    return -1; // No free inode found
+}
+
+/// @brief creates a new file sharing all the blocks of file inode_num. The blocks are
+/// copied on the first write to either file, so cloning costs a single inode write
+/// whatever the size of the file. On success, it returns the inode of the clone.
+/// @param inode_num 
+/// @return 
+static int do_clone_file(int inode_num)
+{
+    if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
+        return fs_EMOUNT;
+
+    uint8_t src_block[BLOCK_SIZE];
+    uint8_t *src = get_inode(inode_num, src_block);
+    if (!src || src[INODE_STATUT] != INODE_VALID) return fs_EREAD;
+
+    int ret = enable_reflink();
+    if (ret != 0) return ret;
+
+    int clone_num = do_create();
+    if (clone_num < 0) return clone_num;
+
+    uint8_t block[BLOCK_SIZE];
+    uint8_t *inode = get_inode(clone_num, block);
+    if (!inode) return fs_EREAD;
+
+    // The top of the pointer trees gains a reference, the blocks below are reached through it
+    memcpy(inode, src, INODE_SIZE);
+    for_each_inode_root(inode, take_ref);
+
+    int block_num = ssfs.inode_start_block + clone_num / INODES_PER_BLOCK;
+    if (write_meta_block(block_num, block) != 0) {
+        for_each_inode_root(inode, release_block);
+        return fs_EWRITE;
+    }
+    return clone_num;
+}
+
+/// @brief takes a read-only snapshot of every file of the volume. The inode table is
+/// copied (inode blocks without any file are skipped) and shares the file blocks, which
+/// are copied on write. On success, it returns the snapshot number, to be passed to
+/// snapshot_stat(), snapshot_read() and snapshot_delete().
+/// @return 
+static int do_snapshot_create()
+{
+    if (!ssfs.is_mounted) return fs_EMOUNT;
+
+    SuperBlock *sb = &ssfs.superblock;
+    if (sb->nb_inode_blocks > MAX_SNAPSHOT_INODE_BLOCKS) return fs_ENOTSUP;
+
+    int snapshot = 0;
+    while (snapshot < MAX_SNAPSHOTS && sb->snapshots[snapshot] != 0)
+        snapshot++;
+    if (snapshot == MAX_SNAPSHOTS) return fs_EWRITE;
+
+    int ret = enable_reflink();
+    if (ret != 0) return ret;
+
+    uint32_t root_num = allocate_block();
+    if (root_num == 0) return fs_EWRITE;
+
+    uint8_t root[BLOCK_SIZE] = {0};
+    uint32_t created = (uint32_t)time(NULL);
+    memcpy(root + SNAPSHOT_NB_BLOCKS_OFFSET, &sb->nb_inode_blocks, sizeof(uint32_t));
+    memcpy(root + SNAPSHOT_TIME_OFFSET, &created, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < sb->nb_inode_blocks && ret == 0; ++i) {
+        uint8_t table[BLOCK_SIZE];
+        if (read_meta_block(ssfs.inode_start_block + i, table) != 0) {
+            ret = fs_EREAD;
+            break;
+        }
+
+        int nb_files = 0;
+        for (int j = 0; j < INODES_PER_BLOCK; ++j)
+            nb_files += table[j * INODE_SIZE + INODE_STATUT] == INODE_VALID;
+        if (nb_files == 0) continue;
+
+        uint32_t copy = allocate_block();
+        if (copy == 0 || write_meta_block(copy, table) != 0) {
+            if (copy != 0) release_block(copy, 0);
+            ret = fs_EWRITE;
+            break;
+        }
+        for (int j = 0; j < INODES_PER_BLOCK; ++j)
+            if (table[j * INODE_SIZE + INODE_STATUT] == INODE_VALID)
+                for_each_inode_root(table + j * INODE_SIZE, take_ref);
+        memcpy(root + SNAPSHOT_TABLE_OFFSET + i * BLOCK_PTR_SIZE, &copy, sizeof(uint32_t));
+    }
+
+    // The superblock is written last: a snapshot exists once it is listed there
+    if (ret == 0 && write_meta_block(root_num, root) != 0)
+        ret = fs_EWRITE;
+    if (ret == 0) {
+        sb->snapshots[snapshot] = root_num;
+        ret = write_superblock();
+        if (ret != 0) sb->snapshots[snapshot] = 0;
+    }
+    if (ret != 0) {
+        release_snapshot(root_num, root);
+        return ret;
+    }
+    return snapshot;
+}
+
+/// @brief deletes a snapshot, freeing the blocks only it was still referencing.
+/// @param snapshot 
+/// @return 
+static int do_snapshot_delete(int snapshot)
+{
+    if (!ssfs.is_mounted) return fs_EMOUNT;
+    if (snapshot < 0 || snapshot >= MAX_SNAPSHOTS || ssfs.superblock.snapshots[snapshot] == 0)
+        return fs_EREAD;
+
+    uint32_t root_num = ssfs.superblock.snapshots[snapshot];
+    uint8_t root[BLOCK_SIZE];
+    if (read_meta_block(root_num, root) != 0) return fs_EREAD;
+
+    ssfs.superblock.snapshots[snapshot] = 0;
+    if (write_superblock() != 0) {
+        ssfs.superblock.snapshots[snapshot] = root_num;
+        return fs_EWRITE;
+    }
+
+    release_snapshot(root_num, root);
+    return 0;
+}
+
+/// @brief returns the size of file inode_num as it was when the snapshot was taken.
+/// @param snapshot 
+/// @param inode_num 
+/// @return 
+static int do_snapshot_stat(int snapshot, int inode_num)
+{
+    if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
+        return fs_EMOUNT;
+
+    uint8_t block[BLOCK_SIZE];
+    uint8_t *inode = get_snapshot_inode(snapshot, inode_num, block);
+    if (!inode || inode[INODE_STATUT] != INODE_VALID) return fs_EREAD;
+
+    uint32_t size;
+    memcpy(&size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
+    return (int)size;
+}
+
+/// @brief reads len bytes, from offset into file inode_num as it was when the snapshot
+/// was taken. On success, it returns the number of bytes actually read.
+/// @param snapshot 
+/// @param inode_num 
+/// @param data 
+/// @param len 
+/// @param offset 
+/// @return 
+static int do_snapshot_read(int snapshot, int inode_num, uint8_t *data, int len, int offset)
+{
+    if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
+        return fs_EMOUNT;
+
+    uint8_t block[BLOCK_SIZE];
+    uint8_t *inode = get_snapshot_inode(snapshot, inode_num, block);
+    if (!inode || inode[INODE_STATUT] != INODE_VALID) return fs_EREAD;
+
+    return read_from_inode(inode, data, len, offset);
+}
+
+/// @brief sets how the data of file inode_num is stored: COMPRESSION_NONE, or
+/// COMPRESSION_LZ4 for LZ4 compressed clusters of CLUSTER_BLOCKS blocks. Clusters that
+/// do not compress by at least a block are stored as is. The mode of a file can only be
+/// changed while it is empty.
+/// @param inode_num 
+/// @param mode 
+/// @return 
+static int do_set_compression(int inode_num, int mode)
+{
+    if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
+        return fs_EMOUNT;
+    if (mode != COMPRESSION_NONE && mode != COMPRESSION_LZ4)
+        return fs_ENOTSUP;
+    invalidate_handles(inode_num, NULL, 0);
+
+    uint8_t block[BLOCK_SIZE];
+    uint8_t *inode = get_inode(inode_num, block);
+    if (!inode || inode[INODE_STATUT] != INODE_VALID) return fs_EREAD;
+
+    uint32_t size;
+    memcpy(&size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
+    if (size != 0) return fs_EWRITE;
+
+    if (mode == COMPRESSION_LZ4)
+        inode[INODE_FLAGS] |= INODE_FLAG_COMPRESSED;
+    else
+        inode[INODE_FLAGS] &= ~INODE_FLAG_COMPRESSED;
+
+    int block_num = ssfs.inode_start_block + inode_num / INODES_PER_BLOCK;
+    return write_meta_block(block_num, block) == 0 ? 0 : fs_EWRITE;
+}
+
+/// @brief enables CRC32C checksums on the mounted volume. The end of the volume, which
+/// must be free, becomes the checksum region and every block in use is checksummed.
+/// From then on blocks are verified on their first read after mount, reads of a
+/// corrupted block failing, and their checksum is updated on every write.
+/// @return 0 on success, fs_EWRITE if the end of the volume is in use
+static int do_enable_checksums()
+{
+    if (!ssfs.is_mounted) return fs_EMOUNT;
+    if (ssfs.superblock.features & SSFS_FEATURE_CHECKSUMS) return 0;
+
+    uint32_t nb_blocks = ssfs.superblock.nb_blocks;
+    uint32_t nb_sum_blocks = (nb_blocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+    if (nb_blocks - ssfs.data_start_block <= nb_sum_blocks) return fs_EWRITE;
+    uint32_t start = nb_blocks - nb_sum_blocks;
+    for (uint32_t i = start; i < nb_blocks; ++i)
+        if (block_refs[i]) return fs_EWRITE;
+    if (alloc_checksums(nb_sum_blocks) != 0) return fs_EWRITE;
+
+    ssfs.data_end_block = start;
+    ssfs.superblock.checksum_start = start;
+
+    int ret = 0;
+    uint8_t block[BLOCK_SIZE];
+    for (uint32_t i = ssfs.inode_start_block; i < start && ret == 0; ++i) {
+        if (i >= ssfs.data_start_block && block_refs[i] == 0) continue;
+        if (read_data_block(i, block) != 0)
+            ret = fs_EREAD;
+        else
+            record_checksum(i, block);
+    }
+
+    // The whole region is written before the superblock points to it
+    for (uint32_t i = 0; i < nb_sum_blocks; ++i) {
+        if (checksums.is_dirty[i]) continue;
+        checksums.is_dirty[i] = 1;
+        checksums.dirty[checksums.nb_dirty++] = i;
+    }
+    if (ret == 0) ret = flush_checksums(0);
+    if (ret == 0) {
+        ssfs.superblock.features |= SSFS_FEATURE_CHECKSUMS;
+        ret = write_superblock();
+    }
+    if (ret == 0) count_free_blocks(); // The region left the last allocation group
+
+    if (ret != 0) {
+        ssfs.superblock.features &= ~SSFS_FEATURE_CHECKSUMS;
+        ssfs.superblock.checksum_start = 0;
+        ssfs.data_end_block = nb_blocks;
+        free_checksums();
+    }
+    return ret;
+}
+
+/// @brief turns the dedup mode of the mounted volume on (1) or off (0). In dedup mode,
+/// a whole block written with contents already stored in a data block of the volume is
+/// shared with that block, and copied on write like the blocks of a clone, instead of
+/// being written: rewriting existing data costs a hash and a comparison per block, no
+/// block write. Partial block writes and compressed files are not deduplicated.
+/// The mode is saved in the superblock; the index of the blocks by contents is not,
+/// it is rebuilt on the first write after mount.
+/// @param enabled 
+/// @return 
+static int do_set_dedup(int enabled)
+{
+    if (!ssfs.is_mounted) return fs_EMOUNT;
+
+    uint32_t features = ssfs.superblock.features;
+    if (enabled) {
+        int ret = enable_reflink();
+        if (ret != 0) return ret;
+        ssfs.superblock.features |= SSFS_FEATURE_DEDUP;
+    } else {
+        ssfs.superblock.features &= ~SSFS_FEATURE_DEDUP;
+    }
+    if (ssfs.superblock.features == features) return 0;
+
+    int ret = write_superblock();
+    if (ret != 0) {
+        ssfs.superblock.features = features | (ssfs.superblock.features & SSFS_FEATURE_REFLINK);
+        return ret;
+    }
+    if (!enabled) free_dedup_index();
+    return 0;
+}
+
+/// @brief shares the blocks of file inode_num whose contents are already stored in
+/// other data blocks of the volume, in dedup mode. This deduplicates the files written
+/// before the mode was turned on. On success, it returns the number of blocks of the
+/// file that were given up for a shared one.
+/// @param inode_num 
+/// @return 
+static int do_dedup_file(int inode_num)
+{
+    if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
+        return fs_EMOUNT;
+    invalidate_handles(inode_num, NULL, 0);
+    if (!(ssfs.superblock.features & SSFS_FEATURE_DEDUP)) return fs_ENOTSUP;
+
+    uint8_t inode_block[BLOCK_SIZE];
+    uint8_t *inode = get_inode(inode_num, inode_block);
+    if (!inode || inode[INODE_STATUT] != INODE_VALID) return fs_EREAD;
+    if (inode[INODE_FLAGS] & INODE_FLAG_COMPRESSED) return 0;
+    if (!dedup_index.entries && build_dedup_index() != 0) return fs_EMOUNT;
+
+    uint32_t size;
+    memcpy(&size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
+
+    int nb_shared = 0;
+    int inode_dirty = 0;
+    int ret = 0;
+    for (uint32_t i = 0; i < size / BLOCK_SIZE && ret == 0; ++i) {
+        uint32_t block_num;
+        uint8_t block[BLOCK_SIZE];
+        if (get_file_block(inode, (int)i, &block_num) != 0 ||
+            (block_num != 0 && read_data_block(block_num, block) != 0)) {
+            ret = fs_EREAD;
+            break;
+        }
+        if (block_num == 0) continue;
+        uint32_t duplicate = find_duplicate(block, block_hash(block));
+        if (duplicate == 0 || duplicate == block_num) continue;
+
+        // The write path shares the block, copying the pointer blocks on its path if needed
+        inode_dirty = 1;
+        int bytes_written = write_blocks(inode, block, BLOCK_SIZE, (int)i * BLOCK_SIZE);
+        if (bytes_written < 0) ret = bytes_written;
+        else nb_shared++;
+    }
+
+    // Saved even after an error, the blocks shared until then belong to the file
+    int block_num = ssfs.inode_start_block + inode_num / INODES_PER_BLOCK;
+    if (inode_dirty && write_meta_block(block_num, inode_block) != 0) return fs_EWRITE;
+    return ret < 0 ? ret : nb_shared;
+}
+
+/// @brief allocates the blocks of file inode_num between offset and offset + len that
+/// are not allocated yet, filled with zeros, and extends the file to offset + len if it
+/// is shorter, like posix_fallocate(). The blocks are reserved up front as a single run
+/// of free blocks when the volume has one, so that the file stays contiguous whatever
+/// is written to other files meanwhile. Compressed files are not supported.
+/// @param inode_num 
+/// @param len 
+/// @param offset 
+/// @return 0 on success
+static int do_preallocate(int inode_num, int len, int offset)
+{
+    if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
+        return fs_EMOUNT;
+    invalidate_handles(inode_num, NULL, 0);
+    if (len <= 0 || offset < 0 || (int64_t)offset + len > (int64_t)MAX_FILE_BLOCKS * BLOCK_SIZE)
+        return fs_EWRITE;
+
+    uint8_t inode_block[BLOCK_SIZE];
+    uint8_t *inode = get_inode(inode_num, inode_block);
+    if (!inode || inode[INODE_STATUT] != INODE_VALID) return fs_EREAD;
+    if (inode[INODE_FLAGS] & INODE_FLAG_COMPRESSED) return fs_ENOTSUP;
+
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + len - 1) / BLOCK_SIZE;
+
+    // The run holds the pointer blocks too, they are allocated along the data blocks
+    uint32_t count = (uint32_t)(last - first + 1);
+    count += count / BLOCK_POINTERS_SIZE + 2;
+    uint32_t goal = 0;
+    if (first > 0 && get_file_block(inode, first - 1, &goal) == 0 && goal != 0) goal++;
+    uint32_t run = find_free_run(goal, count, inode_num);
+    if (run != 0) reserve_window(inode_num, run, count);
+
+    int ret = 0;
+    set_alloc_cursor(inode_num, 1);
+    for (int i = first; i <= last && ret == 0; ++i) {
+        BlockPath path;
+        uint32_t *slot;
+        ret = open_block_path(inode, i, &path, &slot);
+        if (ret < 0) break;
+
+        int moved = 0;
+        if (*slot == 0) {
+            uint8_t block[BLOCK_SIZE];
+            moved = load_private_data_block(slot, block, 1);
+            if (moved < 0) {
+                ret = moved;
+                break;
+            }
+            if (write_data_block(*slot, block) != 0) ret = fs_EWRITE;
+        }
+        if (ret == 0) ret = close_block_path(inode, i, &path, moved);
+    }
+    clear_alloc_cursor();
+
+    uint32_t size;
+    memcpy(&size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
+    uint32_t new_size = (uint32_t)offset + (uint32_t)len;
+    if (ret == 0 && new_size > size)
+        memcpy(inode + INODE_SIZE_OFFSET, &new_size, sizeof(uint32_t));
+
+    // Saved even after an error, the blocks allocated until then belong to the file
+    int block_num = ssfs.inode_start_block + inode_num / INODES_PER_BLOCK;
+    if (write_meta_block(block_num, inode_block) != 0) return fs_EWRITE;
+    return ret;
+}
+
+/// @brief describes how the blocks of file inode_num are laid out on the disk, walking
+/// its direct, indirect and double-indirect pointers in file order. An extent is a run
+/// of data blocks each stored right after the previous one, or after a pointer block of
+/// the file stored right after the previous one: a file written sequentially to a
+/// fresh volume has a single extent.
+/// @param inode_num 
+/// @param layout 
+/// @return 0 on success
+static int do_file_layout(int inode_num, FileLayout *layout)
+{
+    if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
+        return fs_EMOUNT;
+
+    uint8_t block[BLOCK_SIZE];
+    uint8_t *inode = get_inode(inode_num, block);
+    if (!inode || inode[INODE_STATUT] != INODE_VALID) return fs_EREAD;
+
+    LayoutWalk walk;
+    memset(&walk, 0, sizeof(LayoutWalk));
+    int ret = walk_layout(inode, &walk);
+    if (ret != 0) return ret;
+
+    layout->data_blocks = walk.data_blocks;
+    layout->pointer_blocks = walk.pointer_blocks;
+    layout->shared_blocks = walk.shared_blocks;
+    layout->extents = walk.extents;
+    return 0;
+}
+
+/// @brief moves the blocks of file inode_num to a run of consecutive free blocks, in
+/// file order, while the volume stays mounted. The blocks are copied first, the new
+/// pointer blocks written, then the inode switched to them in a single write: the file
+/// is either entirely at its old place or entirely at its new one. The old blocks are
+/// freed last. Blocks shared with clones, snapshots or deduplicated files stay where
+/// they are, with the blocks below them.
+/// On success, it returns the number of blocks moved: 0 if the file has a single
+/// extent already, fs_EWRITE if no run of free blocks is large enough.
+/// @param inode_num 
+/// @param rate_kib maximum KiB copied per second, 0 for no limit
+/// @return 
+static int do_defrag_file(int inode_num, int rate_kib)
+{
+    if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
+        return fs_EMOUNT;
+    invalidate_handles(inode_num, NULL, 0);
+
+    uint8_t inode_block[BLOCK_SIZE];
+    uint8_t *inode = get_inode(inode_num, inode_block);
+    if (!inode || inode[INODE_STATUT] != INODE_VALID) return fs_EREAD;
+
+    Relocation reloc;
+    memset(&reloc, 0, sizeof(Relocation));
+    int ret = walk_layout(inode, &reloc.walk);
+    if (ret != 0) return ret;
+    uint32_t count = reloc.walk.private_blocks;
+    if (reloc.walk.extents <= 1 || count == 0) return 0;
+
+    uint32_t run = find_free_run(0, count, inode_num);
+    if (run == 0) return fs_EWRITE;
+    reloc.old_blocks = malloc(count * sizeof(uint32_t));
+    reloc.new_blocks = malloc(count * sizeof(uint32_t));
+    if (!reloc.old_blocks || !reloc.new_blocks) {
+        free(reloc.old_blocks);
+        free(reloc.new_blocks);
+        return fs_EWRITE;
+    }
+    reloc.capacity = count;
+    reloc.rate_kib = rate_kib;
+    clock_gettime(CLOCK_MONOTONIC, &reloc.start);
+
+    // The new copy is built on a copy of the inode, the old blocks stay untouched
+    uint8_t new_inode[INODE_SIZE];
+    memcpy(new_inode, inode, INODE_SIZE);
+    reserve_window(inode_num, run, count);
+    set_alloc_cursor(inode_num, 1);
+    for (int i = 0; i < NB_DIRECT_BLOCKS && ret == 0; ++i)
+        ret = relocate_block((uint32_t *)(new_inode + INODE_DIRECT_OFFSET + i * BLOCK_PTR_SIZE), 0, &reloc);
+    if (ret == 0)
+        ret = relocate_block((uint32_t *)(new_inode + INODE_INDIRECT1_OFFSET), 1, &reloc);
+    if (ret == 0)
+        ret = relocate_block((uint32_t *)(new_inode + INODE_INDIRECT2_OFFSET), 2, &reloc);
+    clear_alloc_cursor();
+
+    if (ret == 0) {
+        memcpy(inode, new_inode, INODE_SIZE);
+        int block_num = ssfs.inode_start_block + inode_num / INODES_PER_BLOCK;
+        if (write_meta_block(block_num, inode_block) != 0) ret = fs_EWRITE;
+    }
+
+    // Only the blocks no longer pointed to are freed: pointer blocks are freed alone,
+    // their children are in the list too
+    uint32_t *unused = ret == 0 ? reloc.old_blocks : reloc.new_blocks;
+    for (uint32_t i = 0; i < reloc.nb_moved; ++i)
+        release_block(unused[i], 0);
+    free(reloc.old_blocks);
+    free(reloc.new_blocks);
+    return ret == 0 ? (int)reloc.nb_moved : ret;
+}
+
+/// @brief opens file inode_num of the mounted volume. On success, it returns a handle
+/// for ssfs_pread(), ssfs_pwrite(), ssfs_read() and ssfs_write(), valid until
+/// ssfs_close() or the unmount of the volume.
+/// @param inode_num 
+/// @return 
+static int do_open(int inode_num)
+{
+    if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
+        return fs_EMOUNT;
+
+    uint8_t block[BLOCK_SIZE];
+    uint8_t *inode = get_inode(inode_num, block);
+    if (!inode || inode[INODE_STATUT] != INODE_VALID) return fs_EREAD;
+
+    for (int slot = 0; slot < MAX_OPEN_FILES; ++slot) {
+        OpenFile *file = &open_files[slot];
+        if (file->in_use) continue;
+
+        file->in_use = 1;
+        file->volume = mount_depth;
+        file->inode_num = inode_num;
+        file->stale = 0;
+        file->deleted = 0;
+        memcpy(file->inode, inode, INODE_SIZE);
+        file->map = NULL;
+        file->map_size = 0;
+        file->position = 0;
+        return (int)(file->generation << HANDLE_SLOT_BITS) | slot;
+    }
+    return fs_ENFILE;
+}
+
+/// @brief closes a handle returned by ssfs_open().
+/// @param handle 
+/// @return 0 on success, fs_EBADF if the handle is not open
+static int do_close(int handle)
+{
+    OpenFile *file = get_open_file(handle);
+    if (!file) return fs_EBADF;
+    close_open_file(file);
+    return 0;
+}
+
+/// @brief reads len bytes at offset from the file of an open handle, like read().
+/// @param file 
+/// @param data 
+/// @param len 
+/// @param offset 
+/// @return the number of bytes read, or a negative error code
+static int do_pread(OpenFile *file, uint8_t *data, int len, int offset)
+{
+    if (!file) return fs_EBADF;
+    if (len < 0 || offset < 0) return fs_EREAD;
+    int ret = refresh_open_file(file);
+    if (ret != 0) return ret;
+
+    uint32_t size;
+    memcpy(&size, file->inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
+    if ((uint32_t)offset >= size) return 0;
+    int bytes_to_read = (len < (int)(size - offset)) ? len : (int)(size - offset);
+    if (file->inode[INODE_FLAGS] & INODE_FLAG_COMPRESSED)
+        return read_clusters(file->inode, data, bytes_to_read, offset);
+
+    int bytes_read = 0;
+    while (bytes_read < bytes_to_read) {
+        int current_offset = offset + bytes_read;
+        int inner_offset = current_offset % BLOCK_SIZE;
+        int chunk = BLOCK_SIZE - inner_offset;
+        if (chunk > bytes_to_read - bytes_read) chunk = bytes_to_read - bytes_read;
+
+        uint32_t block_num = 0;
+        ret = lookup_block(file, (uint32_t)(current_offset / BLOCK_SIZE), &block_num);
+        if (ret != 0)
+            return bytes_read > 0 ? bytes_read : ret;
+
+        if (block_num == MAP_HOLE) {
+            memset(data + bytes_read, 0, chunk);
+        } else if (chunk == BLOCK_SIZE) {
+            ret = read_data_block(block_num, data + bytes_read);
+            if (ret != 0)
+                return bytes_read > 0 ? bytes_read : read_error(ret);
+        } else {
+            uint8_t data_block[BLOCK_SIZE];
+            ret = read_data_block(block_num, data_block);
+            if (ret != 0)
+                return bytes_read > 0 ? bytes_read : read_error(ret);
+            memcpy(data + bytes_read, data_block + inner_offset, chunk);
+        }
+        bytes_read += chunk;
+    }
+    return bytes_read;
+}
+
+/// @brief writes len bytes from data at offset into the file of an open handle, like
+/// write(). The blocks written are looked up again on their next read.
+/// @param file 
+/// @param data 
+/// @param len 
+/// @param offset 
+/// @return the number of bytes written, or a negative error code
+static int do_pwrite(OpenFile *file, uint8_t *data, int len, int offset)
+{
+    if (!file) return fs_EBADF;
+    if (len < 0 || offset < 0) return fs_EWRITE;
+    int ret = refresh_open_file(file);
+    if (ret != 0) return ret;
+    if (len == 0) return 0;
+
+    uint8_t *inode = file->inode;
+    uint32_t file_size;
+    memcpy(&file_size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
+
+    set_alloc_cursor(file->inode_num, (int64_t)offset + len > (int64_t)file_size);
+    int bytes_written = (inode[INODE_FLAGS] & INODE_FLAG_COMPRESSED)
+                      ? write_clusters(inode, data, len, offset)
+                      : write_blocks(inode, data, len, offset);
+    clear_alloc_cursor();
+
+    // The pointers changed on the disk and in the kept inode may no longer match
+    invalidate_handles(file->inode_num, file, 0);
+    if (bytes_written < 0) {
+        // The inode is saved all the same, as write() does
+        file->stale = 1;
+    } else {
+        uint32_t new_size = offset + bytes_written;
+        if (new_size > file_size)
+            memcpy(inode + INODE_SIZE_OFFSET, &new_size, sizeof(uint32_t));
+
+        uint32_t first = (uint32_t)offset / BLOCK_SIZE;
+        uint32_t last = ((uint32_t)offset + bytes_written - 1) / BLOCK_SIZE;
+        for (uint32_t i = first; i <= last && i < file->map_size; ++i)
+            file->map[i] = 0;
+    }
+
+    uint8_t block[BLOCK_SIZE];
+    uint8_t *on_disk = get_inode(file->inode_num, block);
+    if (!on_disk) {
+        file->stale = 1;
+        return bytes_written < 0 ? bytes_written : fs_EREAD;
+    }
+    memcpy(on_disk, inode, INODE_SIZE);
+    int block_num = ssfs.inode_start_block + file->inode_num / INODES_PER_BLOCK;
+    if (write_meta_block(block_num, block) != 0) {
+        file->stale = 1;
+        return bytes_written < 0 ? bytes_written : fs_EWRITE;
+    }
+    return bytes_written;
+}
+
+/// @brief runs the count operations of ops, each as the call of the same name would,
+/// and stores what that call returns in its result. The operations are sorted by inode,
+/// so that every block of the inode table they touch is read and written once, in a
+/// single pass over the table, and the data of the files is read and written in inode
+/// order. The results are those of calling the operations one at a time in the order
+/// given, the creates after all the others: operations on different files do not depend
+/// on each other, and the creates take the first inodes free once the batch ran.
+/// @param ops 
+/// @param count 
+/// @return 0 on success, a negative error code if no operation could run
+static int do_batch(BatchOp *ops, int count)
+{
+    if (!ssfs.is_mounted) return fs_EMOUNT;
+    if (count <= 0) return 0;
+
+    BatchEntry *entries = malloc(count * sizeof(BatchEntry));
+    if (!entries) return fs_EREAD;
+    int nb_entries = 0, nb_creates = 0;
+    for (int i = 0; i < count; ++i) {
+        BatchOp *op = &ops[i];
+        if (op->op == BATCH_CREATE) {
+            op->result = -1; // No free inode, unless one is found below
+            ++nb_creates;
+        } else if (op->op < BATCH_STAT || op->op > BATCH_DELETE) {
+            op->result = fs_ENOTSUP;
+        } else if (op->inode_num < 0 || (uint32_t)op->inode_num >= ssfs.nb_inodes) {
+            op->result = fs_EMOUNT;
+        } else {
+            entries[nb_entries].inode_num = (uint32_t)op->inode_num;
+            entries[nb_entries].index = i;
+            ++nb_entries;
+        }
+    }
+    qsort(entries, nb_entries, sizeof(BatchEntry), compare_batch_entries);
+
+    uint32_t nb_table_blocks = (ssfs.nb_inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    int next = 0;        // First entry not run yet
+    int next_create = 0; // Operations before it are not creates waiting for an inode
+    for (uint32_t table_block = 0; table_block < nb_table_blocks; ++table_block) {
+        // Without creates left, the blocks no operation touches are skipped
+        if (nb_creates == 0) {
+            if (next == nb_entries) break;
+            table_block = entries[next].inode_num / INODES_PER_BLOCK;
+        }
+        uint32_t block_num = ssfs.inode_start_block + table_block;
+        uint8_t block[BLOCK_SIZE];
+        int loaded = read_meta_block(block_num, block) == 0;
+        int dirty = 0;
+        int first = next, first_create = next_create;
+
+        for (; next < nb_entries && entries[next].inode_num / INODES_PER_BLOCK == table_block; ++next) {
+            BatchOp *op = &ops[entries[next].index];
+            uint8_t *inode = block + (op->inode_num % INODES_PER_BLOCK) * INODE_SIZE;
+            op->result = loaded ? run_batch_op(op, inode, &dirty) : fs_EREAD;
+        }
+
+        // The creates take the free inodes of the block once its other operations ran,
+        // and all fail if it cannot be read, as create() stops there
+        for (uint32_t slot = 0; nb_creates > 0 && (!loaded || slot < INODES_PER_BLOCK); ++slot) {
+            uint32_t inode_num = table_block * INODES_PER_BLOCK + slot;
+            uint8_t *inode = block + (slot % INODES_PER_BLOCK) * INODE_SIZE;
+            if (loaded && (inode_num >= ssfs.nb_inodes || inode[INODE_STATUT] == INODE_VALID))
+                continue;
+
+            while (ops[next_create].op != BATCH_CREATE) ++next_create;
+            if (loaded) {
+                inode[INODE_STATUT] = (uint8_t)INODE_VALID;
+                memset(inode + 1, 0, INODE_SIZE - 1);
+                ops[next_create].result = (int)inode_num;
+                dirty = 1;
+            } else {
+                ops[next_create].result = fs_EREAD;
+            }
+            ++next_create;
+            --nb_creates;
+        }
+
+        if (dirty && write_meta_block(block_num, block) != 0) {
+            // None of the changes to the block reached the disk
+            for (int i = first; i < next; ++i) {
+                BatchOp *op = &ops[entries[i].index];
+                if ((op->op == BATCH_WRITE || op->op == BATCH_DELETE) && op->result >= 0)
+                    op->result = fs_EWRITE;
+            }
+            for (int i = first_create; i < next_create; ++i) {
+                if (ops[i].op == BATCH_CREATE) ops[i].result = fs_EWRITE;
+            }
+        }
+    }
+
+    free(entries);
+    return 0;
+}
+
+/// @brief writes the contents of file inode_num to the host file descriptor fd, from
+/// its current offset. The runs of consecutive blocks of the file are copied from the
+/// image by the kernel, without going through user memory, unless the blocks must be
+/// decoded or verified: compressed files, volumes with checksums and nested volumes
+/// are copied through a buffer of TRANSFER_BLOCKS blocks. Memory use does not depend
+/// on the size of the file.
+/// @param inode_num 
+/// @param fd 
+/// @return the number of bytes written to fd, or a negative error code
+static int do_export(int inode_num, int fd)
+{
+    if (!ssfs.is_mounted || inode_num < 0 || (uint32_t)inode_num >= ssfs.nb_inodes)
+        return fs_EMOUNT;
+
+    uint8_t inode_block[BLOCK_SIZE];
+    uint8_t *inode = get_inode(inode_num, inode_block);
+    if (!inode || inode[INODE_STATUT] != INODE_VALID) return fs_EREAD;
+
+    uint32_t size;
+    memcpy(&size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
+    int copyable = !(inode[INODE_FLAGS] & INODE_FLAG_COMPRESSED)
+                && !(ssfs.superblock.features & SSFS_FEATURE_CHECKSUMS);
+    int image_fd = copyable ? vdisk_fd(&ssfs.disk) : -1;
+    return image_fd >= 0 ? export_blocks(inode, size, image_fd, fd)
+                         : export_buffered(inode, size, fd);
+}
+
+/// @brief creates a file holding what is left to read from the host file descriptor fd,
+/// until its end. As with ssfs_export(), the data is copied into the blocks of the file
+/// by the kernel, TRANSFER_BLOCKS blocks at a time, unless the volume has checksums or
+/// dedup, or is nested: it is then written as with write(). When fd is a regular file,
+/// the blocks are reserved up front in a single run, as preallocate() does.
+/// @param fd 
+/// @param bytes receives the size of the file
+/// @return the inode of the file, or a negative error code
+static int do_import(int fd, int *bytes)
+{
+    *bytes = 0;
+    if (!ssfs.is_mounted) return fs_EMOUNT;
+    int64_t known_size = host_remaining(fd);
+    if (known_size > (int64_t)MAX_FILE_BLOCKS * BLOCK_SIZE) return fs_EWRITE;
+
+    int inode_num = do_create();
+    if (inode_num < 0) return inode_num;
+    uint8_t inode_block[BLOCK_SIZE];
+    uint8_t *inode = get_inode(inode_num, inode_block);
+    if (!inode) {
+        do_delete(inode_num);
+        return fs_EREAD;
+    }
+
+    int direct = !(ssfs.superblock.features & (SSFS_FEATURE_CHECKSUMS | SSFS_FEATURE_DEDUP))
+              && vdisk_fd(&ssfs.disk) >= 0;
+    int ret = direct ? import_blocks(inode_num, inode, known_size, fd)
+                     : import_buffered(inode_num, inode, fd);
+
+    // Saved even after an error, so that the file is deleted with every block it got
+    int block_num = ssfs.inode_start_block + inode_num / INODES_PER_BLOCK;
+    if (write_meta_block(block_num, inode_block) != 0 && ret >= 0) ret = fs_EWRITE;
+    if (ret < 0) {
+        do_delete(inode_num);
+        return ret;
+    }
+    *bytes = ret;
+    return inode_num;
+}
+
+//=============================================================================
+//========================== SSFS STATIC FUNCTIONS ============================
+//=============================================================================
+
+/// @brief Reads a metadata block (superblock, inode or pointer block).
+/// @param block_num 
+/// @param buffer 
+/// @return 0 on success, fs_ECORRUPT if it does not match its checksum, a vdisk error otherwise
+static int read_meta_block(uint32_t block_num, uint8_t *buffer)
+{
+    STATS_COUNT(meta_reads);
+    int ret = vdisk_read(&ssfs.disk, block_num, buffer);
+    return ret != 0 ? ret : verify_checksum(block_num, buffer);
+}
+
+/// @brief Writes a metadata block (superblock, inode or pointer block).
+/// @param block_num 
+/// @param buffer 
+/// @return 0 on success, a vdisk error otherwise
+static int write_meta_block(uint32_t block_num, uint8_t *buffer)
+{
+    STATS_COUNT(meta_writes);
+    int ret = vdisk_write(&ssfs.disk, block_num, buffer);
+    if (ret == 0) record_checksum(block_num, buffer);
+    return ret;
+}
+
+/// @brief Reads a data block.
+/// @param block_num 
+/// @param buffer 
+/// @return 0 on success, fs_ECORRUPT if it does not match its checksum, a vdisk error otherwise
+static int read_data_block(uint32_t block_num, uint8_t *buffer)
+{
+    STATS_COUNT(data_reads);
+    int ret = vdisk_read(&ssfs.disk, block_num, buffer);
+    return ret != 0 ? ret : verify_checksum(block_num, buffer);
+}
+
+/// @brief Writes a data block.
+/// @param block_num 
+/// @param buffer 
+/// @return 0 on success, a vdisk error otherwise
+static int write_data_block(uint32_t block_num, uint8_t *buffer)
+{
+    STATS_COUNT(data_writes);
+    int ret = vdisk_write(&ssfs.disk, block_num, buffer);
+    if (ret == 0) record_checksum(block_num, buffer);
+    return ret;
+}
+
+/// @brief Allocates the checksums of a volume whose checksum region has nb_sum_blocks
+/// blocks, all unknown.
+/// @param nb_sum_blocks 
+/// @return 0 on success, fs_EMOUNT if out of memory
+static int alloc_checksums(uint32_t nb_sum_blocks)
+{
+    size_t nb_sums = (size_t)nb_sum_blocks * CHECKSUMS_PER_BLOCK;
+    checksums.sums = calloc(nb_sums, sizeof(uint32_t));
+    checksums.verified = calloc((nb_sums + 63) / 64, sizeof(uint64_t));
+    checksums.dirty = calloc(nb_sum_blocks, sizeof(uint32_t));
+    checksums.is_dirty = calloc(nb_sum_blocks, sizeof(uint8_t));
+    checksums.nb_dirty = 0;
+    checksums.nb_sum_blocks = nb_sum_blocks;
+    if (!checksums.sums || !checksums.verified || !checksums.dirty || !checksums.is_dirty) {
+        free_checksums();
+        return fs_EMOUNT;
+    }
+    return 0;
+}
+
+/// @brief Drops the checksums of the mounted volume, unwritten ones included.
+static void free_checksums()
+{
+    free(checksums.sums);
+    free(checksums.verified);
+    free(checksums.dirty);
+    free(checksums.is_dirty);
+    memset(&checksums, 0, sizeof(Checksums));
+}
+
+/// @brief Reads the checksum region of the volume being mounted.
+/// @return 0 on success, a negative error code otherwise
+static int load_checksums()
+{
+    uint32_t start = ssfs.superblock.checksum_start;
+    int ret = alloc_checksums(ssfs.superblock.nb_blocks - start);
+    if (ret != 0) return ret;
+
+    for (uint32_t i = 0; i < checksums.nb_sum_blocks; ++i) {
+        if (read_meta_block(start + i, (uint8_t *)(checksums.sums + i * CHECKSUMS_PER_BLOCK)) != 0) {
+            free_checksums();
+            return fs_EREAD;
+        }
+    }
+    return 0;
+}
+
+/// @brief Writes back the blocks of the checksum region changed since the last flush.
+/// @param ret value returned by the call that changed them, passed through
+/// @return ret, or fs_EWRITE if a block of the checksum region could not be written
+static int flush_checksums(int ret)
+{
+    while (checksums.nb_dirty > 0) {
+        uint32_t index = checksums.dirty[--checksums.nb_dirty];
+        checksums.is_dirty[index] = 0;
+        uint8_t *block = (uint8_t *)(checksums.sums + index * CHECKSUMS_PER_BLOCK);
+        if (write_meta_block(ssfs.superblock.checksum_start + index, block) != 0)
+            ret = fs_EWRITE;
+    }
+    return ret;
+}
+
+/// @brief Checks a block just read against its checksum, unless it was already
+/// verified since mount or its checksum is unknown.
+/// @param block_num 
+/// @param buffer 
+/// @return 0 if it matches, fs_ECORRUPT otherwise
+static int verify_checksum(uint32_t block_num, const uint8_t *buffer)
+{
+    if (!checksums.sums || block_num == SUPERBLOCK_SECTOR || block_num >= ssfs.data_end_block)
+        return 0;
+
+    uint64_t bit = (uint64_t)1 << (block_num % 64);
+    if (checksums.verified[block_num / 64] & bit) return 0;
+
+    uint32_t expected = checksums.sums[block_num];
+    if (expected == 0) return 0;
+    if (crc32c(0, buffer, BLOCK_SIZE) != expected) return fs_ECORRUPT;
+    checksums.verified[block_num / 64] |= bit;
+    return 0;
+}
+
+/// @brief Error a read returns for a block that could not be read: fs_ECORRUPT is
+/// passed on, so that the caller can tell a damaged block from a failed read.
+/// @param ret what read_meta_block() or read_data_block() returned
+/// @return fs_ECORRUPT or fs_EREAD
+static inline int read_error(int ret)
+{
+    return ret == fs_ECORRUPT ? fs_ECORRUPT : fs_EREAD;
+}
+
+/// @brief Updates the checksum of a block just written.
+/// @param block_num 
+/// @param buffer 
+static void record_checksum(uint32_t block_num, const uint8_t *buffer)
+{
+    if (!checksums.sums || block_num == SUPERBLOCK_SECTOR || block_num >= ssfs.data_end_block)
+        return;
+
+    checksums.verified[block_num / 64] |= (uint64_t)1 << (block_num % 64);
+    set_checksum(block_num, crc32c(0, buffer, BLOCK_SIZE));
+}
+
+/// @brief Sets the checksum of a block, queuing its block of the checksum region for
+/// flush_checksums() if it changed.
+/// @param block_num 
+/// @param sum 
+static void set_checksum(uint32_t block_num, uint32_t sum)
+{
+    if (checksums.sums[block_num] == sum) return;
+    checksums.sums[block_num] = sum;
+
+    uint32_t index = block_num / CHECKSUMS_PER_BLOCK;
+    if (!checksums.is_dirty[index]) {
+        checksums.is_dirty[index] = 1;
+        checksums.dirty[checksums.nb_dirty++] = index;
+    }
+}
+
+/// @brief Forgets the checksums of the data blocks below a block, which are about to
+/// be written behind the back of the volume (by a nested volume).
+/// @param block_num 
+/// @param depth 0 for a data block, 1 for an indirect block, 2 for a double-indirect block
+static void forget_checksums(uint32_t block_num, int depth)
+{
+    if (block_num == 0 || block_num >= ssfs.data_end_block) return;
+
+    if (depth == 0) {
+        checksums.verified[block_num / 64] &= ~((uint64_t)1 << (block_num % 64));
+        set_checksum(block_num, 0);
+        return;
+    }
+
+    uint8_t block[BLOCK_SIZE];
+    if (read_meta_block(block_num, block) != 0) return;
+    for (int i = 0; i < BLOCK_POINTERS_SIZE; ++i) {
+        uint32_t ptr;
+        memcpy(&ptr, block + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
+        forget_checksums(ptr, depth - 1);
+    }
+}
+
+/// @brief Gets the inode of a file.
+/// @param inode_num 
+/// @param block_out 
+/// @return pointer to the inode in the block_out buffer
+static uint8_t* get_inode(uint32_t inode_num, uint8_t *block_out) 
+{
+    int block_index = inode_num / INODES_PER_BLOCK;
+    int offset = inode_num % INODES_PER_BLOCK;
+    int block_num = ssfs.inode_start_block + block_index;
+
+    if (read_meta_block(block_num, block_out) != 0)
+        return NULL;
+
+    return block_out + (offset * INODE_SIZE);
+}
+
+/// @brief Frees a block by writing zeros to it.
+/// @param block_num 
+/// @return 0 on success, -1 on error
+static int free_block(uint32_t block_num) 
+{
+    uint8_t zero[BLOCK_SIZE] = {0};
+    return write_data_block(block_num, zero);
+}
+
+/// @brief Allocates a free block for the call in progress (see set_alloc_cursor()): the
+/// next block of the preallocation window of a growing file, otherwise the first free
+/// block from the goal on that no other file reserved. Free blocks are zero, as
+/// release_block() leaves them, and are not read: every caller fills the block it gets.
+/// @return The block number of the allocated block, or 0 if no free block is found.
+static uint32_t allocate_block() 
+{
+    int inode_num = alloc_cursor.inode_num;
+    PreallocWindow *window = alloc_cursor.grow ? get_window(inode_num) : NULL;
+    uint32_t block_num = 0;
+
+    if (window) {
+        while (window->next < window->end && !claim_block(window->next)) window->next++;
+        if (window->next < window->end) block_num = window->next++;
+    }
+    if (block_num == 0) {
+        uint32_t goal = alloc_cursor.goal ? alloc_cursor.goal : home_block(inode_num);
+
+        // Around the windows of the other files first, through them if the volume is full.
+        // A block found free but claimed first by someone else is searched past.
+        for (int steal = 0; steal < 2 && block_num == 0; ++steal) {
+            uint32_t from = goal;
+            while ((block_num = find_free_block(from, steal || alloc_cursor.grow ? inode_num : -1, steal)) != 0 &&
+                   !claim_block(block_num))
+                from = block_num + 1;
+        }
+        if (block_num == 0) {
+            printf("No free block available!\n");
+            return 0;
+        }
+        if (alloc_cursor.grow) reserve_window(inode_num, block_num + 1, 0);
+    }
+
+    block_refs[block_num] = 1;
+    alloc_cursor.goal = block_num + 1;
+    return block_num;
+}
+
+/// @brief Sets up the allocator of the volume just mounted, from its block reference counts.
+/// @return 0 on success, -1 if out of memory
+static int alloc_allocator()
+{
+    uint32_t nb_groups = (ssfs.data_end_block - ssfs.data_start_block + ALLOC_GROUP_BLOCKS - 1) / ALLOC_GROUP_BLOCKS;
+    allocator.group_free = calloc(nb_groups ? nb_groups : 1, sizeof(uint32_t));
+    allocator.free_map = calloc((ssfs.superblock.nb_blocks + 63) / 64, sizeof(uint64_t));
+    if (!allocator.group_free || !allocator.free_map) {
+        free_allocator();
+        return -1;
+    }
+    count_free_blocks();
+    return 0;
+}
+
+static void free_allocator()
+{
+    free(allocator.group_free);
+    free(allocator.free_map);
+    memset(&allocator, 0, sizeof(Allocator));
+}
+
+/// @brief Builds the free map and counts the free blocks of each allocation group, and
+/// drops every window, for the current data area (which enable_checksums() shrinks).
+static void count_free_blocks()
+{
+    allocator.nb_groups = (ssfs.data_end_block - ssfs.data_start_block + ALLOC_GROUP_BLOCKS - 1) / ALLOC_GROUP_BLOCKS;
+    memset(allocator.group_free, 0, allocator.nb_groups * sizeof(uint32_t));
+    memset(allocator.free_map, 0, (ssfs.superblock.nb_blocks + 63) / 64 * sizeof(uint64_t));
+    for (uint32_t i = ssfs.data_start_block; i < ssfs.data_end_block; ++i) {
+        if (block_refs[i] == 0) {
+            allocator.free_map[i / 64] |= (uint64_t)1 << (i % 64);
+            allocator.group_free[(i - ssfs.data_start_block) / ALLOC_GROUP_BLOCKS]++;
+        }
+    }
+
+    for (int i = 0; i < PREALLOC_WINDOWS; ++i)
+        allocator.windows[i].inode_num = -1;
+    allocator.clock = 0;
+}
+
+/// @brief Takes a block out of the free map, if it is still free.
+/// @param block_num 
+/// @return 1 if the caller got the block, 0 if it is in use
+static int claim_block(uint32_t block_num)
+{
+    uint64_t *word = &allocator.free_map[block_num / 64];
+    uint64_t bit = (uint64_t)1 << (block_num % 64);
+    uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+    do {
+        if (!(old & bit)) return 0;
+    } while (!__atomic_compare_exchange_n(word, &old, old & ~bit, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    __atomic_sub_fetch(&allocator.group_free[(block_num - ssfs.data_start_block) / ALLOC_GROUP_BLOCKS], 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/// @brief Puts a block of the data area back in the free map.
+/// @param block_num 
+static void unclaim_block(uint32_t block_num)
+{
+    __atomic_or_fetch(&allocator.free_map[block_num / 64], (uint64_t)1 << (block_num % 64), __ATOMIC_RELEASE);
+    __atomic_add_fetch(&allocator.group_free[(block_num - ssfs.data_start_block) / ALLOC_GROUP_BLOCKS], 1, __ATOMIC_RELAXED);
+}
+
+/// @brief Tells allocate_block() which file the blocks allocated until clear_alloc_cursor()
+/// belong to.
+/// @param inode_num 
+/// @param grow 1 if the file grows past its end
+static void set_alloc_cursor(int inode_num, int grow)
+{
+    alloc_cursor.inode_num = inode_num;
+    alloc_cursor.grow = grow;
+    alloc_cursor.goal = 0;
+}
+
+static void clear_alloc_cursor()
+{
+    set_alloc_cursor(-1, 0);
+}
+
+/// @brief First block of the allocation group of an inode, where its file starts:
+/// files are spread over the groups, leaving each one room to grow.
+/// @param inode_num -1 for blocks of no file, which go first in the volume
+/// @return
+static uint32_t home_block(int inode_num)
+{
+    if (inode_num < 0) return ssfs.data_start_block;
+    return ssfs.data_start_block + ((uint32_t)inode_num % allocator.nb_groups) * ALLOC_GROUP_BLOCKS;
+}
+
+/// @brief Block of the file just before the one whose pointer is *slot, when both
+/// pointers are in the same inode or pointer block.
+/// @param file_block_index 
+/// @param slot pointer returned by open_block_path()
+/// @return the block number, 0 if none or unknown
+static uint32_t previous_block(int file_block_index, const uint32_t *slot)
+{
+    int index = file_block_index;
+    if (index >= NB_DIRECT_BLOCKS) index = (index - NB_DIRECT_BLOCKS) % BLOCK_POINTERS_SIZE;
+    if (index == 0) return 0;
+
+    uint32_t previous;
+    memcpy(&previous, slot - 1, sizeof(uint32_t));
+    return previous;
+}
+
+/// @brief Preallocation window of a file.
+/// @param inode_num 
+/// @return NULL if the file has none
+static PreallocWindow *get_window(int inode_num)
+{
+    if (inode_num < 0) return NULL;
+    for (int i = 0; i < PREALLOC_WINDOWS; ++i) {
+        PreallocWindow *window = &allocator.windows[i];
+        if (window->inode_num == inode_num) {
+            window->last_use = ++allocator.clock;
+            return window;
+        }
+    }
+    return NULL;
+}
+
+/// @brief Reserves the free blocks from start on for a file, up to the first block in
+/// use or reserved by another file. Replaces the previous window of the file, or the
+/// least recently used window of another file.
+/// @param inode_num 
+/// @param start 
+/// @param size blocks to reserve, 0 for twice the previous window of the file
+static void reserve_window(int inode_num, uint32_t start, uint32_t size)
+{
+    PreallocWindow *window = get_window(inode_num);
+    if (!window) {
+        window = &allocator.windows[0];
+        for (int i = 0; i < PREALLOC_WINDOWS; ++i) {
+            PreallocWindow *candidate = &allocator.windows[i];
+            if (candidate->inode_num < 0) {
+                window = candidate;
+                break;
+            }
+            if (candidate->last_use < window->last_use) window = candidate;
+        }
+        window->inode_num = inode_num;
+        window->size = 0;
+        window->last_use = ++allocator.clock;
+    }
+
+    if (size == 0) {
+        size = window->size ? window->size * 2 : PREALLOC_MIN_BLOCKS;
+        if (size > PREALLOC_MAX_BLOCKS) size = PREALLOC_MAX_BLOCKS;
+    }
+    uint32_t end = start;
+    while (end < ssfs.data_end_block && end - start < size && is_free(end) &&
+           reserved_until(end, inode_num) == 0)
+        end++;
+
+    window->next = start;
+    window->end = end;
+    window->size = size;
+}
+
+/// @brief Forgets the preallocation window of a file.
+/// @param inode_num 
+static void drop_window(int inode_num)
+{
+    PreallocWindow *window = get_window(inode_num);
+    if (window) window->inode_num = -1;
+}
+
+/// @brief Tells whether a block is reserved by the window of another file.
+/// @param block_num 
+/// @param inode_num file allocating, -1 to avoid every window
+/// @return the end of that window, 0 if the block is not reserved
+static uint32_t reserved_until(uint32_t block_num, int inode_num)
+{
+    for (int i = 0; i < PREALLOC_WINDOWS; ++i) {
+        const PreallocWindow *window = &allocator.windows[i];
+        if (window->inode_num >= 0 && window->inode_num != inode_num &&
+            block_num >= window->next && block_num < window->end)
+            return window->end;
+    }
+    return 0;
+}
+
+/// @brief Tells whether a block is in the free map.
+/// @param block_num 
+/// @return
+static inline int is_free(uint32_t block_num)
+{
+    return (allocator.free_map[block_num / 64] >> (block_num % 64)) & 1;
+}
+
+/// @brief Finds the first free block from goal on, wrapping around the data area.
+/// Groups without a free block are skipped, the others are scanned a word of the free
+/// map at a time.
+/// @param goal 
+/// @param inode_num file allocating, its own window is not avoided (-1 to avoid every window)
+/// @param steal 1 to take blocks reserved by other files as well
+/// @return the block number, 0 if none
+static uint32_t find_free_block(uint32_t goal, int inode_num, int steal)
+{
+    uint32_t start = ssfs.data_start_block;
+    uint32_t end = ssfs.data_end_block;
+    if (goal < start || goal >= end) goal = start;
+    uint32_t first_group = (goal - start) / ALLOC_GROUP_BLOCKS;
+
+    // The group of the goal is scanned from the goal first, and from its start last
+    for (uint32_t n = 0; n <= allocator.nb_groups; ++n) {
+        uint32_t group = (first_group + n) % allocator.nb_groups;
+        if (allocator.group_free[group] == 0) continue;
+
+        uint32_t from = (n == 0) ? goal : start + group * ALLOC_GROUP_BLOCKS;
+        uint32_t to = start + (group + 1) * ALLOC_GROUP_BLOCKS;
+        if (n == allocator.nb_groups) to = goal;
+        if (to > end) to = end;
+
+        uint32_t i = from;
+        while (i < to) {
+            STATS_COUNT(alloc_scanned);
+            uint64_t word = __atomic_load_n(&allocator.free_map[i / 64], __ATOMIC_RELAXED) >> (i % 64);
+            if (word == 0) {
+                i += 64 - i % 64;
+                continue;
+            }
+            i += __builtin_ctzll(word);
+            if (i >= to) break;
+            uint32_t reserved = steal ? 0 : reserved_until(i, inode_num);
+            if (reserved == 0) return i;
+            i = reserved;
+        }
+    }
+    return 0;
+}
+
+/// @brief Finds count consecutive free blocks not reserved by other files, the first
+/// one from goal on, wrapping around the data area. A goal inside a free run is moved
+/// back to the start of that run, within its allocation group, so that the run found
+/// does not leave a few free blocks before it.
+/// @param goal 0 for the group of the inode
+/// @param count 
+/// @param inode_num 
+/// @return the first block of the run, 0 if none
+static uint32_t find_free_run(uint32_t goal, uint32_t count, int inode_num)
+{
+    uint32_t start = ssfs.data_start_block;
+    uint32_t end = ssfs.data_end_block;
+    if (goal == 0) goal = home_block(inode_num);
+    if (goal < start || goal >= end) goal = start;
+
+    uint32_t group_start = goal - (goal - start) % ALLOC_GROUP_BLOCKS;
+    while (goal > group_start && is_free(goal) && is_free(goal - 1) && !reserved_until(goal - 1, inode_num))
+        goal--;
+
+    uint32_t run_start = 0, run_length = 0;
+    for (uint32_t n = 0; n < end - start; ++n) {
+        uint32_t i = goal + n < end ? goal + n : goal + n - (end - start);
+        STATS_COUNT(alloc_scanned);
+        if (i == start) run_length = 0; // Runs do not wrap
+
+        // The rest of a word without a free block is skipped at once
+        if ((allocator.free_map[i / 64] >> (i % 64)) == 0) {
+            uint32_t skip = 64 - i % 64;
+            if (skip > end - i) skip = end - i;
+            n += skip - 1;
+            run_length = 0;
+            continue;
+        }
+        if (!is_free(i) || reserved_until(i, inode_num)) {
+            run_length = 0;
+            continue;
+        }
+        if (run_length++ == 0) run_start = i;
+        if (run_length == count) return run_start;
+    }
+    return 0;
+}
+
+/// @brief Walks the blocks of a file in file order (see do_file_layout()).
+/// @param inode 
+/// @param walk zeroed by the caller
+/// @return 0 on success, fs_EREAD otherwise
+static int walk_layout(const uint8_t *inode, LayoutWalk *walk)
+{
+    walk->compressed = inode[INODE_FLAGS] & INODE_FLAG_COMPRESSED;
+
+    int ret = 0;
+    for (int i = 0; i < NB_DIRECT_BLOCKS && ret == 0; ++i) {
+        uint32_t ptr;
+        memcpy(&ptr, inode + INODE_DIRECT_OFFSET + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
+        ret = walk_block(ptr, 0, 0, walk);
+    }
+    uint32_t indirect1, indirect2;
+    memcpy(&indirect1, inode + INODE_INDIRECT1_OFFSET, sizeof(uint32_t));
+    memcpy(&indirect2, inode + INODE_INDIRECT2_OFFSET, sizeof(uint32_t));
+    if (ret == 0) ret = walk_block(indirect1, 1, 0, walk);
+    if (ret == 0) ret = walk_block(indirect2, 2, 0, walk);
+    return ret;
+}
+
+/// @brief Accounts a block of a file and the blocks below it in a layout walk.
+/// @param block_num 0 or a compressed cluster marker are skipped
+/// @param depth 0 for a data block, 1 for an indirect block, 2 for a double-indirect block
+/// @param shared 1 if a pointer block above it is shared
+/// @param walk 
+/// @return 0 on success, fs_EREAD otherwise
+static int walk_block(uint32_t block_num, int depth, int shared, LayoutWalk *walk)
+{
+    if (block_num == 0 || (walk->compressed && depth == 0 && (block_num & CLUSTER_COMPRESSED)))
+        return 0;
+    if (block_num >= ssfs.superblock.nb_blocks) return fs_EREAD;
+
+    shared |= block_refs[block_num] > 1;
+    if (shared)
+        walk->shared_blocks++;
+    else
+        walk->private_blocks++;
+
+    if (depth == 0) {
+        walk->data_blocks++;
+        if (block_num != walk->expected) walk->extents++;
+        walk->expected = block_num + 1;
+        return 0;
+    }
+
+    // A pointer block between two data blocks does not break the extent
+    walk->pointer_blocks++;
+    if (block_num == walk->expected) walk->expected = block_num + 1;
+
+    uint8_t block[BLOCK_SIZE];
+    if (read_meta_block(block_num, block) != 0) return fs_EREAD;
+    for (int i = 0; i < BLOCK_POINTERS_SIZE; ++i) {
+        uint32_t ptr;
+        memcpy(&ptr, block + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
+        int ret = walk_block(ptr, depth - 1, shared, walk);
+        if (ret != 0) return ret;
+    }
+    return 0;
+}
+
+/// @brief Copies a private block and the private blocks below it to newly allocated
+/// blocks, parents before children, and points *slot to the copy. Shared blocks are
+/// left in place.
+/// @param slot pointer to the block inside the inode or pointer block copy
+/// @param depth 0 for a data block, 1 for an indirect block, 2 for a double-indirect block
+/// @param reloc 
+/// @return 0 on success, a negative error code otherwise
+static int relocate_block(uint32_t *slot, int depth, Relocation *reloc)
+{
+    uint32_t old = *slot;
+    if (old == 0 || (reloc->walk.compressed && depth == 0 && (old & CLUSTER_COMPRESSED)))
+        return 0;
+    if (old >= ssfs.superblock.nb_blocks || block_refs[old] != 1) return 0;
+    if (reloc->nb_moved == reloc->capacity) return 0; // The file changed since the walk
+
+    uint8_t block[BLOCK_SIZE];
+    int err = depth > 0 ? read_meta_block(old, block) : read_data_block(old, block);
+    if (err != 0) return fs_EREAD;
+
+    uint32_t copy = allocate_block();
+    if (copy == 0) return fs_EWRITE;
+    reloc->old_blocks[reloc->nb_moved] = old;
+    reloc->new_blocks[reloc->nb_moved] = copy;
+    reloc->nb_moved++;
+
+    for (int i = 0; i < BLOCK_POINTERS_SIZE && depth > 0; ++i) {
+        int ret = relocate_block((uint32_t *)(block + i * BLOCK_PTR_SIZE), depth - 1, reloc);
+        if (ret != 0) return ret;
+    }
+
+    err = depth > 0 ? write_meta_block(copy, block) : write_data_block(copy, block);
+    if (err != 0) return fs_EWRITE;
+    if (depth == 0 && !reloc->walk.compressed && dedup_index.entries)
+        dedup_insert(copy, block_hash(block));
+    *slot = copy;
+
+    throttle(reloc);
+    return 0;
+}
+
+/// @brief Sleeps as long as the blocks moved so far are ahead of the rate limit.
+/// @param reloc 
+static void throttle(const Relocation *reloc)
+{
+    if (reloc->rate_kib <= 0) return;
+
+    uint64_t due_ns = (uint64_t)reloc->nb_moved * (BLOCK_SIZE / 1024) * 1000000000ull / (uint64_t)reloc->rate_kib;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed_ns = (uint64_t)(now.tv_sec - reloc->start.tv_sec) * 1000000000ull
+                        + (uint64_t)now.tv_nsec - (uint64_t)reloc->start.tv_nsec;
+    if (elapsed_ns >= due_ns) return;
+
+    uint64_t wait_ns = due_ns - elapsed_ns;
+    struct timespec wait = { (time_t)(wait_ns / 1000000000ull), (long)(wait_ns % 1000000000ull) };
+    nanosleep(&wait, NULL);
+}
+
+/// @brief Open file of a handle.
+/// @param handle 
+/// @return NULL if the handle is not open, or its volume not the one mounted
+static OpenFile *get_open_file(int handle)
+{
+    if (handle < 0 || !ssfs.is_mounted) return NULL;
+    OpenFile *file = &open_files[handle & (MAX_OPEN_FILES - 1)];
+    if (!file->in_use || file->volume != mount_depth) return NULL;
+    if ((uint32_t)handle >> HANDLE_SLOT_BITS != file->generation) return NULL;
+    return file;
+}
+
+/// @brief Frees the slot of an open file; its handle no longer matches.
+/// @param file 
+static void close_open_file(OpenFile *file)
+{
+    free(file->map);
+    file->map = NULL;
+    file->map_size = 0;
+    file->in_use = 0;
+    file->generation = (file->generation + 1) & (UINT32_MAX >> (HANDLE_SLOT_BITS + 1));
+}
+
+/// @brief Marks the handles open on a file stale, after a change of its inode or of
+/// its pointer blocks through another way.
+/// @param inode_num 
+/// @param except handle left untouched, NULL for none
+/// @param deleted 1 if the file was deleted
+static void invalidate_handles(int inode_num, const OpenFile *except, int deleted)
+{
+    for (int i = 0; i < MAX_OPEN_FILES; ++i) {
+        OpenFile *file = &open_files[i];
+        if (!file->in_use || file == except || file->volume != mount_depth || file->inode_num != inode_num)
+            continue;
+        file->stale = 1;
+        file->deleted |= deleted;
+    }
+}
+
+/// @brief Loads the inode of a stale open file again and drops its block map.
+/// @param file 
+/// @return 0 on success, fs_EREAD if the file is gone
+static int refresh_open_file(OpenFile *file)
+{
+    if (file->deleted) return fs_EREAD;
+    if (!file->stale) return 0;
+
+    uint8_t block[BLOCK_SIZE];
+    uint8_t *inode = get_inode(file->inode_num, block);
+    if (!inode || inode[INODE_STATUT] != INODE_VALID) return fs_EREAD;
+    memcpy(file->inode, inode, INODE_SIZE);
+    if (file->map)
+        memset(file->map, 0, file->map_size * sizeof(uint32_t));
+    file->stale = 0;
+    return 0;
+}
+
+/// @brief Data block of a block of an open file, looked up in its block map. A miss
+/// fills the entries of every block sharing the pointer block of that one.
+/// @param file 
+/// @param index block of the file
+/// @param block_num receives the block number, MAP_HOLE for a hole
+/// @return 0 on success, a negative error code otherwise (see read_error())
+static int lookup_block(OpenFile *file, uint32_t index, uint32_t *block_num)
+{
+    if (index >= MAX_FILE_BLOCKS) return fs_EREAD;
+    if (index >= file->map_size) {
+        uint32_t size = file->map_size ? file->map_size : NB_DIRECT_BLOCKS;
+        while (size <= index) size *= 2;
+        if (size > MAX_FILE_BLOCKS) size = MAX_FILE_BLOCKS;
+        uint32_t *map = realloc(file->map, size * sizeof(uint32_t));
+        if (!map) return fs_EREAD;
+        memset(map + file->map_size, 0, (size - file->map_size) * sizeof(uint32_t));
+        file->map = map;
+        file->map_size = size;
+    }
+    if (file->map[index]) {
+        *block_num = file->map[index];
+        return 0;
+    }
+
+    uint32_t pointers[BLOCK_POINTERS_SIZE];
+    int first = load_pointer_group(file->inode, index, pointers);
+    if (first < 0) return first;
+
+    uint32_t count = pointer_group_end(index) - (uint32_t)first;
+    if (first + count > file->map_size) count = file->map_size - first;
+    for (uint32_t i = 0; i < count; ++i)
+        file->map[first + i] = pointers[i] ? pointers[i] : MAP_HOLE;
+    *block_num = file->map[index];
+    return 0;
+}
+
+/// @brief End of the blocks of a file whose pointers are stored along the pointer of
+/// one of them: in the inode for the direct blocks, in the same pointer block otherwise.
+/// @param index block of the file
+/// @return the block of the file after the last one
+static uint32_t pointer_group_end(uint32_t index)
+{
+    if (index < NB_DIRECT_BLOCKS) return NB_DIRECT_BLOCKS;
+    uint32_t group = (index - NB_DIRECT_BLOCKS) / BLOCK_POINTERS_SIZE;
+    return NB_DIRECT_BLOCKS + (group + 1) * BLOCK_POINTERS_SIZE;
+}
+
+/// @brief Loads the pointers stored along the pointer of a block of a file, see
+/// pointer_group_end(). The pointers of a missing pointer block are all 0.
+/// @param inode 
+/// @param index block of the file
+/// @param pointers receives up to BLOCK_POINTERS_SIZE pointers, 0 for holes
+/// @return the block of the file the first pointer is for, or a negative error code (see read_error())
+static int load_pointer_group(const uint8_t *inode, uint32_t index, uint32_t *pointers)
+{
+    int ret;
+    if (index >= MAX_FILE_BLOCKS) return fs_EREAD;
+    if (index < NB_DIRECT_BLOCKS) {
+        memcpy(pointers, inode + INODE_DIRECT_OFFSET, NB_DIRECT_BLOCKS * BLOCK_PTR_SIZE);
+        return 0;
+    }
+
+    uint8_t block[BLOCK_SIZE];
+    uint32_t ptr;
+    uint32_t first;
+    if (index < NB_DIRECT_BLOCKS + BLOCK_POINTERS_SIZE) {
+        first = NB_DIRECT_BLOCKS;
+        memcpy(&ptr, inode + INODE_INDIRECT1_OFFSET, sizeof(uint32_t));
+    } else {
+        uint32_t group = (index - NB_DIRECT_BLOCKS - BLOCK_POINTERS_SIZE) / BLOCK_POINTERS_SIZE;
+        first = NB_DIRECT_BLOCKS + BLOCK_POINTERS_SIZE + group * BLOCK_POINTERS_SIZE;
+        memcpy(&ptr, inode + INODE_INDIRECT2_OFFSET, sizeof(uint32_t));
+        if (ptr && (ret = read_meta_block(ptr, block)) != 0) return read_error(ret);
+        if (ptr) memcpy(&ptr, block + group * BLOCK_PTR_SIZE, sizeof(uint32_t));
+    }
+    if (ptr && (ret = read_meta_block(ptr, block)) != 0) return read_error(ret);
+
+    if (ptr) memcpy(pointers, block, BLOCK_SIZE);
+    else memset(pointers, 0, BLOCK_SIZE);
+    return (int)first;
+}
+
+/// @brief Allocates the missing blocks between first and first + count of a file with
+/// the allocation cursor in place (see set_alloc_cursor()). The blocks are not written:
+/// free blocks are zero. Each pointer block on the way is written once.
+/// @param inode modified in place, saved by the caller
+/// @param first 
+/// @param count 
+/// @param blocks receives the count data blocks
+/// @return 0 on success, a negative error code otherwise
+static int map_blocks(uint8_t *inode, uint32_t first, uint32_t count, uint32_t *blocks)
+{
+    uint32_t index = first;
+    while (index < first + count) {
+        BlockPath path;
+        uint32_t *slot;
+        int ret = open_block_path(inode, (int)index, &path, &slot);
+        if (ret < 0) return ret;
+
+        uint32_t end = pointer_group_end(index);
+        if (end > first + count) end = first + count;
+        int changed = 0;
+        for (; index < end; ++index, ++slot) {
+            if (*slot == 0 && alloc_cursor.goal == 0) {
+                uint32_t previous = previous_block((int)index, slot);
+                if (previous != 0) alloc_cursor.goal = previous + 1;
+            }
+            uint8_t scratch[BLOCK_SIZE];
+            int moved = load_private_data_block(slot, scratch, 1);
+            if (moved < 0) {
+                close_block_path(inode, (int)index, &path, changed);
+                return moved;
+            }
+            changed |= moved;
+            blocks[index - first] = *slot;
+        }
+        ret = close_block_path(inode, (int)index - 1, &path, changed);
+        if (ret < 0) return ret;
+    }
+    return 0;
+}
+
+/// @brief Releases the data blocks between first and first + count of a file.
+/// @param inode modified in place, saved by the caller
+/// @param first 
+/// @param count 
+/// @return 0 on success, a negative error code otherwise
+static int unmap_blocks(uint8_t *inode, uint32_t first, uint32_t count)
+{
+    uint32_t index = first;
+    while (index < first + count) {
+        BlockPath path;
+        uint32_t *slot;
+        int ret = open_block_path(inode, (int)index, &path, &slot);
+        if (ret < 0) return ret;
+
+        uint32_t end = pointer_group_end(index);
+        if (end > first + count) end = first + count;
+        int changed = 0;
+        for (; index < end; ++index, ++slot) {
+            if (*slot == 0) continue;
+            release_block(*slot, 0);
+            *slot = 0;
+            changed = 1;
+        }
+        ret = close_block_path(inode, (int)index - 1, &path, changed);
+        if (ret < 0) return ret;
+    }
+    return 0;
+}
+
+/// @brief Copies a file stored block by block to fd, each run of consecutive data
+/// blocks in a single call to the kernel. Holes are written as zeros.
+/// @param inode 
+/// @param size size of the file
+/// @param image_fd see vdisk_fd()
+/// @param fd 
+/// @return the number of bytes copied, or a negative error code
+static int export_blocks(const uint8_t *inode, uint32_t size, int image_fd, int fd)
+{
+    static const uint8_t zeros[BLOCK_SIZE];
+    uint32_t nb_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t run_index = 0, run_block = 0, run_length = 0; // Blocks not copied yet
+
+    for (uint32_t index = 0; index <= nb_blocks; ) {
+        uint32_t pointers[BLOCK_POINTERS_SIZE];
+        uint32_t first = index, end = index + 1;
+        if (index < nb_blocks) {
+            int ret = load_pointer_group(inode, index, pointers);
+            if (ret < 0) return ret;
+            first = (uint32_t)ret;
+            end = pointer_group_end(index);
+            if (end > nb_blocks) end = nb_blocks;
+        }
+
+        for (; index < end; ++index) {
+            uint32_t block_num = index < nb_blocks ? pointers[index - first] : 0;
+            if (block_num != 0 && run_length > 0 && block_num == run_block + run_length) {
+                run_length++;
+                continue;
+            }
+
+            // The run ends here, the last block of the file is copied up to its size
+            if (run_length > 0) {
+                int64_t offset = (int64_t)run_index * BLOCK_SIZE;
+                int64_t len = (int64_t)run_length * BLOCK_SIZE;
+                if (offset + len > size) len = size - offset;
+                STATS_ADD(data_reads, run_length);
+                if (host_copy_out(image_fd, (int64_t)run_block * BLOCK_SIZE, fd, len) != len)
+                    return fs_EWRITE;
+            }
+            run_index = index;
+            run_block = block_num;
+            run_length = block_num != 0;
+
+            if (block_num == 0 && index < nb_blocks) {
+                int64_t len = size - (int64_t)index * BLOCK_SIZE;
+                if (host_write(fd, zeros, len < BLOCK_SIZE ? len : BLOCK_SIZE) < 0) return fs_EWRITE;
+            }
+        }
+    }
+    return (int)size;
+}
+
+/// @brief Copies a file to fd through a buffer, reading it as read() does.
+/// @param inode 
+/// @param size size of the file
+/// @param fd 
+/// @return the number of bytes copied, or a negative error code
+static int export_buffered(const uint8_t *inode, uint32_t size, int fd)
+{
+    uint8_t *buffer = malloc(TRANSFER_BLOCKS * BLOCK_SIZE);
+    if (!buffer) return fs_EREAD;
+
+    uint32_t offset = 0;
+    int ret = 0;
+    while (offset < size && ret == 0) {
+        uint32_t len = size - offset < TRANSFER_BLOCKS * BLOCK_SIZE ? size - offset : TRANSFER_BLOCKS * BLOCK_SIZE;
+        int bytes_read = read_from_inode(inode, buffer, (int)len, (int)offset);
+        if (bytes_read < 0) {
+            ret = bytes_read;
+            break;
+        }
+
+        // read_from_inode() stops at a missing pointer block: the blocks it covers are a hole
+        if ((uint32_t)bytes_read < len) {
+            uint32_t hole_end = pointer_group_end((offset + bytes_read) / BLOCK_SIZE) * BLOCK_SIZE;
+            if (hole_end > offset + len) hole_end = offset + len;
+            memset(buffer + bytes_read, 0, hole_end - offset - bytes_read);
+            len = hole_end - offset;
+        }
+        if (host_write(fd, buffer, len) != (int64_t)len) ret = fs_EWRITE;
+        offset += len;
+    }
+    free(buffer);
+    return ret < 0 ? ret : (int)size;
+}
+
+/// @brief Fills a new file with the data left in fd, allocating TRANSFER_BLOCKS blocks
+/// at a time and copying into each run of consecutive blocks in a single call to the
+/// kernel. The blocks past the end of the data are released.
+/// @param inode_num 
+/// @param inode modified in place, saved by the caller
+/// @param known_size bytes left in fd, -1 if unknown
+/// @param fd 
+/// @return the size of the file, or a negative error code
+static int import_blocks(int inode_num, uint8_t *inode, int64_t known_size, int fd)
+{
+    set_alloc_cursor(inode_num, 1);
+    if (known_size > 0) {
+        uint32_t count = (uint32_t)((known_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        count += count / BLOCK_POINTERS_SIZE + 2;
+        uint32_t run = find_free_run(0, count, inode_num);
+        if (run != 0) reserve_window(inode_num, run, count);
+    }
+
+    uint32_t size = 0;
+    int ret = 0;
+    for (int end_of_input = 0; !end_of_input && ret == 0; ) {
+        uint32_t first = size / BLOCK_SIZE;
+        uint32_t count = TRANSFER_BLOCKS;
+        if (known_size >= 0 && (int64_t)(first + count) * BLOCK_SIZE >= known_size) {
+            count = (uint32_t)((known_size - size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            end_of_input = 1;
+        }
+        if (count == 0) break;
+        if (first + count > MAX_FILE_BLOCKS) {
+            ret = fs_EWRITE; // Larger than the largest file
+            break;
+        }
+
+        uint32_t blocks[TRANSFER_BLOCKS];
+        ret = map_blocks(inode, first, count, blocks);
+        if (ret < 0) break;
+
+        int image_fd = vdisk_fd(&ssfs.disk);
+        uint32_t copied = 0;
+        for (uint32_t i = 0, j; i < count && ret == 0; i = j) {
+            for (j = i + 1; j < count && blocks[j] == blocks[j - 1] + 1; ++j)
+                ;
+            int64_t len = (int64_t)(j - i) * BLOCK_SIZE;
+            int64_t n = host_copy_in(fd, image_fd, (int64_t)blocks[i] * BLOCK_SIZE, len);
+            if (n < 0) {
+                ret = fs_EREAD;
+                break;
+            }
+            STATS_ADD(data_writes, (n + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            copied += (uint32_t)n;
+            if (n < len) break;
+        }
+        size += copied;
+        if (ret == 0 && copied < count * BLOCK_SIZE) {
+            uint32_t used = (copied + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            ret = unmap_blocks(inode, first + used, count - used);
+            end_of_input = 1;
+        }
+    }
+    clear_alloc_cursor();
+
+    memcpy(inode + INODE_SIZE_OFFSET, &size, sizeof(uint32_t));
+    return ret < 0 ? ret : (int)size;
+}
+
+/// @brief Fills a new file with the data left in fd, written as write() does through a
+/// buffer of TRANSFER_BLOCKS blocks.
+/// @param inode_num 
+/// @param inode modified in place, saved by the caller
+/// @param fd 
+/// @return the size of the file, or a negative error code
+static int import_buffered(int inode_num, uint8_t *inode, int fd)
+{
+    uint8_t *buffer = malloc(TRANSFER_BLOCKS * BLOCK_SIZE);
+    if (!buffer) return fs_EWRITE;
+
+    uint32_t size = 0;
+    int ret = 0;
+    for (;;) {
+        int64_t len = host_read(fd, buffer, TRANSFER_BLOCKS * BLOCK_SIZE);
+        if (len <= 0) {
+            if (len < 0) ret = fs_EREAD;
+            break;
+        }
+        if ((int64_t)size + len > (int64_t)MAX_FILE_BLOCKS * BLOCK_SIZE) {
+            ret = fs_EWRITE;
+            break;
+        }
+        set_alloc_cursor(inode_num, 1);
+        int bytes_written = write_blocks(inode, buffer, (int)len, (int)size);
+        clear_alloc_cursor();
+        if (bytes_written < 0) {
+            ret = bytes_written;
+            break;
+        }
+        size += (uint32_t)bytes_written;
+        memcpy(inode + INODE_SIZE_OFFSET, &size, sizeof(uint32_t));
+    }
+    free(buffer);
+    return ret < 0 ? ret : (int)size;
+}
+
+/// @brief Orders the operations of a batch by inode, then by position in the batch.
+/// @param a 
+/// @param b 
+/// @return 
+static int compare_batch_entries(const void *a, const void *b)
+{
+    const BatchEntry *x = a, *y = b;
+    if (x->inode_num != y->inode_num) return x->inode_num < y->inode_num ? -1 : 1;
+    return x->index - y->index;
+}
+
+/// @brief Runs an operation of a batch, other than a create, on its inode inside the
+/// block of the inode table loaded by do_batch().
+/// @param op 
+/// @param inode 
+/// @param dirty set to 1 if the inode changed
+/// @return what the call of the same name returns
+static int run_batch_op(BatchOp *op, uint8_t *inode, int *dirty)
+{
+    uint32_t size;
+    memcpy(&size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
+
+    if (op->op == BATCH_STAT)
+        return inode[INODE_STATUT] == INODE_VALID ? (int)size : fs_EREAD;
+
+    if (op->op == BATCH_READ)
+        return read_from_inode(inode, op->data, op->len, op->offset);
+
+    if (op->op == BATCH_DELETE) {
+        if (inode[INODE_STATUT] == 0) return fs_EREAD;
+        for_each_inode_root(inode, release_block);
+        drop_window(op->inode_num);
+        invalidate_handles(op->inode_num, NULL, 1);
+        memset(inode, 0, INODE_SIZE);
+        *dirty = 1;
+        return 0;
+    }
+
+    invalidate_handles(op->inode_num, NULL, 0);
+    if (inode[INODE_STATUT] != INODE_VALID) return fs_EREAD;
+
+    // As with write(), the inode is saved even after a failed write
+    set_alloc_cursor(op->inode_num, (int64_t)op->offset + op->len > (int64_t)size);
+    int bytes_written = (inode[INODE_FLAGS] & INODE_FLAG_COMPRESSED)
+                      ? write_clusters(inode, op->data, op->len, op->offset)
+                      : write_blocks(inode, op->data, op->len, op->offset);
+    clear_alloc_cursor();
+    *dirty = 1;
+    if (bytes_written < 0) return bytes_written;
+
+    uint32_t new_size = op->offset + bytes_written;
+    if (new_size > size)
+        memcpy(inode + INODE_SIZE_OFFSET, &new_size, sizeof(uint32_t));
+    return bytes_written;
+}
+
+/// @brief Traced operation of an operation of a batch.
+/// @param op BATCH_*
+/// @return 
+static inline int batch_trace_op(int op)
+{
+    if (op == BATCH_STAT) return TRACE_OP_STAT;
+    if (op == BATCH_READ) return TRACE_OP_READ;
+    if (op == BATCH_WRITE) return TRACE_OP_WRITE;
+    if (op == BATCH_CREATE) return TRACE_OP_CREATE;
+    return TRACE_OP_DELETE;
+}
+
+/// @brief Gets the size of the virtual disk.
+/// @param disk 
+/// @return The size of the disk in blocks.
+static uint32_t get_vdisk_size(DISK *disk) 
+{
+    return disk->size_in_sectors * disk->sector_size / BLOCK_SIZE;
+}
+
+/// @brief Writes the in-memory superblock to the disk.
+/// @return 0 on success, fs_EWRITE otherwise
+static int write_superblock()
+{
+    uint8_t block[BLOCK_SIZE] = {0};
+    memcpy(block, &ssfs.superblock, sizeof(SuperBlock));
+    return write_meta_block(SUPERBLOCK_SECTOR, block) == 0 ? 0 : fs_EWRITE;
+}
+
+/// @brief Flags the volume as sharing blocks, before the first block gets shared, so
+/// that ssfs_fsck does not report shared blocks as cross-links.
+/// @return 0 on success, fs_EWRITE otherwise
+static int enable_reflink()
+{
+    if (ssfs.superblock.features & SSFS_FEATURE_REFLINK) return 0;
+
+    ssfs.superblock.features |= SSFS_FEATURE_REFLINK;
+    int ret = write_superblock();
+    if (ret != 0) ssfs.superblock.features &= ~SSFS_FEATURE_REFLINK;
+    return ret;
+}
+
+/// @brief Adds a reference to a block. The blocks below a pointer block are not
+/// affected: they are referenced once by the pointer block, however many pointers to it.
+/// @param block_num 
+/// @param depth unused, see for_each_inode_root()
+static void take_ref(uint32_t block_num, int depth)
+{
+    (void)depth;
+    if (block_num < ssfs.superblock.nb_blocks)
+        block_refs[block_num]++;
+}
+
+/// @brief Drops a reference to a block. The last reference frees the block and, for a
+/// pointer block, drops the references it holds.
+/// @param block_num 
+/// @param depth 0 for a data block, 1 for an indirect block, 2 for a double-indirect block
+static void release_block(uint32_t block_num, int depth)
+{
+    if (block_num < ssfs.data_start_block || block_num >= ssfs.superblock.nb_blocks)
+        return;
+    if (block_refs[block_num] > 1) {
+        block_refs[block_num]--;
+        return;
+    }
+
+    if (depth > 0) {
+        uint8_t block[BLOCK_SIZE];
+        if (read_meta_block(block_num, block) != 0) return;
+        for (int i = 0; i < BLOCK_POINTERS_SIZE; i++) {
+            uint32_t ptr;
+            memcpy(&ptr, block + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
+            if (ptr != 0)
+                release_block(ptr, depth - 1);
+        }
+    }
+
+    block_refs[block_num] = 0;
+    if (block_num < ssfs.data_end_block)
+        unclaim_block(block_num);
+    if (dedup_index.indexed)
+        dedup_index.indexed[block_num / 64] &= ~((uint64_t)1 << (block_num % 64));
+    free_block(block_num);
+}
+
+/// @brief Counts a pointer to a block while rebuilding the reference counts. The
+/// pointers of a pointer block are counted on its first reference only.
+/// @param block_num 
+/// @param depth 0 for a data block, 1 for an indirect block, 2 for a double-indirect block
+static void count_block_refs(uint32_t block_num, int depth)
+{
+    if (block_num >= ssfs.superblock.nb_blocks) return;
+    if (block_refs[block_num]++ > 0 || depth == 0) return;
+
+    uint8_t block[BLOCK_SIZE];
+    if (read_meta_block(block_num, block) != 0) {
+        refs_incomplete = 1;
+        return;
+    }
+
+    for (int i = 0; i < BLOCK_POINTERS_SIZE; ++i) {
+        uint32_t ptr;
+        memcpy(&ptr, block + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
+        if (ptr != 0)
+            count_block_refs(ptr, depth - 1);
+    }
+}
+
+/// @brief Counts the pointers of the valid inodes of a block of an inode table.
+/// @param block_num 
+static void count_table_refs(uint32_t block_num)
+{
+    uint8_t block[BLOCK_SIZE];
+    if (read_meta_block(block_num, block) != 0) {
+        refs_incomplete = 1;
+        return;
+    }
+
+    for (int i = 0; i < INODES_PER_BLOCK; ++i) {
+        uint8_t *inode = block + i * INODE_SIZE;
+        if (inode[INODE_STATUT] == INODE_VALID)
+            for_each_inode_root(inode, count_block_refs);
+    }
+}
+
+/// @brief Calls fn on every block pointed to by an inode, with its depth in the pointer tree.
+/// @param inode 
+/// @param fn 
+static void for_each_inode_root(const uint8_t *inode, void (*fn)(uint32_t block_num, int depth))
+{
+    uint32_t ptr;
+
+    // Direct
+    for (int i = 0; i < NB_DIRECT_BLOCKS; ++i) {
+        memcpy(&ptr, inode + INODE_DIRECT_OFFSET + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
+        if (ptr != 0)
+            fn(ptr, 0);
+    }
+
+    // Indirect1
+    memcpy(&ptr, inode + INODE_INDIRECT1_OFFSET, sizeof(uint32_t));
+    if (ptr != 0)
+        fn(ptr, 1);
+
+    // Indirect2
+    memcpy(&ptr, inode + INODE_INDIRECT2_OFFSET, sizeof(uint32_t));
+    if (ptr != 0)
+        fn(ptr, 2);
+}
+
+/// @brief Rebuilds the block reference counts from the inodes and the snapshots.
+/// @note This should be called after mounting the disk to ensure that all blocks are marked as used or free.
+static void rebuild_block_refs() 
+{
+    for (uint32_t i = 0; i < ssfs.superblock.nb_inode_blocks; ++i)
+        count_table_refs(ssfs.inode_start_block + i);
+
+    for (int s = 0; s < MAX_SNAPSHOTS; ++s) {
+        uint32_t root_num = ssfs.superblock.snapshots[s];
+        if (root_num == 0) continue;
+        count_block_refs(root_num, 0);
+
+        uint8_t root[BLOCK_SIZE];
+        if (read_meta_block(root_num, root) != 0) {
+            refs_incomplete = 1;
+            continue;
+        }
+
+        for (uint32_t i = 0; i < ssfs.superblock.nb_inode_blocks && i < MAX_SNAPSHOT_INODE_BLOCKS; ++i) {
+            uint32_t table;
+            memcpy(&table, root + SNAPSHOT_TABLE_OFFSET + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
+            if (table == 0) continue;
+            count_block_refs(table, 0);
+            count_table_refs(table);
+        }
+    }
+}
+
+/// @brief Loads the pointer block *slot into buffer so that it can be modified in place:
+/// a missing block is allocated, a shared block is copied to a new one (copy-on-write),
+/// the blocks it points to gaining a reference from the copy.
+/// @param slot pointer to the pointer block inside an inode or pointer block buffer
+/// @param buffer 
+/// @return 1 if *slot changed, 0 if not, a negative error code otherwise
+static int load_private_pointer_block(uint32_t *slot, uint8_t *buffer)
+{
+    if (*slot == 0) {
+        uint32_t block_num = allocate_block();
+        if (block_num == 0) return fs_EWRITE;
+        memset(buffer, 0, BLOCK_SIZE);
+        *slot = block_num;
+        return 1;
+    }
+
+    if (read_meta_block(*slot, buffer) != 0) return fs_EREAD;
+    if (block_refs[*slot] <= 1) return 0;
+
+    uint32_t copy = allocate_block();
+    if (copy == 0) return fs_EWRITE;
+    for (int i = 0; i < BLOCK_POINTERS_SIZE; ++i) {
+        uint32_t ptr;
+        memcpy(&ptr, buffer + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
+        if (ptr != 0)
+            take_ref(ptr, 0);
+    }
+    block_refs[*slot]--;
+    *slot = copy;
+    return 1;
+}
+
+/// @brief Loads the data block *slot into buffer so that it can be modified in place:
+/// a missing block is allocated, a shared block is copied to a new one (copy-on-write).
+/// @param slot pointer to the data block inside an inode or pointer block buffer
+/// @param buffer 
+/// @param overwrite 1 if the whole block is about to be overwritten, its contents are then not read
+/// @return 1 if *slot changed, 0 if not, a negative error code otherwise
+static int load_private_data_block(uint32_t *slot, uint8_t *buffer, int overwrite)
+{
+    if (*slot == 0) {
+        uint32_t block_num = allocate_block();
+        if (block_num == 0) return fs_EWRITE;
+        memset(buffer, 0, BLOCK_SIZE);
+        *slot = block_num;
+        return 1;
+    }
+
+    if (!overwrite && read_data_block(*slot, buffer) != 0) return fs_EREAD;
+    if (block_refs[*slot] <= 1) return 0;
+
+    uint32_t copy = allocate_block();
+    if (copy == 0) return fs_EWRITE;
+    block_refs[*slot]--;
+    *slot = copy;
+    return 1;
+}
+
+/// @brief Undoes load_private_data_block() when the new block could not be written:
+/// the new block is released and *slot points to old again, with its reference back.
+/// @param slot 
+/// @param old *slot before load_private_data_block(), 0 if there was no block
+static void drop_private_data_block(uint32_t *slot, uint32_t old)
+{
+    release_block(*slot, 0);
+    *slot = old;
+    if (old != 0) take_ref(old, 0);
+}
+
+/// @brief Makes a block and every block below it private to the file owning *slot,
+/// copying the shared ones.
+/// @param slot pointer to the block inside an inode or pointer block buffer
+/// @param depth 0 for a data block, 1 for an indirect block, 2 for a double-indirect block
+/// @return 1 if *slot changed, 0 if not, a negative error code otherwise
+static int unshare_block(uint32_t *slot, int depth)
+{
+    if (*slot == 0) return 0;
+
+    uint8_t block[BLOCK_SIZE];
+    if (depth == 0) {
+        if (*slot >= ssfs.superblock.nb_blocks || block_refs[*slot] <= 1) return 0;
+        uint32_t old = *slot;
+        int moved = load_private_data_block(slot, block, 0);
+        if (moved < 0) return moved;
+        if (write_data_block(*slot, block) == 0) return 1;
+        drop_private_data_block(slot, old);
+        return fs_EWRITE;
+    }
+
+    int moved = load_private_pointer_block(slot, block);
+    if (moved < 0) return moved;
+
+    // After an error, the copies made below are written all the same: their references
+    // are counted, and *slot may have changed
+    int dirty = moved;
+    int ret = 0;
+    for (int i = 0; i < BLOCK_POINTERS_SIZE && ret >= 0; ++i) {
+        ret = unshare_block((uint32_t *)(block + i * BLOCK_PTR_SIZE), depth - 1);
+        dirty |= ret != 0;
+    }
+    if (dirty && write_meta_block(*slot, block) != 0) return fs_EWRITE;
+    return ret < 0 ? ret : moved;
+}
+
+/// @brief Gives file inode_num a private copy of every block it shares with other files
+/// or snapshots.
+/// @param inode_num 
+/// @return 0 on success, a negative error code otherwise
+static int unshare_file(uint32_t inode_num)
+{
+    if (!(ssfs.superblock.features & SSFS_FEATURE_REFLINK)) return 0;
+
+    uint8_t block[BLOCK_SIZE];
+    uint8_t *inode = get_inode(inode_num, block);
+    if (!inode) return fs_EREAD;
+    if (inode[INODE_STATUT] != INODE_VALID) return 0;
+
+    int dirty = 0;
+    int ret = 0;
+    for (int i = 0; i <= NB_DIRECT_BLOCKS + 1 && ret >= 0; ++i) {
+        // Direct pointers, then indirect1 and indirect2, which follow them in the inode
+        int depth = i < NB_DIRECT_BLOCKS ? 0 : i - NB_DIRECT_BLOCKS + 1;
+        ret = unshare_block((uint32_t *)(inode + INODE_DIRECT_OFFSET + i * BLOCK_PTR_SIZE), depth);
+        dirty |= ret != 0;
+    }
+
+    // Saved even after an error, the copies made until then belong to the file
+    int block_num = ssfs.inode_start_block + inode_num / INODES_PER_BLOCK;
+    if (dirty && write_meta_block(block_num, block) != 0) return fs_EWRITE;
+    return ret < 0 ? ret : 0;
+}
+
+/// @brief Drops the references held by a snapshot and frees its root and inode blocks.
+/// @param root_num 
+/// @param root contents of the root block
+static void release_snapshot(uint32_t root_num, const uint8_t *root)
+{
+    uint32_t nb_blocks;
+    memcpy(&nb_blocks, root + SNAPSHOT_NB_BLOCKS_OFFSET, sizeof(uint32_t));
+    if (nb_blocks > MAX_SNAPSHOT_INODE_BLOCKS) nb_blocks = MAX_SNAPSHOT_INODE_BLOCKS;
+
+    for (uint32_t i = 0; i < nb_blocks; ++i) {
+        uint32_t table_num;
+        memcpy(&table_num, root + SNAPSHOT_TABLE_OFFSET + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
+        if (table_num == 0) continue;
+
+        uint8_t table[BLOCK_SIZE];
+        if (read_meta_block(table_num, table) == 0) {
+            for (int j = 0; j < INODES_PER_BLOCK; ++j)
+                if (table[j * INODE_SIZE + INODE_STATUT] == INODE_VALID)
+                    for_each_inode_root(table + j * INODE_SIZE, release_block);
+        }
+        release_block(table_num, 0);
+    }
+    release_block(root_num, 0);
+}
+
+/// @brief Gets the inode of a file in a snapshot.
+/// @param snapshot 
+/// @param inode_num 
+/// @param block_out 
+/// @return pointer to the inode in the block_out buffer, NULL if the snapshot does not exist
+static uint8_t *get_snapshot_inode(int snapshot, uint32_t inode_num, uint8_t *block_out)
+{
+    if (snapshot < 0 || snapshot >= MAX_SNAPSHOTS || ssfs.superblock.snapshots[snapshot] == 0)
+        return NULL;
+    if (read_meta_block(ssfs.superblock.snapshots[snapshot], block_out) != 0)
+        return NULL;
+
+    uint32_t nb_blocks, table_num;
+    uint32_t block_index = inode_num / INODES_PER_BLOCK;
+    memcpy(&nb_blocks, block_out + SNAPSHOT_NB_BLOCKS_OFFSET, sizeof(uint32_t));
+    if (block_index >= nb_blocks || block_index >= MAX_SNAPSHOT_INODE_BLOCKS)
+        return NULL;
+    memcpy(&table_num, block_out + SNAPSHOT_TABLE_OFFSET + block_index * BLOCK_PTR_SIZE, sizeof(uint32_t));
+
+    // Inode blocks without any file are not copied
+    if (table_num == 0)
+        memset(block_out, 0, BLOCK_SIZE);
+    else if (read_meta_block(table_num, block_out) != 0)
+        return NULL;
+
+    return block_out + (inode_num % INODES_PER_BLOCK) * INODE_SIZE;
+}
+
+/// @brief Reads len bytes from offset into the file described by an inode.
+/// @param inode 
+/// @param data 
+/// @param len 
+/// @param offset 
+/// @return the number of bytes read, or a negative error code (fs_ECORRUPT for a block
+/// that does not match its checksum)
+static int read_from_inode(const uint8_t *inode, uint8_t *data, int len, int offset)
+{
+    uint32_t size;
+    memcpy(&size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
+    if (offset >= (int)size) return 0;
 
-            data_block_ptr = (uint32_t *)(indirect_block + BLOCK_PTR_SIZE * (file_block_index - NB_DIRECT_BLOCKS));
-        }
+    int bytes_to_read = (len < (int)(size - offset)) ? len : (int)(size - offset);
+    if (inode[INODE_FLAGS] & INODE_FLAG_COMPRESSED)
+        return read_clusters(inode, data, bytes_to_read, offset);
+
+    int bytes_read = 0;
+    int current_offset = offset;
+
+    while (bytes_read < bytes_to_read) {
+        int file_block_index = current_offset / BLOCK_SIZE;
+        int inner_offset = current_offset % BLOCK_SIZE;
+
+        uint32_t data_block_num = 0;
+
+        // Direct blocks
+        if (file_block_index < NB_DIRECT_BLOCKS) {
+            memcpy(&data_block_num, inode + INODE_DIRECT_OFFSET + BLOCK_PTR_SIZE * file_block_index, sizeof(uint32_t));
+        } 
 
-        // Case 3: Indirect 2
+        // Indirect 1 blocks
+        else if (file_block_index < BLOCK_POINTERS_SIZE + NB_DIRECT_BLOCKS) {
+            uint32_t indirect1;
+            memcpy(&indirect1, inode + INODE_INDIRECT1_OFFSET, sizeof(uint32_t));
+            if (indirect1 == 0) break;
+
+            uint8_t indirect_block[BLOCK_SIZE];
+            int ret = read_meta_block(indirect1, indirect_block);
+            if (ret != 0)
+                return read_error(ret);
+
+            memcpy(&data_block_num, indirect_block + BLOCK_PTR_SIZE * (file_block_index - NB_DIRECT_BLOCKS), BLOCK_PTR_SIZE);
+        
+        } 
+        
+        // Indirect 2 blocks
         else {
-            int idx = file_block_index - (BLOCK_POINTERS_SIZE + NB_DIRECT_BLOCKS);
-            int outer = idx / BLOCK_POINTERS_SIZE;
-            int inner = idx % BLOCK_POINTERS_SIZE;
+            uint32_t indirect2;
+            memcpy(&indirect2, inode + INODE_INDIRECT2_OFFSET, sizeof(uint32_t));
+            if (indirect2 == 0) break;
 
-            uint32_t *indirect2_ptr = (uint32_t *)(inode + INODE_INDIRECT2_OFFSET);
-            if (*indirect2_ptr == 0) {
-                *indirect2_ptr = allocate_block();
-                if (*indirect2_ptr == 0) return -1;
-            }
+            uint8_t indirect2_block[BLOCK_SIZE];
+            int ret = read_meta_block(indirect2, indirect2_block);
+            if (ret != 0)
+                return read_error(ret);
 
-            if (vdisk_read(&ssfs.disk, *indirect2_ptr, dbl_indirect_block) != 0)
-                return fs_EREAD;
+            int idx = file_block_index - (BLOCK_POINTERS_SIZE + NB_DIRECT_BLOCKS);
+            int first_level = idx / BLOCK_POINTERS_SIZE;
+            int second_level = idx % BLOCK_POINTERS_SIZE;
 
-            uint32_t *intermediate_ptr = (uint32_t *)(dbl_indirect_block + BLOCK_PTR_SIZE * outer);
-            if (*intermediate_ptr == 0) {
-                *intermediate_ptr = allocate_block();
-                if (*intermediate_ptr == 0) return -1;
-                if(vdisk_write(&ssfs.disk, *indirect2_ptr, dbl_indirect_block) != 0)
-                    return fs_EWRITE;
-            }
+            uint32_t intermediate_block_num;
+            memcpy(&intermediate_block_num, indirect2_block + BLOCK_PTR_SIZE * first_level, sizeof(uint32_t));
+            if (intermediate_block_num == 0) break;
 
-            if (vdisk_read(&ssfs.disk, *intermediate_ptr, inner_indirect_block) != 0)
-                return fs_EREAD;
+            uint8_t intermediate_block[BLOCK_SIZE];
+            ret = read_meta_block(intermediate_block_num, intermediate_block);
+            if (ret != 0)
+                return read_error(ret);
 
-            data_block_ptr = (uint32_t *)(inner_indirect_block + BLOCK_PTR_SIZE * inner);
+            memcpy(&data_block_num, intermediate_block + BLOCK_PTR_SIZE * second_level, sizeof(uint32_t));
         }
 
-        // Allocate data block if needed
-        if (*data_block_ptr == 0) {
-            *data_block_ptr = allocate_block();
-            if (*data_block_ptr == 0) return fs_EWRITE;
+        if (data_block_num == 0) {
+            int chunk = (BLOCK_SIZE - inner_offset < bytes_to_read - bytes_read)
+                      ? BLOCK_SIZE - inner_offset
+                      : bytes_to_read - bytes_read;
+            memset(data + bytes_read, 0, chunk); // simulate sparse
+            bytes_read += chunk;
+            current_offset += chunk;
+            continue;
         }
-
-        // Write actual data
+        
+        // An unreadable or corrupted block ends the read, and fails it if it is the first
         uint8_t data_block[BLOCK_SIZE];
-        if(vdisk_read(&ssfs.disk, *data_block_ptr, data_block) != 0)
-            return -1;
+        int ret = read_data_block(data_block_num, data_block);
+        if (ret != 0)
+            return bytes_read > 0 ? bytes_read : read_error(ret);
 
         int bytes_available = BLOCK_SIZE - inner_offset;
-        int bytes_remaining = len - bytes_written;
+        int bytes_remaining = bytes_to_read - bytes_read;
         int chunk = (bytes_available < bytes_remaining) ? bytes_available : bytes_remaining;
 
-        memcpy(data_block + inner_offset, data + bytes_written, chunk);
-        if(vdisk_write(&ssfs.disk, *data_block_ptr, data_block) != 0)
-            return fs_EWRITE;
-        
-        // Write back modified pointer block if indirect
-        if (file_block_index >= NB_DIRECT_BLOCKS && file_block_index < BLOCK_POINTERS_SIZE + NB_DIRECT_BLOCKS) {
-            // Indirect1
-            uint32_t indirect1 = *(uint32_t *)(inode + INODE_INDIRECT1_OFFSET);
-            if (vdisk_write(&ssfs.disk, indirect1, indirect_block) != 0)
-                return fs_EWRITE;
-        }
-        else if (file_block_index >= BLOCK_POINTERS_SIZE + NB_DIRECT_BLOCKS) {
-            // Indirect2
-            int idx = file_block_index - (BLOCK_POINTERS_SIZE + NB_DIRECT_BLOCKS);
-            int outer = idx / BLOCK_POINTERS_SIZE;
+        memcpy(data + bytes_read, data_block + inner_offset, chunk);
 
-            uint32_t *indirect2_ptr = (uint32_t *)(inode + INODE_INDIRECT2_OFFSET);
-            uint32_t *intermediate_ptr = (uint32_t *)(dbl_indirect_block + BLOCK_PTR_SIZE * outer);
+        bytes_read += chunk;
+        current_offset += chunk;
+    }
 
-            if (vdisk_write(&ssfs.disk, *intermediate_ptr, inner_indirect_block) != 0)
-                return fs_EWRITE;
-            if (vdisk_write(&ssfs.disk, *indirect2_ptr, dbl_indirect_block) != 0)
-                return fs_EWRITE;
-        }
+    return bytes_read;
+}
 
-        bytes_written += chunk;
-        current_offset += chunk;
+/// @brief Loads the pointer blocks leading to the pointer of a block of a file, making
+/// them private to the file (see load_private_pointer_block()).
+/// @param inode 
+/// @param file_block_index 
+/// @param path receives the pointer blocks, to pass to close_block_path()
+/// @param slot receives the pointer to the block, inside the inode or path
+/// @return 0 on success, a negative error code otherwise (the pointer blocks copied
+/// until then are written, the inode must be saved)
+static int open_block_path(uint8_t *inode, int file_block_index, BlockPath *path, uint32_t **slot)
+{
+    path->intermediate_ptr = NULL;
+    path->indirect_dirty = 0;
+    path->dbl_indirect_dirty = 0;
+    path->inner_indirect_dirty = 0;
+
+    // Case 1: Direct blocks
+    if (file_block_index < NB_DIRECT_BLOCKS) {
+        *slot = (uint32_t *)(inode + INODE_DIRECT_OFFSET + BLOCK_PTR_SIZE * file_block_index);
+        return 0;
     }
 
-    // Update file size if needed
-    uint32_t new_size = offset + bytes_written;
-    if (new_size > file_size) {
-        memcpy(inode + INODE_SIZE_OFFSET, &new_size, sizeof(uint32_t));
+    // Case 2: Indirect 1
+    if (file_block_index < BLOCK_POINTERS_SIZE + NB_DIRECT_BLOCKS) {
+        uint32_t *indirect_ptr = (uint32_t *)(inode + INODE_INDIRECT1_OFFSET);
+        path->indirect_dirty = load_private_pointer_block(indirect_ptr, path->indirect);
+        if (path->indirect_dirty < 0) return path->indirect_dirty;
+
+        *slot = (uint32_t *)(path->indirect + BLOCK_PTR_SIZE * (file_block_index - NB_DIRECT_BLOCKS));
+        return 0;
     }
 
-    // Save updated inode block
-    int block_num = ssfs.inode_start_block + (inode_num / INODES_PER_BLOCK);
-    return vdisk_write(&ssfs.disk, block_num, inode_block) == 0 ? bytes_written : -1;
+    // Case 3: Indirect 2
+    int idx = file_block_index - (BLOCK_POINTERS_SIZE + NB_DIRECT_BLOCKS);
+    int outer = idx / BLOCK_POINTERS_SIZE;
+    int inner = idx % BLOCK_POINTERS_SIZE;
+
+    uint32_t *indirect2_ptr = (uint32_t *)(inode + INODE_INDIRECT2_OFFSET);
+    path->dbl_indirect_dirty = load_private_pointer_block(indirect2_ptr, path->dbl_indirect);
+    if (path->dbl_indirect_dirty < 0) return path->dbl_indirect_dirty;
+
+    path->intermediate_ptr = (uint32_t *)(path->dbl_indirect + BLOCK_PTR_SIZE * outer);
+    int moved = load_private_pointer_block(path->intermediate_ptr, path->inner_indirect);
+    if (moved < 0) {
+        // A copy of the indirect2 block is kept, the references it holds are counted
+        uint32_t indirect2 = *indirect2_ptr;
+        if (path->dbl_indirect_dirty && write_meta_block(indirect2, path->dbl_indirect) != 0)
+            return fs_EWRITE;
+        return moved;
+    }
+    path->inner_indirect_dirty = moved;
+    path->dbl_indirect_dirty |= moved;
+
+    *slot = (uint32_t *)(path->inner_indirect + BLOCK_PTR_SIZE * inner);
+    return 0;
 }
 
-int create()
+/// @brief Writes back the pointer blocks of a path that changed, children first.
+/// The inode itself is left to the caller.
+/// @param inode 
+/// @param file_block_index 
+/// @param path 
+/// @param slot_changed 1 if the pointer returned by open_block_path() was modified
+/// @return 0 on success, fs_EWRITE otherwise
+static int close_block_path(uint8_t *inode, int file_block_index, BlockPath *path, int slot_changed)
 {
-    if (!ssfs.is_mounted) return fs_EMOUNT;
+    if (slot_changed && file_block_index >= BLOCK_POINTERS_SIZE + NB_DIRECT_BLOCKS)
+        path->inner_indirect_dirty = 1;
+    else if (slot_changed && file_block_index >= NB_DIRECT_BLOCKS)
+        path->indirect_dirty = 1;
+
+    if (path->indirect_dirty) {
+        uint32_t indirect1 = *(uint32_t *)(inode + INODE_INDIRECT1_OFFSET);
+        if (write_meta_block(indirect1, path->indirect) != 0)
+            return fs_EWRITE;
+    }
+    if (path->inner_indirect_dirty && write_meta_block(*path->intermediate_ptr, path->inner_indirect) != 0)
+        return fs_EWRITE;
+    if (path->dbl_indirect_dirty) {
+        uint32_t indirect2 = *(uint32_t *)(inode + INODE_INDIRECT2_OFFSET);
+        if (write_meta_block(indirect2, path->dbl_indirect) != 0)
+            return fs_EWRITE;
+    }
+    return 0;
+}
 
-    for (uint32_t inode_num = 0; inode_num < ssfs.nb_inodes; ++inode_num) {
-        uint8_t block[BLOCK_SIZE];
-        uint8_t *inode = get_inode(inode_num, block);
-        if (!inode)
-            return fs_EREAD;
+/// @brief Writes len bytes at offset into a file stored block by block.
+/// @param inode modified in place, saved by the caller even after an error: the
+/// pointer blocks copied on write until then hold the references of the file
+/// @param data 
+/// @param len 
+/// @param offset 
+/// @return the number of bytes written, or a negative error code
+static int write_blocks(uint8_t *inode, const uint8_t *data, int len, int offset)
+{
+    int bytes_written = 0;
+    int current_offset = offset;
 
-        if (inode[INODE_STATUT] != INODE_VALID) {
-            inode[INODE_STATUT] = (uint8_t)INODE_VALID;
-            memset(inode + 1, 0, INODE_SIZE - 1);
+    // The dedup index is built on the first write after mount; without it, no dedup
+    if ((ssfs.superblock.features & SSFS_FEATURE_DEDUP) && !dedup_index.entries)
+        build_dedup_index();
 
-            int block_index = inode_num / INODES_PER_BLOCK;
-            int block_num = ssfs.inode_start_block + block_index;
-            if (vdisk_write(&ssfs.disk, block_num, block) != 0)
-                return fs_EWRITE;
+    while (bytes_written < len) {
+        int file_block_index = current_offset / BLOCK_SIZE;
+        int inner_offset = current_offset % BLOCK_SIZE;
 
-            return inode_num;
+        int bytes_available = BLOCK_SIZE - inner_offset;
+        int bytes_remaining = len - bytes_written;
+        int chunk = (bytes_available < bytes_remaining) ? bytes_available : bytes_remaining;
+
+        BlockPath path;
+        uint32_t *data_block_ptr;
+        int ret = open_block_path(inode, file_block_index, &path, &data_block_ptr);
+        if (ret < 0) return ret;
+
+        // A whole block already stored in the volume is shared rather than written
+        uint64_t hash = 0;
+        if (dedup_index.entries && chunk == BLOCK_SIZE) {
+            hash = block_hash(data + bytes_written);
+            uint32_t duplicate = find_duplicate(data + bytes_written, hash);
+            if (duplicate != 0) {
+                int moved = duplicate != *data_block_ptr;
+                if (moved) {
+                    take_ref(duplicate, 0);
+                    release_block(*data_block_ptr, 0);
+                    *data_block_ptr = duplicate;
+                }
+                ret = close_block_path(inode, file_block_index, &path, moved);
+                if (ret < 0) return ret;
+                bytes_written += chunk;
+                current_offset += chunk;
+                continue;
+            }
         }
-    }
 
-    return -1; // No free inode found
-}
+        // Blocks written in order are allocated in order, starting after the previous block
+        if (*data_block_ptr == 0 && alloc_cursor.goal == 0) {
+            uint32_t previous = previous_block(file_block_index, data_block_ptr);
+            if (previous != 0) alloc_cursor.goal = previous + 1;
+        }
 
-//=============================================================================
-//========================== SSFS STATIC FUNCTIONS ============================
-//=============================================================================
+        // Allocate or unshare the data block, its old contents are not needed if it is overwritten
+        uint8_t data_block[BLOCK_SIZE];
+        uint32_t old = *data_block_ptr;
+        int moved = load_private_data_block(data_block_ptr, data_block, chunk == BLOCK_SIZE);
+        if (moved < 0) {
+            close_block_path(inode, file_block_index, &path, 0);
+            return moved;
+        }
 
-/// @brief Gets the inode of a file.
-/// @param inode_num 
-/// @param block_out 
-/// @return pointer to the inode in the block_out buffer
-static uint8_t* get_inode(uint32_t inode_num, uint8_t *block_out) 
-{
-    int block_index = inode_num / INODES_PER_BLOCK;
-    int offset = inode_num % INODES_PER_BLOCK;
-    int block_num = ssfs.inode_start_block + block_index;
+        memcpy(data_block + inner_offset, data + bytes_written, chunk);
+        if(write_data_block(*data_block_ptr, data_block) != 0) {
+            if (moved) drop_private_data_block(data_block_ptr, old);
+            close_block_path(inode, file_block_index, &path, 0);
+            return fs_EWRITE;
+        }
+        if (dedup_index.entries)
+            dedup_insert(*data_block_ptr, hash ? hash : block_hash(data_block));
 
-    if (vdisk_read(&ssfs.disk, block_num, block_out) != 0)
-        return NULL;
+        ret = close_block_path(inode, file_block_index, &path, moved);
+        if (ret < 0) return ret;
 
-    return block_out + (offset * INODE_SIZE);
+        bytes_written += chunk;
+        current_offset += chunk;
+    }
+
+    return bytes_written;
 }
 
-/// @brief Frees a block by writing zeros to it.
-/// @param block_num 
-/// @return 0 on success, -1 on error
-static int free_block(uint32_t block_num) 
+/// @brief Hash of the contents of a block, never 0 (the empty entry of the dedup index).
+/// @param buffer 
+/// @return 
+static uint64_t block_hash(const uint8_t *buffer)
 {
-    uint8_t zero[BLOCK_SIZE] = {0};
-    return vdisk_write(&ssfs.disk, block_num, zero);
+    uint64_t hash = xxh64(buffer, BLOCK_SIZE, 0);
+    return hash ? hash : 1;
 }
 
-/// @brief Allocates a free block by writing zeros to it.
-/// @return The block number of the allocated block, or 0 if no free block is found.
-uint32_t allocate_block() 
+/// @brief Builds the dedup index from the data blocks of the files of the mounted volume.
+/// @return 0 on success, fs_EMOUNT if out of memory
+static int build_dedup_index()
 {
-    uint8_t block[BLOCK_SIZE];
-
-    for (uint32_t i = ssfs.data_start_block; i < ssfs.superblock.nb_blocks; ++i) {
-        if (block_used[i]) continue;
-
-        if (vdisk_read(&ssfs.disk, i, block) != 0) {
-            fprintf(stderr, "vdisk_read failed on block %u\n", i);
-            return 0;
-        }
-
-        int is_free = 1;
-        for (int j = 0; j < BLOCK_SIZE; ++j) {
-            if (block[j] != 0) {
-                is_free = 0;
-                break;
-            }
-        }
+    // Twice as many entries as blocks, rounded up to a power of two
+    uint32_t nb_entries = 1;
+    while (nb_entries < 2 * ssfs.superblock.nb_blocks) nb_entries <<= 1;
+
+    dedup_index.entries = calloc(nb_entries, sizeof(DedupEntry));
+    dedup_index.indexed = calloc((ssfs.superblock.nb_blocks + 63) / 64, sizeof(uint64_t));
+    dedup_index.mask = nb_entries - 1;
+    if (!dedup_index.entries || !dedup_index.indexed) {
+        free_dedup_index();
+        return fs_EMOUNT;
+    }
 
-        if (is_free) {
-            block_used[i] = 1;
-            return i;
+    for (uint32_t i = 0; i < ssfs.superblock.nb_inode_blocks; ++i) {
+        uint8_t block[BLOCK_SIZE];
+        if (read_meta_block(ssfs.inode_start_block + i, block) != 0) continue;
+        for (int j = 0; j < INODES_PER_BLOCK; ++j) {
+            const uint8_t *inode = block + j * INODE_SIZE;
+            if (inode[INODE_STATUT] == INODE_VALID && !(inode[INODE_FLAGS] & INODE_FLAG_COMPRESSED))
+                for_each_inode_root(inode, index_blocks);
         }
     }
-
-    printf("No free block available!\n");
     return 0;
 }
 
-/// @brief Clears an indirect1 block by freeing all its data blocks.
+/// @brief Drops the dedup index.
+static void free_dedup_index()
+{
+    free(dedup_index.entries);
+    free(dedup_index.indexed);
+    memset(&dedup_index, 0, sizeof(DedupIndex));
+}
+
+/// @brief Adds the data blocks below a block of a file to the dedup index.
 /// @param block_num 
-static void clear_indirect_block(uint32_t block_num) 
+/// @param depth 0 for a data block, 1 for an indirect block, 2 for a double-indirect block
+static void index_blocks(uint32_t block_num, int depth)
 {
+    if (block_num < ssfs.data_start_block || block_num >= ssfs.data_end_block) return;
+
     uint8_t block[BLOCK_SIZE];
-    if (vdisk_read(&ssfs.disk, block_num, block) != 0) return;
-    for (int i = 0; i < BLOCK_POINTERS_SIZE; i++) {
+    if (depth == 0) {
+        // Shared blocks are reached once per file
+        // A block whose contents are indexed already is left for dedup_file() to share
+        if (dedup_index.indexed[block_num / 64] & ((uint64_t)1 << (block_num % 64))) return;
+        if (read_data_block(block_num, block) != 0) return;
+        uint64_t hash = block_hash(block);
+        if (find_duplicate(block, hash) == 0)
+            dedup_insert(block_num, hash);
+        return;
+    }
+
+    if (read_meta_block(block_num, block) != 0) return;
+    for (int i = 0; i < BLOCK_POINTERS_SIZE; ++i) {
         uint32_t ptr;
         memcpy(&ptr, block + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
-        if (ptr != 0) {
-            free_block(ptr);
-        }
+        index_blocks(ptr, depth - 1);
     }
-    free_block(block_num);
 }
 
-/// @brief Clears a indirect2 block by freeing all its data blocks.
+/// @brief Records that a data block holds contents of the given hash.
 /// @param block_num 
-static void clear_double_indirect_block(uint32_t block_num) 
+/// @param hash 
+static void dedup_insert(uint32_t block_num, uint64_t hash)
 {
-    uint8_t outer[BLOCK_SIZE];
-    if (vdisk_read(&ssfs.disk, block_num, outer) != 0) return;
-    for (int i = 0; i < BLOCK_POINTERS_SIZE; i++) {
-        uint32_t indirect_block_num;
-        memcpy(&indirect_block_num, outer + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
-        if (indirect_block_num != 0) {
-            clear_indirect_block(indirect_block_num);
+    DedupEntry *victim = &dedup_index.entries[hash & dedup_index.mask];
+    for (uint32_t i = 0; i < DEDUP_PROBES; ++i) {
+        DedupEntry *entry = &dedup_index.entries[(hash + i) & dedup_index.mask];
+        if (entry->hash == 0 || entry->hash == hash) {
+            victim = entry;
+            break;
         }
     }
-    free_block(block_num);
+    victim->hash = hash;
+    victim->block = block_num;
+    dedup_index.indexed[block_num / 64] |= (uint64_t)1 << (block_num % 64);
 }
 
-/// @brief Gets the size of the virtual disk.
-/// @param disk 
-/// @return The size of the disk in blocks.
-static uint32_t get_vdisk_size(DISK *disk) 
+/// @brief Looks for a data block holding the same contents as buffer. Stale entries
+/// (blocks freed or rewritten since) and hash collisions are skipped, only an empty
+/// entry ends the probe.
+/// @param buffer 
+/// @param hash block_hash() of buffer
+/// @return the block, after comparing its contents, or 0 if there is none
+static uint32_t find_duplicate(const uint8_t *buffer, uint64_t hash)
 {
-    long current = ftell(disk->fp);
-    fseek(disk->fp, 0, SEEK_END);
-    long size_bytes = ftell(disk->fp);
-    fseek(disk->fp, current, SEEK_SET); // Restore original position
-    return (uint32_t)(size_bytes / BLOCK_SIZE);
+    for (uint32_t i = 0; i < DEDUP_PROBES; ++i) {
+        const DedupEntry *entry = &dedup_index.entries[(hash + i) & dedup_index.mask];
+        if (entry->hash == 0) return 0;
+        if (entry->hash != hash) continue;
+
+        uint32_t block_num = entry->block;
+        if (!(dedup_index.indexed[block_num / 64] & ((uint64_t)1 << (block_num % 64)))) continue;
+        if (block_refs[block_num] == 0) continue;
+
+        uint8_t block[BLOCK_SIZE];
+        if (read_data_block(block_num, block) != 0 || memcmp(block, buffer, BLOCK_SIZE) != 0)
+            continue;
+        return block_num;
+    }
+    return 0;
 }
 
-/// @brief Marks a block as used.
-/// @param block_num 
-static void mark_block_used(uint32_t block_num) 
+/// @brief Gets the data block of a file, without modifying anything.
+/// @param inode 
+/// @param file_block_index 
+/// @param block_num receives the block, 0 for a hole
+/// @return 0 on success, fs_EREAD otherwise
+static int get_file_block(const uint8_t *inode, int file_block_index, uint32_t *block_num)
 {
-    if (block_num < MAX_BLOCKS)
-        block_used[block_num] = 1;
+    uint8_t block[BLOCK_SIZE];
+    uint32_t ptr;
+
+    if (file_block_index < NB_DIRECT_BLOCKS) {
+        memcpy(block_num, inode + INODE_DIRECT_OFFSET + BLOCK_PTR_SIZE * file_block_index, sizeof(uint32_t));
+        return 0;
+    }
+
+    *block_num = 0;
+    int idx = file_block_index - NB_DIRECT_BLOCKS;
+    if (idx < BLOCK_POINTERS_SIZE) {
+        memcpy(&ptr, inode + INODE_INDIRECT1_OFFSET, sizeof(uint32_t));
+    } else {
+        idx -= BLOCK_POINTERS_SIZE;
+        memcpy(&ptr, inode + INODE_INDIRECT2_OFFSET, sizeof(uint32_t));
+        if (ptr == 0) return 0;
+        if (read_meta_block(ptr, block) != 0) return fs_EREAD;
+        memcpy(&ptr, block + BLOCK_PTR_SIZE * (idx / BLOCK_POINTERS_SIZE), sizeof(uint32_t));
+        idx %= BLOCK_POINTERS_SIZE;
+    }
+    if (ptr == 0) return 0;
+    if (read_meta_block(ptr, block) != 0) return fs_EREAD;
+    memcpy(block_num, block + BLOCK_PTR_SIZE * idx, sizeof(uint32_t));
+    return 0;
 }
 
-/// @brief Marks all blocks in an indirect block as used.
-/// @param block_num 
-static void mark_indirect_blocks(uint32_t block_num) 
+// A compressed file is stored in clusters of CLUSTER_BLOCKS blocks, cluster c using the
+// pointers of file blocks c * CLUSTER_BLOCKS and up; clusters never straddle a pointer
+// block (CLUSTER_BLOCKS divides both NB_DIRECT_BLOCKS and BLOCK_POINTERS_SIZE). A cluster
+// whose LZ4 encoding saves at least one block is stored in the first blocks, its last
+// pointer holding CLUSTER_COMPRESSED | the compressed length; others are stored as is.
+
+/// @brief Gets the pointers of a cluster of a compressed file.
+/// @param inode 
+/// @param cluster 
+/// @param slots receives CLUSTER_BLOCKS pointers, 0 for holes
+/// @return 0 on success, a negative error code otherwise (see read_error())
+static int get_cluster_slots(const uint8_t *inode, int cluster, uint32_t *slots)
 {
-    mark_block_used(block_num);
-
+    int file_block_index = cluster * CLUSTER_BLOCKS;
     uint8_t block[BLOCK_SIZE];
-    if (vdisk_read(&ssfs.disk, block_num, block) != 0)
-        return;
+    uint32_t ptr;
+    int ret;
 
-    for (int i = 0; i < BLOCK_POINTERS_SIZE; ++i) {
-        uint32_t ptr;
-        memcpy(&ptr, block + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
-        if (ptr != 0)
-            mark_block_used(ptr);
+    if (file_block_index < NB_DIRECT_BLOCKS) {
+        memcpy(slots, inode + INODE_DIRECT_OFFSET + BLOCK_PTR_SIZE * file_block_index, CLUSTER_BLOCKS * BLOCK_PTR_SIZE);
+        return 0;
+    }
+
+    memset(slots, 0, CLUSTER_BLOCKS * BLOCK_PTR_SIZE);
+    int idx = file_block_index - NB_DIRECT_BLOCKS;
+    if (idx < BLOCK_POINTERS_SIZE) {
+        memcpy(&ptr, inode + INODE_INDIRECT1_OFFSET, sizeof(uint32_t));
+    } else {
+        idx -= BLOCK_POINTERS_SIZE;
+        memcpy(&ptr, inode + INODE_INDIRECT2_OFFSET, sizeof(uint32_t));
+        if (ptr == 0) return 0;
+        if ((ret = read_meta_block(ptr, block)) != 0) return read_error(ret);
+        memcpy(&ptr, block + BLOCK_PTR_SIZE * (idx / BLOCK_POINTERS_SIZE), sizeof(uint32_t));
+        idx %= BLOCK_POINTERS_SIZE;
     }
+
+    if (ptr == 0) return 0;
+    if ((ret = read_meta_block(ptr, block)) != 0) return read_error(ret);
+    memcpy(slots, block + BLOCK_PTR_SIZE * idx, CLUSTER_BLOCKS * BLOCK_PTR_SIZE);
+    return 0;
 }
 
-/// @brief Marks all blocks in a double indirect block as used.
-/// @param block_num 
-static void mark_double_indirect_blocks(uint32_t block_num) 
+/// @brief Reads the plain contents of a cluster. A compressed cluster is read and
+/// decoded whole, only the blocks overlapping [from, to) of other clusters are read.
+/// @param slots pointers of the cluster
+/// @param plain receives CLUSTER_SIZE bytes, holes reading as zeros
+/// @param from first byte needed
+/// @param to end of the bytes needed
+/// @return 0 on success, a negative error code otherwise (see read_error())
+static int read_cluster(const uint32_t *slots, uint8_t *plain, int from, int to)
 {
-    mark_block_used(block_num);
+    uint32_t last = slots[CLUSTER_BLOCKS - 1];
+    int ret;
+    if (last & CLUSTER_COMPRESSED) {
+        int stored = (int)(last & ~CLUSTER_COMPRESSED);
+        if (stored > (CLUSTER_BLOCKS - 1) * BLOCK_SIZE) return fs_EREAD;
+
+        uint8_t packed[(CLUSTER_BLOCKS - 1) * BLOCK_SIZE];
+        for (int i = 0; i * BLOCK_SIZE < stored; ++i) {
+            if (slots[i] == 0) return fs_EREAD;
+            if ((ret = read_data_block(slots[i], packed + i * BLOCK_SIZE)) != 0) return read_error(ret);
+        }
 
-    uint8_t outer[BLOCK_SIZE];
-    if (vdisk_read(&ssfs.disk, block_num, outer) != 0)
-        return;
+        int n = lz4_decompress_block(packed, stored, plain, CLUSTER_SIZE);
+        if (n < 0) return fs_EREAD;
+        memset(plain + n, 0, CLUSTER_SIZE - n);
+        return 0;
+    }
 
-    for (int i = 0; i < BLOCK_POINTERS_SIZE; ++i) {
-        uint32_t intermediate;
-        memcpy(&intermediate, outer + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
-        if (intermediate == 0) continue;
+    for (int i = from / BLOCK_SIZE; i * BLOCK_SIZE < to; ++i) {
+        if (slots[i] == 0)
+            memset(plain + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+        else if ((ret = read_data_block(slots[i], plain + i * BLOCK_SIZE)) != 0)
+            return read_error(ret);
+    }
+    return 0;
+}
 
-        mark_block_used(intermediate);
+/// @brief Stores the first used bytes of a cluster, compressed if that saves at least
+/// one block. Private blocks of the cluster are rewritten in place, shared ones are
+/// replaced and blocks no longer needed are released. Every new block is allocated
+/// before anything is written and the old blocks are released last, so that a full
+/// volume leaves the cluster as it was.
+/// @param slots pointers of the cluster, updated
+/// @param plain CLUSTER_SIZE bytes, zero past used
+/// @param used 
+/// @return 1 if slots changed, 0 if not, a negative error code otherwise (slots unchanged)
+static int store_cluster(uint32_t *slots, uint8_t *plain, int used)
+{
+    uint8_t packed[CLUSTER_SIZE];
+    int stored = lz4_compress_block(plain, used, packed, (CLUSTER_BLOCKS - 1) * BLOCK_SIZE);
+    int nb_blocks = (stored + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int raw_blocks = (used + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    uint8_t *src = packed;
+    uint32_t last = CLUSTER_COMPRESSED | (uint32_t)stored;
+    if (stored == 0 || nb_blocks >= raw_blocks) {
+        src = plain;
+        nb_blocks = raw_blocks;
+        last = 0;
+    } else {
+        memset(packed + stored, 0, nb_blocks * BLOCK_SIZE - stored);
+    }
 
-        uint8_t inner[BLOCK_SIZE];
-        if (vdisk_read(&ssfs.disk, intermediate, inner) != 0)
-            continue;
+    uint32_t before[CLUSTER_BLOCKS], after[CLUSTER_BLOCKS];
+    for (int i = 0; i < CLUSTER_BLOCKS; ++i) {
+        before[i] = (slots[i] & CLUSTER_COMPRESSED) ? 0 : slots[i];
+        after[i] = 0;
+    }
 
-        for (int j = 0; j < BLOCK_POINTERS_SIZE; ++j) {
-            uint32_t data_ptr;
-            memcpy(&data_ptr, inner + j * BLOCK_PTR_SIZE, sizeof(uint32_t));
-            if (data_ptr != 0)
-                mark_block_used(data_ptr);
+    int ret = 0;
+    for (int i = 0; i < nb_blocks && ret == 0; ++i) {
+        uint32_t old = before[i];
+        after[i] = old;
+        if (old == 0 || old >= ssfs.superblock.nb_blocks || block_refs[old] > 1) {
+            after[i] = allocate_block();
+            if (after[i] == 0) ret = fs_EWRITE;
         }
     }
+    for (int i = 0; i < nb_blocks && ret == 0; ++i)
+        if (write_data_block(after[i], src + i * BLOCK_SIZE) != 0)
+            ret = fs_EWRITE;
+    if (ret < 0) {
+        for (int i = 0; i < nb_blocks; ++i)
+            if (after[i] != 0 && after[i] != before[i])
+                release_block(after[i], 0);
+        return ret;
+    }
+
+    int changed = 0;
+    if (last != 0) after[CLUSTER_BLOCKS - 1] = last;
+    for (int i = 0; i < CLUSTER_BLOCKS; ++i) {
+        changed |= slots[i] != after[i];
+        slots[i] = after[i];
+    }
+    for (int i = 0; i < CLUSTER_BLOCKS; ++i)
+        if (before[i] != 0 && (i >= nb_blocks || after[i] != before[i]))
+            release_block(before[i], 0);
+    return changed;
 }
 
-/// @brief Rebuilds the block usage information from inodes.
-/// @note This should be called after mounting the disk to ensure that all blocks are marked as used or free.
-static void rebuild_block_usage_from_inodes() 
+/// @brief Reads len bytes (within the file size) at offset from a compressed file.
+/// @param inode 
+/// @param data 
+/// @param len 
+/// @param offset 
+/// @return the number of bytes read, or a negative error code
+static int read_clusters(const uint8_t *inode, uint8_t *data, int len, int offset)
 {
-    uint8_t inode_block[BLOCK_SIZE];
-    for (uint32_t inode_num = 0; inode_num < ssfs.nb_inodes; ++inode_num) {
-        uint8_t *inode = get_inode(inode_num, inode_block);
-        if (!inode || inode[INODE_STATUT] != INODE_VALID)
-            continue;
+    int bytes_read = 0;
+    int current_offset = offset;
 
-        // Direct
-        for (int i = 0; i < NB_DIRECT_BLOCKS; ++i) {
-            uint32_t ptr;
-            memcpy(&ptr, inode + INODE_DIRECT_OFFSET + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
-            if (ptr != 0)
-                mark_block_used(ptr);
-        }
+    while (bytes_read < len) {
+        int cluster = current_offset / CLUSTER_SIZE;
+        int inner_offset = current_offset % CLUSTER_SIZE;
+        int chunk = (CLUSTER_SIZE - inner_offset < len - bytes_read) ? CLUSTER_SIZE - inner_offset : len - bytes_read;
 
-        // Indirect1
-        uint32_t indirect1;
-        memcpy(&indirect1, inode + INODE_INDIRECT1_OFFSET, sizeof(uint32_t));
-        if (indirect1 != 0)
-            mark_indirect_blocks(indirect1);
+        uint32_t slots[CLUSTER_BLOCKS];
+        uint8_t plain[CLUSTER_SIZE];
+        int ret = get_cluster_slots(inode, cluster, slots);
+        if (ret == 0) ret = read_cluster(slots, plain, inner_offset, inner_offset + chunk);
+        if (ret != 0) return ret;
 
-        // Indirect2
-        uint32_t indirect2;
-        memcpy(&indirect2, inode + INODE_INDIRECT2_OFFSET, sizeof(uint32_t));
-        if (indirect2 != 0)
-            mark_double_indirect_blocks(indirect2);
+        memcpy(data + bytes_read, plain + inner_offset, chunk);
+        bytes_read += chunk;
+        current_offset += chunk;
     }
+
+    return bytes_read;
 }
 
+/// @brief Writes len bytes at offset into a compressed file, cluster by cluster.
+/// @param inode modified in place, saved by the caller even after an error (see write_blocks())
+/// @param data 
+/// @param len 
+/// @param offset 
+/// @return the number of bytes written, or a negative error code
+static int write_clusters(uint8_t *inode, const uint8_t *data, int len, int offset)
+{
+    uint32_t file_size;
+    memcpy(&file_size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
+    uint32_t new_size = (uint32_t)(offset + len) > file_size ? (uint32_t)(offset + len) : file_size;
+
+    int bytes_written = 0;
+    int current_offset = offset;
+
+    while (bytes_written < len) {
+        int cluster = current_offset / CLUSTER_SIZE;
+        int inner_offset = current_offset % CLUSTER_SIZE;
+        int chunk = (CLUSTER_SIZE - inner_offset < len - bytes_written) ? CLUSTER_SIZE - inner_offset : len - bytes_written;
+        uint32_t cluster_end = new_size - (uint32_t)cluster * CLUSTER_SIZE;
+        int used = cluster_end < CLUSTER_SIZE ? (int)cluster_end : CLUSTER_SIZE;
+
+        BlockPath path;
+        uint32_t *slots;
+        int ret = open_block_path(inode, cluster * CLUSTER_BLOCKS, &path, &slots);
+        if (ret < 0) return ret;
+
+        // A cluster that is not overwritten up to its end is merged with its contents
+        uint8_t plain[CLUSTER_SIZE];
+        if (chunk < used) {
+            ret = read_cluster(slots, plain, 0, CLUSTER_SIZE);
+            if (ret != 0) {
+                close_block_path(inode, cluster * CLUSTER_BLOCKS, &path, 0);
+                return ret;
+            }
+        } else {
+            memset(plain, 0, CLUSTER_SIZE);
+        }
+        memcpy(plain + inner_offset, data + bytes_written, chunk);
 
+        int changed = store_cluster(slots, plain, used);
+        if (changed < 0) {
+            close_block_path(inode, cluster * CLUSTER_BLOCKS, &path, 0);
+            return changed;
+        }
 
+        ret = close_block_path(inode, cluster * CLUSTER_BLOCKS, &path, changed);
+        if (ret < 0) return ret;
 
+        bytes_written += chunk;
+        current_offset += chunk;
+    }
 
+    return bytes_written;
+}
@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include "hostio.h"
+
+// fs.c defines read() and write() for the whole program: descriptors are read and
+// written with readv() and writev() instead.
+
+#define HOST_BUFFER_SIZE (64 * 1024) // Bounce buffer of the copies the kernel cannot do
+
+/// @brief Whether a copy call failed because the kind of descriptors is not supported,
+/// rather than because of an I/O error: the next way of copying is then tried.
+/// @param err errno of the call
+/// @return
+static int unsupported(int err)
+{
+    return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+/// @brief Bytes left to read from fd, for a regular file.
+/// @param fd
+/// @return the size of the file past the offset of fd, -1 if fd is not a regular file
+int64_t host_remaining(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    off_t position = lseek(fd, 0, SEEK_CUR);
+    if (position < 0) return -1;
+    return st.st_size > position ? (int64_t)(st.st_size - position) : 0;
+}
+
+/// @brief Reads len bytes from fd at its offset, fewer only at the end of the input.
+/// @param fd
+/// @param buffer
+/// @param len
+/// @return the number of bytes read, -1 on error
+int64_t host_read(int fd, uint8_t *buffer, int64_t len)
+{
+    int64_t done = 0;
+    while (done < len) {
+        struct iovec iov = { buffer + done, (size_t)(len - done) };
+        ssize_t n = readv(fd, &iov, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+/// @brief Writes len bytes to fd at its offset.
+/// @param fd
+/// @param buffer
+/// @param len
+/// @return len, -1 on error
+int64_t host_write(int fd, const uint8_t *buffer, int64_t len)
+{
+    int64_t done = 0;
+    while (done < len) {
+        struct iovec iov = { (void *)(buffer + done), (size_t)(len - done) };
+        ssize_t n = writev(fd, &iov, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return done;
+}
+
+/// @brief Copies len bytes of the image, from offset, to fd at its offset: with
+/// copy_file_range() to a regular file, sendfile() to a pipe or a socket.
+/// @param image_fd
+/// @param offset
+/// @param fd
+/// @param len
+/// @return the number of bytes copied, fewer than len only past the end of the image,
+/// -1 on error
+int64_t host_copy_out(int image_fd, int64_t offset, int fd, int64_t len)
+{
+    int64_t done = 0;
+    loff_t from = offset;
+    while (done < len) {
+        ssize_t n = copy_file_range(image_fd, &from, fd, NULL, (size_t)(len - done), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && unsupported(errno)) break;
+        if (n < 0) return -1;
+        if (n == 0) return done;
+        done += n;
+    }
+
+    off_t position = (off_t)from;
+    while (done < len) {
+        ssize_t n = sendfile(fd, image_fd, &position, (size_t)(len - done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && unsupported(errno)) break;
+        if (n < 0) return -1;
+        if (n == 0) return done;
+        done += n;
+    }
+
+    uint8_t buffer[HOST_BUFFER_SIZE];
+    while (done < len) {
+        int64_t chunk = len - done < HOST_BUFFER_SIZE ? len - done : HOST_BUFFER_SIZE;
+        ssize_t n = pread(image_fd, buffer, (size_t)chunk, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        if (host_write(fd, buffer, n) != n) return -1;
+        done += n;
+    }
+    return done;
+}
+
+/// @brief Copies len bytes from fd, at its offset, into the image from offset: with
+/// copy_file_range() from a regular file, splice() from a pipe.
+/// @param fd
+/// @param image_fd
+/// @param offset
+/// @param len
+/// @return the number of bytes copied, fewer than len only at the end of the input,
+/// -1 on error
+int64_t host_copy_in(int fd, int image_fd, int64_t offset, int64_t len)
+{
+    int64_t done = 0;
+    loff_t to = offset;
+    while (done < len) {
+        ssize_t n = copy_file_range(fd, NULL, image_fd, &to, (size_t)(len - done), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && unsupported(errno)) break;
+        if (n < 0) return -1;
+        if (n == 0) return done;
+        done += n;
+    }
+
+    while (done < len) {
+        ssize_t n = splice(fd, NULL, image_fd, &to, (size_t)(len - done), SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && unsupported(errno)) break;
+        if (n < 0) return -1;
+        if (n == 0) return done;
+        done += n;
+    }
+
+    uint8_t buffer[HOST_BUFFER_SIZE];
+    while (done < len) {
+        int64_t chunk = len - done < HOST_BUFFER_SIZE ? len - done : HOST_BUFFER_SIZE;
+        int64_t n = host_read(fd, buffer, chunk);
+        if (n < 0) return -1;
+        for (int64_t written = 0; written < n; ) {
+            ssize_t w = pwrite(image_fd, buffer + written, (size_t)(n - written), offset + done + written);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return -1;
+            written += w;
+        }
+        done += n;
+        if (n < chunk) break;
+    }
+    return done;
+}
@@ -0,0 +1,13 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+
+// In-tree codec for the LZ4 block format (no frame, no checksum), used for the
+// compressed clusters of files (see set_compression() in fs.h). Blocks are
+// interchangeable with LZ4_compress_default() / LZ4_decompress_safe().
+
+int lz4_compress_block(const uint8_t *src, int len, uint8_t *dst, int capacity);
+int lz4_decompress_block(const uint8_t *src, int len, uint8_t *dst, int capacity);
+
+#endif
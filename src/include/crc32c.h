@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli), computed with the SSE4.2 crc32 instruction when the CPU has it,
+// with a slicing-by-8 table otherwise. The implementation is picked once, at load time.
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+const char *crc32c_impl_name();
+
+#endif
@@ -11,4 +11,8 @@ extern const int fs_ESYNC      ; // Sync error
 extern const int fs_EREAD      ; // Read error
 extern const int fs_EON        ; // Disk on error
 extern const int fs_EMOUNT     ; // Disk related mount error
+extern const int fs_ENOTSUP    ; // Feature not compiled in or not supported
+extern const int fs_ECORRUPT   ; // Block does not match its checksum
+extern const int fs_EBADF      ; // Handle not open
+extern const int fs_ENFILE     ; // Too many open files
 #endif
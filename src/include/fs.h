@@ -3,12 +3,61 @@
 
 #include <stdint.h>
 
+#define COMPRESSION_NONE 0 // Data blocks are stored as written
+#define COMPRESSION_LZ4  1 // Data is stored in LZ4 compressed clusters, see set_compression()
+
+/// @brief Layout of the blocks of a file on the disk, see file_layout()
+typedef struct {
+    uint32_t data_blocks;
+    uint32_t pointer_blocks; // Indirect and double-indirect blocks
+    uint32_t shared_blocks;  // Blocks shared with clones, snapshots or deduplicated files
+    uint32_t extents;        // Runs of consecutive data blocks
+} FileLayout;
+
+#define BATCH_STAT   0 // Operations of ssfs_batch(), run as the call of the same name
+#define BATCH_READ   1
+#define BATCH_WRITE  2
+#define BATCH_CREATE 3
+#define BATCH_DELETE 4
+
+/// @brief One operation of ssfs_batch()
+typedef struct {
+    int op;          // BATCH_*
+    int inode_num;   // Unused by BATCH_CREATE
+    uint8_t *data;   // Buffer of BATCH_READ and BATCH_WRITE
+    int len;
+    int offset;
+    int result;      // Set by ssfs_batch() to what the single call returns
+} BatchOp;
+
 int format(char *disk_name, int inodes);
 int stat(int inode_num);
 int mount(char *disk_name);
+int mount_nested(int inode_num);
 int unmount();
 int create();
 int delete(int inode_num);
 int read(int inode_num, uint8_t *data, int len, int offset);
 int write(int inode_num, uint8_t *data, int len, int offset);
+int clone_file(int inode_num);
+int snapshot_create();
+int snapshot_delete(int snapshot);
+int snapshot_stat(int snapshot, int inode_num);
+int snapshot_read(int snapshot, int inode_num, uint8_t *data, int len, int offset);
+int set_compression(int inode_num, int mode);
+int enable_checksums();
+int set_dedup(int enabled);
+int dedup_file(int inode_num);
+int preallocate(int inode_num, int len, int offset);
+int file_layout(int inode_num, FileLayout *layout);
+int defrag_file(int inode_num, int rate_kib);
+int ssfs_open(int inode_num);
+int ssfs_close(int handle);
+int ssfs_pread(int handle, uint8_t *data, int len, int offset);
+int ssfs_pwrite(int handle, uint8_t *data, int len, int offset);
+int ssfs_read(int handle, uint8_t *data, int len);
+int ssfs_write(int handle, uint8_t *data, int len);
+int ssfs_batch(BatchOp *ops, int count);
+int ssfs_export(int inode_num, int fd);
+int ssfs_import(int fd);
 #endif
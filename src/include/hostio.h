@@ -0,0 +1,18 @@
+#ifndef HOSTIO_H
+#define HOSTIO_H
+
+#include <stdint.h>
+
+// Transfers between the image of a volume and file descriptors of the host, used by
+// ssfs_export() and ssfs_import(). They live apart from fs.c, whose fs.h declares
+// read(), write() and stat() under the names of their POSIX counterparts.
+// The copies go through the kernel (copy_file_range(), sendfile() or splice()) when
+// the descriptors allow it, and through a small buffer otherwise.
+
+int64_t host_remaining(int fd);
+int64_t host_copy_out(int image_fd, int64_t offset, int fd, int64_t len);
+int64_t host_copy_in(int fd, int image_fd, int64_t offset, int64_t len);
+int64_t host_read(int fd, uint8_t *buffer, int64_t len);
+int64_t host_write(int fd, const uint8_t *buffer, int64_t len);
+
+#endif
@@ -10,12 +10,49 @@
 #define SUPERBLOCK_SECTOR 0 // The superblock is stored in the first block of the disk
 #define MAGIC_NUMBER_SIZE 16 // Size of the magic number
 
+#define INODE_VALID             1 // Valid inode status
+#define INODE_STATUT            0 // Offset for inode status in the inode structure
+#define INODE_FLAGS             1 // Offset for the INODE_FLAG_* flags in the inode structure
+#define INODE_SIZE_OFFSET       4 // Offset for file size in the inode structure
+#define INODE_DIRECT_OFFSET     8 // Offset for direct pointers in the inode structure
+#define INODE_INDIRECT1_OFFSET  24 // Offset for indirect1 pointer in the inode structure
+#define INODE_INDIRECT2_OFFSET  28 // Offset for indirect2 pointer in the inode structure
+#define BLOCK_POINTERS_SIZE     256 // Number of pointers in a block
+#define NB_DIRECT_BLOCKS        4 // Number of direct blocks in an inode
+#define BLOCK_PTR_SIZE          4 // Size of a block pointer
+#define MAX_FILE_BLOCKS (NB_DIRECT_BLOCKS + BLOCK_POINTERS_SIZE + BLOCK_POINTERS_SIZE * BLOCK_POINTERS_SIZE) // Largest file in blocks
+
+#define INODE_FLAG_COMPRESSED   0x1 // The file is stored in compressed clusters
+#define CLUSTER_BLOCKS          4 // Blocks per cluster of a compressed file
+#define CLUSTER_SIZE            (CLUSTER_BLOCKS * BLOCK_SIZE) // Bytes per cluster of a compressed file
+#define CLUSTER_COMPRESSED      0x80000000u // Flag of the last pointer of a compressed cluster, holding its compressed length
+
+#define SSFS_FEATURE_REFLINK    0x1 // Blocks may be shared by several files and snapshots
+#define SSFS_FEATURE_CHECKSUMS  0x2 // Blocks have a CRC32C in the checksum region
+#define SSFS_FEATURE_DEDUP      0x4 // write() shares the blocks already stored in the volume
+#define MAX_SNAPSHOTS           16 // Snapshot slots in the superblock
+
+// A snapshot root block holds the number of inode blocks and the creation time
+// (seconds since the epoch) of the snapshot, then one pointer per copied inode block.
+#define SNAPSHOT_NB_BLOCKS_OFFSET 0 // Offset of the number of inode blocks in a snapshot root
+#define SNAPSHOT_TIME_OFFSET      4 // Offset of the creation time in a snapshot root
+#define SNAPSHOT_TABLE_OFFSET     8 // Offset of the inode block pointers in a snapshot root
+#define MAX_SNAPSHOT_INODE_BLOCKS ((BLOCK_SIZE - SNAPSHOT_TABLE_OFFSET) / BLOCK_PTR_SIZE) // Largest inode table a snapshot can copy
+
+// The checksum region fills the end of the volume, from SuperBlock.checksum_start. It
+// holds the CRC32C of every block of the volume but the superblock and the region
+// itself, block n at index n, 0 when the checksum is unknown.
+#define CHECKSUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t)) // Checksums in a block of the checksum region
+
 /// @brief SuperBlock structure (inside the first block of the SSFS disk)
 typedef struct {
     uint8_t magic[MAGIC_NUMBER_SIZE]; // 0–15
     uint32_t nb_blocks;               // 16–19
     uint32_t nb_inode_blocks;         // 20–23
     uint32_t block_size;              // 24–27
+    uint32_t features;                // 28–31 SSFS_FEATURE_* flags
+    uint32_t snapshots[MAX_SNAPSHOTS]; // 32–95 Root block of each snapshot, 0 if the slot is free
+    uint32_t checksum_start;          // 96–99 First block of the checksum region, 0 without SSFS_FEATURE_CHECKSUMS
 } SuperBlock;
 
 /// @brief SSFS file system structure
@@ -26,6 +63,7 @@ typedef struct {
     uint32_t nb_inodes;         // Number of inodes
     uint32_t inode_start_block; // The block number where the inodes start
     uint32_t data_start_block;  // The block number where the data starts
+    uint32_t data_end_block;    // The block number where the data ends (the checksum region, if any)
 } SSFS;
 
 extern SSFS ssfs;
@@ -38,5 +76,11 @@ extern const uint8_t OFFSET_NB_BLOCKS;
 extern const uint8_t OFFSET_NB_INODE_BLOCKS;
 /// @brief Offset of the block size in the superblock
 extern const uint8_t OFFSET_BLOCK_SIZE;
+/// @brief Offset of the feature flags in the superblock
+extern const uint8_t OFFSET_FEATURES;
+/// @brief Offset of the snapshot slots in the superblock
+extern const uint8_t OFFSET_SNAPSHOTS;
+/// @brief Offset of the first block of the checksum region in the superblock
+extern const uint8_t OFFSET_CHECKSUM_START;
 
 #endif
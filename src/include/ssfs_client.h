@@ -0,0 +1,70 @@
+#ifndef SSFS_CLIENT_H
+#define SSFS_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Client of ssfsd, which serves the volume it mounted over a Unix domain socket.
+// Operations are pipelined: every request of ssfs_client_run() is sent before the
+// first response is awaited.
+
+#define SSFS_CLIENT_STAT   0 // Operations, run as the fs.h call of the same name
+#define SSFS_CLIENT_READ   1
+#define SSFS_CLIENT_WRITE  2
+#define SSFS_CLIENT_CREATE 3
+#define SSFS_CLIENT_DELETE 4
+
+#define SSFS_CLIENT_SHM_MIN (64 * 1024) // Reads from this size on use the shared buffer, if mapped
+
+/// @brief One operation of ssfs_client_run()
+typedef struct {
+    int op;          // SSFS_CLIENT_*
+    int inode_num;   // Unused by SSFS_CLIENT_CREATE
+    uint8_t *data;   // Buffer of SSFS_CLIENT_READ and SSFS_CLIENT_WRITE
+    int len;
+    int offset;
+    int result;      // What the fs.h call returned on the server, or a transport error
+} SsfsClientOp;
+
+typedef struct SsfsClient SsfsClient;
+
+SsfsClient *ssfs_client_connect(const char *socket_path);
+void ssfs_client_close(SsfsClient *client);
+int ssfs_client_map(SsfsClient *client, size_t size);
+int ssfs_client_run(SsfsClient *client, SsfsClientOp *ops, int count);
+int ssfs_client_stat(SsfsClient *client, int inode_num);
+int ssfs_client_create(SsfsClient *client);
+int ssfs_client_delete(SsfsClient *client, int inode_num);
+int ssfs_client_read(SsfsClient *client, int inode_num, uint8_t *data, int len, int offset);
+int ssfs_client_write(SsfsClient *client, int inode_num, uint8_t *data, int len, int offset);
+
+//=============================================================================
+//================================ PROTOCOL ===================================
+//=============================================================================
+
+// Every message is a fixed header in host byte order, the server being local. A write
+// request is followed by its len bytes, a response to a read by its result bytes,
+// unless the read goes to the shared buffer. Responses come in the order of the requests.
+// A read or write of a negative len, or of more than SSFSD_MAX_DATA bytes, is answered
+// fs_ENOTSUP; the len bytes following such a write are dropped. The memfd of a mapping
+// must hold len bytes and be sealed with F_SEAL_SHRINK, or the mapping is refused.
+
+#define SSFSD_OP_MAP   16     // Maps the memfd sent along with the request (SCM_RIGHTS), of len bytes
+#define SSFSD_FLAG_SHM 0x100  // Read into the shared buffer at shm_offset instead of the socket
+#define SSFSD_MAX_DATA (16 * 1024 * 1024) // Largest read or write of a request
+
+typedef struct {
+    uint32_t id;          // Echoed by the response
+    uint32_t op;          // SSFS_CLIENT_* or SSFSD_OP_MAP, with SSFSD_FLAG_SHM for a read
+    int32_t inode_num;
+    int32_t len;
+    int32_t offset;
+    uint32_t shm_offset;
+} SsfsdRequest;
+
+typedef struct {
+    uint32_t id;
+    int32_t result;
+} SsfsdResponse;
+
+#endif
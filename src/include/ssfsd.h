@@ -0,0 +1,14 @@
+#ifndef SSFSD_H
+#define SSFSD_H
+
+#include "ssfs_client.h"
+
+// The volume served by ssfsd. Its calls live apart from the socket code of the daemon,
+// as fs.h declares read() and write() under the names of their POSIX counterparts.
+
+int volume_mount(char *disk_name);
+int volume_unmount();
+int volume_run(SsfsClientOp *ops, int count);
+void volume_print_stats();
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+// Instrumentation of the fs.h operations. Build with -DSSFS_STATS (make STATS=1) to
+// enable it; otherwise every STATS_* macro expands to nothing and ssfs_get_stats()
+// returns fs_ENOTSUP.
+
+#define STATS_SUB_BITS     3 // Linear sub-buckets per power of two (2^3 = 8, ~12% precision)
+#define STATS_HIST_BUCKETS ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS) // Buckets covering 0 .. 2^64 ns
+
+/// @brief Operations that are accounted separately
+typedef enum {
+    STATS_OP_FORMAT,
+    STATS_OP_MOUNT,
+    STATS_OP_UNMOUNT,
+    STATS_OP_STAT,
+    STATS_OP_CREATE,
+    STATS_OP_DELETE,
+    STATS_OP_READ,
+    STATS_OP_WRITE,
+    STATS_OP_MOUNT_NESTED,
+    STATS_OP_CLONE,
+    STATS_OP_SNAPSHOT_CREATE,
+    STATS_OP_SNAPSHOT_DELETE,
+    STATS_OP_SET_COMPRESSION,
+    STATS_OP_ENABLE_CHECKSUMS,
+    STATS_OP_SET_DEDUP,
+    STATS_OP_DEDUP_FILE,
+    STATS_OP_PREALLOCATE,
+    STATS_OP_DEFRAG_FILE,
+    STATS_OP_OPEN,
+    STATS_OP_CLOSE,
+    STATS_OP_BATCH,
+    STATS_OP_EXPORT,
+    STATS_OP_IMPORT,
+    STATS_NB_OPS
+} StatsOp;
+
+/// @brief Counters of a single operation
+typedef struct {
+    uint64_t calls;          // Number of calls
+    uint64_t errors;         // Calls that returned a negative value
+    uint64_t bytes;          // Bytes read or written by the caller
+    uint64_t meta_reads;     // Superblock, inode and pointer blocks read
+    uint64_t meta_writes;    // Superblock, inode and pointer blocks written
+    uint64_t data_reads;     // Data blocks read
+    uint64_t data_writes;    // Data blocks written
+    uint64_t alloc_scanned;  // Blocks examined by the block allocator
+    uint64_t total_ns;       // Sum of the latencies
+    uint64_t hist[STATS_HIST_BUCKETS]; // Latency histogram (log-linear buckets, ns)
+} OpStats;
+
+/// @brief Snapshot of every counter, summed over all threads
+typedef struct {
+    OpStats ops[STATS_NB_OPS];
+} SsfsStats;
+
+/// @brief Scope of an instrumented call, see STATS_BEGIN / STATS_END
+typedef struct {
+    uint64_t start_ns;
+    int op;
+    int previous_op;
+} StatsScope;
+
+int ssfs_get_stats(SsfsStats *out);
+void ssfs_reset_stats();
+uint64_t ssfs_stats_percentile(const OpStats *op, double p);
+void ssfs_print_stats(FILE *f, const SsfsStats *stats);
+int ssfs_stats_start_dump(FILE *f, unsigned interval_ms);
+void ssfs_stats_stop_dump();
+
+const char *stats_op_name(int op);
+StatsScope stats_begin(int op);
+void stats_end(StatsScope *scope, int ret, int bytes);
+void stats_add(size_t field_offset, uint64_t n);
+
+#ifdef SSFS_STATS
+#define STATS_BEGIN(op)             StatsScope stats_scope_ = stats_begin(op)
+#define STATS_END(ret, bytes)       stats_end(&stats_scope_, (ret), (bytes))
+#define STATS_ADD(field, n)         stats_add(offsetof(OpStats, field), (n))
+#else
+#define STATS_BEGIN(op)             do { } while (0)
+#define STATS_END(ret, bytes)       do { } while (0)
+#define STATS_ADD(field, n)         do { } while (0)
+#endif
+
+#define STATS_COUNT(field)          STATS_ADD(field, 1)
+
+#endif
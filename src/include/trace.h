@@ -0,0 +1,76 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Recording of the fs.h calls into a binary trace, replayed by ssfs_replay.
+// Build with -DSSFS_TRACE (make TRACE=1) to enable it; otherwise every TRACE_*
+// macro expands to nothing and ssfs_trace_start() returns fs_ENOTSUP.
+// When enabled, setting SSFS_TRACE=<path> in the environment starts a trace on the
+// first call. Like the rest of fs.h, calls are expected to be serialized by the caller.
+//
+// File layout: a TraceHeader followed by TraceRecords, all little endian.
+
+#define TRACE_MAGIC_SIZE 8
+#define TRACE_VERSION    1
+
+/// @brief Traced operations. The values are part of the file format.
+typedef enum {
+    TRACE_OP_FORMAT  = 0,
+    TRACE_OP_MOUNT   = 1,
+    TRACE_OP_UNMOUNT = 2,
+    TRACE_OP_STAT    = 3,
+    TRACE_OP_CREATE  = 4,
+    TRACE_OP_DELETE  = 5,
+    TRACE_OP_READ    = 6,
+    TRACE_OP_WRITE   = 7,
+    TRACE_OP_MOUNT_NESTED = 8,
+    TRACE_OP_CLONE   = 9,
+    TRACE_OP_SNAPSHOT_CREATE = 10,
+    TRACE_OP_SNAPSHOT_DELETE = 11,
+    TRACE_OP_SET_COMPRESSION = 12,
+    TRACE_OP_ENABLE_CHECKSUMS = 13,
+    TRACE_OP_SET_DEDUP = 14,
+    TRACE_OP_DEDUP_FILE = 15,
+    TRACE_OP_PREALLOCATE = 16,
+    TRACE_OP_DEFRAG_FILE = 17,
+    TRACE_NB_OPS
+} TraceOp;
+
+/// @brief Header at the start of a trace file
+typedef struct {
+    uint8_t magic[TRACE_MAGIC_SIZE]; // "SSFSTRC\0"
+    uint32_t version;                // TRACE_VERSION
+    uint32_t record_size;            // sizeof(TraceRecord)
+} TraceHeader;
+
+/// @brief One call (32 bytes)
+typedef struct {
+    uint64_t timestamp_ns; // Start of the call, relative to the start of the trace
+    uint32_t duration_ns;  // Latency of the call (saturated)
+    uint32_t op;           // TraceOp
+    int32_t inode;         // inode_num argument (-1 if none)
+    int32_t len;           // len argument, inodes for format, snapshot for snapshot_delete,
+                           // mode for set_compression, enabled for set_dedup,
+                           // rate_kib for defrag_file (0 if none)
+    int32_t offset;        // offset argument (0 if none)
+    int32_t result;        // Value returned to the caller
+} TraceRecord;
+
+extern const uint8_t TRACE_MAGIC[TRACE_MAGIC_SIZE];
+
+int ssfs_trace_start(const char *path);
+int ssfs_trace_stop();
+
+uint64_t trace_begin();
+void trace_end(uint64_t start_ns, int op, int inode, int len, int offset, int result);
+
+#ifdef SSFS_TRACE
+#define TRACE_BEGIN()                                   uint64_t trace_start_ = trace_begin()
+#define TRACE_END(op, inode, len, offset, result)       trace_end(trace_start_, (op), (inode), (len), (offset), (result))
+#else
+#define TRACE_BEGIN()                                   do { } while (0)
+#define TRACE_END(op, inode, len, offset, result)       do { } while (0)
+#endif
+
+#endif
@@ -4,17 +4,37 @@
 #include <stdint.h>
 #include <stdio.h>
 
+extern const int VDISK_SECTOR_SIZE;
+
+typedef struct VdiskOps VdiskOps;
+
 typedef struct {
     uint32_t sector_size;
     uint32_t size_in_sectors;
     char *name;
     FILE *fp;
+    const VdiskOps *ops; // Backend of the disk, NULL for a plain image file
+    void *backend;       // State of the backend
 } DISK;
 
+/// @brief Sector access of a disk that is not a plain image file
+struct VdiskOps {
+    int (*read)(DISK *diskp, uint32_t sector, uint8_t *buffer);
+    int (*write)(DISK *diskp, uint32_t sector, uint8_t *buffer);
+    int (*sync)(DISK *diskp);
+    void (*off)(DISK *diskp);
+};
+
 int vdisk_on(char *filename, DISK *diskp);
 int vdisk_read(DISK *diskp, uint32_t sector, uint8_t *buffer);
 int vdisk_write(DISK *diskp, uint32_t sector, uint8_t *buffer);
 int vdisk_sync(DISK *diskp);
+int vdisk_fd(DISK *diskp);
 void vdisk_off(DISK *diskp);
 
+int vdisk_on_nested(DISK *outer, uint32_t inode_start_block, uint32_t inode_num, DISK *diskp);
+int vdisk_on_striped(char **filenames, int nb_files, uint32_t stripe_width, DISK *diskp);
+int vdisk_on_spec(char *spec, DISK *diskp);
+uint64_t vdisk_striped_reads(DISK *diskp);
+
 #endif
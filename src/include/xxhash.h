@@ -0,0 +1,12 @@
+#ifndef XXHASH_H
+#define XXHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XXH64, the 64-bit xxHash: a fast non-cryptographic hash used to index blocks by
+// contents. Equal hashes do not mean equal contents, the blocks must still be compared.
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif
@@ -3,6 +3,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include "fs.h"
+#include "error.h"
+#include "vdisk.h"
 
 void print_file_preview(int inode) {
     int size = stat(inode);
@@ -31,6 +33,562 @@ void print_file_preview(int inode) {
     }
 }
 
+/// @brief Creates a file of nb_blocks zero blocks.
+/// @return 0 on success
+static int make_zero_file(const char *filename, int nb_blocks) {
+    static const uint8_t zeros[1024];
+    FILE *f = fopen(filename, "wb");
+    if (!f) return -1;
+    for (int i = 0; i < nb_blocks; i++) {
+        if (fwrite(zeros, 1, sizeof(zeros), f) != sizeof(zeros)) {
+            fclose(f);
+            return -1;
+        }
+    }
+    return fclose(f);
+}
+
+/// @brief Creates a zero-filled disk image of nb_blocks blocks, formats and mounts it.
+/// @return 0 on success
+static int make_scratch_disk(const char *disk_name, int nb_blocks, int inodes) {
+    if (make_zero_file(disk_name, nb_blocks) != 0) return -1;
+    if (format((char *)disk_name, inodes) != 0) return -1;
+    return mount((char *)disk_name);
+}
+
+/// @brief Writes one block at a time to a new file until the disk is full.
+/// @return the inode of the file
+static int fill_disk(void) {
+    uint8_t block[1024];
+    memset(block, 'F', sizeof(block));
+    int filler = create();
+    for (int offset = 0; filler >= 0; offset += sizeof(block)) {
+        if (write(filler, block, sizeof(block), offset) != (int)sizeof(block))
+            break;
+    }
+    return filler;
+}
+
+static int test_failed_cow_write(const char *disk_name) {
+    if (make_scratch_disk(disk_name, 64, 32) != 0) {
+        printf("Failed to create %s\n", disk_name);
+        return 1;
+    }
+
+    // 8 blocks: 4 direct, 4 behind the indirect block
+    uint8_t data[8 * 1024], check[8 * 1024];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (uint8_t)(i * 7 + i / 1024);
+    int inode = create();
+    if (inode < 0 || write(inode, data, sizeof(data), 0) != (int)sizeof(data)) {
+        printf("Failed to write the file to snapshot\n");
+        unmount();
+        return 1;
+    }
+    int snapshot = snapshot_create();
+    if (snapshot < 0) {
+        printf("snapshot_create() failed\n");
+        unmount();
+        return 1;
+    }
+
+    // Leaves a single free block: enough to copy the indirect block, not the data block
+    int spare = create();
+    if (spare < 0 || write(spare, data, 1024, 0) != 1024 || fill_disk() < 0 || delete(spare) != 0) {
+        printf("Failed to fill the disk\n");
+        unmount();
+        return 1;
+    }
+    if (write(inode, (uint8_t *)"Changed", 7, 5 * 1024) >= 0) {
+        printf("Write to a shared block succeeded on a full disk\n");
+        unmount();
+        return 1;
+    }
+    printf("Write to a shared block failed on a full disk, as expected\n");
+
+    if (snapshot_delete(snapshot) != 0) {
+        printf("snapshot_delete(%d) failed\n", snapshot);
+        unmount();
+        return 1;
+    }
+    if (read(inode, check, sizeof(check), 0) != (int)sizeof(check) || memcmp(check, data, sizeof(data)) != 0) {
+        printf("inode %d lost blocks when the snapshot was deleted\n", inode);
+        unmount();
+        return 1;
+    }
+    printf("inode %d intact after snapshot_delete(%d)\n", inode, snapshot);
+
+    unmount();
+    remove(disk_name);
+    return 0;
+}
+
+static int test_compression(const char *disk_name) {
+    if (make_scratch_disk(disk_name, 64, 32) != 0) {
+        printf("Failed to create %s\n", disk_name);
+        return 1;
+    }
+
+    // 4 clusters of text, which compress to a block each
+    uint8_t data[16 * 1024], check[16 * 1024];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = "Compressible SSFS text. "[i % 24];
+    int inode = create();
+    if (inode < 0 || set_compression(inode, COMPRESSION_LZ4) != 0 || write(inode, data, sizeof(data), 0) != (int)sizeof(data)) {
+        printf("Failed to write the compressed file\n");
+        unmount();
+        return 1;
+    }
+    FileLayout layout;
+    if (read(inode, check, sizeof(check), 0) != (int)sizeof(check) || memcmp(check, data, sizeof(data)) != 0 ||
+        file_layout(inode, &layout) != 0 || layout.data_blocks >= sizeof(data) / 1024) {
+        printf("Compressed file read back wrong or not compressed\n");
+        unmount();
+        return 1;
+    }
+    printf("inode %d: %d bytes in %u data blocks\n", inode, (int)sizeof(data), layout.data_blocks);
+
+    // A cluster that no longer compresses needs 3 more blocks than the disk has left
+    uint8_t noise[4 * 1024];
+    uint32_t x = 12345;
+    for (int i = 0; i < (int)sizeof(noise); i++) {
+        x = x * 1103515245 + 12345;
+        noise[i] = (uint8_t)(x >> 16);
+    }
+    int spare = create();
+    if (spare < 0 || write(spare, data, 2 * 1024, 0) != 2 * 1024 || fill_disk() < 0 || delete(spare) != 0) {
+        printf("Failed to fill the disk\n");
+        unmount();
+        return 1;
+    }
+    if (write(inode, noise, sizeof(noise), 4 * 1024) >= 0) {
+        printf("Incompressible write succeeded on a full disk\n");
+        unmount();
+        return 1;
+    }
+    if (read(inode, check, sizeof(check), 0) != (int)sizeof(check) || memcmp(check, data, sizeof(data)) != 0) {
+        printf("inode %d damaged by a write that ran out of space\n", inode);
+        unmount();
+        return 1;
+    }
+    printf("inode %d intact after a write that ran out of space\n", inode);
+
+    unmount();
+    remove(disk_name);
+    return 0;
+}
+
+static int test_checksums(const char *disk_name) {
+    if (make_scratch_disk(disk_name, 64, 32) != 0 || enable_checksums() != 0) {
+        printf("Failed to create %s with checksums\n", disk_name);
+        unmount();
+        return 1;
+    }
+
+    uint8_t data[2 * 1024], check[2 * 1024];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = "Checksummed block. "[i % 19];
+    int inode = create();
+    if (inode < 0 || write(inode, data, sizeof(data), 0) != (int)sizeof(data)) {
+        printf("Failed to write the file to corrupt\n");
+        unmount();
+        return 1;
+    }
+    unmount();
+
+    // Flips a byte of the first data block of the file, behind the back of the volume
+    FILE *f = fopen(disk_name, "r+b");
+    uint8_t block[1024];
+    long found = -1;
+    for (long pos = 0; f && found < 0 && fread(block, 1, sizeof(block), f) == sizeof(block); pos += sizeof(block))
+        if (memcmp(block, data, sizeof(block)) == 0) found = pos;
+    if (found >= 0) {
+        block[100] ^= 0xff;
+        fseek(f, found, SEEK_SET);
+        fwrite(block, 1, sizeof(block), f);
+    }
+    if (f) fclose(f);
+    if (found < 0 || mount((char *)disk_name) != 0) {
+        printf("Failed to corrupt the file\n");
+        return 1;
+    }
+
+    int r = read(inode, check, sizeof(check), 0);
+    if (r != fs_ECORRUPT) {
+        printf("read() of a corrupted block returned %d, expected fs_ECORRUPT\n", r);
+        unmount();
+        return 1;
+    }
+    printf("read() of a corrupted block returned fs_ECORRUPT\n");
+
+    unmount();
+    remove(disk_name);
+    return 0;
+}
+
+static int test_dedup(const char *disk_name) {
+    if (make_scratch_disk(disk_name, 128, 32) != 0 || set_dedup(1) != 0) {
+        printf("Failed to create %s with dedup\n", disk_name);
+        unmount();
+        return 1;
+    }
+
+    // 4 blocks of different contents
+    uint8_t data[4 * 1024], check[4 * 1024];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (uint8_t)(i / 1024 + 'A');
+    int a = create();
+    int b = create();
+    FileLayout layout;
+    if (a < 0 || b < 0 || write(a, data, sizeof(data), 0) != (int)sizeof(data) ||
+        write(b, data, sizeof(data), 0) != (int)sizeof(data) || file_layout(b, &layout) != 0) {
+        printf("Failed to write the same data to two files\n");
+        unmount();
+        return 1;
+    }
+    if (layout.shared_blocks != 4) {
+        printf("inode %d shares %u blocks, expected 4\n", b, layout.shared_blocks);
+        unmount();
+        return 1;
+    }
+    printf("inode %d shares its %u blocks with inode %d\n", b, layout.shared_blocks, a);
+
+    // Writing to a shared block copies it
+    if (write(a, (uint8_t *)"Changed", 7, 0) != 7 || read(b, check, sizeof(check), 0) != (int)sizeof(check) ||
+        memcmp(check, data, sizeof(data)) != 0) {
+        printf("Writing to inode %d changed inode %d\n", a, b);
+        unmount();
+        return 1;
+    }
+
+    // A file written with dedup off is deduplicated afterwards
+    int c = create();
+    if (c < 0 || set_dedup(0) != 0 || write(c, data, sizeof(data), 0) != (int)sizeof(data) || set_dedup(1) != 0) {
+        printf("Failed to write inode %d with dedup off\n", c);
+        unmount();
+        return 1;
+    }
+    int shared = dedup_file(c);
+    if (shared != 4 || read(c, check, sizeof(check), 0) != (int)sizeof(check) || memcmp(check, data, sizeof(data)) != 0) {
+        printf("dedup_file(%d) returned %d, expected 4\n", c, shared);
+        unmount();
+        return 1;
+    }
+    printf("dedup_file(%d) shared %d blocks\n", c, shared);
+
+    unmount();
+    remove(disk_name);
+    return 0;
+}
+
+static int test_defrag(const char *disk_name) {
+    if (make_scratch_disk(disk_name, 128, 32) != 0) {
+        printf("Failed to create %s\n", disk_name);
+        return 1;
+    }
+
+    // One-block files, every other one deleted, leave one-block holes to write into
+    uint8_t data[8 * 1024], check[8 * 1024];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (uint8_t)('a' + i / 1024);
+    int small[16];
+    for (int i = 0; i < 16; i++) {
+        small[i] = create();
+        if (small[i] < 0 || write(small[i], data, 1024, 0) != 1024) {
+            printf("Failed to write small file %d\n", i);
+            unmount();
+            return 1;
+        }
+    }
+    for (int i = 0; i < 16; i += 2) delete(small[i]);
+
+    int inode = create();
+    FileLayout before, after;
+    if (inode < 0 || write(inode, data, sizeof(data), 0) != (int)sizeof(data) || file_layout(inode, &before) != 0) {
+        printf("Failed to write the fragmented file\n");
+        unmount();
+        return 1;
+    }
+    int moved = defrag_file(inode, 0);
+    if (moved <= 0 || file_layout(inode, &after) != 0 || after.extents != 1) {
+        printf("defrag_file(%d) returned %d, %u extents left\n", inode, moved, after.extents);
+        unmount();
+        return 1;
+    }
+    if (read(inode, check, sizeof(check), 0) != (int)sizeof(check) || memcmp(check, data, sizeof(data)) != 0) {
+        printf("inode %d reads differently after defrag_file()\n", inode);
+        unmount();
+        return 1;
+    }
+    printf("defrag_file(%d) moved %d blocks: %u extents -> %u\n", inode, moved, before.extents, after.extents);
+
+    unmount();
+    remove(disk_name);
+    return 0;
+}
+
+static int test_handles(const char *disk_name) {
+    if (make_scratch_disk(disk_name, 128, 32) != 0) {
+        printf("Failed to create %s\n", disk_name);
+        return 1;
+    }
+
+    uint8_t data[6 * 1024], check[6 * 1024];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (uint8_t)(i * 13);
+    int inode = create();
+    int handle = inode < 0 ? -1 : ssfs_open(inode);
+    if (handle < 0) {
+        printf("ssfs_open() failed\n");
+        unmount();
+        return 1;
+    }
+
+    // Sequential writes and reads share the position of the handle
+    if (ssfs_write(handle, data, 4 * 1024) != 4 * 1024 || ssfs_write(handle, data + 4 * 1024, 2 * 1024) != 2 * 1024 ||
+        ssfs_pread(handle, check, sizeof(check), 0) != (int)sizeof(check) || memcmp(check, data, sizeof(data)) != 0) {
+        printf("Handle %d reads back differently\n", handle);
+        unmount();
+        return 1;
+    }
+
+    // A write through the inode is seen by the handle
+    if (write(inode, (uint8_t *)"Changed", 7, 5000) != 7 || ssfs_pread(handle, check, 7, 5000) != 7 ||
+        memcmp(check, "Changed", 7) != 0) {
+        printf("Handle %d missed a write to inode %d\n", handle, inode);
+        unmount();
+        return 1;
+    }
+    if (ssfs_close(handle) != 0 || ssfs_pread(handle, check, 1, 0) != fs_EBADF) {
+        printf("Handle %d still usable after ssfs_close()\n", handle);
+        unmount();
+        return 1;
+    }
+    printf("Handle %d wrote and read inode %d\n", handle, inode);
+
+    unmount();
+    remove(disk_name);
+    return 0;
+}
+
+static int test_batch(const char *disk_name) {
+    if (make_scratch_disk(disk_name, 128, 32) != 0) {
+        printf("Failed to create %s\n", disk_name);
+        return 1;
+    }
+
+    uint8_t data[3 * 1024], check[3 * 1024], update[1500];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (uint8_t)(i * 7);
+    memset(update, 0xA5, sizeof(update));
+    int first = create(), second = create();
+    if (first < 0 || second < 0 || write(first, data, sizeof(data), 0) != (int)sizeof(data) ||
+        write(second, data, 1024, 0) != 1024) {
+        printf("Failed to set up the files\n");
+        unmount();
+        return 1;
+    }
+
+    // The read of the first file runs before its delete, the create after both
+    BatchOp ops[] = {
+        { BATCH_READ, first, check, sizeof(check), 0, 0 },
+        { BATCH_WRITE, second, update, sizeof(update), 512, 0 },
+        { BATCH_STAT, second, NULL, 0, 0, 0 },
+        { BATCH_DELETE, first, NULL, 0, 0, 0 },
+        { BATCH_CREATE, 0, NULL, 0, 0, 0 },
+        { BATCH_STAT, first, NULL, 0, 0, 0 },
+        { 99, second, NULL, 0, 0, 0 },
+    };
+    int expected[] = { sizeof(check), sizeof(update), 512 + sizeof(update), 0, first, fs_EREAD, fs_ENOTSUP };
+    int nb_ops = sizeof(ops) / sizeof(ops[0]);
+    if (ssfs_batch(ops, nb_ops) != 0) {
+        printf("ssfs_batch() failed\n");
+        unmount();
+        return 1;
+    }
+    for (int i = 0; i < nb_ops; i++) {
+        if (ops[i].result != expected[i]) {
+            printf("Operation %d of the batch returned %d instead of %d\n", i, ops[i].result, expected[i]);
+            unmount();
+            return 1;
+        }
+    }
+    if (memcmp(check, data, sizeof(data)) != 0) {
+        printf("The batch read different contents\n");
+        unmount();
+        return 1;
+    }
+    uint8_t after[512 + sizeof(update)];
+    if (read(second, after, sizeof(after), 0) != (int)sizeof(after) || memcmp(after, data, 512) != 0 ||
+        memcmp(after + 512, update, sizeof(update)) != 0 || stat(ops[4].result) != 0) {
+        printf("The batch left different files than single calls would\n");
+        unmount();
+        return 1;
+    }
+    printf("Batch of %d operations ran as single calls\n", nb_ops);
+
+    unmount();
+    remove(disk_name);
+    return 0;
+}
+
+static int test_export_import(const char *disk_name) {
+    if (make_scratch_disk(disk_name, 256, 32) != 0) {
+        printf("Failed to create %s\n", disk_name);
+        return 1;
+    }
+
+    // Spans the direct pointers and the indirect block
+    static uint8_t data[40 * 1024], check[40 * 1024];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (uint8_t)(i * 31 + i / 1024);
+    int inode = create();
+    FILE *host = tmpfile();
+    if (inode < 0 || !host || write(inode, data, sizeof(data), 0) != (int)sizeof(data)) {
+        printf("Failed to set up the transfer\n");
+        if (host) fclose(host);
+        unmount();
+        return 1;
+    }
+
+    int exported = ssfs_export(inode, fileno(host));
+    fseek(host, 0, SEEK_END);
+    long host_size = ftell(host);
+    rewind(host);
+    int imported = exported == (int)sizeof(data) ? ssfs_import(fileno(host)) : -1;
+    fclose(host);
+    if (exported != (int)sizeof(data) || host_size != (long)sizeof(data) || imported < 0) {
+        printf("Export of %d bytes (host file %ld bytes) or import (%d) failed\n", exported, host_size, imported);
+        unmount();
+        return 1;
+    }
+    if (stat(imported) != (int)sizeof(data) || read(imported, check, sizeof(check), 0) != (int)sizeof(check) ||
+        memcmp(check, data, sizeof(data)) != 0) {
+        printf("Inode %d imported differs from inode %d exported\n", imported, inode);
+        unmount();
+        return 1;
+    }
+    if (ssfs_export(inode + 100, 1) >= 0) {
+        printf("Export of a missing inode succeeded\n");
+        unmount();
+        return 1;
+    }
+    printf("Inode %d exported and imported as inode %d\n", inode, imported);
+
+    unmount();
+    remove(disk_name);
+    return 0;
+}
+
+static int test_striped(const char *disk_name) {
+    char members[2][256];
+    for (int i = 0; i < 2; i++) snprintf(members[i], sizeof(members[i]), "%s.%d", disk_name, i);
+
+    // Each chunk of the members is read once by a sequential scan: 8 sector stripes,
+    // or 64 sector chunks when concatenated
+    const char *layouts[] = { "stripe:8:", "concat:" };
+    const uint64_t chunk_reads[] = { 1024 / 8, 1024 / 64 };
+    static uint8_t data[64 * 1024], check[64 * 1024];
+    for (int i = 0; i < (int)sizeof(data); i++) data[i] = (uint8_t)(i * 11 + i / 1024);
+    for (int layout = 0; layout < 2; layout++) {
+        // format() only takes empty members
+        char spec[600];
+        snprintf(spec, sizeof(spec), "%s%s,%s", layouts[layout], members[0], members[1]);
+        if (make_zero_file(members[0], 512) != 0 || make_zero_file(members[1], 512) != 0) {
+            printf("Failed to create the members of %s\n", spec);
+            return 1;
+        }
+        int inode = -1;
+        if (format(spec, 32) == 0 && mount(spec) == 0) {
+            inode = create();
+            if (inode >= 0 && write(inode, data, sizeof(data), 0) != (int)sizeof(data)) inode = -1;
+            unmount();
+        }
+        if (inode < 0 || mount(spec) != 0 || read(inode, check, sizeof(check), 0) != (int)sizeof(check) ||
+            memcmp(check, data, sizeof(data)) != 0) {
+            printf("Inode %d of %s reads back differently\n", inode, spec);
+            unmount();
+            return 1;
+        }
+        unmount();
+
+        DISK disk;
+        uint8_t sector[1024];
+        if (vdisk_on(spec, &disk) != 0) {
+            printf("Failed to open %s\n", spec);
+            return 1;
+        }
+        uint32_t scanned = 0;
+        while (scanned < disk.size_in_sectors && vdisk_read(&disk, scanned, sector) == 0) scanned++;
+        uint64_t reads = vdisk_striped_reads(&disk);
+        vdisk_off(&disk);
+        if (scanned != 1024 || reads != chunk_reads[layout]) {
+            printf("Scan of %u sectors of %s took %llu member reads instead of %llu\n", scanned, spec,
+                   (unsigned long long)reads, (unsigned long long)chunk_reads[layout]);
+            return 1;
+        }
+        printf("%s: inode %d read back, %llu member reads per scan\n", layouts[layout], inode,
+               (unsigned long long)reads);
+    }
+
+    remove(members[0]);
+    remove(members[1]);
+    return 0;
+}
+
+static int test_preallocate(const char *disk_name) {
+    if (make_scratch_disk(disk_name, 256, 32) != 0) {
+        printf("Failed to create %s\n", disk_name);
+        return 1;
+    }
+
+    // The range follows the first block of the file, written beforehand
+    uint8_t block[1024], check[20 * 1024];
+    memset(block, 'P', sizeof(block));
+    int inode = create();
+    FileLayout reserved, written;
+    if (inode < 0 || write(inode, block, sizeof(block), 0) != (int)sizeof(block) ||
+        preallocate(inode, 20 * 1024, 1024) != 0 || file_layout(inode, &reserved) != 0) {
+        printf("preallocate() failed\n");
+        unmount();
+        return 1;
+    }
+    if (stat(inode) != 21 * 1024 || reserved.data_blocks != 21 || reserved.extents != 1) {
+        printf("Size %d, %u data blocks in %u extents after preallocate()\n", stat(inode),
+               reserved.data_blocks, reserved.extents);
+        unmount();
+        return 1;
+    }
+    int zeros = read(inode, check, sizeof(check), 1024) == (int)sizeof(check);
+    for (int i = 0; zeros && i < (int)sizeof(check); i++) zeros = check[i] == 0;
+    if (!zeros) {
+        printf("The preallocated range does not read back as zeros\n");
+        unmount();
+        return 1;
+    }
+
+    // Another file written meanwhile stays out of the range, the writes into it take
+    // the blocks already there
+    int other = create();
+    if (other < 0 || write(other, block, sizeof(block), 0) != (int)sizeof(block)) {
+        printf("Failed to write another file\n");
+        unmount();
+        return 1;
+    }
+    for (int i = 0; i < (int)sizeof(check); i++) check[i] = (uint8_t)(i * 3);
+    uint8_t after[20 * 1024];
+    if (write(inode, check, sizeof(check), 1024) != (int)sizeof(check) || file_layout(inode, &written) != 0 ||
+        read(inode, after, sizeof(after), 1024) != (int)sizeof(after) || memcmp(after, check, sizeof(check)) != 0) {
+        printf("Write into the preallocated range failed\n");
+        unmount();
+        return 1;
+    }
+    if (stat(inode) != 21 * 1024 || written.data_blocks != reserved.data_blocks ||
+        written.pointer_blocks != reserved.pointer_blocks || written.extents != 1) {
+        printf("Size %d, %u data blocks in %u extents after the write\n", stat(inode), written.data_blocks,
+               written.extents);
+        unmount();
+        return 1;
+    }
+    printf("Inode %d preallocated %u blocks in one extent\n", inode, reserved.data_blocks);
+
+    unmount();
+    remove(disk_name);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     if (argc != 2) {
         printf("Usage: %s <disk_image>\n", argv[0]);
@@ -51,38 +609,36 @@ int main(int argc, char *argv[]) {
         print_file_preview(i);
     }
 
-    int size = stat(0);
-    if (size <= 0) {
-        printf("Failed to stat inode 0 (expected nested image)\n");
-        unmount();
-        return 1;
-    }
+    printf("\n-------------- Test 2: Read files from nested disk in place --------------\n");
 
-    uint8_t *nested_data = malloc(size);
-    if (!nested_data) {
-        printf("Failed to allocate buffer\n");
+    printf("Mounting nested disk in place: inode 0\n");
+    if (mount_nested(0) != 0) {
+        printf("Failed to mount nested disk in place\n");
         unmount();
         return 1;
     }
+    for (int i = 1; i <= 4; i++) {
+        print_file_preview(i);
+    }
+    unmount();
+    printf("Nested disk unmounted, back to outer disk.\n");
 
-    if (read(0, nested_data, size, 0) != size) {
-        printf("Failed to read full nested disk\n");
-        free(nested_data);
+    int size = stat(0);
+    if (size <= 0) {
+        printf("Failed to stat inode 0 (expected nested image)\n");
         unmount();
         return 1;
     }
 
     const char *nested_filename = "disk_img.3.extracted";
     FILE *f = fopen(nested_filename, "wb");
-    if (!f || fwrite(nested_data, 1, size, f) != (size_t)size) {
+    if (!f || ssfs_export(0, fileno(f)) != size) {
         printf("Failed to write extracted disk image\n");
-        free(nested_data);
         if (f) fclose(f);
         unmount();
         return 1;
     }
     fclose(f);
-    free(nested_data);
     printf("Extracted nested disk to %s\n", nested_filename);
     unmount();
 
@@ -93,12 +649,12 @@ int main(int argc, char *argv[]) {
     }
     printf("Nested disk mounted.\n");
 
-    printf("\n-------------- Test 2: Read files from nested disk --------------\n");
+    printf("\n-------------- Test 3: Read files from extracted nested disk --------------\n");
     for (int i = 1; i <= 4; i++) {
         print_file_preview(i);
     }
 
-    printf("\n-------------- Test 3: Create, write, read and delete --------------\n");
+    printf("\n-------------- Test 4: Create, write, read and delete --------------\n");
 
     int inode = create();
     if (inode < 0) { 
@@ -127,7 +683,7 @@ int main(int argc, char *argv[]) {
         printf("Deleted inode %d\n", inode);
     }
 
-    printf("\n-------------- Test 4: Appending and stat checks --------------\n");
+    printf("\n-------------- Test 5: Appending and stat checks --------------\n");
 
     inode = create();
     if (inode < 0) { 
@@ -170,7 +726,46 @@ int main(int argc, char *argv[]) {
         printf("Deleted inode %d\n", inode);
     }
 
-    printf("\n-------------- Test 5: Stress test - fill all inodes --------------\n");
+    printf("\n-------------- Test 6: Clone and copy-on-write --------------\n");
+
+    inode = create();
+    if (inode < 0 || write(inode, (uint8_t *)msg1, strlen(msg1), 0) != (int)strlen(msg1)) {
+        printf("Failed to create the file to clone\n");
+        unmount();
+        return 1;
+    }
+
+    int clone = clone_file(inode);
+    if (clone < 0) {
+        printf("clone_file(inode %d) failed\n", inode);
+        unmount();
+        return 1;
+    }
+    printf("Cloned inode %d to inode %d\n", inode, clone);
+
+    if (write(clone, (uint8_t *)"Changed", 7, 0) != 7) {
+        printf("Failed to write to clone %d\n", clone);
+        unmount();
+        return 1;
+    }
+
+    uint8_t original[64] = {0};
+    if (read(inode, original, strlen(msg1), 0) != (int)strlen(msg1) || memcmp(original, msg1, strlen(msg1)) != 0) {
+        printf("Writing to the clone changed inode %d\n", inode);
+        unmount();
+        return 1;
+    }
+    print_file_preview(inode);
+    print_file_preview(clone);
+
+    if (delete(inode) != 0 || delete(clone) != 0) {
+        printf("Failed to delete inodes %d and %d\n", inode, clone);
+        unmount();
+        return 1;
+    }
+    printf("Deleted inodes %d and %d\n", inode, clone);
+
+    printf("\n-------------- Test 7: Stress test - fill all inodes --------------\n");
 
     int count = 0;
     int inodes_created[1024];
@@ -197,6 +792,48 @@ int main(int argc, char *argv[]) {
     printf("Nested disk unmounted.\n");
     remove(nested_filename);
 
+    const char *scratch_filename = "disk_img.scratch";
+
+    printf("\n-------------- Test 8: Failed copy-on-write, then snapshot_delete --------------\n");
+    if (test_failed_cow_write(scratch_filename) != 0)
+        return 1;
+
+    printf("\n-------------- Test 9: Compressed file, then a full disk --------------\n");
+    if (test_compression(scratch_filename) != 0)
+        return 1;
+
+    printf("\n-------------- Test 10: Corrupted block with checksums --------------\n");
+    if (test_checksums(scratch_filename) != 0)
+        return 1;
+
+    printf("\n-------------- Test 11: Dedup --------------\n");
+    if (test_dedup(scratch_filename) != 0)
+        return 1;
+
+    printf("\n-------------- Test 12: Defragmentation --------------\n");
+    if (test_defrag(scratch_filename) != 0)
+        return 1;
+
+    printf("\n-------------- Test 13: Open handles --------------\n");
+    if (test_handles(scratch_filename) != 0)
+        return 1;
+
+    printf("\n-------------- Test 14: Batches --------------\n");
+    if (test_batch(scratch_filename) != 0)
+        return 1;
+
+    printf("\n-------------- Test 15: Export and import --------------\n");
+    if (test_export_import(scratch_filename) != 0)
+        return 1;
+
+    printf("\n-------------- Test 16: Striped and concatenated disks --------------\n");
+    if (test_striped(scratch_filename) != 0)
+        return 1;
+
+    printf("\n-------------- Test 17: Preallocation --------------\n");
+    if (test_preallocate(scratch_filename) != 0)
+        return 1;
+
     printf("\nAll tests passed.\n");
 
     return 0;
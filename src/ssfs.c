@@ -12,3 +12,6 @@ const uint8_t MAGIC_NUMBER[MAGIC_NUMBER_SIZE] = {
 const uint8_t OFFSET_NB_BLOCKS = 16;
 const uint8_t OFFSET_NB_INODE_BLOCKS = 20;
 const uint8_t OFFSET_BLOCK_SIZE = 24;
+const uint8_t OFFSET_FEATURES = 28;
+const uint8_t OFFSET_SNAPSHOTS = 32;
+const uint8_t OFFSET_CHECKSUM_START = 96;
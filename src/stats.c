@@ -0,0 +1,290 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "stats.h"
+#include "include/error.h"
+
+static const char *OP_NAMES[STATS_NB_OPS] = {
+    "format", "mount", "unmount", "stat", "create", "delete", "read", "write", "mount_nested",
+    "clone", "snap_create", "snap_delete", "set_compress",
+    "enable_csum", "set_dedup", "dedup_file", "preallocate",
+    "defrag_file", "open", "close", "batch",
+    "export", "import"
+};
+
+/// @brief Name of an operation as used in dumps.
+/// @param op
+/// @return
+const char *stats_op_name(int op)
+{
+    return (op >= 0 && op < STATS_NB_OPS) ? OP_NAMES[op] : "unknown";
+}
+
+/// @brief Lower bound of the values that fall in a histogram bucket.
+/// @param bucket
+/// @return
+static uint64_t bucket_value(int bucket)
+{
+    int sub_count = 1 << STATS_SUB_BITS;
+    if (bucket < sub_count) return bucket;
+    int exponent = bucket / sub_count + STATS_SUB_BITS - 1;
+    uint64_t sub = bucket % sub_count;
+    return (sub_count + sub) << (exponent - STATS_SUB_BITS);
+}
+
+/// @brief Percentile (0.0 - 1.0) of the latency of an operation, in ns, estimated from
+/// its histogram.
+/// @param op
+/// @param p
+/// @return
+uint64_t ssfs_stats_percentile(const OpStats *op, double p)
+{
+    if (op->calls == 0) return 0;
+    uint64_t rank = (uint64_t)(p * (op->calls - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_HIST_BUCKETS; ++i) {
+        seen += op->hist[i];
+        if (seen >= rank) return bucket_value(i);
+    }
+    return bucket_value(STATS_HIST_BUCKETS - 1);
+}
+
+/// @brief Prints a snapshot of the counters, one line per operation that was called.
+/// @param f
+/// @param stats
+void ssfs_print_stats(FILE *f, const SsfsStats *stats)
+{
+    fprintf(f, "%-12s %10s %7s %12s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+            "op", "calls", "errors", "bytes", "meta_rd", "meta_wr", "data_rd", "data_wr",
+            "alloc_scan", "p50_ns", "p99_ns", "max_ns");
+    for (int i = 0; i < STATS_NB_OPS; ++i) {
+        const OpStats *op = &stats->ops[i];
+        if (op->calls == 0) continue;
+        fprintf(f, "%-12s %10llu %7llu %12llu %10llu %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n",
+                OP_NAMES[i], (unsigned long long)op->calls, (unsigned long long)op->errors,
+                (unsigned long long)op->bytes, (unsigned long long)op->meta_reads,
+                (unsigned long long)op->meta_writes, (unsigned long long)op->data_reads,
+                (unsigned long long)op->data_writes, (unsigned long long)op->alloc_scanned,
+                (unsigned long long)ssfs_stats_percentile(op, 0.5),
+                (unsigned long long)ssfs_stats_percentile(op, 0.99),
+                (unsigned long long)ssfs_stats_percentile(op, 1.0));
+    }
+    fflush(f);
+}
+
+#ifdef SSFS_STATS
+
+#include <pthread.h>
+
+#define STATS_NB_FIELDS (sizeof(OpStats) / sizeof(uint64_t))
+
+/// @brief Counters owned by one thread. Only the owner writes them, readers sum every
+/// registered slab, so the hot path never takes a lock nor a contended atomic.
+typedef struct ThreadStats {
+    SsfsStats stats;
+    struct ThreadStats *next;
+} ThreadStats;
+
+static ThreadStats *all_threads = NULL;      // Lock-free list of the per-thread slabs
+static __thread ThreadStats *thread_stats = NULL;
+static __thread int current_op = -1;
+
+static pthread_t dump_thread;
+static int dump_running = 0;
+static FILE *dump_file = NULL;
+static unsigned dump_interval_ms = 0;
+
+/// @brief Current monotonic time in nanoseconds.
+/// @return
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/// @brief Histogram bucket of a value: exact below 2^STATS_SUB_BITS, then
+/// 2^STATS_SUB_BITS linear sub-buckets per power of two.
+/// @param value
+/// @return
+static int bucket_of(uint64_t value)
+{
+    int sub_count = 1 << STATS_SUB_BITS;
+    if (value < (uint64_t)sub_count) return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (int)(value >> (exponent - STATS_SUB_BITS)) & (sub_count - 1);
+    return (exponent - STATS_SUB_BITS + 1) * sub_count + sub;
+}
+
+/// @brief Returns the slab of the calling thread, registering it on first use.
+/// @return NULL if it could not be allocated
+static ThreadStats *get_thread_stats()
+{
+    if (thread_stats) return thread_stats;
+
+    ThreadStats *slab = calloc(1, sizeof(ThreadStats));
+    if (!slab) return NULL;
+    slab->next = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&all_threads, &slab->next, slab, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+    thread_stats = slab;
+    return slab;
+}
+
+/// @brief Adds n to a counter of the slab, readable concurrently by ssfs_get_stats().
+/// @param counter
+/// @param n
+static inline void bump(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/// @brief Enters an instrumented operation.
+/// @param op
+/// @return the scope to pass to stats_end()
+StatsScope stats_begin(int op)
+{
+    StatsScope scope = { now_ns(), op, current_op };
+    current_op = op;
+    return scope;
+}
+
+/// @brief Leaves an instrumented operation and records its latency.
+/// @param scope
+/// @param ret value returned by the operation
+/// @param bytes bytes transferred for the caller
+void stats_end(StatsScope *scope, int ret, int bytes)
+{
+    uint64_t elapsed = now_ns() - scope->start_ns;
+    current_op = scope->previous_op;
+
+    ThreadStats *slab = get_thread_stats();
+    if (!slab) return;
+    OpStats *op = &slab->stats.ops[scope->op];
+    bump(&op->calls, 1);
+    if (ret < 0) bump(&op->errors, 1);
+    if (bytes > 0) bump(&op->bytes, (uint64_t)bytes);
+    bump(&op->total_ns, elapsed);
+    bump(&op->hist[bucket_of(elapsed)], 1);
+}
+
+/// @brief Adds n to a counter of the operation in progress on this thread.
+/// @param field_offset offsetof(OpStats, counter)
+/// @param n
+void stats_add(size_t field_offset, uint64_t n)
+{
+    if (current_op < 0) return;
+    ThreadStats *slab = get_thread_stats();
+    if (!slab) return;
+    bump((uint64_t *)((uint8_t *)&slab->stats.ops[current_op] + field_offset), n);
+}
+
+/// @brief Sums the counters of every thread into out.
+/// @param out
+/// @return 0
+int ssfs_get_stats(SsfsStats *out)
+{
+    memset(out, 0, sizeof(SsfsStats));
+    for (ThreadStats *t = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+        const uint64_t *src = (const uint64_t *)&t->stats;
+        uint64_t *dst = (uint64_t *)out;
+        for (size_t i = 0; i < STATS_NB_OPS * STATS_NB_FIELDS; ++i)
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/// @brief Resets every counter. Increments racing with the reset may be lost.
+void ssfs_reset_stats()
+{
+    for (ThreadStats *t = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+        uint64_t *counters = (uint64_t *)&t->stats;
+        for (size_t i = 0; i < STATS_NB_OPS * STATS_NB_FIELDS; ++i)
+            __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/// @brief Body of the dump thread.
+/// @param arg unused
+/// @return NULL
+static void *dump_loop(void *arg)
+{
+    (void)arg;
+    struct timespec interval = { dump_interval_ms / 1000, (long)(dump_interval_ms % 1000) * 1000000L };
+    while (__atomic_load_n(&dump_running, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+        SsfsStats snapshot;
+        ssfs_get_stats(&snapshot);
+        ssfs_print_stats(dump_file, &snapshot);
+    }
+    return NULL;
+}
+
+/// @brief Starts a thread printing the counters to f every interval_ms.
+/// @param f
+/// @param interval_ms
+/// @return 0 on success, fs_EON if a dump is already running or the thread cannot start
+int ssfs_stats_start_dump(FILE *f, unsigned interval_ms)
+{
+    if (dump_running || interval_ms == 0) return fs_EON;
+    dump_file = f;
+    dump_interval_ms = interval_ms;
+    dump_running = 1;
+    if (pthread_create(&dump_thread, NULL, dump_loop, NULL) != 0) {
+        dump_running = 0;
+        return fs_EON;
+    }
+    return 0;
+}
+
+/// @brief Stops the dump thread, after its last dump.
+void ssfs_stats_stop_dump()
+{
+    if (!dump_running) return;
+    __atomic_store_n(&dump_running, 0, __ATOMIC_RELEASE);
+    pthread_join(dump_thread, NULL);
+}
+
+#else
+
+StatsScope stats_begin(int op)
+{
+    StatsScope scope = { 0, op, -1 };
+    return scope;
+}
+
+void stats_end(StatsScope *scope, int ret, int bytes)
+{
+    (void)scope; (void)ret; (void)bytes;
+}
+
+void stats_add(size_t field_offset, uint64_t n)
+{
+    (void)field_offset; (void)n;
+}
+
+int ssfs_get_stats(SsfsStats *out)
+{
+    memset(out, 0, sizeof(SsfsStats));
+    return fs_ENOTSUP;
+}
+
+void ssfs_reset_stats()
+{
+}
+
+int ssfs_stats_start_dump(FILE *f, unsigned interval_ms)
+{
+    (void)f; (void)interval_ms;
+    return fs_ENOTSUP;
+}
+
+void ssfs_stats_stop_dump()
+{
+}
+
+#endif
@@ -0,0 +1,676 @@
+// ssfs_bench: reproducible micro- and macro-benchmarks of the fs.h API.
+//
+// Usage: ssfs_bench [-d dir] [-m dir,dir,...] [-o output.json] [-s seed] [-q]
+//
+// Every benchmark runs against freshly generated images in dir (use a tmpfs such as
+// /dev/shm and a directory on a real disk to compare both). Results are written as
+// JSON to output: one entry per benchmark with ops/s, MB/s and latency percentiles.
+// The members of striped volumes are spread over the -m directories, dir by default.
+// -q runs a reduced set of sizes for a quick check.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "fs.h"
+#include "stats.h"
+
+#define KiB 1024
+#define MiB (1024 * KiB)
+
+#define WORK_VOLUME_SIZE  (64 * MiB) // Volume used by the I/O benchmarks
+#define WORK_INODES       1024       // Inodes of the I/O benchmark volume
+#define WORK_FILE_SIZE    (4 * MiB)  // File used by the sequential and random benchmarks
+#define RANDOM_OPS        2000       // Operations per random benchmark
+#define META_OPS          512        // Files per create / stat / delete benchmark
+#define CHURN_OPS         2000       // Create-write-read-delete cycles
+#define MOUNT_ROUNDS      5          // Mounts measured per volume size
+#define CLONE_OPS         64         // Clones of the work file
+#define INTERLEAVED_FILES 4          // Files written side by side by the interleaved benchmark
+#define BATCH_ROUNDS      64         // Batches of META_OPS operations per batch benchmark
+#define STRIPE_WIDTH      64         // Stripe width of the striped volumes, in sectors
+#define STRIPE_ROUNDS     4          // Reads of the work file per striped volume
+
+/// @brief Latency samples of one benchmark.
+typedef struct {
+    uint64_t *lat_ns;
+    int count;
+    int capacity;
+    uint64_t bytes;
+    uint64_t total_ns;
+} Samples;
+
+static FILE *out;
+static int nb_results = 0;
+static uint64_t rng_state;
+static char image_path[512];
+static uint8_t *buffer;
+
+//=============================================================================
+//================================ HELPERS ====================================
+//=============================================================================
+
+/// @brief Current monotonic time in nanoseconds.
+/// @return
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/// @brief xorshift64* generator, seeded once so that runs are reproducible.
+/// @return
+static uint64_t next_random()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+static void samples_init(Samples *s, int capacity)
+{
+    s->lat_ns = malloc(sizeof(uint64_t) * capacity);
+    s->count = 0;
+    s->capacity = capacity;
+    s->bytes = 0;
+    s->total_ns = 0;
+    if (!s->lat_ns) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+}
+
+static void samples_add(Samples *s, uint64_t ns, uint64_t bytes)
+{
+    if (s->count < s->capacity)
+        s->lat_ns[s->count++] = ns;
+    s->bytes += bytes;
+    s->total_ns += ns;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const Samples *s, double p)
+{
+    if (s->count == 0) return 0;
+    int idx = (int)(p * (s->count - 1) + 0.5);
+    return s->lat_ns[idx];
+}
+
+/// @brief Emits one JSON result and releases the samples.
+/// @param name benchmark name
+/// @param param_name name of the benchmark parameter (op size, volume size, ...)
+/// @param param value of the parameter
+/// @param s
+static void emit(const char *name, const char *param_name, uint64_t param, Samples *s)
+{
+    qsort(s->lat_ns, s->count, sizeof(uint64_t), compare_u64);
+    double seconds = s->total_ns / 1e9;
+    double ops_per_sec = seconds > 0 ? s->count / seconds : 0;
+    double mb_per_sec = seconds > 0 ? s->bytes / (double)MiB / seconds : 0;
+
+    fprintf(out, "%s    {\"name\": \"%s\", \"%s\": %llu, \"ops\": %d, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+            "\"lat_ns\": {\"min\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu, \"mean\": %llu}}",
+            nb_results++ ? ",\n" : "", name, param_name, (unsigned long long)param, s->count, ops_per_sec, mb_per_sec,
+            (unsigned long long)percentile(s, 0.0), (unsigned long long)percentile(s, 0.5),
+            (unsigned long long)percentile(s, 0.9), (unsigned long long)percentile(s, 0.99),
+            (unsigned long long)percentile(s, 0.999), (unsigned long long)percentile(s, 1.0),
+            (unsigned long long)(s->count ? s->total_ns / s->count : 0));
+    fflush(out);
+    fprintf(stderr, "%-12s %s=%-8llu %10.1f ops/s %9.2f MB/s  p50 %llu ns  p99 %llu ns\n",
+            name, param_name, (unsigned long long)param, ops_per_sec, mb_per_sec,
+            (unsigned long long)percentile(s, 0.5), (unsigned long long)percentile(s, 0.99));
+    free(s->lat_ns);
+}
+
+/// @brief Creates a zero-filled image of size bytes at path.
+/// @param path
+/// @param size
+/// @return 0 on success, -1 on error
+static int make_image_at(const char *path, long size)
+{
+    remove(path);
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+    int ok = fseek(f, size - 1, SEEK_SET) == 0 && fputc(0, f) != EOF;
+    return (fclose(f) == 0 && ok) ? 0 : -1;
+}
+
+/// @brief Creates a zero-filled image of size bytes at image_path.
+/// @param size
+/// @return 0 on success, -1 on error
+static int make_image(long size)
+{
+    return make_image_at(image_path, size);
+}
+
+/// @brief Creates and formats a fresh volume, then mounts it.
+/// @param size
+/// @param inodes
+/// @return 0 on success, -1 on error
+static int fresh_volume(long size, int inodes)
+{
+    if (make_image(size) != 0 || format(image_path, inodes) != 0 || mount(image_path) != 0) {
+        fprintf(stderr, "Cannot set up a %ld byte volume at %s\n", size, image_path);
+        return -1;
+    }
+    return 0;
+}
+
+/// @brief Fills a file with size bytes of pseudo-random data, 64 KiB per call.
+/// @param inode
+/// @param size
+/// @return 0 on success, -1 on error
+static int fill_file(int inode, int size)
+{
+    for (int offset = 0; offset < size; offset += 64 * KiB) {
+        int len = size - offset < 64 * KiB ? size - offset : 64 * KiB;
+        if (write(inode, buffer, len, offset) != len) return -1;
+    }
+    return 0;
+}
+
+//=============================================================================
+//=============================== BENCHMARKS ==================================
+//=============================================================================
+
+/// @brief Format and mount time as a function of the volume size. Volumes are
+/// populated to half of their capacity with 1 MiB files before mounting.
+/// @param sizes zero terminated list of volume sizes
+static void bench_volume(const long *sizes)
+{
+    for (int i = 0; sizes[i]; ++i) {
+        long size = sizes[i];
+        int inodes = (int)(size / (64 * KiB));
+        Samples fmt, mnt;
+        samples_init(&fmt, 1);
+        samples_init(&mnt, MOUNT_ROUNDS);
+
+        // A size that cannot be set up is reported and skipped, the others still run
+        int ok = make_image(size) == 0;
+        uint64_t t = now_ns();
+        ok = ok && format(image_path, inodes) == 0;
+        if (ok) samples_add(&fmt, now_ns() - t, size);
+
+        ok = ok && mount(image_path) == 0;
+        if (ok) {
+            for (long used = 0; used + MiB <= size / 2; used += MiB) {
+                int inode = create();
+                if (inode < 0 || fill_file(inode, MiB) != 0) break;
+            }
+            unmount();
+        }
+
+        for (int r = 0; ok && r < MOUNT_ROUNDS; ++r) {
+            t = now_ns();
+            ok = mount(image_path) == 0;
+            if (ok) {
+                samples_add(&mnt, now_ns() - t, size);
+                unmount();
+            }
+        }
+
+        if (!ok) {
+            fprintf(stderr, "Cannot set up a %ld byte volume at %s\n", size, image_path);
+            free(fmt.lat_ns);
+            free(mnt.lat_ns);
+            continue;
+        }
+        emit("format", "volume_bytes", size, &fmt);
+        emit("mount", "volume_bytes", size, &mnt);
+    }
+}
+
+/// @brief Sequential write then read of a WORK_FILE_SIZE file with op_size calls.
+/// @param op_size
+static void bench_sequential(int op_size)
+{
+    if (fresh_volume(WORK_VOLUME_SIZE, WORK_INODES) != 0) return;
+    int inode = create();
+    if (inode < 0) {
+        fprintf(stderr, "Cannot create the work file (%d)\n", inode);
+        unmount();
+        return;
+    }
+    int nb_ops = WORK_FILE_SIZE / op_size;
+    Samples wr, rd;
+    samples_init(&wr, nb_ops);
+    samples_init(&rd, nb_ops);
+
+    for (int i = 0; i < nb_ops; ++i) {
+        uint64_t t = now_ns();
+        int r = write(inode, buffer, op_size, i * op_size);
+        samples_add(&wr, now_ns() - t, r > 0 ? r : 0);
+    }
+    for (int i = 0; i < nb_ops; ++i) {
+        uint64_t t = now_ns();
+        int r = read(inode, buffer, op_size, i * op_size);
+        samples_add(&rd, now_ns() - t, r > 0 ? r : 0);
+    }
+    unmount();
+
+    emit("seq_write", "op_bytes", op_size, &wr);
+    emit("seq_read", "op_bytes", op_size, &rd);
+}
+
+/// @brief Random aligned reads and writes of op_size inside a WORK_FILE_SIZE file, the
+/// reads both by inode and through an open handle.
+/// @param op_size
+static void bench_random(int op_size)
+{
+    if (fresh_volume(WORK_VOLUME_SIZE, WORK_INODES) != 0) return;
+    int inode = create();
+    if (fill_file(inode, WORK_FILE_SIZE) != 0) {
+        unmount();
+        return;
+    }
+
+    int nb_slots = WORK_FILE_SIZE / op_size;
+    Samples wr, rd, hrd;
+    samples_init(&wr, RANDOM_OPS);
+    samples_init(&rd, RANDOM_OPS);
+    samples_init(&hrd, RANDOM_OPS);
+
+    for (int i = 0; i < RANDOM_OPS; ++i) {
+        int offset = (int)(next_random() % nb_slots) * op_size;
+        uint64_t t = now_ns();
+        int r = read(inode, buffer, op_size, offset);
+        samples_add(&rd, now_ns() - t, r > 0 ? r : 0);
+    }
+    int handle = ssfs_open(inode);
+    for (int i = 0; handle >= 0 && i < RANDOM_OPS; ++i) {
+        int offset = (int)(next_random() % nb_slots) * op_size;
+        uint64_t t = now_ns();
+        int r = ssfs_pread(handle, buffer, op_size, offset);
+        samples_add(&hrd, now_ns() - t, r > 0 ? r : 0);
+    }
+    ssfs_close(handle);
+    for (int i = 0; i < RANDOM_OPS; ++i) {
+        int offset = (int)(next_random() % nb_slots) * op_size;
+        uint64_t t = now_ns();
+        int r = write(inode, buffer, op_size, offset);
+        samples_add(&wr, now_ns() - t, r > 0 ? r : 0);
+    }
+    unmount();
+
+    emit("rand_read", "op_bytes", op_size, &rd);
+    emit("handle_rand_read", "op_bytes", op_size, &hrd);
+    emit("rand_write", "op_bytes", op_size, &wr);
+}
+
+/// @brief create, stat and delete throughput over META_OPS small files.
+static void bench_metadata()
+{
+    if (fresh_volume(WORK_VOLUME_SIZE, WORK_INODES) != 0) return;
+    int inodes[META_OPS];
+    Samples cr, st, del;
+    samples_init(&cr, META_OPS);
+    samples_init(&st, META_OPS);
+    samples_init(&del, META_OPS);
+
+    for (int i = 0; i < META_OPS; ++i) {
+        uint64_t t = now_ns();
+        inodes[i] = create();
+        samples_add(&cr, now_ns() - t, 0);
+        write(inodes[i], buffer, 100, 0);
+    }
+    for (int i = 0; i < META_OPS; ++i) {
+        int inode = inodes[next_random() % META_OPS];
+        uint64_t t = now_ns();
+        stat(inode);
+        samples_add(&st, now_ns() - t, 0);
+    }
+    for (int i = 0; i < META_OPS; ++i) {
+        uint64_t t = now_ns();
+        delete(inodes[i]);
+        samples_add(&del, now_ns() - t, 0);
+    }
+    unmount();
+
+    emit("create", "files", META_OPS, &cr);
+    emit("stat", "files", META_OPS, &st);
+    emit("delete", "files", META_OPS, &del);
+}
+
+/// @brief The stat and read of META_OPS random small files submitted as one ssfs_batch()
+/// call, BATCH_ROUNDS times; compare with stat and rand_read, one call per file.
+static void bench_batch()
+{
+    if (fresh_volume(WORK_VOLUME_SIZE, WORK_INODES) != 0) return;
+    BatchOp ops[META_OPS];
+    for (int i = 0; i < META_OPS; ++i)
+        ops[i] = (BatchOp){ BATCH_CREATE, 0, NULL, 0, 0, 0 };
+    ssfs_batch(ops, META_OPS);
+    for (int i = 0; i < META_OPS; ++i)
+        ops[i] = (BatchOp){ BATCH_WRITE, ops[i].result, buffer, 100, 0, 0 };
+    ssfs_batch(ops, META_OPS);
+
+    Samples st, rd;
+    samples_init(&st, BATCH_ROUNDS);
+    samples_init(&rd, BATCH_ROUNDS);
+    for (int round = 0; round < 2 * BATCH_ROUNDS; ++round) {
+        int reads = round >= BATCH_ROUNDS;
+        for (int i = 0; i < META_OPS; ++i) {
+            int inode = (int)(next_random() % META_OPS);
+            ops[i] = reads ? (BatchOp){ BATCH_READ, inode, buffer + i * 100, 100, 0, 0 }
+                           : (BatchOp){ BATCH_STAT, inode, NULL, 0, 0, 0 };
+        }
+        uint64_t t = now_ns();
+        ssfs_batch(ops, META_OPS);
+        samples_add(reads ? &rd : &st, now_ns() - t, reads ? META_OPS * 100 : 0);
+    }
+    unmount();
+
+    emit("batch_stat", "batch_ops", META_OPS, &st);
+    emit("batch_read", "batch_ops", META_OPS, &rd);
+}
+
+/// @brief Small-file churn: create, write 1-4 KiB, read it back, delete.
+static void bench_churn()
+{
+    if (fresh_volume(WORK_VOLUME_SIZE, WORK_INODES) != 0) return;
+    Samples s;
+    samples_init(&s, CHURN_OPS);
+
+    for (int i = 0; i < CHURN_OPS; ++i) {
+        int len = KiB + (int)(next_random() % (3 * KiB));
+        uint64_t t = now_ns();
+        int inode = create();
+        write(inode, buffer, len, 0);
+        read(inode, buffer, len, 0);
+        delete(inode);
+        samples_add(&s, now_ns() - t, 2 * (uint64_t)len);
+    }
+    unmount();
+
+    emit("churn", "cycles", CHURN_OPS, &s);
+}
+
+/// @brief Sequential write then read of a WORK_FILE_SIZE text-like file in 64 KiB
+/// calls, stored as is and LZ4 compressed (set_compression()). The data blocks moved
+/// are printed with the stats when they are enabled.
+static void bench_compression()
+{
+    static const char *words[] = { "inode", "block", "the", "superblock", "of", "disk", "file",
+                                   "pointer", "and", "SSFS", "volume", "read", "write", "data" };
+    uint8_t *text = malloc(WORK_FILE_SIZE);
+    if (!text) return;
+    for (int i = 0; i < WORK_FILE_SIZE; ) {
+        const char *word = words[next_random() % (sizeof(words) / sizeof(words[0]))];
+        for (int j = 0; word[j] && i < WORK_FILE_SIZE; ++j) text[i++] = (uint8_t)word[j];
+        if (i < WORK_FILE_SIZE) text[i++] = (next_random() % 12) ? ' ' : '\n';
+    }
+
+    static const int modes[] = { COMPRESSION_NONE, COMPRESSION_LZ4 };
+    static const char *write_names[] = { "text_write", "lz4_write" };
+    static const char *read_names[] = { "text_read", "lz4_read" };
+    int op_size = 64 * KiB;
+    int nb_ops = WORK_FILE_SIZE / op_size;
+
+    for (int m = 0; m < 2; ++m) {
+        if (fresh_volume(WORK_VOLUME_SIZE, WORK_INODES) != 0) break;
+        Samples wr, rd;
+        samples_init(&wr, nb_ops);
+        samples_init(&rd, nb_ops);
+
+        int inode = create();
+        set_compression(inode, modes[m]);
+        for (int i = 0; i < nb_ops; ++i) {
+            uint64_t t = now_ns();
+            int r = write(inode, text + i * op_size, op_size, i * op_size);
+            samples_add(&wr, now_ns() - t, r > 0 ? r : 0);
+        }
+        for (int i = 0; i < nb_ops; ++i) {
+            uint64_t t = now_ns();
+            int r = read(inode, buffer, op_size, i * op_size);
+            samples_add(&rd, now_ns() - t, r > 0 ? r : 0);
+        }
+        unmount();
+
+        emit(write_names[m], "op_bytes", op_size, &wr);
+        emit(read_names[m], "op_bytes", op_size, &rd);
+    }
+    free(text);
+}
+
+/// @brief clone_file() of a WORK_FILE_SIZE file, then the first 4 KiB write to each
+/// clone, which copies the shared blocks on its path.
+static void bench_clone()
+{
+    if (fresh_volume(WORK_VOLUME_SIZE, WORK_INODES) != 0) return;
+    int inode = create();
+    if (fill_file(inode, WORK_FILE_SIZE) != 0) {
+        unmount();
+        return;
+    }
+
+    int clones[CLONE_OPS];
+    Samples cl, cow;
+    samples_init(&cl, CLONE_OPS);
+    samples_init(&cow, CLONE_OPS);
+
+    for (int i = 0; i < CLONE_OPS; ++i) {
+        uint64_t t = now_ns();
+        clones[i] = clone_file(inode);
+        samples_add(&cl, now_ns() - t, WORK_FILE_SIZE);
+    }
+    for (int i = 0; i < CLONE_OPS; ++i) {
+        int offset = (int)(next_random() % (WORK_FILE_SIZE / (4 * KiB))) * 4 * KiB;
+        uint64_t t = now_ns();
+        int r = write(clones[i], buffer, 4 * KiB, offset);
+        samples_add(&cow, now_ns() - t, r > 0 ? r : 0);
+    }
+    for (int i = 0; i < CLONE_OPS; ++i)
+        delete(clones[i]);
+    unmount();
+
+    emit("clone", "file_bytes", WORK_FILE_SIZE, &cl);
+    emit("cow_write", "op_bytes", 4 * KiB, &cow);
+}
+
+/// @brief Sequential 64 KiB reads of a WORK_FILE_SIZE file just after mount, without
+/// and with checksums (enable_checksums()): every block is verified on this first read.
+static void bench_checksums()
+{
+    static const char *read_names[] = { "nocsum_seq_read", "csum_seq_read" };
+    static const char *write_names[] = { "nocsum_seq_write", "csum_seq_write" };
+    int op_size = 64 * KiB;
+    int nb_ops = WORK_FILE_SIZE / op_size;
+
+    for (int m = 0; m < 2; ++m) {
+        if (fresh_volume(WORK_VOLUME_SIZE, WORK_INODES) != 0) break;
+        if (m == 1 && enable_checksums() != 0) {
+            unmount();
+            break;
+        }
+        Samples wr, rd;
+        samples_init(&wr, nb_ops);
+        samples_init(&rd, nb_ops);
+
+        int inode = create();
+        for (int i = 0; i < nb_ops; ++i) {
+            uint64_t t = now_ns();
+            int r = write(inode, buffer, op_size, i * op_size);
+            samples_add(&wr, now_ns() - t, r > 0 ? r : 0);
+        }
+        unmount();
+        if (mount(image_path) != 0) break;
+        for (int i = 0; i < nb_ops; ++i) {
+            uint64_t t = now_ns();
+            int r = read(inode, buffer, op_size, i * op_size);
+            samples_add(&rd, now_ns() - t, r > 0 ? r : 0);
+        }
+        unmount();
+
+        emit(write_names[m], "op_bytes", op_size, &wr);
+        emit(read_names[m], "op_bytes", op_size, &rd);
+    }
+}
+
+/// @brief INTERLEAVED_FILES files of WORK_FILE_SIZE / INTERLEAVED_FILES written side by
+/// side in 4 KiB calls, as concurrent writers would, then read back sequentially in
+/// 64 KiB calls after a remount; with preallocate() of each file first, and without.
+static void bench_interleaved()
+{
+    static const char *write_names[] = { "interleaved_write", "prealloc_write" };
+    static const char *read_names[] = { "interleaved_read", "prealloc_read" };
+    int file_size = WORK_FILE_SIZE / INTERLEAVED_FILES;
+    int nb_writes = file_size / (4 * KiB);
+    int nb_reads = file_size / (64 * KiB);
+
+    for (int m = 0; m < 2; ++m) {
+        if (fresh_volume(WORK_VOLUME_SIZE, WORK_INODES) != 0) break;
+        Samples wr, rd;
+        samples_init(&wr, nb_writes * INTERLEAVED_FILES);
+        samples_init(&rd, nb_reads * INTERLEAVED_FILES);
+
+        int inodes[INTERLEAVED_FILES];
+        for (int f = 0; f < INTERLEAVED_FILES; ++f) {
+            inodes[f] = create();
+            if (m == 1) preallocate(inodes[f], file_size, 0);
+        }
+        for (int i = 0; i < nb_writes; ++i) {
+            for (int f = 0; f < INTERLEAVED_FILES; ++f) {
+                uint64_t t = now_ns();
+                int r = write(inodes[f], buffer, 4 * KiB, i * 4 * KiB);
+                samples_add(&wr, now_ns() - t, r > 0 ? r : 0);
+            }
+        }
+        unmount();
+        if (mount(image_path) != 0) break;
+        for (int f = 0; f < INTERLEAVED_FILES; ++f) {
+            for (int i = 0; i < nb_reads; ++i) {
+                uint64_t t = now_ns();
+                int r = read(inodes[f], buffer, 64 * KiB, i * 64 * KiB);
+                samples_add(&rd, now_ns() - t, r > 0 ? r : 0);
+            }
+        }
+        unmount();
+
+        emit(write_names[m], "op_bytes", 4 * KiB, &wr);
+        emit(read_names[m], "op_bytes", 64 * KiB, &rd);
+    }
+}
+
+/// @brief Sequential 1 MiB reads of a WORK_FILE_SIZE file, after a remount, on a
+/// WORK_VOLUME_SIZE volume striped over nb_members images spread over member_dirs.
+/// @param member_dirs comma separated directories
+/// @param nb_members
+static void bench_striped(const char *member_dirs, int nb_members)
+{
+    char spec[4096];
+    char paths[8][512];
+    int len = snprintf(spec, sizeof(spec), "stripe:%d:", STRIPE_WIDTH);
+    const char *dir = member_dirs;
+    for (int i = 0; i < nb_members; ++i) {
+        int dir_len = (int)strcspn(dir, ",");
+        snprintf(paths[i], sizeof(paths[i]), "%.*s/ssfs_bench.%d.img", dir_len, dir, i);
+        if (make_image_at(paths[i], WORK_VOLUME_SIZE / nb_members) != 0) return;
+        len += snprintf(spec + len, sizeof(spec) - len, "%s%s", i ? "," : "", paths[i]);
+        dir = dir[dir_len] == ',' ? dir + dir_len + 1 : member_dirs;
+    }
+
+    int nb_ops = WORK_FILE_SIZE / MiB;
+    Samples rd;
+    samples_init(&rd, nb_ops * STRIPE_ROUNDS);
+    int inode = -1;
+    if (format(spec, WORK_INODES) == 0 && mount(spec) == 0) {
+        inode = create();
+        if (inode < 0 || fill_file(inode, WORK_FILE_SIZE) != 0) inode = -1;
+        unmount();
+    }
+    if (inode >= 0 && mount(spec) == 0) {
+        for (int round = 0; round < STRIPE_ROUNDS; ++round) {
+            for (int i = 0; i < nb_ops; ++i) {
+                uint64_t t = now_ns();
+                int r = read(inode, buffer, MiB, i * MiB);
+                samples_add(&rd, now_ns() - t, r > 0 ? r : 0);
+            }
+        }
+        unmount();
+    } else {
+        fprintf(stderr, "Cannot set up a volume striped over %s\n", spec);
+    }
+    for (int i = 0; i < nb_members; ++i)
+        remove(paths[i]);
+
+    emit("striped_read", "members", nb_members, &rd);
+}
+
+//=============================================================================
+//=============================== ENTRY POINT =================================
+//=============================================================================
+
+int main(int argc, char *argv[])
+{
+    const char *dir = ".";
+    const char *member_dirs = NULL;
+    const char *output = "bench.json";
+    uint64_t seed = 42;
+    int quick = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) dir = argv[++i];
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) member_dirs = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-q") == 0) quick = 1;
+        else {
+            printf("Usage: %s [-d dir] [-m dir,dir,...] [-o output.json] [-s seed] [-q]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    rng_state = seed ? seed : 1;
+    snprintf(image_path, sizeof(image_path), "%s/ssfs_bench.img", dir);
+    buffer = malloc(MiB);
+    out = fopen(output, "w");
+    if (!buffer || !out) {
+        fprintf(stderr, "Cannot open %s\n", output);
+        return 1;
+    }
+    for (int i = 0; i < MiB; ++i)
+        buffer[i] = (uint8_t)next_random();
+
+    static const long volume_sizes[] = { 1 * MiB, 4 * MiB, 16 * MiB, 64 * MiB, 0 };
+    static const long quick_volume_sizes[] = { 1 * MiB, 4 * MiB, 0 };
+    static const int seq_sizes[] = { KiB, 4 * KiB, 64 * KiB, MiB, 0 };
+    static const int quick_seq_sizes[] = { 4 * KiB, 0 };
+
+    fprintf(out, "{\n  \"benchmark\": \"ssfs\",\n  \"dir\": \"%s\",\n  \"seed\": %llu,\n  \"results\": [\n",
+            dir, (unsigned long long)seed);
+
+    bench_volume(quick ? quick_volume_sizes : volume_sizes);
+    for (const int *size = quick ? quick_seq_sizes : seq_sizes; *size; ++size)
+        bench_sequential(*size);
+    bench_random(KiB);
+    bench_random(4 * KiB);
+    bench_metadata();
+    bench_batch();
+    bench_churn();
+    bench_clone();
+    bench_compression();
+    bench_checksums();
+    bench_interleaved();
+    for (int members = 1; members <= 4; members *= 2)
+        bench_striped(member_dirs ? member_dirs : dir, members);
+
+    SsfsStats stats;
+    if (ssfs_get_stats(&stats) == 0)
+        ssfs_print_stats(stderr, &stats);
+
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    free(buffer);
+    remove(image_path);
+    return 0;
+}
@@ -0,0 +1,86 @@
+// ssfs_dedup: offline deduplication of an SSFS image.
+//
+// Usage: ssfs_dedup [-n] <image>
+//
+// Turns the dedup mode of the volume on (set_dedup()), then has every file give up
+// its blocks whose contents are already stored elsewhere in the volume (dedup_file()):
+// identical files, or identical blocks inside disk images stored as files, end up
+// sharing their blocks, copied on write. The dedup mode stays on, so that later writes
+// of duplicate data are shared as well, unless -n is given.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "fs.h"
+#include "error.h"
+
+/// @brief Milliseconds elapsed since start.
+/// @param start
+/// @return
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    int keep_mode = 1;
+    int argi = 1;
+
+    for (; argi < argc && argv[argi][0] == '-'; ++argi) {
+        if (strcmp(argv[argi], "-n") == 0) keep_mode = 0;
+        else break;
+    }
+    if (argc - argi != 1) {
+        printf("Usage: %s [-n] <image>\n", argv[0]);
+        return 1;
+    }
+    char *image_path = argv[argi];
+
+    if (mount(image_path) != 0) {
+        fprintf(stderr, "%s: cannot mount\n", image_path);
+        return 1;
+    }
+    if (set_dedup(1) != 0) {
+        fprintf(stderr, "%s: cannot turn the dedup mode on\n", image_path);
+        unmount();
+        return 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // stat() tells free inodes (fs_EREAD) from the end of the inode table (fs_EMOUNT)
+    long nb_files = 0, nb_shared = 0, nb_errors = 0;
+    unsigned long long nb_bytes = 0;
+    for (int inode = 0; ; ++inode) {
+        int size = stat(inode);
+        if (size == fs_EMOUNT) break;
+        if (size < 0) continue;
+
+        int shared = dedup_file(inode);
+        if (shared < 0) {
+            fprintf(stderr, "inode %d: dedup_file() failed (%d)\n", inode, shared);
+            nb_errors++;
+            continue;
+        }
+        nb_files++;
+        nb_bytes += (unsigned)size;
+        nb_shared += shared;
+    }
+    double ms = elapsed_ms(&start);
+
+    if (!keep_mode && set_dedup(0) != 0) nb_errors++;
+    if (unmount() != 0) nb_errors++;
+
+    printf("%s: %ld files, %.1f MiB scanned in %.3f ms\n", image_path, nb_files, nb_bytes / 1048576.0, ms);
+    printf("  blocks now shared: %ld (%.1f MiB freed)%s\n", nb_shared, nb_shared / 1024.0,
+           keep_mode ? ", dedup mode on" : "");
+    return nb_errors ? 1 : 0;
+}
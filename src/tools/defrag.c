@@ -0,0 +1,103 @@
+// ssfs_defrag: fragmentation report and online defragmenter for SSFS images.
+//
+// Usage: ssfs_defrag [-n] [-r KiB/s] [-t min_score] [-v] <image>
+//
+// Every file is walked with file_layout() and given a fragmentation score: 0 when its
+// data blocks form a single extent, 100 when no two of them are consecutive. The files
+// scoring at least min_score (default 1) are moved to contiguous runs with defrag_file(),
+// at most KiB/s copied per second with -r. -n only reports, -v lists every file.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "fs.h"
+#include "error.h"
+
+/// @brief Fragmentation score of a file, 0 (one extent) to 100 (one extent per block).
+/// @param layout
+/// @return
+static int score(const FileLayout *layout)
+{
+    if (layout->data_blocks <= 1 || layout->extents <= 1) return 0;
+    return (int)((uint64_t)(layout->extents - 1) * 100 / (layout->data_blocks - 1));
+}
+
+int main(int argc, char *argv[])
+{
+    int report_only = 0, verbose = 0;
+    int rate_kib = 0, min_score = 1;
+    int argi = 1;
+
+    for (; argi < argc && argv[argi][0] == '-'; ++argi) {
+        if (strcmp(argv[argi], "-n") == 0) report_only = 1;
+        else if (strcmp(argv[argi], "-v") == 0) verbose = 1;
+        else if (strcmp(argv[argi], "-r") == 0 && argi + 1 < argc) rate_kib = atoi(argv[++argi]);
+        else if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc) min_score = atoi(argv[++argi]);
+        else break;
+    }
+    if (argc - argi != 1 || rate_kib < 0) {
+        printf("Usage: %s [-n] [-r KiB/s] [-t min_score] [-v] <image>\n", argv[0]);
+        return 1;
+    }
+    char *image_path = argv[argi];
+
+    if (mount(image_path) != 0) {
+        fprintf(stderr, "%s: cannot mount\n", image_path);
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long nb_files = 0, nb_fragmented = 0, nb_defragmented = 0, nb_errors = 0;
+    unsigned long long extents_before = 0, extents_after = 0, blocks_moved = 0;
+    if (verbose) printf("%8s %10s %8s %8s %6s %8s\n", "inode", "blocks", "shared", "extents", "score", "after");
+
+    // file_layout() tells free inodes (fs_EREAD) from the end of the inode table (fs_EMOUNT)
+    for (int inode = 0; ; ++inode) {
+        FileLayout layout;
+        int ret = file_layout(inode, &layout);
+        if (ret == fs_EMOUNT) break;
+        if (ret < 0) continue;
+
+        nb_files++;
+        extents_before += layout.extents;
+        int before = score(&layout);
+        if (before >= min_score && layout.extents > 1) nb_fragmented++;
+
+        FileLayout after = layout;
+        if (!report_only && before >= min_score && layout.extents > 1) {
+            int moved = defrag_file(inode, rate_kib);
+            if (moved == fs_EWRITE) {
+                fprintf(stderr, "inode %d: no run of %u free blocks\n", inode,
+                        layout.data_blocks + layout.pointer_blocks - layout.shared_blocks);
+            } else if (moved < 0) {
+                fprintf(stderr, "inode %d: defrag_file() failed (%d)\n", inode, moved);
+                nb_errors++;
+            } else {
+                blocks_moved += (unsigned)moved;
+                if (file_layout(inode, &after) != 0) after = layout;
+                if (after.extents < layout.extents) nb_defragmented++;
+            }
+        }
+        extents_after += after.extents;
+
+        if (verbose)
+            printf("%8d %10u %8u %8u %6d %8u\n", inode, layout.data_blocks, layout.shared_blocks,
+                   layout.extents, before, after.extents);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    if (unmount() != 0) nb_errors++;
+
+    printf("%s: %ld files, %ld fragmented, %llu extents\n", image_path, nb_files, nb_fragmented, extents_before);
+    if (!report_only)
+        printf("  %ld files defragmented, %llu blocks moved, %llu extents left in %.3f ms\n",
+               nb_defragmented, blocks_moved, extents_after, ms);
+    return nb_errors ? 1 : 0;
+}
@@ -0,0 +1,836 @@
+// ssfs_fsck: offline consistency checker for SSFS disk images.
+//
+// Usage: ssfs_fsck [-r] [-s] [-j threads] [-v] <disk_image>
+//
+// The image is checked in three phases, four with -s:
+//   1. superblock  : magic number, block size and volume geometry
+//   2. inodes      : inode status and size, every direct / indirect / double-indirect
+//                    pointer is range checked and claims its block in a shared table
+//                    that records the owner and the depth of the first claim; a second
+//                    claim on the same block is a cross-link, unless the volume shares
+//                    blocks (SSFS_FEATURE_REFLINK) and both claims have the same depth
+//                    (a block is never both data and pointers); then the snapshots listed
+//                    in the superblock are checked the same way
+//   3. leaks       : every data block nobody claimed must be zero, otherwise it is leaked
+//                    (free blocks are kept zeroed by release_block())
+//   4. scrub       : on a volume with checksums (SSFS_FEATURE_CHECKSUMS), every block is
+//                    read and checked against its CRC32C
+// Phases 2 to 4 are split into chunks that worker threads pick up from an atomic counter.
+//
+// With -r, invalid and cross-linked pointers are cleared, bad inodes are freed and leaked
+// blocks are zeroed. Cross-links found by the workers are resolved afterwards by a serial
+// walk in inode order, so that the pointer kept is always the one of the lowest inode;
+// the checksums of the blocks rewritten are updated. The checksums that do not match are
+// forgotten, so that the volume can be mounted again (a block whose checksum is unknown
+// is not verified). Exit status follows e2fsck: 0 clean, 1 errors corrected, 4 errors
+// left uncorrected, 8 operational error.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "ssfs.h"
+#include "crc32c.h"
+
+#define FSCK_OK          0 // No error found
+#define FSCK_CORRECTED   1 // Errors found and corrected
+#define FSCK_UNCORRECTED 4 // Errors left uncorrected
+#define FSCK_OPERATIONAL 8 // Could not check the image
+
+#define INODE_BATCH 16   // Inode blocks read per work item
+#define LEAK_BATCH  256  // Data blocks read per work item
+#define MAX_REPORTS 100  // Problems printed without -v
+
+#define CLAIM_DEPTH_SHIFT 32 // A claim is (depth + 1) << CLAIM_DEPTH_SHIFT | owner, 0 if none
+#define CLAIM_SNAPSHOT    3  // Depth of the root and inode table blocks of a snapshot
+
+/// @brief Shared state of a check. Counters, claims and bitmaps are only touched atomically.
+typedef struct {
+    int fd;
+    int repair;
+    int verbose;
+    int scrub;
+    SuperBlock sb;
+    uint32_t nb_inodes;
+    uint32_t inode_start_block;
+    uint32_t data_start_block;
+    uint32_t data_end_block;     // Start of the checksum region, if any
+    uint64_t *claims;            // One claim per block, set by the first pointer to it
+    uint64_t *conflicts;         // One bit per block with conflicting claims, with -r
+    int defer_repair;            // Cross-links are marked in conflicts instead of cleared
+    int resolving;               // The serial walk of resolve_cross_links() is running
+    uint32_t *sums;              // Checksum region, NULL without SSFS_FEATURE_CHECKSUMS
+    int sums_dirty;              // The checksum region must be written back
+    uint32_t next_chunk;         // Work counter of the running phase
+    uint64_t nb_files;
+    uint64_t nb_used_blocks;
+    uint64_t nb_bad_inodes;
+    uint64_t nb_invalid_ptrs;
+    uint64_t nb_cross_links;
+    uint64_t nb_shared;
+    uint64_t nb_snapshots;
+    uint64_t nb_snapshot_files;
+    uint64_t nb_bad_snapshots;
+    uint64_t nb_leaked;
+    uint64_t nb_verified;
+    uint64_t nb_bad_checksums;
+    uint64_t nb_fixed;
+    uint64_t nb_io_errors;
+    uint64_t nb_reports;
+} Fsck;
+
+static int read_blocks(Fsck *fsck, uint32_t block_num, uint32_t count, uint8_t *buffer);
+static int write_block(Fsck *fsck, uint32_t block_num, const uint8_t *buffer);
+static void report(Fsck *fsck, const char *fmt, uint32_t a, uint32_t b, uint32_t c);
+static double elapsed_ms(const struct timespec *start);
+static int check_superblock(Fsck *fsck, const char *disk_name);
+static void run_phase(Fsck *fsck, void *(*worker)(void *), int nb_threads);
+static void *inode_worker(void *arg);
+static void resolve_cross_links(Fsck *fsck);
+static void check_snapshots(Fsck *fsck);
+static void *leak_worker(void *arg);
+static int load_checksums(Fsck *fsck);
+static int store_checksums(Fsck *fsck);
+static void *scrub_worker(void *arg);
+
+//=============================================================================
+//=============================== ENTRY POINT =================================
+//=============================================================================
+
+int main(int argc, char *argv[])
+{
+    Fsck fsck;
+    memset(&fsck, 0, sizeof(fsck));
+    long nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "rsj:v")) != -1) {
+        switch (opt) {
+        case 'r': fsck.repair = 1; break;
+        case 's': fsck.scrub = 1; break;
+        case 'j': nb_threads = strtol(optarg, NULL, 10); break;
+        case 'v': fsck.verbose = 1; break;
+        default:
+            printf("Usage: %s [-r] [-s] [-j threads] [-v] <disk_image>\n", argv[0]);
+            return FSCK_OPERATIONAL;
+        }
+    }
+    if (optind != argc - 1) {
+        printf("Usage: %s [-r] [-s] [-j threads] [-v] <disk_image>\n", argv[0]);
+        return FSCK_OPERATIONAL;
+    }
+    if (nb_threads < 1) nb_threads = 1;
+
+    char *disk_name = argv[optind];
+    fsck.fd = open(disk_name, fsck.repair ? O_RDWR : O_RDONLY);
+    if (fsck.fd < 0) {
+        perror(disk_name);
+        return FSCK_OPERATIONAL;
+    }
+
+    struct timespec start, total;
+    clock_gettime(CLOCK_MONOTONIC, &total);
+
+    // Phase 1: superblock
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = check_superblock(&fsck, disk_name);
+    printf("Phase 1: superblock ............ %9.3f ms\n", elapsed_ms(&start));
+    if (status != FSCK_OK) {
+        close(fsck.fd);
+        return status;
+    }
+
+    fsck.claims = calloc(fsck.sb.nb_blocks, sizeof(uint64_t));
+    fsck.conflicts = calloc((fsck.sb.nb_blocks + 63) / 64, sizeof(uint64_t));
+    if (!fsck.claims || !fsck.conflicts) {
+        free(fsck.claims);
+        free(fsck.conflicts);
+        fprintf(stderr, "Out of memory for %u blocks\n", fsck.sb.nb_blocks);
+        close(fsck.fd);
+        return FSCK_OPERATIONAL;
+    }
+    if ((fsck.sb.features & SSFS_FEATURE_CHECKSUMS) && load_checksums(&fsck) != 0) {
+        fprintf(stderr, "%s: cannot read the checksum region\n", disk_name);
+        free(fsck.claims);
+        free(fsck.conflicts);
+        close(fsck.fd);
+        return FSCK_OPERATIONAL;
+    }
+
+    // Phase 2: inode table and pointer trees
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fsck.defer_repair = fsck.repair;
+    run_phase(&fsck, inode_worker, (int)nb_threads);
+    fsck.defer_repair = 0;
+    if (fsck.repair && fsck.nb_cross_links)
+        resolve_cross_links(&fsck);
+    check_snapshots(&fsck);
+    printf("Phase 2: inodes and pointers ... %9.3f ms\n", elapsed_ms(&start));
+
+    // Phase 3: unreferenced blocks
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_phase(&fsck, leak_worker, (int)nb_threads);
+    printf("Phase 3: leaked blocks ......... %9.3f ms\n", elapsed_ms(&start));
+
+    // Phase 4: checksums
+    if (fsck.scrub && fsck.sums) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run_phase(&fsck, scrub_worker, (int)nb_threads);
+        double ms = elapsed_ms(&start);
+        printf("Phase 4: scrub ................. %9.3f ms (%.1f MiB/s, crc32c %s)\n", ms,
+               ms > 0 ? fsck.data_end_block / 1024.0 / (ms / 1e3) : 0, crc32c_impl_name());
+    }
+
+    if (fsck.sums_dirty && store_checksums(&fsck) != 0)
+        fsck.nb_io_errors++;
+    if (fsck.repair && fsync(fsck.fd) != 0)
+        fsck.nb_io_errors++;
+    printf("Total .......................... %9.3f ms (%ld threads)\n", elapsed_ms(&total), nb_threads);
+
+    uint64_t nb_errors = fsck.nb_bad_inodes + fsck.nb_invalid_ptrs + fsck.nb_cross_links + fsck.nb_leaked
+                       + fsck.nb_bad_snapshots + fsck.nb_bad_checksums;
+    printf("\n%s: %llu files, %llu/%u blocks used\n", disk_name,
+           (unsigned long long)fsck.nb_files, (unsigned long long)fsck.nb_used_blocks, fsck.sb.nb_blocks);
+    printf("  bad inodes: %llu, invalid pointers: %llu, cross-linked: %llu, leaked: %llu\n",
+           (unsigned long long)fsck.nb_bad_inodes, (unsigned long long)fsck.nb_invalid_ptrs,
+           (unsigned long long)fsck.nb_cross_links, (unsigned long long)fsck.nb_leaked);
+    if (fsck.sb.features & SSFS_FEATURE_REFLINK)
+        printf("  shared pointers: %llu, snapshots: %llu (%llu files), bad snapshots: %llu\n",
+               (unsigned long long)fsck.nb_shared, (unsigned long long)fsck.nb_snapshots,
+               (unsigned long long)fsck.nb_snapshot_files, (unsigned long long)fsck.nb_bad_snapshots);
+    if (fsck.scrub && fsck.sums)
+        printf("  verified blocks: %llu, checksum mismatches: %llu\n",
+               (unsigned long long)fsck.nb_verified, (unsigned long long)fsck.nb_bad_checksums);
+    if (fsck.repair)
+        printf("  fixed: %llu\n", (unsigned long long)fsck.nb_fixed);
+    if (fsck.nb_io_errors)
+        printf("  I/O errors: %llu\n", (unsigned long long)fsck.nb_io_errors);
+
+    free(fsck.claims);
+    free(fsck.conflicts);
+    free(fsck.sums);
+    close(fsck.fd);
+
+    if (fsck.nb_io_errors) return FSCK_OPERATIONAL;
+    if (nb_errors == 0) return FSCK_OK;
+    return fsck.nb_fixed == nb_errors ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+}
+
+//=============================================================================
+//================================= PHASES ====================================
+//=============================================================================
+
+/// @brief Validates the superblock and derives the volume geometry.
+/// @param fsck
+/// @param disk_name
+/// @return FSCK_OK if the rest of the image can be checked
+static int check_superblock(Fsck *fsck, const char *disk_name)
+{
+    uint8_t block[BLOCK_SIZE];
+    if (read_blocks(fsck, SUPERBLOCK_SECTOR, 1, block) != 0) {
+        fprintf(stderr, "%s: cannot read superblock\n", disk_name);
+        return FSCK_OPERATIONAL;
+    }
+    memcpy(&fsck->sb, block, sizeof(SuperBlock));
+    SuperBlock *sb = &fsck->sb;
+
+    if (memcmp(sb->magic, MAGIC_NUMBER, MAGIC_NUMBER_SIZE) != 0) {
+        printf("%s: bad magic number, not an SSFS volume\n", disk_name);
+        return FSCK_UNCORRECTED;
+    }
+    if (sb->block_size != BLOCK_SIZE) {
+        printf("%s: unsupported block size %u\n", disk_name, sb->block_size);
+        return FSCK_UNCORRECTED;
+    }
+
+    off_t image_size = lseek(fsck->fd, 0, SEEK_END);
+    uint64_t image_blocks = image_size < 0 ? 0 : (uint64_t)image_size / BLOCK_SIZE;
+    if (sb->nb_blocks > image_blocks) {
+        printf("%s: superblock claims %u blocks but the image holds %llu\n",
+               disk_name, sb->nb_blocks, (unsigned long long)image_blocks);
+        return FSCK_UNCORRECTED;
+    }
+    if (sb->nb_inode_blocks == 0 || (uint64_t)sb->nb_inode_blocks + 1 >= sb->nb_blocks) {
+        printf("%s: bad inode table size %u for %u blocks\n", disk_name, sb->nb_inode_blocks, sb->nb_blocks);
+        return FSCK_UNCORRECTED;
+    }
+
+    fsck->nb_inodes = sb->nb_inode_blocks * INODES_PER_BLOCK;
+    fsck->inode_start_block = 1;
+    fsck->data_start_block = fsck->inode_start_block + sb->nb_inode_blocks;
+    fsck->data_end_block = sb->nb_blocks;
+
+    if (sb->features & SSFS_FEATURE_CHECKSUMS) {
+        uint32_t nb_sum_blocks = (sb->nb_blocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+        if (sb->checksum_start != sb->nb_blocks - nb_sum_blocks || sb->checksum_start <= fsck->data_start_block) {
+            printf("%s: bad checksum region start %u for %u blocks\n", disk_name, sb->checksum_start, sb->nb_blocks);
+            return FSCK_UNCORRECTED;
+        }
+        fsck->data_end_block = sb->checksum_start;
+    }
+    return FSCK_OK;
+}
+
+/// @brief Runs worker on nb_threads threads (the caller being one of them) until
+/// the work counter is exhausted.
+/// @param fsck
+/// @param worker
+/// @param nb_threads
+static void run_phase(Fsck *fsck, void *(*worker)(void *), int nb_threads)
+{
+    pthread_t *threads = malloc(sizeof(pthread_t) * nb_threads);
+    int started = 0;
+
+    fsck->next_chunk = 0;
+    for (int i = 1; threads && i < nb_threads; ++i) {
+        if (pthread_create(&threads[started], NULL, worker, fsck) != 0)
+            break;
+        started++;
+    }
+    worker(fsck);
+    for (int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+//=============================================================================
+//============================= INODE CHECKING ================================
+//=============================================================================
+
+/// @brief Claims a data-area block for owner, unless it is already claimed.
+/// @param fsck
+/// @param block_num
+/// @param owner inode (or snapshot) holding the pointer
+/// @param depth 0 for a data block, 1 or 2 for a pointer block, CLAIM_SNAPSHOT
+/// @param first set to the claim already made on the block, if any
+/// @return 1 if the block was not claimed yet, 0 if it was, -1 if it is out of range
+static int claim_block(Fsck *fsck, uint32_t block_num, uint32_t owner, int depth, uint64_t *first)
+{
+    if (block_num < fsck->data_start_block || block_num >= fsck->data_end_block)
+        return -1;
+
+    uint64_t claim = (uint64_t)(depth + 1) << CLAIM_DEPTH_SHIFT | owner;
+    uint64_t old = 0;
+    if (!__atomic_compare_exchange_n(&fsck->claims[block_num], &old, claim, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *first = old;
+        return 0;
+    }
+    if (!fsck->resolving)
+        __atomic_fetch_add(&fsck->nb_used_blocks, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/// @brief Checks a single pointer and claims the block it points to.
+/// Clears the pointer when repairing, or only marks its block during the parallel walk,
+/// the cross-links being cleared in inode order by resolve_cross_links().
+/// @param fsck
+/// @param ptr pointer inside an inode or pointer block buffer
+/// @param inode_num owner of the pointer
+/// @param depth 0 if the pointer is to a data block, 1 or 2 if to a pointer block
+/// @param dirty set to 1 when the pointer has been cleared
+/// @return 1 if the block is valid and now owned by inode_num, 0 otherwise (a shared
+/// block is valid, but its pointers have been checked through its first claim)
+static int check_pointer(Fsck *fsck, uint8_t *ptr, uint32_t inode_num, int depth, int *dirty)
+{
+    uint32_t block_num;
+    memcpy(&block_num, ptr, sizeof(uint32_t));
+    if (block_num == 0) return 0;
+
+    // The serial walk only decides on the blocks the workers found conflicting
+    if (fsck->resolving && (block_num < fsck->data_start_block || block_num >= fsck->data_end_block ||
+                            !(fsck->conflicts[block_num / 64] & ((uint64_t)1 << (block_num % 64)))))
+        return block_num >= fsck->data_start_block && block_num < fsck->data_end_block;
+
+    uint64_t first = 0;
+    int claim = claim_block(fsck, block_num, inode_num, depth, &first);
+    if (claim > 0) return 1;
+
+    if (claim < 0) {
+        __atomic_fetch_add(&fsck->nb_invalid_ptrs, 1, __ATOMIC_RELAXED);
+        report(fsck, "inode %u: pointer to block %u is out of range", inode_num, block_num, 0);
+    } else if ((fsck->sb.features & SSFS_FEATURE_REFLINK) && (int)(first >> CLAIM_DEPTH_SHIFT) == depth + 1) {
+        if (!fsck->resolving)
+            __atomic_fetch_add(&fsck->nb_shared, 1, __ATOMIC_RELAXED);
+        return 0;
+    } else {
+        __atomic_fetch_add(&fsck->nb_cross_links, 1, __ATOMIC_RELAXED);
+        const char *fmt = (int)(first >> CLAIM_DEPTH_SHIFT) != depth + 1
+            ? "inode %u: block %u is claimed both as data and as pointers by inode %u"
+            : "inode %u: block %u is already claimed by inode %u";
+        if (!fsck->resolving) // Already reported by the parallel walk
+            report(fsck, fmt, inode_num, block_num, (uint32_t)first);
+        if (fsck->defer_repair) {
+            __atomic_fetch_or(&fsck->conflicts[block_num / 64], (uint64_t)1 << (block_num % 64), __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+
+    if (fsck->repair) {
+        memset(ptr, 0, BLOCK_PTR_SIZE);
+        *dirty = 1;
+        __atomic_fetch_add(&fsck->nb_fixed, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/// @brief Tells whether a pointer holds the length of a compressed cluster rather than a block.
+/// @param inode
+/// @param ptr pointer inside an inode or pointer block buffer
+/// @param index position of the pointer among the data block pointers of its block
+/// @return
+static int is_cluster_length(const uint8_t *inode, const uint8_t *ptr, int index)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(uint32_t));
+    return (inode[INODE_FLAGS] & INODE_FLAG_COMPRESSED) && index % CLUSTER_BLOCKS == CLUSTER_BLOCKS - 1
+        && (value & CLUSTER_COMPRESSED) && (value & ~CLUSTER_COMPRESSED) <= (CLUSTER_BLOCKS - 1) * BLOCK_SIZE;
+}
+
+/// @brief Checks every pointer of a pointer block. With depth 2 the pointed blocks
+/// are themselves pointer blocks.
+/// @param fsck
+/// @param block_num a block already claimed by inode_num
+/// @param depth 1 for an indirect block, 2 for a double-indirect block
+/// @param inode the owner of the block
+/// @param inode_num
+static void check_pointer_block(Fsck *fsck, uint32_t block_num, int depth, const uint8_t *inode, uint32_t inode_num)
+{
+    uint8_t block[BLOCK_SIZE];
+    int dirty = 0;
+
+    if (read_blocks(fsck, block_num, 1, block) != 0) {
+        __atomic_fetch_add(&fsck->nb_io_errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (int i = 0; i < BLOCK_POINTERS_SIZE; ++i) {
+        uint8_t *ptr = block + i * BLOCK_PTR_SIZE;
+        if (depth == 1 && is_cluster_length(inode, ptr, i)) continue;
+        if (check_pointer(fsck, ptr, inode_num, depth - 1, &dirty) && depth > 1) {
+            uint32_t child;
+            memcpy(&child, ptr, sizeof(uint32_t));
+            check_pointer_block(fsck, child, depth - 1, inode, inode_num);
+        }
+    }
+
+    if (dirty && write_block(fsck, block_num, block) != 0)
+        __atomic_fetch_add(&fsck->nb_io_errors, 1, __ATOMIC_RELAXED);
+}
+
+static void check_tree(Fsck *fsck, uint8_t *inode, uint32_t inode_num, int *dirty);
+
+/// @brief Checks one inode and its whole pointer tree.
+/// @param fsck
+/// @param inode the 32-byte inode inside its block buffer
+/// @param inode_num
+/// @param dirty set to 1 when the inode has been modified
+static void check_inode(Fsck *fsck, uint8_t *inode, uint32_t inode_num, int *dirty)
+{
+    if (inode[INODE_STATUT] == 0) return;
+
+    if (inode[INODE_STATUT] != INODE_VALID) {
+        __atomic_fetch_add(&fsck->nb_bad_inodes, 1, __ATOMIC_RELAXED);
+        report(fsck, "inode %u: bad status %u", inode_num, inode[INODE_STATUT], 0);
+        if (fsck->repair) {
+            memset(inode, 0, INODE_SIZE);
+            *dirty = 1;
+            __atomic_fetch_add(&fsck->nb_fixed, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    __atomic_fetch_add(&fsck->nb_files, 1, __ATOMIC_RELAXED);
+
+    uint32_t size;
+    memcpy(&size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
+    if ((uint64_t)size > (uint64_t)MAX_FILE_BLOCKS * BLOCK_SIZE) {
+        __atomic_fetch_add(&fsck->nb_bad_inodes, 1, __ATOMIC_RELAXED);
+        report(fsck, "inode %u: size %u exceeds the maximum file size", inode_num, size, 0);
+        if (fsck->repair) {
+            size = (uint32_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+            memcpy(inode + INODE_SIZE_OFFSET, &size, sizeof(uint32_t));
+            *dirty = 1;
+            __atomic_fetch_add(&fsck->nb_fixed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    check_tree(fsck, inode, inode_num, dirty);
+}
+
+/// @brief Checks the pointer tree of a valid inode.
+/// @param fsck
+/// @param inode the 32-byte inode inside its block buffer
+/// @param inode_num
+/// @param dirty set to 1 when the inode has been modified
+static void check_tree(Fsck *fsck, uint8_t *inode, uint32_t inode_num, int *dirty)
+{
+    for (int i = 0; i < NB_DIRECT_BLOCKS; ++i) {
+        uint8_t *ptr = inode + INODE_DIRECT_OFFSET + i * BLOCK_PTR_SIZE;
+        if (!is_cluster_length(inode, ptr, i))
+            check_pointer(fsck, ptr, inode_num, 0, dirty);
+    }
+
+    uint32_t indirect;
+    if (check_pointer(fsck, inode + INODE_INDIRECT1_OFFSET, inode_num, 1, dirty)) {
+        memcpy(&indirect, inode + INODE_INDIRECT1_OFFSET, sizeof(uint32_t));
+        check_pointer_block(fsck, indirect, 1, inode, inode_num);
+    }
+    if (check_pointer(fsck, inode + INODE_INDIRECT2_OFFSET, inode_num, 2, dirty)) {
+        memcpy(&indirect, inode + INODE_INDIRECT2_OFFSET, sizeof(uint32_t));
+        check_pointer_block(fsck, indirect, 2, inode, inode_num);
+    }
+}
+
+/// @brief Phase 2 worker: checks INODE_BATCH inode blocks at a time.
+/// @param arg the Fsck context
+/// @return NULL
+static void *inode_worker(void *arg)
+{
+    Fsck *fsck = arg;
+    uint8_t *blocks = malloc((size_t)INODE_BATCH * BLOCK_SIZE);
+    if (!blocks) return NULL;
+
+    for (;;) {
+        uint32_t first = __atomic_fetch_add(&fsck->next_chunk, INODE_BATCH, __ATOMIC_RELAXED);
+        if (first >= fsck->sb.nb_inode_blocks) break;
+        uint32_t count = fsck->sb.nb_inode_blocks - first;
+        if (count > INODE_BATCH) count = INODE_BATCH;
+
+        if (read_blocks(fsck, fsck->inode_start_block + first, count, blocks) != 0) {
+            __atomic_fetch_add(&fsck->nb_io_errors, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        for (uint32_t b = 0; b < count; ++b) {
+            uint8_t *block = blocks + (size_t)b * BLOCK_SIZE;
+            int dirty = 0;
+            for (int i = 0; i < INODES_PER_BLOCK; ++i) {
+                uint32_t inode_num = (first + b) * INODES_PER_BLOCK + i;
+                check_inode(fsck, block + i * INODE_SIZE, inode_num, &dirty);
+            }
+            if (dirty && write_block(fsck, fsck->inode_start_block + first + b, block) != 0)
+                __atomic_fetch_add(&fsck->nb_io_errors, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(blocks);
+    return NULL;
+}
+
+/// @brief Clears the cross-links found by the inode workers, which only marked their
+/// blocks: the claims on those blocks are dropped and the pointer trees walked again
+/// in inode order, so the first pointer to a block in that order keeps it, whatever
+/// worker claimed it first. Cross-links are counted again by the walk.
+/// @param fsck
+static void resolve_cross_links(Fsck *fsck)
+{
+    for (uint32_t w = 0; w < (fsck->sb.nb_blocks + 63) / 64; ++w)
+        for (uint64_t bits = fsck->conflicts[w]; bits; bits &= bits - 1)
+            fsck->claims[w * 64 + __builtin_ctzll(bits)] = 0;
+
+    fsck->resolving = 1;
+    fsck->nb_cross_links = 0;
+    for (uint32_t b = 0; b < fsck->sb.nb_inode_blocks; ++b) {
+        uint8_t block[BLOCK_SIZE];
+        int dirty = 0;
+        if (read_blocks(fsck, fsck->inode_start_block + b, 1, block) != 0) {
+            fsck->nb_io_errors++;
+            continue;
+        }
+        for (int i = 0; i < INODES_PER_BLOCK; ++i) {
+            uint8_t *inode = block + i * INODE_SIZE;
+            if (inode[INODE_STATUT] == INODE_VALID)
+                check_tree(fsck, inode, b * INODES_PER_BLOCK + i, &dirty);
+        }
+        if (dirty && write_block(fsck, fsck->inode_start_block + b, block) != 0)
+            fsck->nb_io_errors++;
+    }
+    fsck->resolving = 0;
+}
+
+/// @brief Checks the snapshots listed in the superblock, after the inode table: the
+/// root and the inode table copies of a snapshot belong to it alone, the inodes they
+/// hold are checked like live ones. Snapshots with a bad root are dropped when repairing.
+/// @param fsck
+static void check_snapshots(Fsck *fsck)
+{
+    uint64_t nb_live_files = fsck->nb_files;
+    int sb_dirty = 0;
+
+    for (uint32_t s = 0; s < MAX_SNAPSHOTS; ++s) {
+        uint32_t root_num = fsck->sb.snapshots[s];
+        if (root_num == 0) continue;
+
+        uint8_t root[BLOCK_SIZE];
+        uint32_t nb_blocks = 0;
+        uint64_t first;
+        int claim = claim_block(fsck, root_num, s, CLAIM_SNAPSHOT, &first);
+        if (claim > 0) {
+            if (read_blocks(fsck, root_num, 1, root) != 0) {
+                fsck->nb_io_errors++;
+                continue;
+            }
+            memcpy(&nb_blocks, root + SNAPSHOT_NB_BLOCKS_OFFSET, sizeof(uint32_t));
+        }
+        if (claim <= 0 || nb_blocks != fsck->sb.nb_inode_blocks || nb_blocks > MAX_SNAPSHOT_INODE_BLOCKS) {
+            fsck->nb_bad_snapshots++;
+            report(fsck, "snapshot %u: bad root block %u", s, root_num, 0);
+            if (fsck->repair) {
+                fsck->sb.snapshots[s] = 0;
+                sb_dirty = 1;
+                fsck->nb_fixed++;
+            }
+            continue;
+        }
+        fsck->nb_snapshots++;
+
+        int root_dirty = 0;
+        for (uint32_t i = 0; i < nb_blocks; ++i) {
+            uint8_t *ptr = root + SNAPSHOT_TABLE_OFFSET + i * BLOCK_PTR_SIZE;
+            uint32_t table_num;
+            memcpy(&table_num, ptr, sizeof(uint32_t));
+            if (table_num == 0) continue;
+
+            if (claim_block(fsck, table_num, s, CLAIM_SNAPSHOT, &first) <= 0) {
+                fsck->nb_bad_snapshots++;
+                report(fsck, "snapshot %u: bad inode table block %u", s, table_num, 0);
+                if (fsck->repair) {
+                    memset(ptr, 0, BLOCK_PTR_SIZE);
+                    root_dirty = 1;
+                    fsck->nb_fixed++;
+                }
+                continue;
+            }
+
+            uint8_t table[BLOCK_SIZE];
+            int dirty = 0;
+            if (read_blocks(fsck, table_num, 1, table) != 0) {
+                fsck->nb_io_errors++;
+                continue;
+            }
+            for (int j = 0; j < INODES_PER_BLOCK; ++j)
+                check_inode(fsck, table + j * INODE_SIZE, i * INODES_PER_BLOCK + j, &dirty);
+            if (dirty && write_block(fsck, table_num, table) != 0)
+                fsck->nb_io_errors++;
+        }
+        if (root_dirty && write_block(fsck, root_num, root) != 0)
+            fsck->nb_io_errors++;
+    }
+
+    if (sb_dirty) {
+        uint8_t block[BLOCK_SIZE];
+        if (read_blocks(fsck, SUPERBLOCK_SECTOR, 1, block) != 0) {
+            fsck->nb_io_errors++;
+        } else {
+            memcpy(block, &fsck->sb, sizeof(SuperBlock));
+            if (write_block(fsck, SUPERBLOCK_SECTOR, block) != 0)
+                fsck->nb_io_errors++;
+        }
+    }
+
+    fsck->nb_snapshot_files = fsck->nb_files - nb_live_files;
+    fsck->nb_files = nb_live_files;
+}
+
+//=============================================================================
+//============================== LEAK CHECKING ================================
+//=============================================================================
+
+/// @brief Phase 3 worker: reads LEAK_BATCH data blocks at a time and reports the
+/// non-zero blocks that no pointer claimed. Fully claimed batches are not read.
+/// @param arg the Fsck context
+/// @return NULL
+static void *leak_worker(void *arg)
+{
+    Fsck *fsck = arg;
+    uint8_t *blocks = malloc((size_t)LEAK_BATCH * BLOCK_SIZE);
+    if (!blocks) return NULL;
+    uint8_t zero[BLOCK_SIZE] = {0};
+    uint32_t nb_data_blocks = fsck->data_end_block - fsck->data_start_block;
+
+    for (;;) {
+        uint32_t offset = __atomic_fetch_add(&fsck->next_chunk, LEAK_BATCH, __ATOMIC_RELAXED);
+        if (offset >= nb_data_blocks) break;
+        uint32_t first = fsck->data_start_block + offset;
+        uint32_t count = nb_data_blocks - offset;
+        if (count > LEAK_BATCH) count = LEAK_BATCH;
+
+        int all_claimed = 1;
+        for (uint32_t b = first; b < first + count && all_claimed; ++b)
+            if (!fsck->claims[b])
+                all_claimed = 0;
+        if (all_claimed) continue;
+
+        if (read_blocks(fsck, first, count, blocks) != 0) {
+            __atomic_fetch_add(&fsck->nb_io_errors, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        for (uint32_t b = 0; b < count; ++b) {
+            uint32_t block_num = first + b;
+            if (fsck->claims[block_num]) continue;
+            if (memcmp(blocks + (size_t)b * BLOCK_SIZE, zero, BLOCK_SIZE) == 0) continue;
+
+            __atomic_fetch_add(&fsck->nb_leaked, 1, __ATOMIC_RELAXED);
+            report(fsck, "block %u: not referenced but not zero", block_num, 0, 0);
+            if (fsck->repair) {
+                if (write_block(fsck, block_num, zero) != 0)
+                    __atomic_fetch_add(&fsck->nb_io_errors, 1, __ATOMIC_RELAXED);
+                else
+                    __atomic_fetch_add(&fsck->nb_fixed, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    free(blocks);
+    return NULL;
+}
+
+//=============================================================================
+//=============================== CHECKSUMS ===================================
+//=============================================================================
+
+/// @brief Reads the checksum region.
+/// @param fsck
+/// @return 0 on success, -1 on error
+static int load_checksums(Fsck *fsck)
+{
+    uint32_t nb_sum_blocks = fsck->sb.nb_blocks - fsck->sb.checksum_start;
+    fsck->sums = malloc((size_t)nb_sum_blocks * BLOCK_SIZE);
+    if (!fsck->sums) return -1;
+    return read_blocks(fsck, fsck->sb.checksum_start, nb_sum_blocks, (uint8_t *)fsck->sums);
+}
+
+/// @brief Writes the checksum region back.
+/// @param fsck
+/// @return 0 on success, -1 on error
+static int store_checksums(Fsck *fsck)
+{
+    uint32_t nb_sum_blocks = fsck->sb.nb_blocks - fsck->sb.checksum_start;
+    for (uint32_t i = 0; i < nb_sum_blocks; ++i) {
+        const uint8_t *block = (const uint8_t *)(fsck->sums + (size_t)i * CHECKSUMS_PER_BLOCK);
+        if (write_block(fsck, fsck->sb.checksum_start + i, block) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/// @brief Phase 4 worker: reads LEAK_BATCH blocks at a time and checks them against
+/// their checksum. Mismatching checksums are forgotten when repairing.
+/// @param arg the Fsck context
+/// @return NULL
+static void *scrub_worker(void *arg)
+{
+    Fsck *fsck = arg;
+    uint8_t *blocks = malloc((size_t)LEAK_BATCH * BLOCK_SIZE);
+    if (!blocks) return NULL;
+
+    for (;;) {
+        // Everything but the superblock, from the inode table to the checksum region
+        uint32_t first = 1 + __atomic_fetch_add(&fsck->next_chunk, LEAK_BATCH, __ATOMIC_RELAXED);
+        if (first >= fsck->data_end_block) break;
+        uint32_t count = fsck->data_end_block - first;
+        if (count > LEAK_BATCH) count = LEAK_BATCH;
+
+        if (read_blocks(fsck, first, count, blocks) != 0) {
+            __atomic_fetch_add(&fsck->nb_io_errors, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        uint64_t nb_verified = 0;
+        for (uint32_t b = 0; b < count; ++b) {
+            uint32_t block_num = first + b;
+            uint32_t expected = __atomic_load_n(&fsck->sums[block_num], __ATOMIC_RELAXED);
+            if (expected == 0) continue;
+            nb_verified++;
+            if (crc32c(0, blocks + (size_t)b * BLOCK_SIZE, BLOCK_SIZE) == expected) continue;
+
+            __atomic_fetch_add(&fsck->nb_bad_checksums, 1, __ATOMIC_RELAXED);
+            report(fsck, "block %u: does not match its checksum", block_num, 0, 0);
+            if (fsck->repair) {
+                __atomic_store_n(&fsck->sums[block_num], 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&fsck->sums_dirty, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&fsck->nb_fixed, 1, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_fetch_add(&fsck->nb_verified, nb_verified, __ATOMIC_RELAXED);
+    }
+
+    free(blocks);
+    return NULL;
+}
+
+//=============================================================================
+//================================ HELPERS ====================================
+//=============================================================================
+
+/// @brief Reads count consecutive blocks with a single positional read (thread safe).
+/// @param fsck
+/// @param block_num
+/// @param count
+/// @param buffer
+/// @return 0 on success, -1 on error
+static int read_blocks(Fsck *fsck, uint32_t block_num, uint32_t count, uint8_t *buffer)
+{
+    size_t total = (size_t)count * BLOCK_SIZE;
+    off_t offset = (off_t)block_num * BLOCK_SIZE;
+    size_t done = 0;
+
+    while (done < total) {
+        ssize_t r = pread(fsck->fd, buffer + done, total - done, offset + done);
+        if (r <= 0) return -1;
+        done += r;
+    }
+    return 0;
+}
+
+/// @brief Writes a single block with a positional write (thread safe), updating its
+/// checksum.
+/// @param fsck
+/// @param block_num
+/// @param buffer
+/// @return 0 on success, -1 on error
+static int write_block(Fsck *fsck, uint32_t block_num, const uint8_t *buffer)
+{
+    off_t offset = (off_t)block_num * BLOCK_SIZE;
+    if (pwrite(fsck->fd, buffer, BLOCK_SIZE, offset) != BLOCK_SIZE) return -1;
+
+    if (fsck->sums && block_num != SUPERBLOCK_SECTOR && block_num < fsck->data_end_block) {
+        __atomic_store_n(&fsck->sums[block_num], crc32c(0, buffer, BLOCK_SIZE), __ATOMIC_RELAXED);
+        __atomic_store_n(&fsck->sums_dirty, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/// @brief Prints a problem, at most MAX_REPORTS of them unless verbose.
+/// @param fsck
+/// @param fmt format with up to three %u conversions
+/// @param a
+/// @param b
+/// @param c
+static void report(Fsck *fsck, const char *fmt, uint32_t a, uint32_t b, uint32_t c)
+{
+    uint64_t n = __atomic_fetch_add(&fsck->nb_reports, 1, __ATOMIC_RELAXED);
+    if (!fsck->verbose && n >= MAX_REPORTS) {
+        if (n == MAX_REPORTS) printf("... more problems, use -v to list them all\n");
+        return;
+    }
+    char line[128];
+    snprintf(line, sizeof(line), fmt, a, b, c);
+    printf("%s\n", line);
+}
+
+/// @brief Milliseconds elapsed since start.
+/// @param start
+/// @return
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
@@ -0,0 +1,504 @@
+// mkssfs: builds a populated SSFS image directly, without going through fs.h.
+//
+// Usage: mkssfs [-s size_mib] [-i inodes] [-j threads] [-m] <image> <source>
+//
+// source is a host directory (its regular files, sorted by name, become inodes
+// 0, 1, 2, ...) or, with -m, a manifest listing one host path per line (line n
+// becomes inode n, an empty line leaves inode n free).
+//
+// Every file gets one contiguous region laid out in the order a sequential read
+// visits it: direct blocks, indirect block, its data, double-indirect block, then
+// each intermediate block followed by its data. Regions are computed up front, so
+// worker threads read the host files and write their regions with large positional
+// writes independently of each other. The free space past the last region is left
+// zero (sparse), which is what mount() and allocate_block() expect.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "ssfs.h"
+
+#define WINDOW_BLOCKS 1024 // Blocks assembled in memory per write (1 MiB)
+#define GROUP_BLOCKS  (BLOCK_POINTERS_SIZE + 1) // Intermediate block and its data blocks
+
+/// @brief Placement of one host file in the image
+typedef struct {
+    char *path;          // NULL for a free inode
+    uint32_t size;       // File size in bytes
+    uint32_t nb_data;    // Data blocks
+    uint32_t nb_blocks;  // Data and pointer blocks of the region
+    uint32_t start;      // First block of the region
+} FileLayout;
+
+/// @brief Shared state of the workers
+typedef struct {
+    int fd;
+    FileLayout *files;
+    uint32_t nb_files;
+    uint32_t next_file;   // Work counter
+    int nb_errors;
+} Builder;
+
+/// @brief Kinds of blocks inside a region
+typedef enum { KIND_DATA, KIND_INDIRECT1, KIND_INDIRECT2, KIND_INTERMEDIATE } BlockKind;
+
+//=============================================================================
+//================================= LAYOUT ====================================
+//=============================================================================
+
+/// @brief Number of data and pointer blocks needed by a file of nb_data blocks.
+/// @param nb_data
+/// @return
+static uint32_t region_blocks(uint32_t nb_data)
+{
+    uint32_t blocks = nb_data;
+    if (nb_data > NB_DIRECT_BLOCKS) blocks += 1;
+    if (nb_data > NB_DIRECT_BLOCKS + BLOCK_POINTERS_SIZE) {
+        uint32_t rest = nb_data - NB_DIRECT_BLOCKS - BLOCK_POINTERS_SIZE;
+        blocks += 1 + (rest + BLOCK_POINTERS_SIZE - 1) / BLOCK_POINTERS_SIZE;
+    }
+    return blocks;
+}
+
+/// @brief Position of the indirect1 block inside a region.
+static uint32_t indirect1_pos()
+{
+    return NB_DIRECT_BLOCKS;
+}
+
+/// @brief Position of the indirect2 block inside a region.
+static uint32_t indirect2_pos()
+{
+    return NB_DIRECT_BLOCKS + 1 + BLOCK_POINTERS_SIZE;
+}
+
+/// @brief Position of the intermediate block of group j inside a region.
+static uint32_t intermediate_pos(uint32_t j)
+{
+    return indirect2_pos() + 1 + j * GROUP_BLOCKS;
+}
+
+/// @brief Classifies a position of a region.
+/// @param pos
+/// @param index set to the file block index for data, to the group for intermediate blocks
+/// @return
+static BlockKind classify(uint32_t pos, uint32_t *index)
+{
+    if (pos < NB_DIRECT_BLOCKS) {
+        *index = pos;
+        return KIND_DATA;
+    }
+    if (pos == indirect1_pos()) return KIND_INDIRECT1;
+    if (pos < indirect2_pos()) {
+        *index = pos - 1;
+        return KIND_DATA;
+    }
+    if (pos == indirect2_pos()) return KIND_INDIRECT2;
+
+    uint32_t rel = pos - indirect2_pos() - 1;
+    uint32_t group = rel / GROUP_BLOCKS;
+    uint32_t k = rel % GROUP_BLOCKS;
+    if (k == 0) {
+        *index = group;
+        return KIND_INTERMEDIATE;
+    }
+    *index = NB_DIRECT_BLOCKS + BLOCK_POINTERS_SIZE + group * BLOCK_POINTERS_SIZE + (k - 1);
+    return KIND_DATA;
+}
+
+/// @brief Physical block holding file block idx.
+/// @param file
+/// @param idx
+/// @return
+static uint32_t data_block(const FileLayout *file, uint32_t idx)
+{
+    if (idx < NB_DIRECT_BLOCKS) return file->start + idx;
+    if (idx < NB_DIRECT_BLOCKS + BLOCK_POINTERS_SIZE) return file->start + idx + 1;
+    uint32_t rel = idx - NB_DIRECT_BLOCKS - BLOCK_POINTERS_SIZE;
+    return file->start + intermediate_pos(rel / BLOCK_POINTERS_SIZE) + 1 + rel % BLOCK_POINTERS_SIZE;
+}
+
+/// @brief Fills a pointer block of a region.
+/// @param file
+/// @param kind
+/// @param group group of an intermediate block
+/// @param block output
+static void fill_pointer_block(const FileLayout *file, BlockKind kind, uint32_t group, uint8_t *block)
+{
+    memset(block, 0, BLOCK_SIZE);
+    for (uint32_t i = 0; i < BLOCK_POINTERS_SIZE; ++i) {
+        uint32_t ptr = 0;
+        if (kind == KIND_INDIRECT1) {
+            uint32_t idx = NB_DIRECT_BLOCKS + i;
+            if (idx < file->nb_data) ptr = data_block(file, idx);
+        } else if (kind == KIND_INDIRECT2) {
+            uint32_t idx = NB_DIRECT_BLOCKS + BLOCK_POINTERS_SIZE + i * BLOCK_POINTERS_SIZE;
+            if (idx < file->nb_data) ptr = file->start + intermediate_pos(i);
+        } else {
+            uint32_t idx = NB_DIRECT_BLOCKS + BLOCK_POINTERS_SIZE + group * BLOCK_POINTERS_SIZE + i;
+            if (idx < file->nb_data) ptr = data_block(file, idx);
+        }
+        memcpy(block + i * BLOCK_PTR_SIZE, &ptr, sizeof(uint32_t));
+    }
+}
+
+/// @brief Fills the inode of a file.
+/// @param file
+/// @param inode 32-byte output
+static void fill_inode(const FileLayout *file, uint8_t *inode)
+{
+    memset(inode, 0, INODE_SIZE);
+    if (!file->path) return;
+
+    inode[INODE_STATUT] = INODE_VALID;
+    memcpy(inode + INODE_SIZE_OFFSET, &file->size, sizeof(uint32_t));
+    for (uint32_t i = 0; i < NB_DIRECT_BLOCKS && i < file->nb_data; ++i) {
+        uint32_t ptr = data_block(file, i);
+        memcpy(inode + INODE_DIRECT_OFFSET + i * BLOCK_PTR_SIZE, &ptr, sizeof(uint32_t));
+    }
+    if (file->nb_data > NB_DIRECT_BLOCKS) {
+        uint32_t ptr = file->start + indirect1_pos();
+        memcpy(inode + INODE_INDIRECT1_OFFSET, &ptr, sizeof(uint32_t));
+    }
+    if (file->nb_data > NB_DIRECT_BLOCKS + BLOCK_POINTERS_SIZE) {
+        uint32_t ptr = file->start + indirect2_pos();
+        memcpy(inode + INODE_INDIRECT2_OFFSET, &ptr, sizeof(uint32_t));
+    }
+}
+
+//=============================================================================
+//================================= WRITING ===================================
+//=============================================================================
+
+/// @brief Writes buffer at a block position, retrying short writes.
+/// @return 0 on success, -1 on error
+static int write_at(int fd, const uint8_t *buffer, size_t len, uint32_t block_num)
+{
+    off_t offset = (off_t)block_num * BLOCK_SIZE;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = pwrite(fd, buffer + done, len - done, offset + done);
+        if (w <= 0) return -1;
+        done += w;
+    }
+    return 0;
+}
+
+/// @brief Reads up to len bytes of a host file at offset; the rest of the buffer is zeroed.
+/// @return 0 on success, -1 on error
+static int read_at(int fd, uint8_t *buffer, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = pread(fd, buffer + done, len - done, offset + done);
+        if (r < 0) return -1;
+        if (r == 0) break;
+        done += r;
+    }
+    memset(buffer + done, 0, len - done);
+    return 0;
+}
+
+/// @brief Writes the region of a file, WINDOW_BLOCKS at a time. Runs of data blocks
+/// are read from the host file with a single read.
+/// @param builder
+/// @param file
+/// @param window WINDOW_BLOCKS blocks of scratch memory
+/// @return 0 on success, -1 on error
+static int write_region(Builder *builder, const FileLayout *file, uint8_t *window)
+{
+    int fd = open(file->path, O_RDONLY);
+    if (fd < 0) {
+        perror(file->path);
+        return -1;
+    }
+
+    int ret = 0;
+    for (uint32_t first = 0; first < file->nb_blocks && ret == 0; first += WINDOW_BLOCKS) {
+        uint32_t count = file->nb_blocks - first;
+        if (count > WINDOW_BLOCKS) count = WINDOW_BLOCKS;
+
+        uint32_t pos = 0;
+        while (pos < count && ret == 0) {
+            uint32_t index;
+            BlockKind kind = classify(first + pos, &index);
+            if (kind != KIND_DATA) {
+                fill_pointer_block(file, kind, index, window + (size_t)pos * BLOCK_SIZE);
+                pos++;
+                continue;
+            }
+
+            uint32_t run = 1, next;
+            while (pos + run < count && classify(first + pos + run, &next) == KIND_DATA)
+                run++;
+            ret = read_at(fd, window + (size_t)pos * BLOCK_SIZE, (size_t)run * BLOCK_SIZE, (off_t)index * BLOCK_SIZE);
+            pos += run;
+        }
+
+        if (ret == 0)
+            ret = write_at(builder->fd, window, (size_t)count * BLOCK_SIZE, file->start + first);
+    }
+
+    close(fd);
+    return ret;
+}
+
+/// @brief Worker: picks files from the work counter and writes their regions.
+/// @param arg the Builder
+/// @return NULL
+static void *region_worker(void *arg)
+{
+    Builder *builder = arg;
+    uint8_t *window = malloc((size_t)WINDOW_BLOCKS * BLOCK_SIZE);
+    if (!window) {
+        __atomic_fetch_add(&builder->nb_errors, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&builder->next_file, 1, __ATOMIC_RELAXED);
+        if (i >= builder->nb_files) break;
+        const FileLayout *file = &builder->files[i];
+        if (!file->path || file->nb_blocks == 0) continue;
+        if (write_region(builder, file, window) != 0)
+            __atomic_fetch_add(&builder->nb_errors, 1, __ATOMIC_RELAXED);
+    }
+
+    free(window);
+    return NULL;
+}
+
+//=============================================================================
+//================================= SOURCES ===================================
+//=============================================================================
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/// @brief Appends a file (or a free inode when path is NULL) to the list.
+/// @return 0 on success, -1 on error
+static int add_file(FileLayout **files, uint32_t *count, uint32_t *capacity, const char *path)
+{
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        FileLayout *grown = realloc(*files, sizeof(FileLayout) * *capacity);
+        if (!grown) return -1;
+        *files = grown;
+    }
+    FileLayout *file = &(*files)[(*count)++];
+    memset(file, 0, sizeof(FileLayout));
+    if (!path) return 0;
+
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a regular file\n", path);
+        return -1;
+    }
+    if ((uint64_t)st.st_size > (uint64_t)MAX_FILE_BLOCKS * BLOCK_SIZE || st.st_size > INT32_MAX) {
+        fprintf(stderr, "%s: too large for SSFS (%lld bytes)\n", path, (long long)st.st_size);
+        return -1;
+    }
+    file->path = malloc(strlen(path) + 1);
+    if (!file->path) return -1;
+    strcpy(file->path, path);
+    file->size = (uint32_t)st.st_size;
+    file->nb_data = (file->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    file->nb_blocks = region_blocks(file->nb_data);
+    return 0;
+}
+
+/// @brief Lists the regular files of a directory, sorted by name.
+/// @return 0 on success, -1 on error
+static int load_directory(const char *dir_path, FileLayout **files, uint32_t *count)
+{
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        perror(dir_path);
+        return -1;
+    }
+
+    char **names = NULL;
+    size_t nb_names = 0, cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char path[4096];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (nb_names == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(names, sizeof(char *) * cap);
+            if (!grown) break;
+            names = grown;
+        }
+        names[nb_names] = malloc(strlen(path) + 1);
+        if (!names[nb_names]) break;
+        strcpy(names[nb_names++], path);
+    }
+    closedir(dir);
+
+    qsort(names, nb_names, sizeof(char *), compare_names);
+    uint32_t capacity = 0;
+    int ret = 0;
+    for (size_t i = 0; i < nb_names; ++i) {
+        if (ret == 0) ret = add_file(files, count, &capacity, names[i]);
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+}
+
+/// @brief Reads a manifest: one path per line, an empty line leaves the inode free.
+/// @return 0 on success, -1 on error
+static int load_manifest(const char *manifest_path, FileLayout **files, uint32_t *count)
+{
+    FILE *f = fopen(manifest_path, "r");
+    if (!f) {
+        perror(manifest_path);
+        return -1;
+    }
+
+    char line[4096];
+    uint32_t capacity = 0;
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        ret = add_file(files, count, &capacity, line[0] ? line : NULL);
+    }
+    fclose(f);
+    return ret;
+}
+
+//=============================================================================
+//=============================== ENTRY POINT =================================
+//=============================================================================
+
+static double elapsed_s(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    long size_mib = 0;
+    long nb_inodes = 0;
+    long nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int manifest = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:i:j:m")) != -1) {
+        switch (opt) {
+        case 's': size_mib = strtol(optarg, NULL, 10); break;
+        case 'i': nb_inodes = strtol(optarg, NULL, 10); break;
+        case 'j': nb_threads = strtol(optarg, NULL, 10); break;
+        case 'm': manifest = 1; break;
+        default:
+            printf("Usage: %s [-s size_mib] [-i inodes] [-j threads] [-m] <image> <source>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        printf("Usage: %s [-s size_mib] [-i inodes] [-j threads] [-m] <image> <source>\n", argv[0]);
+        return 1;
+    }
+    if (nb_threads < 1) nb_threads = 1;
+    const char *image = argv[optind];
+    const char *source = argv[optind + 1];
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Builder builder;
+    memset(&builder, 0, sizeof(builder));
+    if ((manifest ? load_manifest(source, &builder.files, &builder.nb_files)
+                  : load_directory(source, &builder.files, &builder.nb_files)) != 0)
+        return 1;
+
+    // Geometry: inode table, then one region per file, then free space
+    if (nb_inodes < (long)builder.nb_files) nb_inodes = builder.nb_files;
+    if (nb_inodes < 1) nb_inodes = 1;
+    uint32_t inode_blocks = (uint32_t)((nb_inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK);
+    uint64_t next_block = 1 + (uint64_t)inode_blocks;
+    uint64_t data_bytes = 0;
+    for (uint32_t i = 0; i < builder.nb_files; ++i) {
+        builder.files[i].start = (uint32_t)next_block;
+        next_block += builder.files[i].nb_blocks;
+        data_bytes += builder.files[i].size;
+    }
+    uint64_t total_blocks = next_block + 1; // At least one free data block
+    if (size_mib > 0) {
+        uint64_t requested = (uint64_t)size_mib * 1024 * 1024 / BLOCK_SIZE;
+        if (requested < total_blocks) {
+            fprintf(stderr, "%ld MiB is too small, %llu blocks are needed\n", size_mib, (unsigned long long)total_blocks);
+            return 1;
+        }
+        total_blocks = requested;
+    }
+    if (total_blocks > UINT32_MAX) {
+        fprintf(stderr, "Volume too large (%llu blocks)\n", (unsigned long long)total_blocks);
+        return 1;
+    }
+
+    builder.fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (builder.fd < 0 || ftruncate(builder.fd, (off_t)total_blocks * BLOCK_SIZE) != 0) {
+        perror(image);
+        return 1;
+    }
+
+    // Superblock and inode table
+    uint8_t block[BLOCK_SIZE] = {0};
+    SuperBlock sb;
+    memset(&sb, 0, sizeof(sb));
+    memcpy(sb.magic, MAGIC_NUMBER, MAGIC_NUMBER_SIZE);
+    sb.nb_blocks = (uint32_t)total_blocks;
+    sb.nb_inode_blocks = inode_blocks;
+    sb.block_size = BLOCK_SIZE;
+    memcpy(block, &sb, sizeof(SuperBlock));
+
+    uint8_t *inode_table = calloc(inode_blocks, BLOCK_SIZE);
+    if (!inode_table) return 1;
+    for (uint32_t i = 0; i < builder.nb_files; ++i)
+        fill_inode(&builder.files[i], inode_table + (size_t)i * INODE_SIZE);
+
+    int ret = write_at(builder.fd, block, BLOCK_SIZE, SUPERBLOCK_SECTOR) != 0
+           || write_at(builder.fd, inode_table, (size_t)inode_blocks * BLOCK_SIZE, 1) != 0;
+
+    // File regions
+    pthread_t *threads = malloc(sizeof(pthread_t) * nb_threads);
+    long started = 0;
+    for (long i = 1; !ret && threads && i < nb_threads; ++i)
+        if (pthread_create(&threads[started], NULL, region_worker, &builder) == 0)
+            started++;
+    if (!ret) region_worker(&builder);
+    for (long i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    if (fsync(builder.fd) != 0 || close(builder.fd) != 0) ret = 1;
+    if (builder.nb_errors) ret = 1;
+
+    double seconds = elapsed_s(&start);
+    printf("%s: %u inodes, %u files, %llu/%llu blocks used, %.1f MiB of data in %.3f s (%.1f MiB/s)\n",
+           image, inode_blocks * INODES_PER_BLOCK, builder.nb_files, (unsigned long long)next_block,
+           (unsigned long long)total_blocks, data_bytes / 1048576.0, seconds,
+           seconds > 0 ? data_bytes / 1048576.0 / seconds : 0);
+
+    for (uint32_t i = 0; i < builder.nb_files; ++i)
+        free(builder.files[i].path);
+    free(builder.files);
+    free(inode_table);
+    return ret;
+}
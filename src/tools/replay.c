@@ -0,0 +1,376 @@
+// ssfs_replay: re-executes a trace recorded with SSFS_TRACE against a fresh image.
+//
+// Usage: ssfs_replay [-t] [-s size_mib] [-i inodes] <trace> <image>
+//
+// image is (re)created with size_mib MiB (default 64) and formatted with the given
+// number of inodes (default 1024). Files the trace uses without creating them first
+// are created and filled up front, large enough for every read and stat of the trace.
+// Inode numbers returned by create() and clone_file() are remapped, so the replay does
+// not depend on the allocation order; snapshot numbers are replayed as recorded.
+// Without -t the calls are issued back to back; with -t the original inter-arrival
+// times are honoured. Nested mounts are flattened: the calls made on a nested volume
+// run on the replay image as well. Throughput and latency are reported per operation
+// next to the latency recorded in the trace.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "fs.h"
+#include "trace.h"
+
+#define KiB 1024
+#define MiB (1024 * KiB)
+
+static const char *OP_NAMES[TRACE_NB_OPS] = {
+    "format", "mount", "unmount", "stat", "create", "delete", "read", "write", "mount_nested",
+    "clone", "snap_create", "snap_delete", "set_compress", "enable_csum",
+    "set_dedup", "dedup_file", "preallocate", "defrag_file"
+};
+
+/// @brief Latencies of one operation, replayed and recorded
+typedef struct {
+    uint64_t *replay_ns;
+    uint64_t *trace_ns;
+    int count;
+} OpLatencies;
+
+static int32_t *inode_map;     // Trace inode -> replay inode, -1 if unknown
+static int32_t map_size;
+
+//=============================================================================
+//================================ HELPERS ====================================
+//=============================================================================
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *sorted, int count, double p)
+{
+    if (count == 0) return 0;
+    return sorted[(int)(p * (count - 1) + 0.5)];
+}
+
+/// @brief Reads the whole trace in memory.
+/// @param path
+/// @param count set to the number of records
+/// @return the records, NULL on error
+static TraceRecord *load_trace(const char *path, long *count)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Cannot open trace %s\n", path);
+        return NULL;
+    }
+
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0
+        || header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s is not an SSFS trace (version %d)\n", path, TRACE_VERSION);
+        fclose(f);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long bytes = ftell(f) - (long)sizeof(header);
+    fseek(f, sizeof(header), SEEK_SET);
+    *count = bytes / (long)sizeof(TraceRecord);
+
+    TraceRecord *records = malloc(sizeof(TraceRecord) * (*count > 0 ? *count : 1));
+    if (!records || fread(records, sizeof(TraceRecord), *count, f) != (size_t)*count) {
+        fprintf(stderr, "Cannot read %ld records from %s\n", *count, path);
+        free(records);
+        records = NULL;
+    }
+    fclose(f);
+    return records;
+}
+
+/// @brief Creates a zero-filled image, formats and mounts it.
+/// @param path
+/// @param size
+/// @param inodes
+/// @return 0 on success, -1 on error
+static int fresh_volume(const char *path, long size, int inodes)
+{
+    remove(path);
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+    int ok = fseek(f, size - 1, SEEK_SET) == 0 && fputc(0, f) != EOF;
+    if (fclose(f) != 0 || !ok) return -1;
+    if (format((char *)path, inodes) != 0) return -1;
+    return mount((char *)path);
+}
+
+/// @brief Creates the files the trace uses without creating them, each filled up to
+/// the largest extent the trace reads or stats.
+/// @param records
+/// @param count
+/// @param pattern buffer of at least 64 KiB
+/// @return number of files created
+static int prepopulate(const TraceRecord *records, long count, uint8_t *pattern)
+{
+    int64_t *extent = malloc(sizeof(int64_t) * map_size);
+    char *created = calloc(map_size, 1);
+    int nb_files = 0;
+    if (!extent || !created) {
+        free(extent);
+        free(created);
+        return 0;
+    }
+    for (int32_t i = 0; i < map_size; ++i) extent[i] = -1;
+
+    for (long i = 0; i < count; ++i) {
+        const TraceRecord *r = &records[i];
+        if (r->op == TRACE_OP_CLONE && r->inode >= 0 && r->inode < map_size && !created[r->inode]
+            && extent[r->inode] < 0)
+            extent[r->inode] = 0;
+        if ((r->op == TRACE_OP_CREATE || r->op == TRACE_OP_CLONE) && r->result >= 0) {
+            created[r->result] = 1;
+            continue;
+        }
+        if (r->inode < 0 || r->inode >= map_size || created[r->inode]) continue;
+        if (r->op == TRACE_OP_DELETE) {
+            if (extent[r->inode] < 0) extent[r->inode] = 0;
+            created[r->inode] = 1;
+            continue;
+        }
+
+        int64_t end = 0;
+        if (r->op == TRACE_OP_READ && r->result > 0) end = (int64_t)r->offset + r->result;
+        if (r->op == TRACE_OP_STAT && r->result > 0) end = r->result;
+        if ((r->op == TRACE_OP_READ || r->op == TRACE_OP_STAT || r->op == TRACE_OP_WRITE) && r->result >= 0
+            && end > extent[r->inode])
+            extent[r->inode] = end;
+    }
+
+    for (int32_t i = 0; i < map_size; ++i) {
+        if (extent[i] < 0) continue;
+        int inode = create();
+        if (inode < 0) break;
+        inode_map[i] = inode;
+        nb_files++;
+        for (int64_t offset = 0; offset < extent[i]; offset += 64 * KiB) {
+            int len = extent[i] - offset < 64 * KiB ? (int)(extent[i] - offset) : 64 * KiB;
+            write(inode, pattern, len, (int)offset);
+        }
+    }
+
+    free(extent);
+    free(created);
+    return nb_files;
+}
+
+/// @brief Translates a trace inode into the replay inode.
+/// @param inode
+/// @return
+static int map_inode(int32_t inode)
+{
+    if (inode < 0 || inode >= map_size || inode_map[inode] < 0) return inode;
+    return inode_map[inode];
+}
+
+//=============================================================================
+//=============================== ENTRY POINT =================================
+//=============================================================================
+
+int main(int argc, char *argv[])
+{
+    int timed = 0;
+    long size_mib = 64;
+    int nb_inodes = 1024;
+    int argi = 1;
+
+    for (; argi < argc && argv[argi][0] == '-'; ++argi) {
+        if (strcmp(argv[argi], "-t") == 0) timed = 1;
+        else if (strcmp(argv[argi], "-s") == 0 && argi + 1 < argc) size_mib = strtol(argv[++argi], NULL, 10);
+        else if (strcmp(argv[argi], "-i") == 0 && argi + 1 < argc) nb_inodes = (int)strtol(argv[++argi], NULL, 10);
+        else break;
+    }
+    if (argc - argi != 2 || size_mib <= 0) {
+        printf("Usage: %s [-t] [-s size_mib] [-i inodes] <trace> <image>\n", argv[0]);
+        return 1;
+    }
+    const char *trace_path = argv[argi];
+    const char *image_path = argv[argi + 1];
+
+    long count;
+    TraceRecord *records = load_trace(trace_path, &count);
+    if (!records) return 1;
+
+    int32_t max_len = 64 * KiB;
+    map_size = 1;
+    for (long i = 0; i < count; ++i) {
+        if (records[i].op >= TRACE_NB_OPS) {
+            fprintf(stderr, "Record %ld: unknown operation %u\n", i, records[i].op);
+            return 1;
+        }
+        if (records[i].inode >= map_size) map_size = records[i].inode + 1;
+        if ((records[i].op == TRACE_OP_CREATE || records[i].op == TRACE_OP_CLONE) && records[i].result >= map_size)
+            map_size = records[i].result + 1;
+        if (records[i].len > max_len) max_len = records[i].len;
+    }
+
+    inode_map = malloc(sizeof(int32_t) * map_size);
+    uint8_t *buffer = malloc(max_len);
+    OpLatencies lat[TRACE_NB_OPS];
+    memset(lat, 0, sizeof(lat));
+    for (int op = 0; op < TRACE_NB_OPS; ++op) {
+        lat[op].replay_ns = malloc(sizeof(uint64_t) * (count > 0 ? count : 1));
+        lat[op].trace_ns = malloc(sizeof(uint64_t) * (count > 0 ? count : 1));
+        if (!lat[op].replay_ns || !lat[op].trace_ns) return 1;
+    }
+    if (!inode_map || !buffer) return 1;
+    for (int32_t i = 0; i < map_size; ++i) inode_map[i] = -1;
+    for (int32_t i = 0; i < max_len; ++i) buffer[i] = (uint8_t)(i * 31 + 7);
+
+    if (fresh_volume(image_path, size_mib * MiB, nb_inodes) != 0) {
+        fprintf(stderr, "Cannot create a %ld MiB volume at %s\n", size_mib, image_path);
+        return 1;
+    }
+    int nb_prepopulated = prepopulate(records, count, buffer);
+
+    long nb_mismatches = 0;
+    long nb_skipped = 0;
+    int mounted = 1;
+    int nested_depth = 0;
+    uint64_t first_ts = count > 0 ? records[0].timestamp_ns : 0;
+    uint64_t start = now_ns();
+
+    for (long i = 0; i < count; ++i) {
+        const TraceRecord *r = &records[i];
+
+        if (timed) {
+            uint64_t due = start + (r->timestamp_ns - first_ts);
+            uint64_t now = now_ns();
+            if (due > now) {
+                struct timespec wait = { (time_t)((due - now) / 1000000000ull), (long)((due - now) % 1000000000ull) };
+                nanosleep(&wait, NULL);
+            }
+        }
+
+        int inode = map_inode(r->inode);
+        int ret = 0;
+        uint64_t t = now_ns();
+        switch (r->op) {
+        case TRACE_OP_FORMAT:
+            nb_skipped++;
+            continue;
+        case TRACE_OP_MOUNT:
+            if (mounted) {
+                nb_skipped++;
+                continue;
+            }
+            ret = mount((char *)image_path);
+            mounted = ret == 0;
+            break;
+        case TRACE_OP_MOUNT_NESTED:
+            if (r->result == 0) nested_depth++;
+            nb_skipped++;
+            continue;
+        case TRACE_OP_UNMOUNT:
+            if (nested_depth > 0) {
+                nested_depth--;
+                nb_skipped++;
+                continue;
+            }
+            ret = unmount();
+            mounted = 0;
+            break;
+        case TRACE_OP_STAT:
+            ret = stat(inode);
+            break;
+        case TRACE_OP_CREATE:
+            ret = create();
+            if (r->result >= 0 && ret >= 0) inode_map[r->result] = ret;
+            break;
+        case TRACE_OP_DELETE:
+            ret = delete(inode);
+            if (ret == 0 && r->inode >= 0 && r->inode < map_size) inode_map[r->inode] = -1;
+            break;
+        case TRACE_OP_READ:
+            ret = read(inode, buffer, r->len, r->offset);
+            break;
+        case TRACE_OP_WRITE:
+            ret = write(inode, buffer, r->len, r->offset);
+            break;
+        case TRACE_OP_CLONE:
+            ret = clone_file(inode);
+            if (r->result >= 0 && ret >= 0) inode_map[r->result] = ret;
+            break;
+        case TRACE_OP_SNAPSHOT_CREATE:
+            ret = snapshot_create();
+            break;
+        case TRACE_OP_SNAPSHOT_DELETE:
+            ret = snapshot_delete(r->len);
+            break;
+        case TRACE_OP_SET_COMPRESSION:
+            ret = set_compression(inode, r->len);
+            break;
+        case TRACE_OP_ENABLE_CHECKSUMS:
+            ret = enable_checksums();
+            break;
+        case TRACE_OP_SET_DEDUP:
+            ret = set_dedup(r->len);
+            break;
+        case TRACE_OP_DEDUP_FILE:
+            ret = dedup_file(inode);
+            break;
+        case TRACE_OP_PREALLOCATE:
+            ret = preallocate(inode, r->len, r->offset);
+            break;
+        case TRACE_OP_DEFRAG_FILE:
+            ret = defrag_file(inode, r->len);
+            break;
+        }
+        uint64_t elapsed = now_ns() - t;
+
+        OpLatencies *l = &lat[r->op];
+        l->replay_ns[l->count] = elapsed;
+        l->trace_ns[l->count] = r->duration_ns;
+        l->count++;
+
+        if (r->op == TRACE_OP_CREATE || r->op == TRACE_OP_CLONE ? (ret < 0) != (r->result < 0) : ret != r->result)
+            nb_mismatches++;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    if (mounted) unmount();
+
+    printf("Replayed %ld calls from %s in %.3f s (%.1f ops/s%s)\n", count - nb_skipped, trace_path,
+           seconds, seconds > 0 ? (count - nb_skipped) / seconds : 0, timed ? ", original timing" : "");
+    printf("Prepopulated files: %d, skipped calls: %ld, results differing from the trace: %ld\n\n",
+           nb_prepopulated, nb_skipped, nb_mismatches);
+    printf("%-12s %10s %12s %12s %12s %12s\n", "op", "calls", "p50_ns", "p99_ns", "trace_p50", "trace_p99");
+    for (int op = 0; op < TRACE_NB_OPS; ++op) {
+        OpLatencies *l = &lat[op];
+        if (l->count > 0) {
+            qsort(l->replay_ns, l->count, sizeof(uint64_t), compare_u64);
+            qsort(l->trace_ns, l->count, sizeof(uint64_t), compare_u64);
+            printf("%-12s %10d %12llu %12llu %12llu %12llu\n", OP_NAMES[op], l->count,
+                   (unsigned long long)percentile(l->replay_ns, l->count, 0.5),
+                   (unsigned long long)percentile(l->replay_ns, l->count, 0.99),
+                   (unsigned long long)percentile(l->trace_ns, l->count, 0.5),
+                   (unsigned long long)percentile(l->trace_ns, l->count, 0.99));
+        }
+        free(l->replay_ns);
+        free(l->trace_ns);
+    }
+
+    free(records);
+    free(inode_map);
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,491 @@
+// ssfsd: serves a mounted SSFS volume to local clients over a Unix domain socket.
+//
+// Usage: ssfsd [-s socket] [-c max_clients] disk_image
+//
+// One event loop (epoll) reads the requests of every client without blocking. The
+// requests waiting at each wake-up, from all the clients, are merged into ssfs_batch()
+// calls: the volume runs one call at a time, and a batch touches each block of the
+// inode table once whatever the number of clients. Responses are queued per client,
+// in the order of its requests, and a client whose responses pile up is not read from
+// until they drain. Reads into a client's shared buffer go there straight from the
+// volume (see ssfs_client.h for the protocol).
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "error.h"
+#include "ssfsd.h"
+
+#define MAX_CLIENTS   64               // Default of -c
+#define MAX_EVENTS    64
+#define MAX_BATCH     1024             // Operations of one ssfs_batch() call
+#define BATCH_BYTES   (8 * 1024 * 1024) // Socket read data of one batch, unless a single read is larger
+#define IN_CHUNK      (256 * 1024)     // Input buffers grow by at least that much
+#define OUT_LIMIT     (8 * 1024 * 1024) // Requests of a client are not run past that much pending output
+
+/// @brief A connected client.
+typedef struct {
+    int fd;
+    uint8_t *in;            // Received bytes not consumed yet, from in_start to in_len
+    size_t in_start, in_len, in_capacity;
+    uint8_t *out;           // Responses not sent yet, from out_start to out_len
+    size_t out_start, out_len, out_capacity;
+    uint32_t events;        // Registered epoll events
+    size_t discard;         // Bytes of a rejected write still to be dropped on arrival
+    int passed_fd;          // Descriptor received with the data, for SSFSD_OP_MAP
+    uint8_t *shm;           // Shared buffer of the client, NULL if none
+    size_t shm_size;
+    int closing;            // Dropped once the event loop is done with it
+} Client;
+
+/// @brief An operation of the batch being built, and where its response goes.
+typedef struct {
+    Client *client;
+    uint32_t id;
+    int to_socket;          // A read whose data is sent after the response header
+    size_t scratch_offset;  // Where such a read lands in the scratch buffer
+} Pending;
+
+static Client **clients;
+static int nb_clients = 0;
+static int max_clients = MAX_CLIENTS;
+static int epoll_fd;
+static volatile sig_atomic_t running = 1;
+
+static int first_client = 0;   // Gathered first by the next round
+static SsfsClientOp batch[MAX_BATCH];
+static Pending pending[MAX_BATCH];
+static uint8_t *scratch = NULL;
+static size_t scratch_capacity = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+/// @brief Grows a buffer to hold at least needed bytes.
+/// @return 0 on success, -1 if out of memory
+static int reserve(uint8_t **buffer, size_t *capacity, size_t needed)
+{
+    if (needed <= *capacity) return 0;
+    size_t size = *capacity ? *capacity : IN_CHUNK;
+    while (size < needed) size *= 2;
+    uint8_t *grown = realloc(*buffer, size);
+    if (!grown) return -1;
+    *buffer = grown;
+    *capacity = size;
+    return 0;
+}
+
+/// @brief Size of the next request of a client once complete, header and payload. A
+/// write of a bad length counts as its header, its payload is dropped (see gather()).
+/// @param client
+/// @return 0 if its header is not complete
+static long next_request_size(const Client *client)
+{
+    size_t available = client->in_len - client->in_start;
+    if (available < sizeof(SsfsdRequest)) return 0;
+    SsfsdRequest request;
+    memcpy(&request, client->in + client->in_start, sizeof(request));
+    if (request.op != SSFS_CLIENT_WRITE) return sizeof(SsfsdRequest);
+    if (request.len < 0 || request.len > SSFSD_MAX_DATA) return sizeof(SsfsdRequest);
+    return sizeof(SsfsdRequest) + request.len;
+}
+
+/// @brief Drops the received bytes of the payload of a rejected write.
+/// @param client
+static void drop_discarded(Client *client)
+{
+    size_t available = client->in_len - client->in_start;
+    size_t dropped = client->discard < available ? client->discard : available;
+    client->in_start += dropped;
+    client->discard -= dropped;
+    if (client->in_start == client->in_len) {
+        client->in_start = 0;
+        client->in_len = 0;
+    }
+}
+
+/// @brief Registers the events the client is waiting for: input while its output is
+/// below OUT_LIMIT, and room to send while output is pending.
+/// @param client
+static void update_events(Client *client)
+{
+    uint32_t events = 0;
+    if (client->out_len - client->out_start < OUT_LIMIT) events |= EPOLLIN;
+    if (client->out_len > client->out_start) events |= EPOLLOUT;
+    if (events == client->events) return;
+    struct epoll_event ev = { events, { .ptr = client } };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+    client->events = events;
+}
+
+static void accept_clients(int listen_fd)
+{
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        Client *client = nb_clients < max_clients ? calloc(1, sizeof(Client)) : NULL;
+        if (!client) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->passed_fd = -1;
+        client->events = EPOLLIN;
+        struct epoll_event ev = { EPOLLIN, { .ptr = client } };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        clients[nb_clients++] = client;
+    }
+}
+
+static void drop_client(Client *client)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    if (client->passed_fd >= 0) close(client->passed_fd);
+    if (client->shm) munmap(client->shm, client->shm_size);
+    free(client->in);
+    free(client->out);
+    free(client);
+}
+
+/// @brief Receives what the socket of a client holds, and the descriptors passed along.
+/// @param client
+static void receive(Client *client)
+{
+    // Consumed input is dropped first
+    if (client->in_start > 0) {
+        memmove(client->in, client->in + client->in_start, client->in_len - client->in_start);
+        client->in_len -= client->in_start;
+        client->in_start = 0;
+    }
+
+    for (;;) {
+        long size = next_request_size(client);
+        size_t needed = client->in_len + IN_CHUNK;
+        if ((size_t)size > client->in_len) needed = size;
+        if (reserve(&client->in, &client->in_capacity, needed) != 0) {
+            client->closing = 1;
+            return;
+        }
+
+        struct iovec iov = { client->in + client->in_len, client->in_capacity - client->in_len };
+        union {
+            struct cmsghdr header;
+            char space[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.space;
+        msg.msg_controllen = sizeof(control.space);
+        ssize_t r = recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && errno == EAGAIN) return;
+        if (r <= 0) {
+            client->closing = 1;
+            return;
+        }
+        client->in_len += r;
+        drop_discarded(client);
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            if (client->passed_fd >= 0) close(client->passed_fd);
+            client->passed_fd = fd;
+        }
+        // Stops with a large enough backlog, the rest is read on the next wake-up
+        if (client->in_len >= IN_CHUNK && client->in_len >= (size_t)next_request_size(client)) return;
+    }
+}
+
+/// @brief Sends what the socket of a client accepts of its pending responses.
+/// @param client
+static void send_pending(Client *client)
+{
+    while (client->out_start < client->out_len) {
+        ssize_t w = send(client->fd, client->out + client->out_start, client->out_len - client->out_start,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && errno == EAGAIN) break;
+        if (w <= 0) {
+            client->closing = 1;
+            return;
+        }
+        client->out_start += w;
+    }
+    if (client->out_start == client->out_len) {
+        client->out_start = 0;
+        client->out_len = 0;
+    }
+}
+
+/// @brief Queues a response, followed by len bytes of data.
+/// @return 0 on success, -1 if out of memory
+static int queue_response(Client *client, uint32_t id, int32_t result, const uint8_t *data, size_t len)
+{
+    if (client->out_start > 0 && client->out_start == client->out_len) {
+        client->out_start = 0;
+        client->out_len = 0;
+    }
+    if (reserve(&client->out, &client->out_capacity, client->out_len + sizeof(SsfsdResponse) + len) != 0)
+        return -1;
+    SsfsdResponse response = { id, result };
+    memcpy(client->out + client->out_len, &response, sizeof(response));
+    if (len > 0) memcpy(client->out + client->out_len + sizeof(response), data, len);
+    client->out_len += sizeof(response) + len;
+    return 0;
+}
+
+/// @brief Maps the buffer a client shares. The memfd must hold size bytes and be sealed
+/// against shrinking: pages cut off after the mapping would fault the server.
+/// @param client
+/// @param size
+/// @return 0 on success, a negative error code otherwise
+static int map_shared(Client *client, int32_t size)
+{
+    if (client->passed_fd < 0 || size <= 0) return fs_ENOTSUP;
+    struct stat st;
+    int seals = fcntl(client->passed_fd, F_GET_SEALS);
+    uint8_t *shm = MAP_FAILED;
+    if (fstat(client->passed_fd, &st) == 0 && st.st_size >= size && seals >= 0 && (seals & F_SEAL_SHRINK))
+        shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, client->passed_fd, 0);
+    close(client->passed_fd);
+    client->passed_fd = -1;
+    if (shm == MAP_FAILED) return fs_ENOTSUP;
+    if (client->shm) munmap(client->shm, client->shm_size);
+    client->shm = shm;
+    client->shm_size = size;
+    return 0;
+}
+
+/// @brief Adds the complete requests of a client to the batch, until it is full.
+/// @param client
+/// @param count operations in the batch so far, updated
+/// @param scratch_used bytes of scratch taken so far, updated
+static void gather(Client *client, int *count, size_t *scratch_used)
+{
+    int first = *count;
+    while (*count < MAX_BATCH && !client->closing &&
+           client->out_len - client->out_start < OUT_LIMIT) {
+        drop_discarded(client);
+        long size = next_request_size(client);
+        if (size == 0 || client->in_len - client->in_start < (size_t)size) return;
+
+        SsfsdRequest request;
+        memcpy(&request, client->in + client->in_start, sizeof(request));
+        uint32_t op = request.op & ~SSFSD_FLAG_SHM;
+        int shm = (request.op & SSFSD_FLAG_SHM) != 0;
+
+        int32_t error = 0;
+        if (op > SSFS_CLIENT_DELETE && op != SSFSD_OP_MAP) error = fs_ENOTSUP;
+        if (shm && op != SSFS_CLIENT_READ) error = fs_ENOTSUP;
+        if ((op == SSFS_CLIENT_READ || op == SSFS_CLIENT_WRITE) && (request.len < 0 || request.len > SSFSD_MAX_DATA))
+            error = fs_ENOTSUP;
+        if (shm && !error && (!client->shm || request.shm_offset > client->shm_size ||
+                              (size_t)request.len > client->shm_size - request.shm_offset))
+            error = fs_ENOTSUP;
+
+        // Answered at once, so after the requests of the client already in the batch have
+        // run: responses keep the order of the requests, and the reads before a mapping
+        // go to the previous one
+        if (error || op == SSFSD_OP_MAP) {
+            if (*count > first) return;
+            if (!error) error = map_shared(client, request.len);
+            // The payload of a write too large to be buffered is dropped as it arrives
+            if (request.op == SSFS_CLIENT_WRITE && request.len > SSFSD_MAX_DATA) client->discard = request.len;
+            client->in_start += size;
+            if (queue_response(client, request.id, error, NULL, 0) != 0) client->closing = 1;
+            continue;
+        }
+
+        int to_socket = op == SSFS_CLIENT_READ && !shm;
+        if (to_socket && *count > 0 && *scratch_used + request.len > BATCH_BYTES) return;
+
+        SsfsClientOp *bop = &batch[*count];
+        Pending *p = &pending[*count];
+        bop->op = (int)op;
+        bop->inode_num = request.inode_num;
+        bop->len = request.len;
+        bop->offset = request.offset;
+        bop->data = NULL;
+        if (op == SSFS_CLIENT_WRITE) bop->data = client->in + client->in_start + sizeof(SsfsdRequest);
+        if (shm) bop->data = client->shm + request.shm_offset;
+        p->client = client;
+        p->id = request.id;
+        p->to_socket = to_socket;
+        p->scratch_offset = *scratch_used;
+        if (to_socket) *scratch_used += request.len;
+        client->in_start += size;
+        (*count)++;
+    }
+}
+
+/// @brief Runs the waiting requests of every client as one batch, and queues the responses.
+/// Each round gathers from the next client first, so that when the batch fills up, the
+/// same clients are not always the ones left waiting.
+/// @return 1 if requests are left waiting, 0 otherwise
+static int run_round()
+{
+    int count = 0;
+    size_t scratch_used = 0;
+    if (first_client >= nb_clients) first_client = 0;
+    for (int i = 0; i < nb_clients && count < MAX_BATCH; ++i)
+        gather(clients[(first_client + i) % nb_clients], &count, &scratch_used);
+    first_client++;
+
+    if (count > 0) {
+        if (reserve(&scratch, &scratch_capacity, scratch_used) != 0) {
+            for (int i = 0; i < count; ++i) pending[i].client->closing = 1;
+            return 0;
+        }
+        // Pointers into scratch are only set once it stopped moving
+        for (int i = 0; i < count; ++i)
+            if (pending[i].to_socket) batch[i].data = scratch + pending[i].scratch_offset;
+
+        int ret = volume_run(batch, count);
+        for (int i = 0; i < count; ++i) {
+            int result = ret < 0 ? ret : batch[i].result;
+            size_t len = pending[i].to_socket && result > 0 ? (size_t)result : 0;
+            if (queue_response(pending[i].client, pending[i].id, result, batch[i].data, len) != 0)
+                pending[i].client->closing = 1;
+        }
+    }
+
+    int left = 0;
+    for (int i = 0; i < nb_clients; ++i) {
+        Client *client = clients[i];
+        if (client->out_len > client->out_start) send_pending(client);
+        long size = next_request_size(client);
+        if (!client->closing && size > 0 && client->in_len - client->in_start >= (size_t)size &&
+            client->out_len - client->out_start < OUT_LIMIT)
+            left = 1;
+    }
+    return left;
+}
+
+/// @brief Drops the clients that disconnected or misbehaved, and updates the events of the others.
+static void sweep_clients()
+{
+    int kept = 0;
+    for (int i = 0; i < nb_clients; ++i) {
+        Client *client = clients[i];
+        if (client->closing) {
+            drop_client(client);
+            continue;
+        }
+        update_events(client);
+        clients[kept++] = client;
+    }
+    nb_clients = kept;
+}
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *socket_path = "ssfsd.sock";
+    char *image = NULL;
+    int usage = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) socket_path = argv[++i];
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) max_clients = atoi(argv[++i]);
+        else if (!image && argv[i][0] != '-') image = argv[i];
+        else usage = 1;
+    }
+    if (usage || !image || max_clients <= 0) {
+        printf("Usage: %s [-s socket] [-c max_clients] disk_image\n", argv[0]);
+        return 1;
+    }
+
+    clients = calloc(max_clients, sizeof(Client *));
+    if (!clients) return 1;
+    int ret = volume_mount(image);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot mount %s (%d)\n", image, ret);
+        return 1;
+    }
+    int listen_fd = listen_on(socket_path);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { EPOLLIN, { .ptr = NULL } };
+    if (listen_fd < 0 || epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+        fprintf(stderr, "Cannot listen on %s\n", socket_path);
+        volume_unmount();
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "Serving %s on %s\n", image, socket_path);
+
+    struct epoll_event events[MAX_EVENTS];
+    int left = 0;
+    while (running) {
+        // Waiting requests are run without sleeping, after a look at the sockets
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, left ? 0 : -1);
+        if (n < 0 && errno != EINTR) break;
+        for (int i = 0; i < n; ++i) {
+            Client *client = events[i].data.ptr;
+            if (!client) {
+                accept_clients(listen_fd);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) send_pending(client);
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) receive(client);
+        }
+        left = run_round();
+        sweep_clients();
+    }
+
+    for (int i = 0; i < nb_clients; ++i)
+        drop_client(clients[i]);
+    free(clients);
+    free(scratch);
+    close(listen_fd);
+    close(epoll_fd);
+    unlink(socket_path);
+    ret = volume_unmount();
+    volume_print_stats();
+    return ret == 0 ? 0 : 1;
+}
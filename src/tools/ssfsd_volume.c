@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "fs.h"
+#include "error.h"
+#include "stats.h"
+#include "ssfsd.h"
+
+// The operations of the clients are passed to ssfs_batch() as they are: the build fails
+// if an SSFS_CLIENT_* differs from the BATCH_* of the same name
+#define SAME_OP(name) typedef char same_op_##name[SSFS_CLIENT_##name == BATCH_##name ? 1 : -1]
+SAME_OP(STAT);
+SAME_OP(READ);
+SAME_OP(WRITE);
+SAME_OP(CREATE);
+SAME_OP(DELETE);
+
+int volume_mount(char *disk_name)
+{
+    return mount(disk_name);
+}
+
+int volume_unmount()
+{
+    return unmount();
+}
+
+/// @brief Runs operations of clients as one ssfs_batch() call.
+/// @param ops
+/// @param count
+/// @return what ssfs_batch() returns, or fs_EREAD if out of memory
+int volume_run(SsfsClientOp *ops, int count)
+{
+    static BatchOp *batch = NULL;
+    static int capacity = 0;
+    if (count > capacity) {
+        BatchOp *grown = realloc(batch, count * sizeof(BatchOp));
+        if (!grown) return fs_EREAD;
+        batch = grown;
+        capacity = count;
+    }
+
+    // SSFS_CLIENT_* are the BATCH_* of the same name (see SAME_OP)
+    for (int i = 0; i < count; ++i) {
+        BatchOp op = { ops[i].op, ops[i].inode_num, ops[i].data, ops[i].len, ops[i].offset, 0 };
+        batch[i] = op;
+    }
+    int ret = ssfs_batch(batch, count);
+    for (int i = 0; i < count; ++i)
+        ops[i].result = batch[i].result;
+    return ret;
+}
+
+/// @brief Prints the counters of the volume, when compiled in.
+void volume_print_stats()
+{
+    SsfsStats stats;
+    if (ssfs_get_stats(&stats) == 0)
+        ssfs_print_stats(stderr, &stats);
+}
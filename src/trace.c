@@ -0,0 +1,158 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "trace.h"
+#include "include/error.h"
+
+const uint8_t TRACE_MAGIC[TRACE_MAGIC_SIZE] = { 'S', 'S', 'F', 'S', 'T', 'R', 'C', 0 };
+
+#ifdef SSFS_TRACE
+
+#define TRACE_BUFFER_RECORDS 4096 // Records buffered before a flush (128 KiB)
+
+static FILE *trace_file = NULL;
+static int env_checked = 0;
+static uint64_t trace_epoch_ns = 0;
+static TraceRecord *records = NULL;
+static int nb_records = 0;
+
+/// @brief Current monotonic time in nanoseconds.
+/// @return
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/// @brief Writes the buffered records to the trace file.
+/// @return 0 on success, fs_EWRITE otherwise
+static int flush_records()
+{
+    if (!trace_file || nb_records == 0) return 0;
+    size_t n = fwrite(records, sizeof(TraceRecord), nb_records, trace_file);
+    int ok = n == (size_t)nb_records && fflush(trace_file) == 0;
+    nb_records = 0;
+    return ok ? 0 : fs_EWRITE;
+}
+
+static void stop_at_exit()
+{
+    ssfs_trace_stop();
+}
+
+/// @brief Starts recording every fs.h call into path, replacing a running trace.
+/// @param path
+/// @return 0 on success, fs_EON if the file cannot be created
+int ssfs_trace_start(const char *path)
+{
+    static int atexit_registered = 0;
+
+    ssfs_trace_stop();
+    env_checked = 1;
+
+    records = malloc(sizeof(TraceRecord) * TRACE_BUFFER_RECORDS);
+    trace_file = records ? fopen(path, "wb") : NULL;
+    if (!trace_file) {
+        free(records);
+        records = NULL;
+        return fs_EON;
+    }
+
+    TraceHeader header;
+    memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    if (fwrite(&header, sizeof(header), 1, trace_file) != 1) {
+        ssfs_trace_stop();
+        return fs_EWRITE;
+    }
+
+    if (!atexit_registered) {
+        atexit(stop_at_exit);
+        atexit_registered = 1;
+    }
+    trace_epoch_ns = now_ns();
+    return 0;
+}
+
+/// @brief Flushes and closes the running trace, if any.
+/// @return 0 on success, fs_EWRITE if the last records could not be written
+int ssfs_trace_stop()
+{
+    if (!trace_file) return 0;
+    int ret = flush_records();
+    if (fclose(trace_file) != 0) ret = fs_EWRITE;
+    trace_file = NULL;
+    free(records);
+    records = NULL;
+    return ret;
+}
+
+/// @brief Enters a traced call, starting the trace requested by SSFS_TRACE if needed.
+/// @return start time of the call, 0 when not tracing
+uint64_t trace_begin()
+{
+    if (!env_checked) {
+        env_checked = 1;
+        const char *path = getenv("SSFS_TRACE");
+        if (path && *path) ssfs_trace_start(path);
+    }
+    return trace_file ? now_ns() : 0;
+}
+
+/// @brief Records a finished call.
+/// @param start_ns value returned by trace_begin()
+/// @param op TraceOp
+/// @param inode
+/// @param len
+/// @param offset
+/// @param result
+void trace_end(uint64_t start_ns, int op, int inode, int len, int offset, int result)
+{
+    if (!trace_file || start_ns == 0) return;
+
+    uint64_t duration = now_ns() - start_ns;
+    TraceRecord *r = &records[nb_records++];
+    r->timestamp_ns = start_ns - trace_epoch_ns;
+    r->duration_ns = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+    r->op = (uint32_t)op;
+    r->inode = inode;
+    r->len = len;
+    r->offset = offset;
+    r->result = result;
+
+    // Flush when the buffer is full, and at unmount so that a trace survives a crash
+    // of the application between two volumes
+    if (nb_records == TRACE_BUFFER_RECORDS || op == TRACE_OP_UNMOUNT)
+        flush_records();
+}
+
+#else
+
+int ssfs_trace_start(const char *path)
+{
+    (void)path;
+    return fs_ENOTSUP;
+}
+
+int ssfs_trace_stop()
+{
+    return 0;
+}
+
+uint64_t trace_begin()
+{
+    return 0;
+}
+
+void trace_end(uint64_t start_ns, int op, int inode, int len, int offset, int result)
+{
+    (void)start_ns; (void)op; (void)inode; (void)len; (void)offset; (void)result;
+}
+
+#endif
@@ -0,0 +1,198 @@
+// Nested disk: the sectors of the disk are the blocks of a file stored in another,
+// already mounted SSFS volume (the outer disk). Sector n of the nested disk is block n
+// of the file; its location on the outer disk is looked up in a block map filled
+// lazily, one pointer block (256 sectors) at a time, so opening the disk costs a single
+// inode read whatever the size of the file.
+//
+// Holes of the outer file read as zeros but cannot be written: allocating outer
+// blocks would need the outer volume, which is suspended while the nested one is in use.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/error.h"
+#include "../include/vdisk.h"
+#include "../include/ssfs.h"
+
+#define NESTED_HOLE UINT32_MAX // Block map entry of a sector in a hole of the outer file
+
+typedef struct {
+    DISK *outer;
+    uint8_t inode[INODE_SIZE];
+    uint32_t *map;             // Sector -> outer block, 0 until resolved
+    uint8_t *indirect2;        // Double-indirect block of the file, loaded on first use
+} NestedDisk;
+
+/// @brief Stores count pointers of a pointer block (or holes when block is NULL) in the map.
+static void fill_map(NestedDisk *nested, uint32_t first, const uint8_t *block, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t ptr = 0;
+        if (block) {
+            memcpy(&ptr, block + i * BLOCK_PTR_SIZE, sizeof(uint32_t));
+        }
+        nested->map[first + i] = ptr ? ptr : NESTED_HOLE;
+    }
+}
+
+/// @brief Resolves the outer block of a sector, loading the pointer block covering it.
+/// @return 0 on success, a vdisk error otherwise
+static int resolve(DISK *diskp, uint32_t sector, uint32_t *block_num) {
+    NestedDisk *nested = diskp->backend;
+    if (nested->map[sector]) {
+        *block_num = nested->map[sector];
+        return 0;
+    }
+
+    uint8_t block[BLOCK_SIZE];
+    uint32_t ptr;
+    uint32_t first, count;
+
+    if (sector < NB_DIRECT_BLOCKS) {
+        first = 0;
+        count = NB_DIRECT_BLOCKS;
+        memcpy(block, nested->inode + INODE_DIRECT_OFFSET, NB_DIRECT_BLOCKS * BLOCK_PTR_SIZE);
+        ptr = 1;
+    } else if (sector < NB_DIRECT_BLOCKS + BLOCK_POINTERS_SIZE) {
+        first = NB_DIRECT_BLOCKS;
+        count = BLOCK_POINTERS_SIZE;
+        memcpy(&ptr, nested->inode + INODE_INDIRECT1_OFFSET, sizeof(uint32_t));
+        if (ptr) {
+            int err = vdisk_read(nested->outer, ptr, block);
+            if (err) {
+                return err;
+            }
+        }
+    } else {
+        uint32_t group = (sector - NB_DIRECT_BLOCKS - BLOCK_POINTERS_SIZE) / BLOCK_POINTERS_SIZE;
+        first = NB_DIRECT_BLOCKS + BLOCK_POINTERS_SIZE + group * BLOCK_POINTERS_SIZE;
+        count = BLOCK_POINTERS_SIZE;
+        memcpy(&ptr, nested->inode + INODE_INDIRECT2_OFFSET, sizeof(uint32_t));
+        if (ptr && !nested->indirect2) {
+            nested->indirect2 = malloc(BLOCK_SIZE);
+            if (!nested->indirect2) {
+                return vdisk_ESECTOR;
+            }
+            int err = vdisk_read(nested->outer, ptr, nested->indirect2);
+            if (err) {
+                free(nested->indirect2);
+                nested->indirect2 = NULL;
+                return err;
+            }
+        }
+        if (ptr) {
+            memcpy(&ptr, nested->indirect2 + group * BLOCK_PTR_SIZE, sizeof(uint32_t));
+        }
+        if (ptr) {
+            int err = vdisk_read(nested->outer, ptr, block);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    if (first + count > diskp->size_in_sectors) {
+        count = diskp->size_in_sectors - first;
+    }
+    fill_map(nested, first, ptr ? block : NULL, count);
+    *block_num = nested->map[sector];
+    return 0;
+}
+
+static int nested_read(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    if (sector >= diskp->size_in_sectors) {
+        return vdisk_EEXCEED;
+    }
+    uint32_t block_num;
+    int err = resolve(diskp, sector, &block_num);
+    if (err) {
+        return err;
+    }
+    if (block_num == NESTED_HOLE) {
+        memset(buffer, 0, diskp->sector_size);
+        return 0;
+    }
+    return vdisk_read(((NestedDisk *)diskp->backend)->outer, block_num, buffer);
+}
+
+static int nested_write(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    if (sector >= diskp->size_in_sectors) {
+        return vdisk_EEXCEED;
+    }
+    uint32_t block_num;
+    int err = resolve(diskp, sector, &block_num);
+    if (err) {
+        return err;
+    }
+    if (block_num == NESTED_HOLE) {
+        return vdisk_ESECTOR;
+    }
+    return vdisk_write(((NestedDisk *)diskp->backend)->outer, block_num, buffer);
+}
+
+static int nested_sync(DISK *diskp) {
+    return vdisk_sync(((NestedDisk *)diskp->backend)->outer);
+}
+
+static void nested_off(DISK *diskp) {
+    NestedDisk *nested = diskp->backend;
+    if (nested == NULL) {
+        return;
+    }
+    free(nested->map);
+    free(nested->indirect2);
+    free(nested);
+    free(diskp->name);
+    diskp->backend = NULL;
+    diskp->ops = NULL;
+}
+
+static const VdiskOps NESTED_OPS = { nested_read, nested_write, nested_sync, nested_off };
+
+/// @brief Opens the file inode_num of the SSFS volume on outer as a disk.
+/// The outer disk must stay open, and the file unchanged, until vdisk_off().
+int vdisk_on_nested(DISK *outer, uint32_t inode_start_block, uint32_t inode_num, DISK *diskp) {
+    uint8_t block[BLOCK_SIZE];
+    int err = vdisk_read(outer, inode_start_block + inode_num / INODES_PER_BLOCK, block);
+    if (err) {
+        return err;
+    }
+    uint8_t *inode = block + (inode_num % INODES_PER_BLOCK) * INODE_SIZE;
+    if (inode[INODE_STATUT] != INODE_VALID) {
+        return vdisk_ENOEXIST;
+    }
+    // The sectors of a compressed file are not stored in blocks of their own
+    if (inode[INODE_FLAGS] & INODE_FLAG_COMPRESSED) {
+        return vdisk_ENODISK;
+    }
+
+    uint32_t size;
+    memcpy(&size, inode + INODE_SIZE_OFFSET, sizeof(uint32_t));
+    if (size / outer->sector_size == 0) {
+        return vdisk_ENODISK;
+    }
+
+    NestedDisk *nested = calloc(1, sizeof(NestedDisk));
+    char *name = malloc(32);
+    if (nested) {
+        nested->map = calloc(size / outer->sector_size, sizeof(uint32_t));
+    }
+    if (!nested || !nested->map || !name) {
+        if (nested) {
+            free(nested->map);
+        }
+        free(nested);
+        free(name);
+        return vdisk_ENODISK;
+    }
+    nested->outer = outer;
+    memcpy(nested->inode, inode, INODE_SIZE);
+    snprintf(name, 32, "inode %u", inode_num);
+
+    diskp->sector_size = outer->sector_size;
+    diskp->size_in_sectors = size / outer->sector_size;
+    diskp->name = name;
+    diskp->fp = NULL;
+    diskp->ops = &NESTED_OPS;
+    diskp->backend = nested;
+    return 0;
+}
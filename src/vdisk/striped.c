@@ -0,0 +1,493 @@
+// Striped disk: one sector space spread over several image files (the members).
+// Striped, sector s is in stripe k = s / width, stored on member k % n at sector
+// (k / n) * width + s % width; every member holds the same number of stripes, so the
+// smallest one bounds the disk. Concatenated (width 0), the members follow each other.
+//
+// Every member has an I/O thread and a few slots holding chunks of it (a stripe, or
+// STRIPED_CHUNK sectors when concatenated). When sequential reads enter a chunk, the
+// chunks that follow are queued on their members, as far as their slots allow, so the
+// files are read in parallel and ahead of the caller. Writes go straight to the member
+// and update the slots.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../include/error.h"
+#include "../include/vdisk.h"
+
+#define STRIPED_MAX_MEMBERS 16
+#define STRIPED_SLOTS       4  // Chunks cached per member
+#define STRIPED_CHUNK       64 // Readahead unit of a concatenated disk, in sectors
+
+enum { SLOT_EMPTY, SLOT_QUEUED, SLOT_LOADING, SLOT_READY };
+
+typedef struct {
+    int state;
+    uint32_t first;            // First member sector of the chunk
+    uint32_t count;
+    uint64_t last_use;
+    uint8_t *data;
+} Slot;
+
+typedef struct {
+    int fd;
+    uint32_t size_in_sectors;  // Sectors of the member used by the disk
+    uint32_t start;            // First disk sector of the member when concatenated
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;       // Signaled when a slot is queued or leaves SLOT_LOADING
+    int stop;
+    uint64_t reads;            // Reads issued to the file
+    Slot slots[STRIPED_SLOTS];
+} Member;
+
+typedef struct {
+    uint32_t width;            // Stripe width in sectors, 0 when concatenated
+    uint32_t chunk;            // Readahead unit in sectors
+    int nb_members;
+    int nb_started;            // Members whose thread runs
+    uint32_t next_sector;      // Sector following the last one read
+    uint32_t ahead_from;       // First sector of the chunk whose read last started a readahead
+    uint64_t clock;            // Source of Slot.last_use
+    uint64_t round_start;      // Slots used since are kept by the readahead
+    Member members[STRIPED_MAX_MEMBERS];
+} StripedDisk;
+
+/// @brief Member and member sector of a disk sector.
+static Member *locate(StripedDisk *striped, uint32_t sector, uint32_t *member_sector) {
+    if (striped->width == 0) {
+        int i = striped->nb_members - 1;
+        while (sector < striped->members[i].start) {
+            --i;
+        }
+        *member_sector = sector - striped->members[i].start;
+        return &striped->members[i];
+    }
+    uint32_t stripe = sector / striped->width;
+    *member_sector = stripe / striped->nb_members * striped->width + sector % striped->width;
+    return &striped->members[stripe % striped->nb_members];
+}
+
+/// @brief Reads count sectors of a member, retrying short reads.
+static int member_pread(DISK *diskp, Member *member, uint32_t first, uint32_t count, uint8_t *buffer) {
+    size_t len = (size_t)count * diskp->sector_size;
+    off_t offset = (off_t)first * diskp->sector_size;
+    size_t done = 0;
+    __atomic_add_fetch(&member->reads, 1, __ATOMIC_RELAXED);
+    while (done < len) {
+        ssize_t r = pread(member->fd, buffer + done, len - done, offset + done);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return vdisk_ESECTOR;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+/// @brief Slot of a member holding (or about to hold) a member sector, NULL if none.
+/// Called with the member locked.
+static Slot *find_slot(Member *member, uint32_t member_sector) {
+    for (int i = 0; i < STRIPED_SLOTS; ++i) {
+        Slot *slot = &member->slots[i];
+        if (slot->state != SLOT_EMPTY && member_sector >= slot->first &&
+            member_sector - slot->first < slot->count) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    DISK *diskp;
+    Member *member;
+} WorkerArgs;
+
+/// @brief Body of the I/O thread of a member: loads the queued chunks, oldest first.
+static void *member_loop(void *arg) {
+    WorkerArgs args = *(WorkerArgs *)arg;
+    free(arg);
+    Member *member = args.member;
+
+    pthread_mutex_lock(&member->lock);
+    while (!member->stop) {
+        Slot *slot = NULL;
+        for (int i = 0; i < STRIPED_SLOTS; ++i) {
+            Slot *s = &member->slots[i];
+            if (s->state == SLOT_QUEUED && (!slot || s->last_use < slot->last_use)) {
+                slot = s;
+            }
+        }
+        if (!slot) {
+            pthread_cond_wait(&member->cond, &member->lock);
+            continue;
+        }
+        // The slot cannot be reused nor written to while it is loading
+        slot->state = SLOT_LOADING;
+        pthread_mutex_unlock(&member->lock);
+        int err = member_pread(args.diskp, member, slot->first, slot->count, slot->data);
+        pthread_mutex_lock(&member->lock);
+        slot->state = err ? SLOT_EMPTY : SLOT_READY;
+        pthread_cond_broadcast(&member->cond);
+    }
+    pthread_mutex_unlock(&member->lock);
+    return NULL;
+}
+
+/// @brief Queues the chunk of a member holding a member sector, unless it is cached or
+/// every slot is busy: queued, loading, or used since the current readahead started.
+/// A cached chunk counts as used. Called with the member locked.
+/// @return the slot of the chunk, NULL if it was not queued
+static Slot *queue_chunk(StripedDisk *striped, Member *member, uint32_t member_sector) {
+    Slot *slot = find_slot(member, member_sector);
+    if (slot) {
+        slot->last_use = ++striped->clock;
+        return slot;
+    }
+    // Reuse an empty slot, or the ready one used least recently
+    for (int i = 0; i < STRIPED_SLOTS; ++i) {
+        Slot *s = &member->slots[i];
+        if (s->state == SLOT_EMPTY) {
+            slot = s;
+            break;
+        }
+        if (s->state == SLOT_READY && s->last_use < striped->round_start &&
+            (!slot || s->last_use < slot->last_use)) {
+            slot = s;
+        }
+    }
+    if (!slot) {
+        return NULL;
+    }
+    slot->first = member_sector - member_sector % striped->chunk;
+    slot->count = striped->chunk;
+    if (slot->first + slot->count > member->size_in_sectors) {
+        slot->count = member->size_in_sectors - slot->first;
+    }
+    slot->state = SLOT_QUEUED;
+    slot->last_use = ++striped->clock;
+    pthread_cond_broadcast(&member->cond);
+    return slot;
+}
+
+/// @brief Queues the chunks following the one of a sector, up to two per member. The
+/// chunk of the sector and those already queued are kept; the readahead stops at the
+/// first chunk that finds no free slot, so that the chunks are loaded in order.
+static void read_ahead(DISK *diskp, uint32_t sector) {
+    StripedDisk *striped = diskp->backend;
+    striped->round_start = striped->clock;
+    uint32_t next = sector;
+
+    // The first chunk is the one of the sector, just read
+    for (int i = 0; i <= 2 * striped->nb_members && next < diskp->size_in_sectors; ++i) {
+        uint32_t member_sector;
+        Member *member = locate(striped, next, &member_sector);
+        uint32_t chunk_end = member_sector - member_sector % striped->chunk + striped->chunk;
+        if (chunk_end > member->size_in_sectors) {
+            chunk_end = member->size_in_sectors;
+        }
+        if (i > 0) {
+            pthread_mutex_lock(&member->lock);
+            Slot *slot = queue_chunk(striped, member, member_sector);
+            pthread_mutex_unlock(&member->lock);
+            if (!slot) {
+                break;
+            }
+        }
+        next += chunk_end - member_sector;
+    }
+}
+
+static int striped_read(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    if (sector >= diskp->size_in_sectors) {
+        return vdisk_EEXCEED;
+    }
+    StripedDisk *striped = diskp->backend;
+    uint32_t member_sector;
+    Member *member = locate(striped, sector, &member_sector);
+
+    pthread_mutex_lock(&member->lock);
+    Slot *slot = find_slot(member, member_sector);
+    // A read continuing the previous one, or landing in a chunk read ahead, is sequential
+    int sequential = slot || sector == striped->next_sector;
+    if (!slot && sequential) {
+        slot = queue_chunk(striped, member, member_sector);
+    }
+    while (slot && (slot->state == SLOT_QUEUED || slot->state == SLOT_LOADING)) {
+        pthread_cond_wait(&member->cond, &member->lock);
+        // A failed load empties the slot, which may then be reused for another chunk
+        if (slot->state == SLOT_EMPTY || member_sector < slot->first ||
+            member_sector - slot->first >= slot->count) {
+            slot = NULL;
+        }
+    }
+    int err = 0;
+    if (slot) {
+        memcpy(buffer, slot->data + (size_t)(member_sector - slot->first) * diskp->sector_size,
+               diskp->sector_size);
+        slot->last_use = ++striped->clock;
+    }
+    pthread_mutex_unlock(&member->lock);
+    if (!slot) {
+        err = member_pread(diskp, member, member_sector, 1, buffer);
+    }
+    if (err) {
+        return err;
+    }
+
+    // The readahead runs once per chunk, when the reads enter it
+    uint32_t chunk_start = sector - member_sector % striped->chunk;
+    striped->next_sector = sector + 1;
+    if (sequential && chunk_start != striped->ahead_from) {
+        striped->ahead_from = chunk_start;
+        read_ahead(diskp, sector);
+    }
+    return 0;
+}
+
+static int striped_write(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    if (sector >= diskp->size_in_sectors) {
+        return vdisk_EEXCEED;
+    }
+    StripedDisk *striped = diskp->backend;
+    uint32_t member_sector;
+    Member *member = locate(striped, sector, &member_sector);
+
+    // The member stays locked so that no chunk holding the sector starts loading
+    // between the write and the update of its slot
+    pthread_mutex_lock(&member->lock);
+    Slot *slot = find_slot(member, member_sector);
+    while (slot && slot->state == SLOT_LOADING) {
+        pthread_cond_wait(&member->cond, &member->lock);
+        slot = find_slot(member, member_sector);
+    }
+    size_t len = diskp->sector_size;
+    off_t offset = (off_t)member_sector * diskp->sector_size;
+    size_t done = 0;
+    int err = 0;
+    while (done < len) {
+        ssize_t w = pwrite(member->fd, buffer + done, len - done, offset + done);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            err = vdisk_ESECTOR;
+            break;
+        }
+        done += w;
+    }
+    // A queued chunk is read after the write, a ready one is updated, or dropped when
+    // the write failed and the content of the sector is unknown
+    if (slot && slot->state == SLOT_READY) {
+        if (err) {
+            slot->state = SLOT_EMPTY;
+        } else {
+            memcpy(slot->data + (size_t)(member_sector - slot->first) * diskp->sector_size, buffer, len);
+        }
+    }
+    pthread_mutex_unlock(&member->lock);
+    return err;
+}
+
+static int striped_sync(DISK *diskp) {
+    StripedDisk *striped = diskp->backend;
+    int err = 0;
+    for (int i = 0; i < striped->nb_members; ++i) {
+        if (fsync(striped->members[i].fd) != 0) {
+            err = vdisk_ESECTOR;
+        }
+    }
+    return err;
+}
+
+static void striped_off(DISK *diskp) {
+    StripedDisk *striped = diskp->backend;
+    if (striped == NULL) {
+        return;
+    }
+    for (int i = 0; i < striped->nb_started; ++i) {
+        Member *member = &striped->members[i];
+        pthread_mutex_lock(&member->lock);
+        member->stop = 1;
+        pthread_cond_broadcast(&member->cond);
+        pthread_mutex_unlock(&member->lock);
+        pthread_join(member->thread, NULL);
+        pthread_mutex_destroy(&member->lock);
+        pthread_cond_destroy(&member->cond);
+    }
+    for (int i = 0; i < striped->nb_members; ++i) {
+        Member *member = &striped->members[i];
+        for (int j = 0; j < STRIPED_SLOTS; ++j) {
+            free(member->slots[j].data);
+        }
+        if (member->fd >= 0) {
+            close(member->fd);
+        }
+    }
+    free(striped);
+    free(diskp->name);
+    diskp->backend = NULL;
+    diskp->ops = NULL;
+}
+
+static const VdiskOps STRIPED_OPS = { striped_read, striped_write, striped_sync, striped_off };
+
+/// @brief Reads issued to the members of a striped disk, 0 for other disks.
+uint64_t vdisk_striped_reads(DISK *diskp) {
+    if (diskp->ops != &STRIPED_OPS) {
+        return 0;
+    }
+    StripedDisk *striped = diskp->backend;
+    uint64_t reads = 0;
+    for (int i = 0; i < striped->nb_members; ++i) {
+        reads += __atomic_load_n(&striped->members[i].reads, __ATOMIC_RELAXED);
+    }
+    return reads;
+}
+
+/// @brief Opens image files as a single disk, striped over stripe_width sectors, or
+/// concatenated in order when stripe_width is 0.
+int vdisk_on_striped(char **filenames, int nb_files, uint32_t stripe_width, DISK *diskp) {
+    if (nb_files < 1 || nb_files > STRIPED_MAX_MEMBERS) {
+        return vdisk_ENODISK;
+    }
+    StripedDisk *striped = calloc(1, sizeof(StripedDisk));
+    if (!striped) {
+        return vdisk_ENODISK;
+    }
+    striped->width = stripe_width;
+    striped->chunk = stripe_width ? stripe_width : STRIPED_CHUNK;
+    striped->nb_members = nb_files;
+    striped->ahead_from = UINT32_MAX;
+    diskp->sector_size = VDISK_SECTOR_SIZE;
+    diskp->name = NULL;
+    diskp->fp = NULL;
+    diskp->ops = &STRIPED_OPS;
+    diskp->backend = striped;
+
+    int err = 0;
+    uint64_t total = 0;
+    uint32_t stripes = UINT32_MAX;
+    for (int i = 0; i < nb_files; ++i) {
+        striped->members[i].fd = -1;
+    }
+    for (int i = 0; i < nb_files && !err; ++i) {
+        Member *member = &striped->members[i];
+        member->fd = open(filenames[i], O_RDWR);
+        struct stat st;
+        if (member->fd < 0) {
+            err = errno == EACCES ? vdisk_EACCESS : errno == ENOENT ? vdisk_ENOEXIST : vdisk_ENODISK;
+        } else if (fstat(member->fd, &st) != 0 || st.st_size / VDISK_SECTOR_SIZE == 0 ||
+                   st.st_size / VDISK_SECTOR_SIZE > UINT32_MAX) {
+            err = vdisk_ENODISK;
+        } else {
+            member->size_in_sectors = (uint32_t)(st.st_size / VDISK_SECTOR_SIZE);
+            member->start = (uint32_t)total;
+            total += member->size_in_sectors;
+            if (stripe_width && member->size_in_sectors / stripe_width < stripes) {
+                stripes = member->size_in_sectors / stripe_width;
+            }
+        }
+        for (int j = 0; j < STRIPED_SLOTS && !err; ++j) {
+            member->slots[j].data = malloc((size_t)striped->chunk * VDISK_SECTOR_SIZE);
+            if (!member->slots[j].data) {
+                err = vdisk_ENODISK;
+            }
+        }
+    }
+    if (!err && stripe_width) {
+        for (int i = 0; i < nb_files; ++i) {
+            striped->members[i].size_in_sectors = stripes * stripe_width;
+        }
+        total = (uint64_t)stripes * stripe_width * nb_files;
+    }
+    if (!err && (total == 0 || total > UINT32_MAX)) {
+        err = vdisk_ENODISK;
+    }
+    diskp->size_in_sectors = (uint32_t)total;
+
+    for (int i = 0; i < nb_files && !err; ++i) {
+        Member *member = &striped->members[i];
+        WorkerArgs *args = malloc(sizeof(WorkerArgs));
+        if (!args) {
+            err = vdisk_ENODISK;
+            break;
+        }
+        args->diskp = diskp;
+        args->member = member;
+        pthread_mutex_init(&member->lock, NULL);
+        pthread_cond_init(&member->cond, NULL);
+        if (pthread_create(&member->thread, NULL, member_loop, args) != 0) {
+            pthread_mutex_destroy(&member->lock);
+            pthread_cond_destroy(&member->cond);
+            free(args);
+            err = vdisk_ENODISK;
+            break;
+        }
+        striped->nb_started++;
+    }
+
+    size_t name_length = strlen(filenames[0]) + 32;
+    diskp->name = err ? NULL : malloc(name_length);
+    if (!err && !diskp->name) {
+        err = vdisk_ENODISK;
+    }
+    if (err) {
+        striped_off(diskp);
+        return err;
+    }
+    snprintf(diskp->name, name_length, "%s (+%d)", filenames[0], nb_files - 1);
+    return 0;
+}
+
+/// @brief Opens the disk described by "stripe:<width>:<file>,<file>,..." or
+/// "concat:<file>,<file>,...", the width being in sectors.
+int vdisk_on_spec(char *spec, DISK *diskp) {
+    uint32_t width = 0;
+    char *list;
+    if (strncmp(spec, "stripe:", 7) == 0) {
+        char *end;
+        unsigned long value = strtoul(spec + 7, &end, 10);
+        if (*end != ':' || value == 0 || value > UINT32_MAX / VDISK_SECTOR_SIZE) {
+            return vdisk_ENODISK;
+        }
+        width = (uint32_t)value;
+        list = end + 1;
+    } else if (strncmp(spec, "concat:", 7) == 0) {
+        list = spec + 7;
+    } else {
+        return vdisk_ENODISK;
+    }
+
+    char *copy = malloc(strlen(list) + 1);
+    if (!copy) {
+        return vdisk_ENODISK;
+    }
+    strcpy(copy, list);
+    char *filenames[STRIPED_MAX_MEMBERS];
+    int nb_files = 0;
+    for (char *name = copy; name; ) {
+        char *comma = strchr(name, ',');
+        if (comma) {
+            *comma = '\0';
+        }
+        if (nb_files == STRIPED_MAX_MEMBERS || *name == '\0') {
+            free(copy);
+            return vdisk_ENODISK;
+        }
+        filenames[nb_files++] = name;
+        name = comma ? comma + 1 : NULL;
+    }
+    int err = vdisk_on_striped(filenames, nb_files, width, diskp);
+    free(copy);
+    return err;
+}
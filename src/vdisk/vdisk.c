@@ -15,9 +15,16 @@
 
 const int VDISK_SECTOR_SIZE = 1024;
 
+/// @brief Opens an image file, or the disk described by a "stripe:" or "concat:"
+/// spec (see vdisk_on_spec()).
 int vdisk_on(char *filename, DISK *diskp) {
+    if (strncmp(filename, "stripe:", 7) == 0 || strncmp(filename, "concat:", 7) == 0) {
+        return vdisk_on_spec(filename, diskp);
+    }
     FILE *vdisk = fopen(filename, "r+b");
     diskp->fp = vdisk;
+    diskp->ops = NULL;
+    diskp->backend = NULL;
     if (vdisk == NULL) {
         if (errno == EACCES) {
             return vdisk_EACCESS;
@@ -50,11 +57,14 @@ int seek_sector(DISK *diskp, uint32_t sector) {
     if (sector >= diskp->size_in_sectors) {
         return vdisk_EEXCEED;
     }
-    fseek(vdisk, sector * diskp->sector_size, SEEK_SET);
+    fseek(vdisk, (long)sector * diskp->sector_size, SEEK_SET);
     return 0;
 }
 
 inline int vdisk_read(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    if (diskp->ops) {
+        return diskp->ops->read(diskp, sector, buffer);
+    }
     int err = seek_sector(diskp, sector);
     if (err) {
         return err;
@@ -66,6 +76,9 @@ inline int vdisk_read(DISK *diskp, uint32_t sector, uint8_t *buffer) {
 }
 
 inline int vdisk_write(DISK *diskp, uint32_t sector, uint8_t *buffer) {
+    if (diskp->ops) {
+        return diskp->ops->write(diskp, sector, buffer);
+    }
     int err = seek_sector(diskp, sector);
     if (err) {
         return err;
@@ -77,6 +90,9 @@ inline int vdisk_write(DISK *diskp, uint32_t sector, uint8_t *buffer) {
 }
 
 int vdisk_sync(DISK *diskp) {
+    if (diskp->ops) {
+        return diskp->ops->sync(diskp);
+    }
     FILE *vdisk = diskp->fp;
     if (vdisk == NULL){
         return vdisk_ENODISK;
@@ -86,7 +102,23 @@ int vdisk_sync(DISK *diskp) {
     return 0;
 }
 
+/// @brief Descriptor of a plain image file, for transfers that bypass its stream: the
+/// pending writes of the stream are flushed and its buffered reads dropped first, so
+/// both agree until the stream is used again. -1 for the other backends.
+int vdisk_fd(DISK *diskp) {
+    if (diskp->ops || diskp->fp == NULL) {
+        return -1;
+    }
+    fflush(diskp->fp);
+    fpurge(diskp->fp);
+    return fileno(diskp->fp);
+}
+
 void vdisk_off(DISK *diskp) {
+    if (diskp->ops) {
+        diskp->ops->off(diskp);
+        return;
+    }
     FILE *vdisk = diskp->fp;
     if (vdisk == NULL) {
         return;